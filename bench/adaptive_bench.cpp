@@ -0,0 +1,123 @@
+// adaptive_bench: checks that the adaptive chunk/window controller converges
+// to the path's bandwidth-delay product. Runs an in-process server behind a
+// DelayProxy on loopback for several (delay, rate) settings and compares the
+// controller's final estimates with the configured path, next to fixed-chunk
+// transfers of the same file. Exits 1 if an estimate strays from the path by
+// more than the tolerances in check_estimates().
+
+#include <fcntl.h>
+#include <unistd.h>
+
+#include <cstdio>
+#include <cstdlib>
+#include <filesystem>
+#include <stdexcept>
+#include <string>
+#include <vector>
+
+#include "delay_proxy.h"
+#include "tcptransfer/server.h"
+#include "tcptransfer/session.h"
+
+using namespace TcpTransfer;
+namespace fs = std::filesystem;
+
+namespace {
+
+std::string make_file(const fs::path& dir, size_t size) {
+    fs::path p = dir / "payload.bin";
+    Fd fd(::open(p.c_str(), O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0644));
+    std::vector<char> buf(1 << 20);
+    for (size_t i = 0; i < buf.size(); ++i)
+        buf[i] = static_cast<char>(i * 131 + 7);
+    for (size_t left = size; left > 0;) {
+        size_t n = std::min(left, buf.size());
+        if (::write(fd.get(), buf.data(), n) != static_cast<ssize_t>(n))
+            throw std::runtime_error("write " + p.string());
+        left -= n;
+    }
+    return p.string();
+}
+
+/// Whether the converged model matches a path of the given round trip and
+/// bytes/s. The proxy forwards below its configured rate (about 70-90% of
+/// it on a loaded host), so the BDP is allowed well under the product;
+/// a window under the product would leave the path idle.
+bool check_estimates(const AdaptiveController::Snapshot& s, double rtt_ms, double rate) {
+    double rtt = static_cast<double>(s.min_rtt.count()) / 1e3;
+    double bdp = rate * rtt_ms / 1e3;
+    bool ok = true;
+    auto expect = [&](bool cond, const char* what) {
+        if (!cond) {
+            std::printf("  ESTIMATE OFF: %s\n", what);
+            ok = false;
+        }
+    };
+    expect(rtt >= 0.9 * rtt_ms && rtt <= 1.25 * rtt_ms + 2, "rtt_est outside [0.9, 1.25] x rtt");
+    expect(static_cast<double>(s.bdp) >= 0.5 * bdp && static_cast<double>(s.bdp) <= 1.5 * bdp,
+           "bdp outside [0.5, 1.5] x rate x rtt");
+    expect(static_cast<double>(s.window) >= bdp && static_cast<double>(s.window) <= 4 * bdp,
+           "window outside [1, 4] x rate x rtt");
+    return ok;
+}
+
+} // namespace
+
+int main(int argc, char** argv) {
+    size_t size_mb = argc > 1 ? std::strtoul(argv[1], nullptr, 10) : 128;
+    fs::path tmp = fs::temp_directory_path() / ("tcptransfer_adaptive_" + std::to_string(::getpid()));
+    fs::create_directories(tmp / "root");
+    std::string file = make_file(tmp, size_mb << 20);
+
+    ServerConfig cfg;
+    cfg.root = (tmp / "root").string();
+    cfg.bind_addr = "127.0.0.1";
+    Server server(cfg);
+    server.start();
+
+    struct Path {
+        int delay_ms;
+        double rate_mbps; // MB/s
+    };
+    const Path paths[] = {{0, 400}, {5, 200}, {20, 200}, {50, 100}};
+
+    bool ok = true;
+    std::printf("%-8s %-8s %-10s %9s %10s %10s %10s %10s %9s %10s\n", "rtt_ms", "rate_MB",
+                "mode", "MB/s", "chunk_KB", "window_KB", "bdp_KB", "want_KB", "rtt_est",
+                "sndbuf_KB");
+    for (const Path& p : paths) {
+        bench::DelayProxy proxy({"127.0.0.1", server.port()},
+                                std::chrono::milliseconds(p.delay_ms), p.rate_mbps * 1e6);
+        double expect_bdp = p.rate_mbps * 1e6 * (2 * p.delay_ms) / 1e3;
+        for (int mode = 0; mode < 3; ++mode) {
+            PutOptions opts;
+            opts.checksum = false;
+            opts.adaptive = mode == 0;
+            opts.chunk_size = mode == 2 ? (8 << 20) : (64 << 10);
+            const char* name = mode == 0 ? "adaptive" : mode == 1 ? "fixed64K" : "fixed8M";
+            auto session = Session::connect(proxy.endpoint(), {});
+            PutResult r = session->put_file(file, "bench", opts);
+            double secs = std::chrono::duration<double>(r.elapsed).count();
+            double mbs = static_cast<double>(r.file_size) / secs / 1e6;
+            if (mode == 0) {
+                std::printf("%-8d %-8.0f %-10s %9.1f %10zu %10zu %10llu %10.0f %7.1fms %10d\n",
+                            2 * p.delay_ms, p.rate_mbps, name, mbs, r.flow.chunk >> 10,
+                            r.flow.window >> 10, static_cast<unsigned long long>(r.flow.bdp >> 10),
+                            expect_bdp / 1024, static_cast<double>(r.flow.min_rtt.count()) / 1e3,
+                            r.socket.sndbuf >> 10);
+                // With no delay the BDP is a few packets and the window
+                // sits at min_window.
+                if (p.delay_ms > 0)
+                    ok = check_estimates(r.flow, 2 * p.delay_ms, p.rate_mbps * 1e6) && ok;
+            } else {
+                std::printf("%-8d %-8.0f %-10s %9.1f %10zu %10s %10s %10s %9s %10d\n",
+                            2 * p.delay_ms, p.rate_mbps, name, mbs, opts.chunk_size >> 10, "-",
+                            "-", "-", "-", r.socket.sndbuf >> 10);
+            }
+            std::fflush(stdout);
+        }
+    }
+    server.stop();
+    fs::remove_all(tmp);
+    return ok ? 0 : 1;
+}
@@ -0,0 +1,187 @@
+// In-process TCP proxy that adds a fixed one-way delay and an optional rate
+// cap in each direction, so WAN-like paths can be emulated on loopback
+// without tc/netem.
+#pragma once
+
+#include <sys/socket.h>
+
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <condition_variable>
+#include <deque>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <vector>
+
+#include "tcptransfer/socket.h"
+
+namespace TcpTransfer::bench {
+
+class DelayProxy {
+public:
+    using Clock = std::chrono::steady_clock;
+
+    /// rate_bps == 0 means unlimited.
+    DelayProxy(Endpoint upstream, std::chrono::microseconds one_way_delay, double rate_bps = 0)
+        : upstream_(std::move(upstream)), delay_(one_way_delay), rate_(rate_bps) {
+        listener_ = listen_tcp("127.0.0.1", 0);
+        port_ = local_port(listener_.get());
+        acceptor_ = std::thread([this] { accept_loop(); });
+    }
+
+    ~DelayProxy() {
+        stopping_ = true;
+        ::shutdown(listener_.get(), SHUT_RDWR);
+        acceptor_.join();
+        std::vector<std::unique_ptr<Link>> links;
+        {
+            std::lock_guard<std::mutex> lk(mu_);
+            links.swap(links_);
+        }
+        for (auto& l : links)
+            l->close();
+    }
+
+    Endpoint endpoint() const { return {"127.0.0.1", port_}; }
+
+private:
+    struct Packet {
+        Clock::time_point due;
+        std::string data; ///< Empty marks EOF.
+    };
+
+    /// One direction of a proxied connection.
+    struct Pipe {
+        int from = -1;
+        int to = -1;
+        std::mutex mu;
+        std::condition_variable cv;
+        std::deque<Packet> q;
+        size_t queued = 0;
+        size_t cap = 0;
+        bool closed = false;
+        std::thread reader, writer;
+    };
+
+    struct Link {
+        Fd down, up;
+        Pipe ab, ba;
+
+        void close() {
+            ::shutdown(down.get(), SHUT_RDWR);
+            ::shutdown(up.get(), SHUT_RDWR);
+            for (Pipe* p : {&ab, &ba}) {
+                {
+                    std::lock_guard<std::mutex> lk(p->mu);
+                    p->closed = true;
+                }
+                p->cv.notify_all();
+            }
+            for (Pipe* p : {&ab, &ba}) {
+                if (p->reader.joinable())
+                    p->reader.join();
+                if (p->writer.joinable())
+                    p->writer.join();
+            }
+        }
+    };
+
+    void accept_loop() {
+        while (!stopping_) {
+            int fd = ::accept4(listener_.get(), nullptr, nullptr, SOCK_CLOEXEC);
+            if (fd < 0) {
+                if (stopping_)
+                    return;
+                continue;
+            }
+            auto link = std::make_unique<Link>();
+            link->down = Fd(fd);
+            try {
+                link->up = connect_tcp(upstream_, std::chrono::milliseconds(5000));
+            } catch (const std::exception&) {
+                continue;
+            }
+            set_nodelay(fd, true);
+            start(link->ab, link->down.get(), link->up.get());
+            start(link->ba, link->up.get(), link->down.get());
+            std::lock_guard<std::mutex> lk(mu_);
+            links_.push_back(std::move(link));
+        }
+    }
+
+    void start(Pipe& p, int from, int to) {
+        p.from = from;
+        p.to = to;
+        // Hold about one path BDP so the sender sees a realistic pipe.
+        double bdp = rate_ > 0 ? rate_ * static_cast<double>(delay_.count()) / 1e6 : 64e6;
+        p.cap = std::max<size_t>(static_cast<size_t>(bdp * 1.5), 256 << 10);
+        p.reader = std::thread([this, &p] { read_side(p); });
+        p.writer = std::thread([this, &p] { write_side(p); });
+    }
+
+    void read_side(Pipe& p) {
+        std::vector<char> buf(64 << 10);
+        for (;;) {
+            ssize_t n = ::recv(p.from, buf.data(), buf.size(), 0);
+            std::unique_lock<std::mutex> lk(p.mu);
+            if (n <= 0) {
+                p.q.push_back({Clock::now() + delay_, {}});
+                p.cv.notify_all();
+                return;
+            }
+            p.cv.wait(lk, [&] { return p.closed || p.queued < p.cap; });
+            if (p.closed)
+                return;
+            p.q.push_back({Clock::now() + delay_, std::string(buf.data(), static_cast<size_t>(n))});
+            p.queued += static_cast<size_t>(n);
+            p.cv.notify_all();
+        }
+    }
+
+    void write_side(Pipe& p) {
+        Clock::time_point next_free = Clock::now();
+        for (;;) {
+            Packet pkt;
+            {
+                std::unique_lock<std::mutex> lk(p.mu);
+                p.cv.wait(lk, [&] { return p.closed || !p.q.empty(); });
+                if (p.closed)
+                    return;
+                pkt = std::move(p.q.front());
+                p.q.pop_front();
+                p.queued -= pkt.data.size();
+                p.cv.notify_all();
+            }
+            std::this_thread::sleep_until(std::max(pkt.due, next_free));
+            if (pkt.data.empty()) {
+                ::shutdown(p.to, SHUT_WR);
+                return;
+            }
+            if (rate_ > 0) {
+                next_free = std::max(Clock::now(), next_free) +
+                            std::chrono::duration_cast<Clock::duration>(std::chrono::duration<double>(
+                                static_cast<double>(pkt.data.size()) / rate_));
+            }
+            try {
+                write_full(p.to, pkt.data.data(), pkt.data.size());
+            } catch (const std::exception&) {
+                return;
+            }
+        }
+    }
+
+    Endpoint upstream_;
+    std::chrono::microseconds delay_;
+    double rate_;
+    Fd listener_;
+    uint16_t port_ = 0;
+    std::atomic<bool> stopping_{false};
+    std::thread acceptor_;
+    std::mutex mu_;
+    std::vector<std::unique_ptr<Link>> links_;
+};
+
+} // namespace TcpTransfer::bench
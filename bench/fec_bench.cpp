@@ -0,0 +1,168 @@
+// fec_bench: measures the GF(2^8) multiply kernels and what FEC puts buy
+// on a lossy link. TCP does not lose frames, so loss is emulated by the
+// session's fault shim, which drops or damages outgoing Data and Parity
+// frames. Each run uploads one file to an in-process server, resuming after
+// failures, and reports attempts, wire overhead and time next to a plain
+// checksummed put at the same fault rates; every result is compared with
+// the source byte for byte. Exits 1 if kernels disagree or a put ends
+// corrupt or gives up.
+
+#include <fcntl.h>
+#include <unistd.h>
+
+#include <chrono>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <filesystem>
+#include <stdexcept>
+#include <string>
+#include <vector>
+
+#include "tcptransfer/erasure.h"
+#include "tcptransfer/error.h"
+#include "tcptransfer/server.h"
+#include "tcptransfer/session.h"
+
+using namespace TcpTransfer;
+namespace fs = std::filesystem;
+using Clock = std::chrono::steady_clock;
+
+namespace {
+
+std::vector<char> make_data(size_t size) {
+    std::vector<char> data(size);
+    uint64_t x = 0x9e3779b97f4a7c15;
+    for (size_t i = 0; i < size; ++i) {
+        x ^= x << 13;
+        x ^= x >> 7;
+        x ^= x << 17;
+        data[i] = static_cast<char>(x);
+    }
+    return data;
+}
+
+void write_file(const fs::path& p, const std::vector<char>& data) {
+    Fd fd(::open(p.c_str(), O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0644));
+    if (!fd || ::write(fd.get(), data.data(), data.size()) != static_cast<ssize_t>(data.size()))
+        throw std::runtime_error("write " + p.string());
+}
+
+bool same_content(const fs::path& p, const std::vector<char>& data) {
+    Fd fd(::open(p.c_str(), O_RDONLY | O_CLOEXEC));
+    if (!fd)
+        return false;
+    std::vector<char> got(data.size() + 1);
+    size_t n = 0;
+    for (ssize_t r; (r = ::read(fd.get(), got.data() + n, got.size() - n)) > 0;)
+        n += static_cast<size_t>(r);
+    return n == data.size() && std::memcmp(got.data(), data.data(), n) == 0;
+}
+
+/// Encodes 8+2 groups of 1 MiB shards with each available kernel. False
+/// if a kernel's parity differs from the first one's.
+bool bench_kernels() {
+    constexpr size_t k = 8, m = 2, len = 1 << 20;
+    std::vector<char> src = make_data(k * len);
+    std::vector<std::vector<uint8_t>> parity(m, std::vector<uint8_t>(len));
+    std::vector<uint8_t> reference;
+    std::vector<const uint8_t*> data(k);
+    std::vector<uint8_t*> out(m);
+    for (size_t i = 0; i < k; ++i)
+        data[i] = reinterpret_cast<const uint8_t*>(src.data()) + i * len;
+    for (size_t j = 0; j < m; ++j)
+        out[j] = parity[j].data();
+    ReedSolomon rs(k, m);
+    bool all_ok = true;
+
+    std::printf("%-8s %12s %8s\n", "kernel", "encode_MB/s", "check");
+    for (GfKernel kernel : {GfKernel::Scalar, GfKernel::Ssse3, GfKernel::Avx2}) {
+        if (!gf_use_kernel(kernel))
+            continue;
+        int rounds = 0;
+        auto start = Clock::now();
+        do {
+            rs.encode(data.data(), out.data(), len);
+            ++rounds;
+        } while (Clock::now() - start < std::chrono::milliseconds(500));
+        double secs = std::chrono::duration<double>(Clock::now() - start).count();
+        if (reference.empty())
+            reference = parity[m - 1];
+        bool ok = parity[m - 1] == reference;
+        all_ok = all_ok && ok;
+        std::printf("%-8s %12.0f %8s\n", gf_kernel_name(), rounds * k * len / secs / 1e6,
+                    ok ? "ok" : "MISMATCH");
+    }
+    gf_use_kernel(GfKernel::Auto);
+    return all_ok;
+}
+
+} // namespace
+
+int main(int argc, char** argv) {
+    size_t size_mb = argc > 1 ? std::strtoul(argv[1], nullptr, 10) : 64;
+    bool failed = !bench_kernels();
+
+    fs::path tmp = fs::temp_directory_path() / ("tcptransfer_fec_" + std::to_string(::getpid()));
+    fs::create_directories(tmp / "root");
+    std::vector<char> data = make_data(size_mb << 20);
+    fs::path file = tmp / "payload.bin";
+    write_file(file, data);
+
+    ServerConfig cfg;
+    cfg.root = (tmp / "root").string();
+    cfg.bind_addr = "127.0.0.1";
+    Server server(cfg);
+    server.start();
+
+    struct Fault {
+        double drop;
+        double corrupt;
+    };
+    const Fault faults[] = {{0, 0}, {0.005, 0.005}, {0.02, 0.01}, {0.05, 0.02}};
+    constexpr int kMaxAttempts = 50;
+
+    std::printf("\n%-6s %-8s %-6s %9s %9s %10s %9s %9s\n", "drop", "corrupt", "mode", "attempts",
+                "MB/s", "wire_MB", "repaired", "result");
+    for (const Fault& f : faults) {
+        for (int fec = 0; fec < 2; ++fec) {
+            SessionOptions sopts;
+            sopts.faults = {f.drop, f.corrupt, 42};
+            PutOptions opts;
+            opts.adaptive = false;
+            opts.resume = true;
+            opts.remote_name = fec ? "fec.bin" : "plain.bin";
+            if (fec)
+                opts.fec = {8, 2};
+            auto session = Session::connect({"127.0.0.1", server.port()}, sopts);
+            uint64_t repaired = server.stats().fec_chunks_repaired;
+            uint64_t wire = 0;
+            int attempts = 0;
+            bool done = false;
+            auto start = Clock::now();
+            while (!done && attempts < kMaxAttempts) {
+                ++attempts;
+                try {
+                    PutResult r = session->put_file(file.string(), "bench", opts);
+                    wire += r.wire_bytes;
+                    done = true;
+                } catch (const RemoteError&) {
+                    // The part file stays; the next attempt resumes it.
+                }
+            }
+            double secs = std::chrono::duration<double>(Clock::now() - start).count();
+            bool ok = done && same_content(tmp / "root" / "bench" / opts.remote_name, data);
+            failed = failed || !ok;
+            std::printf("%-6.3f %-8.3f %-6s %9d %9.1f %10.1f %9llu %9s\n", f.drop, f.corrupt,
+                        fec ? "fec8+2" : "plain", attempts, data.size() / secs / 1e6,
+                        wire / 1e6,
+                        static_cast<unsigned long long>(server.stats().fec_chunks_repaired -
+                                                        repaired),
+                        ok ? "ok" : done ? "CORRUPT" : "gave up");
+            std::fflush(stdout);
+        }
+    }
+    server.stop();
+    fs::remove_all(tmp);
+    return failed ? 1 : 0;
+}
@@ -0,0 +1,180 @@
+// pipeline_bench: per-chunk cost of the put pipeline with its options
+// resolved once per transfer (select_pipeline()) against two runtime-
+// dispatched designs, branches on the options for every chunk and a chain
+// of virtual stages. Runs in memory over chunk sizes and feature sets, so
+// only the chunk work is measured; each variant's CRCs and compressed
+// sizes are cross-checked.
+
+#include <chrono>
+#include <cstdio>
+#include <cstdlib>
+#include <memory>
+#include <string>
+#include <utility>
+#include <vector>
+
+#include "tcptransfer/pipeline.h"
+
+using namespace TcpTransfer;
+using Clock = std::chrono::steady_clock;
+
+namespace {
+
+struct Features {
+    const char* name;
+    bool checksum;
+    Codec codec;
+    bool delta;
+};
+
+/// Half random bytes, half text, so that compression has something to do.
+std::vector<char> make_data(size_t size) {
+    static const char kText[] = "the quick brown fox jumps over the lazy dog 0123456789\n";
+    std::vector<char> data(size);
+    uint64_t x = 0x9e3779b97f4a7c15;
+    for (size_t i = 0; i < size; ++i) {
+        if ((i >> 12) & 1) {
+            data[i] = kText[i % (sizeof(kText) - 1)];
+            continue;
+        }
+        x ^= x << 13;
+        x ^= x >> 7;
+        x ^= x << 17;
+        data[i] = static_cast<char>(x);
+    }
+    return data;
+}
+
+/// Makes the compiler reload *p before each chunk, as a transfer loop
+/// reading its options through a pointer does.
+void clobber(const void* p) { asm volatile("" : : "g"(p) : "memory"); }
+
+// Branches on the options for every chunk.
+[[gnu::noinline]] ChunkResult branchy_chunk(const Features& f, char* data, size_t n, int level,
+                                            std::vector<char>& zbuf) {
+    ChunkResult r;
+    if (f.checksum && !f.delta) {
+        StageTimer t(Stage::Hash, n);
+        r.crc = crc32_update(0, data, n);
+    }
+    if (f.codec != Codec::None) {
+        StageTimer t(Stage::Compress, n);
+        r.z = codec_compress(f.codec, level, data, n, zbuf);
+    }
+    return r;
+}
+
+// A chain of stages behind virtual calls, built once per transfer.
+struct ChunkStage {
+    virtual ~ChunkStage() = default;
+    virtual void run(char* data, size_t n, int level, std::vector<char>& zbuf,
+                     ChunkResult& r) = 0;
+};
+
+struct HashStage : ChunkStage {
+    void run(char* data, size_t n, int, std::vector<char>&, ChunkResult& r) override {
+        StageTimer t(Stage::Hash, n);
+        r.crc = crc32_update(0, data, n);
+    }
+};
+
+struct CompressStage : ChunkStage {
+    explicit CompressStage(Codec c) : codec(c) {}
+    void run(char* data, size_t n, int level, std::vector<char>& zbuf,
+             ChunkResult& r) override {
+        StageTimer t(Stage::Compress, n);
+        r.z = codec_compress(codec, level, data, n, zbuf);
+    }
+    Codec codec;
+};
+
+std::vector<std::unique_ptr<ChunkStage>> make_chain(const Features& f) {
+    std::vector<std::unique_ptr<ChunkStage>> chain;
+    if (f.checksum && !f.delta)
+        chain.push_back(std::make_unique<HashStage>());
+    if (f.codec != Codec::None)
+        chain.push_back(std::make_unique<CompressStage>(f.codec));
+    return chain;
+}
+
+struct Run {
+    double ns_per_chunk = 0;
+};
+
+/// CRCs and compressed sizes of one pass, to check the variants agree.
+template <typename Fn>
+std::vector<std::pair<uint32_t, size_t>> one_pass(std::vector<char>& data, size_t chunk, Fn&& fn) {
+    std::vector<std::pair<uint32_t, size_t>> out;
+    for (size_t off = 0; off + chunk <= data.size(); off += chunk) {
+        ChunkResult c = fn(data.data() + off, chunk);
+        out.emplace_back(c.crc, c.z);
+    }
+    return out;
+}
+
+template <typename Fn>
+Run measure(std::vector<char>& data, size_t chunk, std::chrono::milliseconds budget, Fn&& fn) {
+    Run r;
+    uint64_t chunks = 0;
+    auto start = Clock::now();
+    do {
+        for (size_t off = 0; off + chunk <= data.size(); off += chunk, ++chunks) {
+            ChunkResult c = fn(data.data() + off, chunk);
+            asm volatile("" : : "g"(c.crc), "g"(c.z));
+        }
+    } while (Clock::now() - start < budget);
+    double secs = std::chrono::duration<double>(Clock::now() - start).count();
+    r.ns_per_chunk = secs * 1e9 / static_cast<double>(chunks);
+    return r;
+}
+
+} // namespace
+
+int main(int argc, char** argv) {
+    size_t size_mb = argc > 1 ? std::strtoul(argv[1], nullptr, 10) : 16;
+    std::vector<char> data = make_data(size_mb << 20);
+    const Features features[] = {
+        {"plain", false, Codec::None, false},
+        {"checksum", true, Codec::None, false},
+        {"delta", true, Codec::None, true},
+        {"zlib", false, Codec::Zlib, false},
+        {"checksum+zlib", true, Codec::Zlib, false},
+    };
+    const size_t chunks[] = {512, 4 << 10, 64 << 10, 1 << 20};
+    constexpr int kLevel = 1;
+
+    std::printf("%-14s %8s %11s %11s %11s %9s %9s %6s\n", "features", "chunk", "branch_ns",
+                "virtual_ns", "special_ns", "vs_branch", "vs_virt", "check");
+    for (const Features& f : features) {
+        const auto budget = std::chrono::milliseconds(300);
+        for (size_t chunk : chunks) {
+            std::vector<char> zbuf;
+            Features opts = f;
+            auto branchy_fn = [&](char* p, size_t n) {
+                clobber(&opts);
+                return branchy_chunk(opts, p, n, kLevel, zbuf);
+            };
+            auto chain = make_chain(f);
+            auto virt_fn = [&](char* p, size_t n) {
+                ChunkResult r;
+                for (auto& stage : chain)
+                    stage->run(p, n, kLevel, zbuf, r);
+                return r;
+            };
+            ChunkFn fn = select_pipeline(f.checksum, f.codec, f.delta);
+            auto special_fn = [&](char* p, size_t n) { return fn(p, n, kLevel, zbuf); };
+
+            auto expect = one_pass(data, chunk, branchy_fn);
+            bool ok = one_pass(data, chunk, virt_fn) == expect &&
+                      one_pass(data, chunk, special_fn) == expect;
+            Run branchy = measure(data, chunk, budget, branchy_fn);
+            Run virt = measure(data, chunk, budget, virt_fn);
+            Run special = measure(data, chunk, budget, special_fn);
+            std::printf("%-14s %8zu %11.1f %11.1f %11.1f %8.2fx %8.2fx %6s\n", f.name, chunk,
+                        branchy.ns_per_chunk, virt.ns_per_chunk, special.ns_per_chunk,
+                        branchy.ns_per_chunk / special.ns_per_chunk,
+                        virt.ns_per_chunk / special.ns_per_chunk, ok ? "ok" : "BAD");
+        }
+    }
+    return 0;
+}
@@ -0,0 +1,346 @@
+// tcptransfer_bench: loopback throughput/latency sweep.
+//
+// Starts a Server and a Client in this process and uploads generated files
+// for every combination of file size, file count, concurrency, chunk size and
+// feature set. Prints one JSON document with MB/s, files/s, per-file latency
+// percentiles and CPU seconds per GB (client and server together, from
+// getrusage) for each combination.
+//
+//   tcptransfer_bench [--sizes 1K,1M,64M] [--files auto|N,...]
+//                     [--concurrency 1,4] [--chunks adaptive,1M]
+//                     [--features checksum,sendfile,zlib,plain,io_uring]
+//                     [--full] [--tmp DIR] [--out FILE]
+
+#include <fcntl.h>
+#include <sys/resource.h>
+#include <unistd.h>
+
+#include <algorithm>
+#include <chrono>
+#include <cstdio>
+#include <cstdlib>
+#include <filesystem>
+#include <stdexcept>
+#include <string>
+#include <vector>
+
+#include "tcptransfer/client.h"
+#include "tcptransfer/server.h"
+
+using namespace TcpTransfer;
+namespace fs = std::filesystem;
+
+namespace {
+
+struct Features {
+    std::string name;
+    bool checksum = true;
+    bool sendfile = false;
+    Codec compression = Codec::None;
+    bool io_uring = false;
+};
+
+struct Options {
+    std::vector<uint64_t> sizes{1 << 10, 64 << 10, 1 << 20, 16 << 20, 256 << 20};
+    std::vector<size_t> files;          ///< Empty: derive from size.
+    std::vector<size_t> concurrency{1, 4};
+    std::vector<size_t> chunks{0, 1 << 20}; ///< 0 means adaptive.
+    std::vector<Features> features;
+    std::string tmp;
+    std::string out;
+};
+
+std::vector<std::string> split(const std::string& s) {
+    std::vector<std::string> parts;
+    size_t start = 0;
+    while (start <= s.size()) {
+        size_t comma = s.find(',', start);
+        if (comma == std::string::npos)
+            comma = s.size();
+        if (comma > start)
+            parts.push_back(s.substr(start, comma - start));
+        start = comma + 1;
+    }
+    return parts;
+}
+
+uint64_t parse_size(const std::string& s) {
+    size_t pos = 0;
+    double v = std::stod(s, &pos);
+    std::string unit = s.substr(pos);
+    uint64_t mul = 1;
+    if (unit == "K" || unit == "k")
+        mul = 1ull << 10;
+    else if (unit == "M" || unit == "m")
+        mul = 1ull << 20;
+    else if (unit == "G" || unit == "g")
+        mul = 1ull << 30;
+    else if (!unit.empty())
+        throw std::invalid_argument("bad size: " + s);
+    return static_cast<uint64_t>(v * static_cast<double>(mul));
+}
+
+Features parse_features(const std::string& name) {
+    Features f;
+    f.name = name;
+    if (name == "plain") {
+        f.checksum = false;
+    } else if (name == "checksum") {
+    } else if (name == "sendfile") {
+        f.checksum = false;
+        f.sendfile = true;
+    } else if (name == "zlib") {
+        f.compression = Codec::Zlib;
+    } else if (name == "io_uring") {
+        f.io_uring = true;
+    } else {
+        throw std::invalid_argument("unknown feature set: " + name);
+    }
+    return f;
+}
+
+std::string human(uint64_t n) {
+    if (n >= (1ull << 30) && n % (1ull << 30) == 0)
+        return std::to_string(n >> 30) + "G";
+    if (n >= (1ull << 20) && n % (1ull << 20) == 0)
+        return std::to_string(n >> 20) + "M";
+    if (n >= (1ull << 10) && n % (1ull << 10) == 0)
+        return std::to_string(n >> 10) + "K";
+    return std::to_string(n);
+}
+
+/// Half random, half repeated text per 4 KiB block: roughly 2:1 for zlib.
+void write_payload(const fs::path& p, uint64_t size) {
+    Fd fd(::open(p.c_str(), O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0644));
+    if (!fd)
+        throw std::runtime_error("create " + p.string());
+    std::vector<char> buf(1 << 20);
+    uint64_t x = 0x9e3779b97f4a7c15ull;
+    for (size_t i = 0; i < buf.size(); ++i) {
+        if ((i / 2048) % 2 == 0) {
+            x ^= x << 13;
+            x ^= x >> 7;
+            x ^= x << 17;
+            buf[i] = static_cast<char>(x);
+        } else {
+            buf[i] = "tcptransfer benchmark payload "[i % 30];
+        }
+    }
+    for (uint64_t left = size; left > 0;) {
+        size_t n = static_cast<size_t>(std::min<uint64_t>(left, buf.size()));
+        if (::write(fd.get(), buf.data(), n) != static_cast<ssize_t>(n))
+            throw std::runtime_error("write " + p.string());
+        left -= n;
+    }
+}
+
+double cpu_seconds() {
+    rusage ru{};
+    ::getrusage(RUSAGE_SELF, &ru);
+    auto tv = [](const timeval& t) { return static_cast<double>(t.tv_sec) + t.tv_usec / 1e6; };
+    return tv(ru.ru_utime) + tv(ru.ru_stime);
+}
+
+double percentile(std::vector<double> v, double p) {
+    if (v.empty())
+        return 0;
+    std::sort(v.begin(), v.end());
+    size_t idx = static_cast<size_t>(p * static_cast<double>(v.size() - 1) + 0.5);
+    return v[std::min(idx, v.size() - 1)];
+}
+
+void usage() {
+    std::fprintf(stderr,
+                 "usage: tcptransfer_bench [--sizes LIST] [--files auto|LIST]\n"
+                 "                         [--concurrency LIST] [--chunks adaptive|SIZE,...]\n"
+                 "                         [--features checksum,sendfile,zlib,plain,io_uring]\n"
+                 "                         [--full] [--tmp DIR] [--out FILE]\n");
+    std::exit(2);
+}
+
+} // namespace
+
+int main(int argc, char** argv) {
+    Options o;
+    for (int i = 1; i < argc; ++i) {
+        std::string a = argv[i];
+        auto value = [&]() -> std::string {
+            if (i + 1 >= argc)
+                usage();
+            return argv[++i];
+        };
+        try {
+            if (a == "--sizes") {
+                o.sizes.clear();
+                for (auto& s : split(value()))
+                    o.sizes.push_back(parse_size(s));
+            } else if (a == "--files") {
+                o.files.clear();
+                std::string v = value();
+                if (v != "auto")
+                    for (auto& s : split(v))
+                        o.files.push_back(std::stoul(s));
+            } else if (a == "--concurrency") {
+                o.concurrency.clear();
+                for (auto& s : split(value()))
+                    o.concurrency.push_back(std::stoul(s));
+            } else if (a == "--chunks") {
+                o.chunks.clear();
+                for (auto& s : split(value()))
+                    o.chunks.push_back(s == "adaptive" ? 0 : parse_size(s));
+            } else if (a == "--features") {
+                for (auto& s : split(value()))
+                    o.features.push_back(parse_features(s));
+            } else if (a == "--full") {
+                o.sizes = {1ull << 10, 64ull << 10, 1ull << 20, 64ull << 20, 1ull << 30, 10ull << 30};
+                o.concurrency = {1, 4, 16};
+                o.chunks = {0, 64 << 10, 1 << 20, 8 << 20};
+            } else if (a == "--tmp") {
+                o.tmp = value();
+            } else if (a == "--out") {
+                o.out = value();
+            } else {
+                usage();
+            }
+        } catch (const std::invalid_argument&) {
+            usage();
+        }
+    }
+    if (o.features.empty())
+        for (const char* f : {"checksum", "sendfile", "zlib"})
+            o.features.push_back(parse_features(f));
+
+    fs::path tmp = o.tmp.empty() ? fs::temp_directory_path() : fs::path(o.tmp);
+    tmp /= "tcptransfer_bench_" + std::to_string(::getpid());
+    fs::create_directories(tmp / "src");
+    fs::create_directories(tmp / "root");
+
+    ServerConfig scfg;
+    scfg.root = (tmp / "root").string();
+    scfg.bind_addr = "127.0.0.1";
+    Server server(scfg);
+    server.start();
+    Endpoint ep{"127.0.0.1", server.port()};
+
+    std::string json = "{\n  \"results\": [";
+    bool first = true;
+    for (uint64_t size : o.sizes) {
+        std::vector<size_t> counts = o.files;
+        if (counts.empty())
+            counts.push_back(static_cast<size_t>(
+                std::clamp<uint64_t>((256ull << 20) / std::max<uint64_t>(size, 1), 1, 2000)));
+        fs::path payload = tmp / "src" / ("payload_" + human(size));
+        write_payload(payload, size);
+
+        for (size_t count : counts) {
+            fs::path set = tmp / "src" / ("set_" + human(size) + "_" + std::to_string(count));
+            fs::create_directories(set);
+            std::vector<std::string> names;
+            for (size_t i = 0; i < count; ++i) {
+                fs::path link = set / ("f" + std::to_string(i));
+                if (!fs::exists(link))
+                    fs::create_symlink(payload, link);
+                names.push_back(link.string());
+            }
+
+            for (size_t conc : o.concurrency)
+                for (size_t chunk : o.chunks)
+                    for (const Features& f : o.features) {
+                        char head[512];
+                        std::snprintf(head, sizeof(head),
+                                      "%s\n    {\"size\": %llu, \"files\": %zu, \"concurrency\": "
+                                      "%zu, \"chunk\": \"%s\", \"features\": \"%s\", "
+                                      "\"checksum\": %s, \"sendfile\": %s, \"compression\": \"%s\", "
+                                      "\"io_uring\": %s",
+                                      first ? "" : ",", static_cast<unsigned long long>(size),
+                                      count, conc, chunk ? human(chunk).c_str() : "adaptive",
+                                      f.name.c_str(), f.checksum ? "true" : "false",
+                                      f.sendfile ? "true" : "false", codec_name(f.compression),
+                                      f.io_uring ? "true" : "false");
+                        json += head;
+                        first = false;
+                        if (f.io_uring) {
+                            // No io_uring transfer path in this build.
+                            json += ", \"skipped\": \"io_uring not supported\"}";
+                            continue;
+                        }
+
+                        ClientOptions copts;
+                        copts.workers = conc;
+                        copts.pool.background_reaper = false;
+                        copts.put.checksum = f.checksum;
+                        copts.put.use_sendfile = f.sendfile;
+                        copts.put.compression = f.compression;
+                        copts.put.adaptive = chunk == 0;
+                        if (chunk)
+                            copts.put.chunk_size = chunk;
+                        Client client(ep, copts);
+
+                        std::vector<Async<PutResult>> pending;
+                        pending.reserve(names.size());
+                        double cpu0 = cpu_seconds();
+                        auto t0 = std::chrono::steady_clock::now();
+                        for (auto& n : names)
+                            pending.push_back(client.put(n, "bench"));
+                        std::vector<double> lat_ms;
+                        uint64_t bytes = 0, wire = 0;
+                        size_t failed = 0;
+                        for (auto& a : pending) {
+                            try {
+                                PutResult r = a.get();
+                                lat_ms.push_back(std::chrono::duration<double, std::milli>(
+                                                     r.elapsed).count());
+                                bytes += r.file_size;
+                                wire += r.wire_bytes;
+                            } catch (const std::exception&) {
+                                ++failed;
+                            }
+                        }
+                        double secs = std::chrono::duration<double>(
+                                          std::chrono::steady_clock::now() - t0).count();
+                        double cpu = cpu_seconds() - cpu0;
+                        double gb = static_cast<double>(bytes) / 1e9;
+
+                        char body[512];
+                        std::snprintf(
+                            body, sizeof(body),
+                            ", \"bytes\": %llu, \"seconds\": %.4f, \"mb_per_s\": %.2f, "
+                            "\"files_per_s\": %.1f, \"latency_ms\": {\"p50\": %.3f, \"p99\": "
+                            "%.3f, \"max\": %.3f}, \"cpu_seconds\": %.4f, \"cpu_s_per_gb\": %.3f, "
+                            "\"wire_ratio\": %.3f, \"failed\": %zu}",
+                            static_cast<unsigned long long>(bytes), secs,
+                            static_cast<double>(bytes) / secs / 1e6,
+                            static_cast<double>(lat_ms.size()) / secs, percentile(lat_ms, 0.5),
+                            percentile(lat_ms, 0.99), percentile(lat_ms, 1.0), cpu,
+                            gb > 0 ? cpu / gb : 0,
+                            bytes ? static_cast<double>(wire) / static_cast<double>(bytes) : 0,
+                            failed);
+                        json += body;
+                        std::fprintf(stderr, "%s x%zu c%zu %s %s: %.1f MB/s\n",
+                                     human(size).c_str(), count, conc,
+                                     chunk ? human(chunk).c_str() : "adaptive", f.name.c_str(),
+                                     static_cast<double>(bytes) / secs / 1e6);
+                        fs::remove_all(tmp / "root" / "bench");
+                    }
+            fs::remove_all(set);
+        }
+        fs::remove(payload);
+    }
+    json += "\n  ]\n}\n";
+
+    server.stop();
+    fs::remove_all(tmp);
+
+    if (o.out.empty()) {
+        std::fputs(json.c_str(), stdout);
+    } else {
+        FILE* f = std::fopen(o.out.c_str(), "w");
+        if (!f) {
+            std::perror(o.out.c_str());
+            return 1;
+        }
+        std::fputs(json.c_str(), f);
+        std::fclose(f);
+    }
+    return 0;
+}
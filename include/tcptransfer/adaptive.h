@@ -0,0 +1,90 @@
+// Runtime chunk-size and in-flight window controller.
+//
+// The sender records every Data frame it sends and feeds back the server's
+// DataAck frames. From those the controller estimates the bottleneck rate
+// (windowed max of delivery-rate samples), the network round trip (windowed
+// min of ack RTT minus the server's reported write latency) and the disk
+// write latency. The window follows 2x the bandwidth-delay product, growing
+// exponentially until the rate stops improving; the chunk size targets
+// dozens of chunks in flight and is capped so a single chunk's disk write
+// stays near disk_latency_target.
+#pragma once
+
+#include <chrono>
+#include <cstddef>
+#include <cstdint>
+#include <deque>
+
+namespace TcpTransfer {
+
+struct AdaptiveOptions {
+    size_t min_chunk = 64 << 10;
+    size_t max_chunk = 16 << 20;
+    size_t initial_chunk = 256 << 10;
+    size_t min_window = 512 << 10;
+    size_t max_window = 512u << 20;
+    std::chrono::microseconds disk_latency_target{20000};
+};
+
+class AdaptiveController {
+public:
+    using Clock = std::chrono::steady_clock;
+
+    struct Snapshot {
+        size_t chunk = 0;
+        size_t window = 0;
+        double rate_bps = 0;                  ///< Bottleneck estimate, bytes/s.
+        std::chrono::microseconds min_rtt{0}; ///< Network RTT, disk time removed.
+        std::chrono::microseconds disk_latency{0};
+        uint64_t bdp = 0;
+        bool probing = true; ///< Still in exponential startup.
+    };
+
+    explicit AdaptiveController(AdaptiveOptions opts = {});
+
+    /// Call after a Data frame covering [end - bytes, end) is written.
+    void on_send(uint64_t end, size_t bytes, Clock::time_point now);
+    /// Call for every DataAck: committed is the server's contiguous end offset.
+    void on_ack(uint64_t committed, std::chrono::microseconds disk_latency,
+                Clock::time_point now);
+
+    size_t chunk_size() const { return chunk_; }
+    size_t window() const { return window_; }
+    uint64_t in_flight() const { return sent_ - acked_; }
+    bool can_send() const { return in_flight() < window_; }
+    Snapshot snapshot() const;
+
+private:
+    struct Sent {
+        uint64_t end;
+        Clock::time_point sent_at;
+        uint64_t delivered;                ///< Bytes acked when this was sent.
+        Clock::time_point delivered_at;    ///< Time of that ack.
+    };
+    struct Sample {
+        double value;
+        Clock::time_point at;
+    };
+
+    void update_model(Clock::time_point now);
+
+    AdaptiveOptions opts_;
+    size_t chunk_;
+    size_t window_;
+    uint64_t sent_ = 0;
+    uint64_t acked_ = 0;
+    Clock::time_point last_ack_at_{};
+    std::deque<Sent> outstanding_;
+
+    std::deque<Sample> rate_samples_; ///< Windowed max filter.
+    std::deque<Sample> rtt_samples_;  ///< Windowed min filter, microseconds.
+    double disk_us_ = 0;              ///< EWMA of per-chunk write latency.
+    double disk_bytes_ = 0;           ///< EWMA of bytes per acked chunk.
+
+    bool probing_ = true;
+    double round_start_rate_ = 0;
+    uint64_t round_end_ = 0;
+    int flat_rounds_ = 0;
+};
+
+} // namespace TcpTransfer
@@ -0,0 +1,169 @@
+// Async<T>: a shared-state future that is also a C++20 coroutine type.
+//
+// An Async<T> is completed once, from any thread. Like std::future it is
+// move-only and its result is taken once: block on get(), or co_await it
+// from one coroutine, which is resumed on the completing EventLoop when one
+// is attached, inline otherwise. A coroutine declared to return Async<T>
+// starts eagerly and completes the Async with its co_return value or
+// exception.
+#pragma once
+
+#include <cassert>
+#include <condition_variable>
+#include <coroutine>
+#include <exception>
+#include <memory>
+#include <mutex>
+#include <optional>
+#include <type_traits>
+#include <utility>
+
+#include "tcptransfer/event_loop.h"
+
+namespace TcpTransfer {
+
+namespace detail {
+
+struct Unit {};
+
+template <typename T>
+struct AsyncState {
+    using Value = std::conditional_t<std::is_void_v<T>, Unit, T>;
+
+    std::mutex mu;
+    std::condition_variable cv;
+    bool done = false;
+    std::optional<Value> value;
+    std::exception_ptr error;
+    std::coroutine_handle<> waiter; ///< The one coroutine awaiting it.
+    EventLoop* loop = nullptr; ///< Where waiters resume; null resumes inline.
+
+    template <typename... A>
+    void set_value(A&&... a) {
+        std::coroutine_handle<> h;
+        {
+            std::lock_guard<std::mutex> lk(mu);
+            value.emplace(std::forward<A>(a)...);
+            done = true;
+            h = std::exchange(waiter, nullptr);
+        }
+        finish(h);
+    }
+
+    void set_error(std::exception_ptr e) {
+        std::coroutine_handle<> h;
+        {
+            std::lock_guard<std::mutex> lk(mu);
+            error = std::move(e);
+            done = true;
+            h = std::exchange(waiter, nullptr);
+        }
+        finish(h);
+    }
+
+private:
+    void finish(std::coroutine_handle<> h) {
+        cv.notify_all();
+        if (!h)
+            return;
+        if (loop && !loop->in_loop_thread())
+            loop->post([h] { h.resume(); });
+        else
+            h.resume();
+    }
+};
+
+} // namespace detail
+
+template <typename T>
+class Async {
+public:
+    using State = detail::AsyncState<T>;
+
+    Async() = default;
+    explicit Async(std::shared_ptr<State> st) : st_(std::move(st)) {}
+    Async(Async&&) noexcept = default;
+    Async& operator=(Async&&) noexcept = default;
+    Async(const Async&) = delete;
+    Async& operator=(const Async&) = delete;
+
+    /// Creates an unfinished Async and its completion handle.
+    static std::pair<Async, std::shared_ptr<State>> make(EventLoop* loop = nullptr) {
+        auto st = std::make_shared<State>();
+        st->loop = loop;
+        return {Async(st), st};
+    }
+
+    bool valid() const { return st_ != nullptr; }
+
+    bool ready() const {
+        std::lock_guard<std::mutex> lk(st_->mu);
+        return st_->done;
+    }
+
+    void wait() const {
+        std::unique_lock<std::mutex> lk(st_->mu);
+        st_->cv.wait(lk, [&] { return st_->done; });
+    }
+
+    /// Blocks until complete; rethrows the failure if any. Leaves the
+    /// Async invalid, the result having been taken.
+    T get() {
+        wait();
+        return take();
+    }
+
+    // Awaitable interface.
+    bool await_ready() const { return ready(); }
+    bool await_suspend(std::coroutine_handle<> h) {
+        std::lock_guard<std::mutex> lk(st_->mu);
+        if (st_->done)
+            return false;
+        assert(!st_->waiter && "an Async is awaited once");
+        st_->waiter = h;
+        return true;
+    }
+    T await_resume() { return take(); }
+
+    struct promise_type;
+
+private:
+    T take() {
+        std::shared_ptr<State> st = std::move(st_);
+        if (st->error)
+            std::rethrow_exception(st->error);
+        if constexpr (!std::is_void_v<T>)
+            return std::move(*st->value);
+    }
+
+    std::shared_ptr<State> st_;
+};
+
+namespace detail {
+
+template <typename T>
+struct PromiseBase {
+    std::shared_ptr<AsyncState<T>> st = std::make_shared<AsyncState<T>>();
+
+    template <typename U>
+    void return_value(U&& v) { st->set_value(std::forward<U>(v)); }
+};
+
+template <>
+struct PromiseBase<void> {
+    std::shared_ptr<AsyncState<void>> st = std::make_shared<AsyncState<void>>();
+
+    void return_void() { st->set_value(); }
+};
+
+} // namespace detail
+
+template <typename T>
+struct Async<T>::promise_type : detail::PromiseBase<T> {
+    Async get_return_object() { return Async(this->st); }
+    std::suspend_never initial_suspend() noexcept { return {}; }
+    std::suspend_never final_suspend() noexcept { return {}; }
+    void unhandled_exception() { this->st->set_error(std::current_exception()); }
+};
+
+} // namespace TcpTransfer
@@ -0,0 +1,20 @@
+// CRC32 (zlib polynomial) used for end-to-end file integrity, and a fast
+// 64-bit hash for block identity.
+#pragma once
+
+#include <cstddef>
+#include <cstdint>
+
+namespace TcpTransfer {
+
+/// Continues a CRC32; start with crc = 0.
+uint32_t crc32_update(uint32_t crc, const void* data, size_t n);
+
+/// Combines crc(A) and crc(B) into crc(A||B) given len(B).
+uint32_t crc32_combine(uint32_t crc_a, uint32_t crc_b, uint64_t len_b);
+
+/// XXH64 of n bytes. Not cryptographic: used to confirm rolling-checksum
+/// block matches, with the whole-file CRC32 as the final check.
+uint64_t hash64(const void* data, size_t n, uint64_t seed = 0);
+
+} // namespace TcpTransfer
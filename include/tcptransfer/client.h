@@ -0,0 +1,169 @@
+// Embeddable asynchronous client.
+//
+//   TcpTransfer::Client client(TcpTransfer::Endpoint::parse("server:7070"), opts);
+//   PutResult r = co_await client.put("/data/a.bin", "incoming");
+//   auto all = client.put_many({"/data/a", "/data/b"}, "incoming").get();
+//   auto sync = client.sync("/data/tree", "mirror").get();
+//   GetResult g = client.get("incoming/a.bin", "/tmp/a.bin").get();
+//
+// Transfers run on a small pool of I/O workers over pooled sessions, with
+// their CPU work (hashing, compression, delta matching) spread over a shared
+// work-stealing pool; each result is delivered through the client's event
+// loop thread, which is also where awaiting coroutines resume. Queued
+// transfers start earliest deadline first (see PutOptions::priority and
+// PutOptions::deadline).
+#pragma once
+
+#include <chrono>
+#include <condition_variable>
+#include <functional>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <vector>
+
+#include "tcptransfer/async.h"
+#include "tcptransfer/connection_pool.h"
+#include "tcptransfer/event_loop.h"
+#include "tcptransfer/session.h"
+#include "tcptransfer/thread_pool.h"
+
+namespace TcpTransfer {
+
+struct ClientOptions {
+    PoolOptions pool;
+    PutOptions put;      ///< Defaults for put()/put_many().
+    size_t workers = 4;  ///< Concurrent transfers.
+    /// Threads for chunk hashing/compression and delta matching, shared by
+    /// all transfers; 0 = one per CPU. Used unless put.pool is set.
+    size_t cpu_threads = 0;
+    /// Hash cache for sync() (see HashCache::default_path()); empty hashes
+    /// every file on every sync.
+    std::string hash_cache;
+};
+
+/// Per-file outcome of put_many(); error is empty on success.
+struct PutOutcome {
+    std::string path;
+    PutResult result;
+    std::string error;
+
+    bool ok() const { return error.empty(); }
+};
+
+/// Outcome of sync(): how many files the manifest listed and the puts of
+/// the ones the server lacked.
+struct SyncResult {
+    size_t files = 0;
+    size_t hashed = 0; ///< Files read to hash; the rest came from the hash cache.
+    std::vector<PutOutcome> sent;
+};
+
+class Client {
+public:
+    explicit Client(Endpoint server, ClientOptions opts = {});
+    ~Client();
+    Client(const Client&) = delete;
+    Client& operator=(const Client&) = delete;
+
+    Async<PutResult> put(std::string local_path, std::string remote_dir);
+    Async<PutResult> put(std::string local_path, std::string remote_dir, PutOptions opts);
+
+    /// Uploads every path into remote_dir. Files are split into one batch
+    /// per worker so each batch runs back to back on a single session.
+    /// Completes when all files finished; per-file failures are reported in
+    /// the outcomes rather than failing the whole batch.
+    Async<std::vector<PutOutcome>> put_many(std::vector<std::string> paths,
+                                            std::string remote_dir);
+    Async<std::vector<PutOutcome>> put_many(std::vector<std::string> paths,
+                                            std::string remote_dir, PutOptions opts);
+
+    /// Mirrors the regular files under local_dir into remote_dir, keeping
+    /// relative paths. A manifest of sizes, mtimes and content hashes is
+    /// compared against the server's index of remote_dir first, so only
+    /// new or changed files are uploaded. Files deleted locally are left
+    /// in place on the server.
+    Async<SyncResult> sync(std::string local_dir, std::string remote_dir);
+    Async<SyncResult> sync(std::string local_dir, std::string remote_dir, PutOptions opts);
+
+    /// Uploads files named relative to local_dir to the same relative paths
+    /// under remote_dir, without a manifest exchange; for callers that
+    /// already know what changed, such as a DirWatcher. Files up to
+    /// Session::kBundleFileMax are packed into Bundle frames. Paths that no
+    /// longer name a regular file are skipped.
+    Async<std::vector<PutOutcome>> push(std::string local_dir, std::vector<std::string> rel_paths,
+                                        std::string remote_dir);
+    Async<std::vector<PutOutcome>> push(std::string local_dir, std::vector<std::string> rel_paths,
+                                        std::string remote_dir, PutOptions opts);
+
+    /// Downloads remote_path (relative to the server root) to local_path.
+    /// With opts.stripes > 1, a large file is fetched as that many ranges
+    /// over separate pooled sessions and assembled in place; the file must
+    /// not change while they run.
+    Async<GetResult> get(std::string remote_path, std::string local_path);
+    Async<GetResult> get(std::string remote_path, std::string local_path, GetOptions opts);
+
+    const Endpoint& server() const { return server_; }
+    EventLoop& loop() { return loop_; }
+    ConnectionPool& pool() { return pool_; }
+
+private:
+    using Job = std::function<void()>;
+    using Clock = std::chrono::steady_clock;
+
+    struct QueuedJob {
+        Clock::time_point due;
+        uint64_t seq; ///< FIFO among equal deadlines.
+        Job job;
+    };
+    struct LaterDue {
+        bool operator()(const QueuedJob& a, const QueuedJob& b) const {
+            return a.due != b.due ? a.due > b.due : a.seq > b.seq;
+        }
+    };
+
+    struct BatchItem {
+        std::string local_path;
+        std::string remote_dir;
+    };
+
+    void submit(Job job, Clock::time_point due);
+    /// put_file() on lease, acquiring one if empty and dropping it once
+    /// broken. With opts.resume, a put cut off by its connection (a server
+    /// restart, say) is resumed once on a fresh one. A put refused as Busy
+    /// by a server handing off is retried once on a fresh connection.
+    PutResult put_resuming(ConnectionPool::Lease& lease, const std::string& local_path,
+                           const std::string& remote_dir, const PutOptions& opts);
+    /// put_resuming(), or with opts.stripes > 1 and a large enough file, a
+    /// striped put: stripe 0 on lease, the others on their own threads and
+    /// pooled sessions (threads, since every stripe waits for all of them).
+    PutResult put_striped(ConnectionPool::Lease& lease, const std::string& local_path,
+                          const std::string& remote_dir, const PutOptions& opts);
+    /// Runs items split over the workers and calls done with the outcomes,
+    /// in item order, from whichever worker finishes last.
+    void run_batch(std::vector<BatchItem> items, PutOptions opts, Clock::time_point due,
+                   std::function<void(std::vector<PutOutcome>)> done);
+    /// Sends rel_paths from a worker: small files as bundles right away,
+    /// the rest through run_batch().
+    void send_tree(const std::string& local_dir, const std::string& remote_dir,
+                   const std::vector<std::string>& rel_paths, PutOptions opts,
+                   Clock::time_point due, std::function<void(std::vector<PutOutcome>)> done);
+    void worker_loop();
+
+    Endpoint server_;
+    ClientOptions opts_;
+    WorkStealingPool cpu_pool_;
+    ConnectionPool pool_;
+    EventLoop loop_;
+    std::thread loop_thread_;
+
+    std::mutex mu_;
+    std::condition_variable cv_;
+    std::vector<QueuedJob> jobs_; ///< Heap, earliest due on top.
+    uint64_t next_seq_ = 0;
+    bool stopping_ = false;
+    std::vector<std::thread> workers_;
+};
+
+} // namespace TcpTransfer
@@ -0,0 +1,28 @@
+// Per-chunk payload compression. The codec id travels in the low bits of the
+// Data frame header flags and the uncompressed length in its aux field.
+#pragma once
+
+#include <cstddef>
+#include <cstdint>
+#include <vector>
+
+namespace TcpTransfer {
+
+enum class Codec : uint8_t {
+    None = 0,
+    Zlib = 1,
+};
+
+constexpr uint8_t kDataCodecMask = 0x0f;
+
+const char* codec_name(Codec c);
+
+/// Compresses n bytes into out. Returns the compressed size, or 0 if the
+/// result would not be smaller (the caller then sends the chunk raw).
+size_t codec_compress(Codec c, int level, const char* in, size_t n, std::vector<char>& out);
+
+/// Decompresses exactly out_len bytes; throws ProtocolError on corrupt input
+/// or a length mismatch.
+void codec_decompress(Codec c, const char* in, size_t n, char* out, size_t out_len);
+
+} // namespace TcpTransfer
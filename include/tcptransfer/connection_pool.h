@@ -0,0 +1,115 @@
+// Pool of warm, authenticated sessions keyed by server endpoint.
+//
+// Reconnecting (TCP + Hello round trips) dominates short transfers, so the
+// pool hands out idle sessions most-recently-used first and only dials a new
+// one when none is available. Idle sessions are checked before reuse and
+// evicted after idle_timeout.
+#pragma once
+
+#include <chrono>
+#include <condition_variable>
+#include <cstdint>
+#include <deque>
+#include <map>
+#include <memory>
+#include <mutex>
+#include <thread>
+
+#include "tcptransfer/session.h"
+
+namespace TcpTransfer {
+
+enum class HealthCheck {
+    None,  ///< Trust idle sessions.
+    Probe, ///< Non-blocking poll for EOF/unsolicited data.
+    Ping,  ///< Probe, plus a Ping round trip once idle for health_check_interval.
+};
+
+struct PoolOptions {
+    SessionOptions session;
+    size_t max_idle_per_endpoint = 8;
+    size_t max_per_endpoint = 64; ///< In use + idle; 0 means unlimited.
+    std::chrono::milliseconds idle_timeout{60000};
+    std::chrono::milliseconds health_check_interval{5000};
+    HealthCheck health_check = HealthCheck::Ping;
+    std::chrono::milliseconds acquire_timeout{30000};
+    bool background_reaper = true; ///< Evict expired idle sessions periodically.
+};
+
+struct PoolStats {
+    uint64_t connects = 0;
+    uint64_t reuses = 0;
+    uint64_t idle_evictions = 0;
+    uint64_t health_check_failures = 0;
+    uint64_t discarded = 0;
+    size_t in_use = 0;
+    size_t idle = 0;
+};
+
+class ConnectionPool {
+public:
+    /// Exclusive use of one session; returns it to the pool on destruction
+    /// unless the session broke or discard() was called.
+    class Lease {
+    public:
+        Lease() = default;
+        Lease(Lease&& o) noexcept;
+        Lease& operator=(Lease&& o) noexcept;
+        ~Lease();
+
+        Session& operator*() const { return *session_; }
+        Session* operator->() const { return session_.get(); }
+        explicit operator bool() const { return session_ != nullptr; }
+
+        /// Closes the session instead of returning it.
+        void discard();
+
+    private:
+        friend class ConnectionPool;
+        Lease(ConnectionPool* pool, std::unique_ptr<Session> s)
+            : pool_(pool), session_(std::move(s)) {}
+        void release();
+
+        ConnectionPool* pool_ = nullptr;
+        std::unique_ptr<Session> session_;
+    };
+
+    explicit ConnectionPool(PoolOptions opts = {});
+    ~ConnectionPool();
+    ConnectionPool(const ConnectionPool&) = delete;
+    ConnectionPool& operator=(const ConnectionPool&) = delete;
+
+    /// Returns a healthy session to ep, reusing an idle one when possible.
+    /// Blocks up to acquire_timeout when max_per_endpoint is reached.
+    Lease acquire(const Endpoint& ep);
+
+    /// Closes idle sessions older than idle_timeout; returns how many.
+    size_t reap();
+    /// Closes every idle session.
+    void clear();
+
+    PoolStats stats() const;
+    const PoolOptions& options() const { return opts_; }
+
+private:
+    struct Slot {
+        std::deque<std::unique_ptr<Session>> idle; ///< Back is most recent.
+        size_t in_use = 0;
+    };
+
+    void give_back(std::unique_ptr<Session> s, bool reusable);
+    bool healthy(Session& s);
+    void reaper_loop();
+
+    PoolOptions opts_;
+    mutable std::mutex mu_;
+    std::condition_variable slot_freed_;
+    std::map<Endpoint, Slot> slots_;
+    PoolStats stats_;
+
+    std::condition_variable reaper_cv_;
+    bool stopping_ = false;
+    std::thread reaper_;
+};
+
+} // namespace TcpTransfer
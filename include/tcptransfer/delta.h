@@ -0,0 +1,74 @@
+// Rolling-checksum delta encoding (rsync style).
+//
+// The receiver describes the file it already has as per-block signatures.
+// The sender slides a rolling weak checksum over its own file, confirms weak
+// hits with the strong hash, and ends up with a plan of literal ranges to
+// send and block ranges the receiver can copy locally. Both sides split
+// their files into independent segments and run them on a
+// WorkStealingPool; matches never straddle a segment boundary, which costs
+// at most one block of reuse per segment. Segments are read through a
+// MappedFile window rather than copied into buffers, so a scan of a large
+// file keeps only a few windows per worker resident.
+#pragma once
+
+#include <cstddef>
+#include <cstdint>
+#include <vector>
+
+#include "tcptransfer/protocol.h"
+
+namespace TcpTransfer {
+
+class WorkStealingPool;
+
+/// rsync's weak checksum over a fixed window, updatable one byte at a time.
+class RollingChecksum {
+public:
+    void reset(const unsigned char* p, size_t n) {
+        a_ = b_ = 0;
+        n_ = static_cast<uint32_t>(n);
+        for (size_t i = 0; i < n; ++i) {
+            a_ += p[i];
+            b_ += a_;
+        }
+    }
+    /// Slides the window: drops out, appends in.
+    void roll(unsigned char out, unsigned char in) {
+        a_ += in - out;
+        b_ += a_ - n_ * out;
+    }
+    uint32_t value() const { return (a_ & 0xffff) | (b_ << 16); }
+
+private:
+    uint32_t a_ = 0;
+    uint32_t b_ = 0;
+    uint32_t n_ = 0;
+};
+
+/// Block size for a basis file: about sqrt(size), a power of two in
+/// [2 KiB, 1 MiB], grown further if the signature list would not fit one
+/// frame.
+uint32_t delta_block_size(uint64_t basis_size);
+
+/// Signatures of every full block of fd's first size bytes.
+SignaturesMsg compute_signatures(int fd, uint64_t size, WorkStealingPool* pool, int cpu = -1);
+
+struct DeltaOp {
+    uint64_t offset = 0;   ///< Destination offset.
+    uint64_t length = 0;
+    int64_t source = -1;   ///< Basis offset to copy from; -1 for literal bytes.
+
+    bool literal() const { return source < 0; }
+};
+
+struct DeltaPlan {
+    std::vector<DeltaOp> ops; ///< Contiguous and in offset order.
+    uint32_t crc = 0;         ///< CRC32 of the whole source file.
+    uint64_t copied = 0;      ///< Bytes covered by copy ops.
+};
+
+/// Plans how to rebuild fd's first size bytes from the receiver's basis.
+DeltaPlan plan_delta(int fd, uint64_t size, const SignaturesMsg& sig, WorkStealingPool* pool,
+                     int cpu = -1);
+
+} // namespace TcpTransfer
@@ -0,0 +1,66 @@
+// Cache of open directory handles below the server root.
+//
+// Resolving "a/b/c/d" safely means one openat (and with create, one mkdirat)
+// per component, because each step must refuse symlinks. Uploads into a
+// tree land in the same few directories over and over, so handles are kept
+// open, keyed by relative path, and a miss walks only the components below
+// its nearest cached ancestor. Least recently used handles are closed past
+// the capacity; a handle in use stays open until its last holder drops it.
+//
+// The cache assumes the tree is changed mostly through the server. Handles
+// of directories removed on disk are noticed (link count 0) and reopened;
+// a directory renamed behind the server's back is followed for at most ttl.
+#pragma once
+
+#include <atomic>
+#include <chrono>
+#include <cstdint>
+#include <list>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <string_view>
+#include <unordered_map>
+
+#include "tcptransfer/socket.h"
+
+namespace TcpTransfer {
+
+class DirCache {
+public:
+    using Clock = std::chrono::steady_clock;
+    using Handle = std::shared_ptr<const Fd>; ///< O_PATH directory fd.
+
+    /// root_fd must outlive the cache.
+    DirCache(int root_fd, size_t capacity, std::chrono::milliseconds ttl);
+
+    /// Opens (and with create, makes) rel under the root, never following
+    /// symlinks. Safe from any thread. Throws std::system_error.
+    Handle open(std::string_view rel, bool create);
+    void clear();
+
+    uint64_t hits() const { return hits_.load(std::memory_order_relaxed); }
+    uint64_t misses() const { return misses_.load(std::memory_order_relaxed); }
+
+private:
+    struct Entry {
+        Handle handle;
+        Clock::time_point opened;
+        std::list<std::string>::iterator lru;
+    };
+
+    /// Cached, still-linked handle of rel, or null. Caller holds mu_.
+    Handle find_locked(const std::string& rel, Clock::time_point now);
+    void insert(const std::string& rel, Handle h, Clock::time_point now);
+
+    int root_;
+    size_t capacity_;
+    std::chrono::milliseconds ttl_;
+    std::mutex mu_;
+    std::unordered_map<std::string, Entry> map_;
+    std::list<std::string> lru_; ///< Most recent first.
+    std::atomic<uint64_t> hits_{0};
+    std::atomic<uint64_t> misses_{0};
+};
+
+} // namespace TcpTransfer
@@ -0,0 +1,78 @@
+// Persistent metadata index of one synced directory on the server.
+//
+// Maps a relative path to the size, mtime and content hash of the file the
+// server last received there, so a client's manifest can be compared
+// without touching the files themselves. The table is an open-addressing
+// hash with linear probing over fixed 48-byte slots that hold the path's
+// hash inline, followed by an append-only arena of path bytes; the whole
+// file is mmapped and updated in place. Entries are never removed: a path
+// whose file changed outside a sync keeps its slot in a "stale" state, so
+// probe chains stay intact without tombstones.
+//
+// The header carries a dirty flag that is set before the first change and
+// cleared by flush(). An index that was not flushed cleanly (crash, full
+// disk) is discarded on open, which costs one full resync, never a wrong
+// "unchanged".
+#pragma once
+
+#include <cstddef>
+#include <cstdint>
+#include <string>
+#include <string_view>
+
+#include "tcptransfer/socket.h"
+
+namespace TcpTransfer {
+
+class DirIndex {
+public:
+    static constexpr char kFileName[] = ".tcptransfer-index";
+
+    struct Entry {
+        uint64_t size = 0;
+        int64_t mtime_ns = 0;
+        uint64_t hash = 0;
+    };
+
+    /// Opens or creates kFileName in dirfd. Throws on I/O errors.
+    explicit DirIndex(int dirfd);
+    ~DirIndex();
+    DirIndex(const DirIndex&) = delete;
+    DirIndex& operator=(const DirIndex&) = delete;
+
+    /// True if path was received by a sync and still matches e.
+    bool matches(std::string_view path, const Entry& e) const;
+    /// Remembers that a sync is about to send e to path.
+    void expect(std::string_view path, const Entry& e);
+    /// A file of size and mtime_ns was just written at path: confirms a
+    /// matching expect(), and otherwise marks the path stale.
+    void committed(std::string_view path, uint64_t size, int64_t mtime_ns);
+
+    size_t size() const;
+    /// Writes the mapping back and marks the file clean.
+    void flush();
+
+private:
+    struct Header;
+    struct Slot;
+
+    Header* header() const;
+    Slot* slots() const;
+    char* arena() const;
+    void init(uint64_t capacity, uint64_t arena_cap);
+    void map(uint64_t bytes);
+    bool valid() const;
+    void mark_dirty();
+    /// Slot holding path, or the empty slot where it would go.
+    Slot* find(std::string_view path, uint64_t h) const;
+    Slot* insert(std::string_view path);
+    void grow_table();
+    void reserve_arena(uint64_t extra);
+
+    Fd dir_;
+    Fd fd_;
+    char* base_ = nullptr;
+    uint64_t mapped_ = 0;
+};
+
+} // namespace TcpTransfer
@@ -0,0 +1,120 @@
+// Writer threads per destination device.
+//
+// Received data is written off the event loop, by threads that belong to
+// the block device under the destination file. A slow disk then backs up
+// only its own queue: network threads, and uploads to other devices, carry
+// on. Each device gets a number of lanes (threads) suited to its kind: one
+// for a rotating disk, which only loses by seeking between files, several
+// for flash, which needs requests in flight. A file's writes all go through
+// one lane, in order; a lane folds queued writes that continue each other
+// in the same file into one pwritev.
+#pragma once
+
+#include <sys/types.h>
+
+#include <atomic>
+#include <chrono>
+#include <condition_variable>
+#include <cstdint>
+#include <deque>
+#include <functional>
+#include <map>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <vector>
+
+#include "tcptransfer/socket.h"
+
+namespace TcpTransfer {
+
+enum class DeviceKind : uint8_t {
+    Rotational,
+    Flash,
+    Other, ///< No block device (tmpfs, network and overlay filesystems).
+};
+
+/// Kind of the block device dev, from /sys/dev/block.
+DeviceKind device_kind(dev_t dev);
+
+struct DiskWriterOptions {
+    size_t rotational_lanes = 1;
+    size_t flash_lanes = 4;
+    size_t other_lanes = 2;
+    size_t max_merge_bytes = 4 << 20; ///< Largest write made by merging.
+};
+
+class DiskWriters {
+    struct Queue;
+
+public:
+    /// Called on the lane's thread once a write has landed, or failed with
+    /// errno error; took is its share of the syscall it was part of.
+    using Done = std::function<void(int error, std::chrono::nanoseconds took)>;
+
+    /// Where a file's writes go; from lane_for().
+    using Lane = Queue*;
+
+    explicit DiskWriters(DiskWriterOptions opts = {});
+    /// Finishes the writes already queued.
+    ~DiskWriters();
+    DiskWriters(const DiskWriters&) = delete;
+    DiskWriters& operator=(const DiskWriters&) = delete;
+
+    /// Lane of the file (dev, ino). A file always maps to the same lane,
+    /// so writes from one upload never land after the next one's. Starts
+    /// the device's threads on first use.
+    Lane lane_for(dev_t dev, ino_t ino);
+    /// Queues data for [offset, offset + data.size()) of file.
+    void submit(Lane lane, std::shared_ptr<const Fd> file, uint64_t offset,
+                std::vector<char> data, Done done);
+    /// Queues cutting file to size, after the writes queued before it.
+    void truncate(Lane lane, std::shared_ptr<const Fd> file, uint64_t size, Done done);
+    /// Queues calling done once the writes queued before it have landed.
+    void flush(Lane lane, Done done);
+
+    uint64_t writes() const { return writes_.load(std::memory_order_relaxed); }
+    /// Writes folded into another's syscall.
+    uint64_t merged() const { return merged_.load(std::memory_order_relaxed); }
+    size_t devices() const;
+
+private:
+    enum class Kind : uint8_t {
+        Write,
+        Truncate, ///< ftruncate to offset.
+        Flush,    ///< No file; only done.
+    };
+    struct Job {
+        std::shared_ptr<const Fd> file;
+        uint64_t offset = 0;
+        std::vector<char> data;
+        Done done;
+        Kind kind = Kind::Write;
+    };
+    struct Queue {
+        std::string name; ///< Of the thread.
+        std::mutex mu;
+        std::condition_variable cv;
+        std::deque<Job> jobs;
+        bool stop = false;
+        std::thread thread;
+    };
+    struct Device {
+        DeviceKind kind = DeviceKind::Other;
+        std::vector<std::unique_ptr<Queue>> lanes;
+    };
+
+    void enqueue(Lane lane, Job job);
+    void run(Queue& q);
+    /// Writes jobs (consecutive ranges of one file) with one pwritev.
+    void write_merged(std::vector<Job>& jobs);
+
+    DiskWriterOptions opts_;
+    mutable std::mutex mu_;
+    std::map<dev_t, Device> devices_;
+    std::atomic<uint64_t> writes_{0};
+    std::atomic<uint64_t> merged_{0};
+};
+
+} // namespace TcpTransfer
@@ -0,0 +1,51 @@
+// Reed-Solomon erasure coding over GF(2^8) for FEC puts.
+//
+// A group of k equal-sized data shards gets m parity shards; any k of the
+// k + m shards rebuild the rest. The code is systematic (data shards are
+// sent as they are) with a Cauchy parity matrix, so every k x k submatrix
+// of the generator is invertible.
+//
+// All the work is dst ^= c * src over whole shards. That runs on the
+// split-nibble method: two 16-entry product tables per constant, applied
+// with one byte shuffle per nibble, 32 bytes per instruction with AVX2 or
+// 16 with SSSE3. The kernel is picked once from the CPU.
+#pragma once
+
+#include <cstddef>
+#include <cstdint>
+#include <vector>
+
+namespace TcpTransfer {
+
+enum class GfKernel { Auto, Scalar, Ssse3, Avx2 };
+
+/// dst[i] ^= c * src[i] in GF(2^8).
+void gf_mul_add(uint8_t c, const uint8_t* src, uint8_t* dst, size_t n);
+/// Name of the kernel in use.
+const char* gf_kernel_name();
+/// Forces a kernel (for benchmarks); false if the CPU lacks it.
+bool gf_use_kernel(GfKernel k);
+
+class ReedSolomon {
+public:
+    /// data + parity must not exceed 256; throws Error otherwise.
+    ReedSolomon(size_t data, size_t parity);
+
+    size_t data_shards() const { return k_; }
+    size_t parity_shards() const { return m_; }
+
+    /// Fills parity[0..m) from data[0..k), each len bytes.
+    void encode(const uint8_t* const* data, uint8_t* const* parity, size_t len) const;
+    /// shards holds k + m buffers of len bytes, data first; present marks
+    /// the intact ones. Rebuilds the missing data shards in place (parity
+    /// shards are left alone). False if fewer than k shards are present.
+    bool reconstruct(uint8_t* const* shards, const std::vector<bool>& present,
+                     size_t len) const;
+
+private:
+    size_t k_;
+    size_t m_;
+    std::vector<uint8_t> parity_; ///< m x k Cauchy matrix, row-major.
+};
+
+} // namespace TcpTransfer
@@ -0,0 +1,53 @@
+// Error types shared by the client and server.
+#pragma once
+
+#include <cstdint>
+#include <stdexcept>
+#include <string>
+#include <system_error>
+
+namespace TcpTransfer {
+
+/// Status codes carried in PutAck / Error frames.
+enum class Status : uint32_t {
+    Ok = 0,
+    BadRequest = 1,
+    AuthFailed = 2,
+    PathRejected = 3,
+    IoError = 4,
+    ChecksumMismatch = 5,
+    SizeMismatch = 6,
+    Unsupported = 7,
+    Busy = 8,
+};
+
+const char* status_name(Status s);
+
+/// Base class for all library errors.
+class Error : public std::runtime_error {
+public:
+    using std::runtime_error::runtime_error;
+};
+
+/// Malformed or unexpected frame on the wire.
+class ProtocolError : public Error {
+public:
+    using Error::Error;
+};
+
+/// The peer answered with a non-Ok status.
+class RemoteError : public Error {
+public:
+    RemoteError(Status status, const std::string& message)
+        : Error(std::string(status_name(status)) + ": " + message), status_(status) {}
+
+    Status status() const { return status_; }
+
+private:
+    Status status_;
+};
+
+/// Throws std::system_error built from the current errno.
+[[noreturn]] void throw_errno(const std::string& what);
+
+} // namespace TcpTransfer
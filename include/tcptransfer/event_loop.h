@@ -0,0 +1,78 @@
+// Single-threaded epoll reactor with cross-thread task posting and timers.
+#pragma once
+
+#include <sys/epoll.h>
+
+#include <chrono>
+#include <cstdint>
+#include <functional>
+#include <mutex>
+#include <queue>
+#include <thread>
+#include <unordered_map>
+#include <vector>
+
+#include "tcptransfer/socket.h"
+
+namespace TcpTransfer {
+
+class EventLoop {
+public:
+    using Clock = std::chrono::steady_clock;
+    using IoHandler = std::function<void(uint32_t events)>;
+    using Task = std::function<void()>;
+    using TimerId = uint64_t;
+
+    EventLoop();
+    EventLoop(const EventLoop&) = delete;
+    EventLoop& operator=(const EventLoop&) = delete;
+
+    /// Registers fd for epoll events (EPOLLIN/EPOLLOUT/...). Loop thread only.
+    void add(int fd, uint32_t events, IoHandler handler);
+    void modify(int fd, uint32_t events);
+    void remove(int fd);
+
+    /// Queues a task to run on the loop thread. Safe from any thread.
+    void post(Task task);
+
+    /// Runs fn on this iteration, after every I/O handler and due timer,
+    /// before waiting again. Lets handlers look at a whole batch of
+    /// readiness events before acting on them. Loop thread only.
+    void defer(Task fn);
+    /// Runs fn once after delay. Loop thread only.
+    TimerId run_after(std::chrono::milliseconds delay, Task fn);
+    void cancel(TimerId id);
+
+    /// Dispatches events until stop() is called.
+    void run();
+    /// Safe from any thread.
+    void stop();
+
+    bool in_loop_thread() const;
+
+private:
+    struct Timer {
+        Clock::time_point when;
+        TimerId id;
+        bool operator>(const Timer& o) const { return when > o.when; }
+    };
+
+    void wake();
+    void drain_tasks();
+    int next_timeout_ms();
+    void fire_timers();
+
+    Fd epfd_;
+    Fd wakefd_;
+    std::unordered_map<int, IoHandler> handlers_;
+    std::mutex mu_;
+    std::vector<Task> tasks_;
+    std::vector<Task> deferred_;
+    bool stopping_ = false;
+    std::priority_queue<Timer, std::vector<Timer>, std::greater<>> timer_heap_;
+    std::unordered_map<TimerId, Task> timers_;
+    TimerId next_timer_ = 1;
+    std::thread::id thread_id_;
+};
+
+} // namespace TcpTransfer
@@ -0,0 +1,113 @@
+// Read side of downloads: open files, their metadata and their hot extents.
+//
+// A popular artifact is fetched over and over, so the server keeps its fd
+// open, keyed by relative path, and revalidates it with one fstatat per
+// fetch: a file replaced by an upload has a new inode and is reopened, one
+// changed in place has a new size or mtime. CRCs of served ranges are kept
+// with the open file and go away with it.
+//
+// Extents are kExtentSize-aligned slices of a file's content, keyed by the
+// file's identity, so a changed file never serves stale bytes. Admission is
+// 2Q-style: an extent's first fetch only leaves its key in a ghost list,
+// and a second fetch while the key is remembered copies it in. One-off
+// scans of large files therefore never push out the hot set, which stays
+// in memory even when uploads churn the page cache. Kept extents are
+// evicted least recently used past the byte budget.
+#pragma once
+
+#include <sys/types.h>
+
+#include <atomic>
+#include <cstdint>
+#include <list>
+#include <map>
+#include <memory>
+#include <mutex>
+#include <optional>
+#include <string>
+#include <unordered_map>
+#include <utility>
+
+#include "tcptransfer/socket.h"
+
+namespace TcpTransfer {
+
+class FileCache {
+public:
+    static constexpr size_t kExtentSize = 1 << 20;
+
+    struct File {
+        Fd fd;
+        uint64_t size = 0;
+        uint32_t mode = 0;
+        int64_t mtime_ns = 0;
+        dev_t dev = 0;
+        ino_t ino = 0;
+        bool regular = false;
+
+        /// CRC32 of [offset, offset + length), if computed before.
+        std::optional<uint32_t> crc(uint64_t offset, uint64_t length) const;
+        void remember_crc(uint64_t offset, uint64_t length, uint32_t crc) const;
+
+    private:
+        mutable std::mutex mu_;
+        mutable std::map<std::pair<uint64_t, uint64_t>, uint32_t> crcs_;
+    };
+    using FileHandle = std::shared_ptr<const File>;
+    using Extent = std::shared_ptr<const std::string>;
+
+    /// max_files open fds; extent_bytes of extent data (0 disables it).
+    FileCache(size_t max_files, size_t extent_bytes);
+
+    /// Opens name in dir_fd read-only without following symlinks, reusing
+    /// the cached fd of rel while the file is unchanged. Safe from any
+    /// thread. Throws std::system_error; errno is kept for the caller.
+    FileHandle open(int dir_fd, const std::string& rel, const std::string& name);
+
+    /// Extent index of f, or null. On a miss, admit tells whether the
+    /// extent was missed recently enough to be worth insert_extent().
+    Extent extent(const File& f, uint64_t index, bool& admit);
+    /// Keeps data as extent index of f; returns it either way.
+    Extent insert_extent(const File& f, uint64_t index, std::string data);
+
+    uint64_t file_hits() const { return file_hits_.load(std::memory_order_relaxed); }
+    uint64_t file_misses() const { return file_misses_.load(std::memory_order_relaxed); }
+    uint64_t extent_hits() const { return extent_hits_.load(std::memory_order_relaxed); }
+    uint64_t extent_misses() const { return extent_misses_.load(std::memory_order_relaxed); }
+    size_t extent_bytes() const;
+
+private:
+    struct FileEntry {
+        FileHandle file;
+        std::list<std::string>::iterator lru;
+    };
+    struct ExtentEntry {
+        Extent data;
+        std::list<std::string>::iterator lru;
+    };
+
+    static std::string extent_key(const File& f, uint64_t index);
+
+    size_t max_files_;
+    size_t max_extent_bytes_;
+    size_t max_ghosts_;
+
+    std::mutex files_mu_;
+    std::unordered_map<std::string, FileEntry> files_;
+    std::list<std::string> files_lru_; ///< Most recent first.
+
+    mutable std::mutex extents_mu_;
+    std::unordered_map<std::string, ExtentEntry> extents_;
+    std::list<std::string> extents_lru_; ///< Most recent first.
+    size_t extent_bytes_ = 0;
+    /// Keys seen once: the 2Q ghost list, oldest last.
+    std::unordered_map<std::string, std::list<std::string>::iterator> ghosts_;
+    std::list<std::string> ghosts_lru_;
+
+    std::atomic<uint64_t> file_hits_{0};
+    std::atomic<uint64_t> file_misses_{0};
+    std::atomic<uint64_t> extent_hits_{0};
+    std::atomic<uint64_t> extent_misses_{0};
+};
+
+} // namespace TcpTransfer
@@ -0,0 +1,54 @@
+// Hot restart: passing a running server's listener and resume state to a
+// new process.
+//
+// The old process starts its successor with one end of a SOCK_SEQPACKET
+// socketpair. Over it, the listening socket goes across with SCM_RIGHTS
+// (so no connection is ever refused), then, once the old process has
+// drained or given up on its transfers, its resume journal and Done. The
+// successor answers Done with Ack, after which the old process closes what
+// is left; clients resuming from there find their progress journaled. Each
+// message is one packet: a type byte, then the payload.
+#pragma once
+
+#include <sys/types.h>
+
+#include <chrono>
+#include <cstdint>
+#include <string>
+#include <string_view>
+#include <vector>
+
+#include "tcptransfer/socket.h"
+
+namespace TcpTransfer {
+
+enum class HandoffMsg : uint8_t {
+    Listener = 1, ///< Old -> new: carries the listening socket.
+    Journal = 2,  ///< Old -> new: part of ResumeJournal::encode().
+    Done = 3,     ///< Old -> new: nothing more follows.
+    Ack = 4,      ///< New -> old: everything before Done is taken in.
+};
+
+/// Largest payload of one message.
+constexpr size_t kMaxHandoffPayload = 64 << 10;
+
+/// Sends one message, with fd attached when it is not -1. Throws
+/// std::system_error.
+void send_handoff(int sock, HandoffMsg type, std::string_view payload, int fd = -1);
+/// Receives one message, waiting up to timeout. False on timeout or when
+/// the peer has gone; fd receives an attached descriptor, if any. Throws
+/// ProtocolError on a malformed message.
+bool recv_handoff(int sock, std::chrono::milliseconds timeout, HandoffMsg& type,
+                  std::string& payload, Fd& fd);
+
+/// Path of the running binary, from /proc/self/exe. Resolve it at startup:
+/// once an upgrade has renamed a new binary over it, the link names the old,
+/// deleted file (with " (deleted)" appended, which is stripped here).
+std::string current_exe();
+
+/// Starts exe with args (argv[0] included) plus "--handoff-fd N", N being
+/// the child's end of a new socketpair. Returns the parent's end; pid
+/// receives the child's.
+Fd spawn_successor(const std::string& exe, const std::vector<std::string>& args, pid_t& pid);
+
+} // namespace TcpTransfer
@@ -0,0 +1,85 @@
+// Client-side cache of content hashes, keyed by file identity.
+//
+// Maps (device, inode) to the size, mtime, ctime and manifest hash a file
+// had when it was last read, so a sync only re-reads files whose stat data
+// moved. ctime is part of the key because it cannot be set from user space:
+// a tool that restores an old mtime after rewriting a file still bumps it.
+//
+// The file is an mmapped open-addressing table of fixed 64-byte slots,
+// updated in place. Each open starts a new epoch; slots not looked up for
+// kKeepEpochs opens are dropped when the table is next rebuilt, so entries
+// for deleted files do not accumulate. Like DirIndex, a dirty flag makes a
+// cache that was not flushed cleanly start over empty.
+//
+// One process uses the file at a time (flock); a second opener finds it
+// busy and runs without a cache.
+#pragma once
+
+#include <cstddef>
+#include <cstdint>
+#include <memory>
+#include <string>
+
+#include "tcptransfer/socket.h"
+
+namespace TcpTransfer {
+
+class HashCache {
+public:
+    struct Key {
+        uint64_t dev = 0;
+        uint64_t ino = 0;
+        uint64_t size = 0;
+        int64_t mtime_ns = 0;
+        int64_t ctime_ns = 0;
+    };
+
+    static constexpr uint32_t kKeepEpochs = 8;
+
+    /// Opens or creates the cache at path. Throws on I/O errors and if
+    /// another process holds it.
+    explicit HashCache(const std::string& path);
+    ~HashCache();
+    HashCache(const HashCache&) = delete;
+    HashCache& operator=(const HashCache&) = delete;
+
+    /// Opens path, or returns null if it is locked by another process or
+    /// cannot be opened; a cache is an optimisation, never a requirement.
+    static std::unique_ptr<HashCache> try_open(const std::string& path);
+    /// $XDG_CACHE_HOME/tcptransfer/hashes, else ~/.cache/tcptransfer/hashes;
+    /// empty if neither variable is set.
+    static std::string default_path();
+
+    /// Hash recorded for k, if its stat data still matches.
+    bool lookup(const Key& k, uint64_t& hash);
+    /// Records hash for k, replacing what the inode had.
+    void store(const Key& k, uint64_t hash);
+
+    size_t size() const;
+    uint64_t hits() const { return hits_; }
+    uint64_t misses() const { return misses_; }
+    /// Writes the mapping back and marks the file clean.
+    void flush();
+
+private:
+    struct Header;
+    struct Slot;
+
+    Header* header() const;
+    Slot* slots() const;
+    void init(uint64_t capacity);
+    void map(uint64_t bytes);
+    bool valid() const;
+    void mark_dirty();
+    Slot* find(uint64_t dev, uint64_t ino) const;
+    void rebuild(uint64_t capacity);
+
+    std::string path_;
+    Fd fd_;
+    char* base_ = nullptr;
+    uint64_t mapped_ = 0;
+    uint64_t hits_ = 0;
+    uint64_t misses_ = 0;
+};
+
+} // namespace TcpTransfer
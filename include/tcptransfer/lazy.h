@@ -0,0 +1,54 @@
+// Lazy<T>: an object built on first use.
+//
+// Start-up paths hold state that is expensive to make (thread pools, large
+// tables) but not needed to begin listening. A Lazy<T> runs its factory the
+// first time get() or -> is used, exactly once even when several threads
+// race; warm() builds it ahead of need, for instance from a task queued
+// right after start-up. peek() never builds, so stats and shutdown code can
+// look at the object without creating it.
+#pragma once
+
+#include <atomic>
+#include <functional>
+#include <memory>
+#include <mutex>
+#include <utility>
+
+namespace TcpTransfer {
+
+template <typename T>
+class Lazy {
+public:
+    using Factory = std::function<std::unique_ptr<T>()>;
+
+    explicit Lazy(Factory make) : make_(std::move(make)) {}
+    Lazy(const Lazy&) = delete;
+    Lazy& operator=(const Lazy&) = delete;
+
+    /// The object, built now if it was not yet. A throwing factory is
+    /// retried on the next call.
+    T* get() {
+        if (T* p = ptr_.load(std::memory_order_acquire))
+            return p;
+        std::lock_guard<std::mutex> lk(mu_);
+        if (!obj_) {
+            obj_ = make_();
+            ptr_.store(obj_.get(), std::memory_order_release);
+        }
+        return obj_.get();
+    }
+    T* operator->() { return get(); }
+    T& operator*() { return *get(); }
+    void warm() { get(); }
+
+    /// The object if already built, else null.
+    T* peek() const { return ptr_.load(std::memory_order_acquire); }
+
+private:
+    Factory make_;
+    std::mutex mu_;
+    std::unique_ptr<T> obj_;
+    std::atomic<T*> ptr_{nullptr};
+};
+
+} // namespace TcpTransfer
@@ -0,0 +1,31 @@
+// Client side of manifest-based directory sync.
+//
+// A manifest lists every regular file under a local directory with its
+// size, mtime and content hash. The server compares it against its
+// DirIndex of the destination in one round trip and names the entries it
+// lacks; only those are uploaded.
+#pragma once
+
+#include <cstdint>
+#include <string>
+#include <vector>
+
+#include "tcptransfer/protocol.h"
+
+namespace TcpTransfer {
+
+class HashCache;
+class WorkStealingPool;
+
+/// Content hash used by manifests: XXH64 over the XXH64 of each 1 MiB
+/// block, seeded with the size, so blocks can be hashed independently.
+uint64_t content_hash(int fd, uint64_t size);
+
+/// Lists the regular files under dir (symlinks are not followed), paths
+/// relative to dir and sorted, with content hashes computed on pool. With a
+/// cache, only files whose stat data changed since they were last hashed
+/// are read.
+std::vector<ManifestEntry> build_manifest(const std::string& dir, WorkStealingPool* pool,
+                                          HashCache* cache = nullptr);
+
+} // namespace TcpTransfer
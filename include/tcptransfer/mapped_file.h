@@ -0,0 +1,59 @@
+// Read-only file mapping with a sliding read-ahead window.
+//
+// Hashing and delta matching walk a file range front to back exactly once.
+// Mapping the range skips the copy out of the page cache that pread() into a
+// private buffer costs, and advance() keeps the resident part bounded: pages
+// a window ahead of the cursor are requested with MADV_WILLNEED, and pages
+// behind it are unmapped. A range that fits in one window is mapped with
+// MAP_POPULATE instead. If the fd cannot be mapped the range is read into a
+// buffer, so callers need no second code path.
+//
+// A mapped file that is truncated underneath the reader faults with SIGBUS
+// rather than returning a short read; advance() re-checks the file size
+// once per window and throws instead, which narrows that race to the
+// current window.
+#pragma once
+
+#include <cstddef>
+#include <cstdint>
+#include <vector>
+
+namespace TcpTransfer {
+
+class MappedFile {
+public:
+    static constexpr size_t kDefaultWindow = 4 << 20;
+
+    /// Maps [offset, offset + length) of fd. Throws if the file is shorter.
+    MappedFile(int fd, uint64_t offset, size_t length, size_t window = kDefaultWindow);
+    ~MappedFile();
+    MappedFile(const MappedFile&) = delete;
+    MappedFile& operator=(const MappedFile&) = delete;
+
+    const unsigned char* data() const { return data_; }
+    size_t size() const { return length_; }
+    /// False if the range was read into a buffer instead.
+    bool mapped() const { return base_ != nullptr; }
+
+    /// Tells the mapping the caller will not touch bytes before pos again:
+    /// unmaps whole pages behind it and reads the next window ahead. Cheap
+    /// enough to call per block.
+    void advance(size_t pos);
+
+private:
+    void read_ahead(size_t upto);
+
+    int fd_;
+    uint64_t offset_;
+    size_t length_;
+    size_t window_;
+    unsigned char* base_ = nullptr; ///< Page-aligned start of the mapping.
+    size_t map_len_ = 0;
+    size_t lead_ = 0;     ///< offset_ - page-aligned mapping offset.
+    size_t released_ = 0; ///< Mapping bytes already unmapped (page multiple).
+    size_t advised_ = 0;  ///< Mapping bytes already requested with WILLNEED.
+    unsigned char* data_ = nullptr;
+    std::vector<unsigned char> fallback_;
+};
+
+} // namespace TcpTransfer
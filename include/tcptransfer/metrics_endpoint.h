@@ -0,0 +1,46 @@
+// Serves the process metrics as Prometheus text over HTTP, on a TCP port or
+// a Unix socket. Scrapes are handled on a dedicated thread so they never
+// stall a data-path event loop.
+#pragma once
+
+#include <cstdint>
+#include <functional>
+#include <string>
+#include <thread>
+
+#include "tcptransfer/socket.h"
+
+namespace TcpTransfer {
+
+class MetricsEndpoint {
+public:
+    /// Extra exposition text appended to every scrape (gauges owned by the
+    /// caller). Called on the endpoint thread.
+    using Source = std::function<std::string()>;
+
+    /// listen is "HOST:PORT" or "unix:/path/to/socket". Binds immediately and
+    /// throws on failure.
+    explicit MetricsEndpoint(const std::string& listen, Source extra = {});
+    ~MetricsEndpoint();
+    MetricsEndpoint(const MetricsEndpoint&) = delete;
+    MetricsEndpoint& operator=(const MetricsEndpoint&) = delete;
+
+    /// Bound TCP port, or 0 for a Unix socket.
+    uint16_t port() const { return port_; }
+
+    /// The full scrape body.
+    std::string render() const;
+
+private:
+    void serve();
+    void answer(int fd) const;
+
+    Fd listener_;
+    Fd stopfd_;
+    std::string unix_path_;
+    uint16_t port_ = 0;
+    Source extra_;
+    std::thread thread_;
+};
+
+} // namespace TcpTransfer
@@ -0,0 +1,21 @@
+// Validation of client-supplied destination paths.
+#pragma once
+
+#include <string>
+#include <string_view>
+
+namespace TcpTransfer {
+
+/// True if p is a relative path made of non-empty components, none of which
+/// is "." or "..", with no NUL, control, DEL or backslash bytes. An empty
+/// string is accepted and means the server root. Classifies 64 bytes at a
+/// time (SSE2 where available), so it stays cheap for large batches.
+bool is_safe_relative_path(std::string_view p);
+
+/// True if name is a single safe path component.
+bool is_safe_file_name(std::string_view name);
+
+/// Joins two relative paths with a single '/'.
+std::string join_path(std::string_view a, std::string_view b);
+
+} // namespace TcpTransfer
@@ -0,0 +1,96 @@
+// Per-transfer chunk pipelines, specialized at compile time.
+//
+// What a put does to each chunk before sending it (checksum, compression,
+// encryption, whether the data is a delta literal) is fixed when the
+// transfer starts. Pipeline<...> bakes one combination of stages in, so its
+// run() is straight-line code with no tests of options; select_pipeline()
+// picks the instantiation once per transfer. Each chunk then costs one
+// indirect call, not a branch per option plus the codec's own dispatch.
+#pragma once
+
+#include <cstddef>
+#include <cstdint>
+#include <vector>
+
+#include "tcptransfer/checksum.h"
+#include "tcptransfer/codec.h"
+#include "tcptransfer/metrics.h"
+
+namespace TcpTransfer {
+
+/// What a pipeline made of one chunk.
+struct ChunkResult {
+    uint32_t crc = 0; ///< Of the plain bytes, when checksummed.
+    size_t z = 0;     ///< Compressed size in zbuf; 0 sends the chunk as is.
+};
+
+/// A pipeline's entry point: processes data[0, n), compressing into zbuf.
+using ChunkFn = ChunkResult (*)(char* data, size_t n, int level, std::vector<char>& zbuf);
+
+// Checksum stages.
+struct NoChecksum {
+    static constexpr bool enabled = false;
+    static uint32_t update(uint32_t crc, const char*, size_t) { return crc; }
+};
+struct Crc32Checksum {
+    static constexpr bool enabled = true;
+    static uint32_t update(uint32_t crc, const char* p, size_t n) { return crc32_update(crc, p, n); }
+};
+
+// Compression stages.
+template <Codec C>
+struct CodecStage {
+    static constexpr Codec codec = C;
+    static size_t compress(int level, const char* in, size_t n, std::vector<char>& out) {
+        if constexpr (C == Codec::None)
+            return 0;
+        else
+            return codec_compress(C, level, in, n, out);
+    }
+};
+
+// Cipher stages. The protocol carries no encryption of its own yet, so the
+// identity is the only one; a real cipher would run on the bytes as sent.
+struct NoCipher {
+    static constexpr bool enabled = false;
+    static void apply(char*, size_t) {}
+};
+
+// Delta modes. A delta put's literals are not hashed chunk by chunk: the
+// plan's CRC covers the whole file, copied blocks included.
+struct WholeFile {
+    static constexpr bool literals = false;
+};
+struct DeltaLiterals {
+    static constexpr bool literals = true;
+};
+
+template <typename Checksum, typename Compress, typename Cipher, typename Delta>
+struct Pipeline {
+    static constexpr bool hash = Checksum::enabled && !Delta::literals;
+
+    static ChunkResult run(char* data, size_t n, int level, std::vector<char>& zbuf) {
+        ChunkResult r;
+        if constexpr (hash) {
+            StageTimer t(Stage::Hash, n);
+            r.crc = Checksum::update(0, data, n);
+        }
+        if constexpr (Compress::codec != Codec::None) {
+            StageTimer t(Stage::Compress, n);
+            r.z = Compress::compress(level, data, n, zbuf);
+        }
+        if constexpr (Cipher::enabled) {
+            if (r.z)
+                Cipher::apply(zbuf.data(), r.z);
+            else
+                Cipher::apply(data, n);
+        }
+        return r;
+    }
+};
+
+/// The pipeline for a transfer's options. checksum is ignored for delta
+/// puts, whose literals are never hashed per chunk.
+ChunkFn select_pipeline(bool checksum, Codec codec, bool delta);
+
+} // namespace TcpTransfer
@@ -0,0 +1,388 @@
+// Wire protocol: fixed 16-byte frame header followed by a typed payload.
+//
+// All integers are little-endian. Strings are a u32 length followed by the
+// raw bytes. A DATA payload starts with the u64 file offset of the chunk;
+// the remaining bytes are file content.
+#pragma once
+
+#include <chrono>
+#include <cstddef>
+#include <cstdint>
+#include <cstring>
+#include <string>
+#include <string_view>
+#include <vector>
+
+#include "tcptransfer/error.h"
+
+namespace TcpTransfer {
+
+constexpr uint16_t kFrameMagic = 0x5454; // "TT"
+constexpr uint16_t kProtocolVersion = 1;
+constexpr size_t kFrameHeaderSize = 16;
+constexpr uint32_t kMaxFramePayload = 64u << 20;
+
+enum class FrameType : uint8_t {
+    Hello = 1,
+    HelloAck = 2,
+    Ping = 3,
+    Pong = 4,
+    PutBegin = 5,
+    PutReady = 6,
+    Data = 7,
+    PutEnd = 8,
+    PutAck = 9,
+    Error = 10,
+    DataAck = 11,
+    Signatures = 12, ///< Server -> client: blocks of the existing file (delta).
+    Copy = 13,       ///< Client -> server: reuse a block range of that file.
+    Manifest = 14,   ///< Client -> server: part of a directory listing to sync.
+    ManifestDiff = 15, ///< Server -> client: which entries of a part changed.
+    Bundle = 16,       ///< Client -> server: several small files at once.
+    BundleAck = 17,    ///< Server -> client: one status per bundled file.
+    Parity = 18,       ///< Client -> server: one FEC parity shard of a chunk group.
+    GetBegin = 19,     ///< Client -> server: read a byte range of a file.
+    GetReady = 20,     ///< Server -> client: the file's metadata, then Data frames.
+    GetEnd = 21,       ///< Server -> client: the range is complete.
+};
+
+/// PutBegin flags.
+enum PutFlags : uint32_t {
+    kPutResume = 1u << 0,   ///< Keep a partial file and answer with PutReady.
+    kPutChecksum = 1u << 1, ///< PutEnd carries a CRC32 of the whole file.
+    kPutAcked = 1u << 2,    ///< Server answers each Data frame with DataAck.
+    kPutDelta = 1u << 3,    ///< Server answers with Signatures of the old file.
+    kPutFec = 1u << 4,      ///< Data comes in Reed-Solomon groups with Parity frames.
+    kPutStriped = 1u << 5,  ///< One of stripes connections sharing the file's chunks.
+};
+
+/// GetBegin flags.
+enum GetFlags : uint32_t {
+    kGetChecksum = 1u << 0, ///< GetEnd carries a CRC32 of the range.
+};
+
+constexpr uint64_t kWholeFile = ~uint64_t{0}; ///< GetMsg::length: up to the end.
+
+/// Scheduling class of a transfer. A transfer without an explicit deadline
+/// is due default_slack() after it was queued. Deadlines are fixed once
+/// set, so a waiting bulk transfer eventually outranks newer interactive
+/// ones instead of starving.
+enum class Priority : uint8_t { Bulk = 0, Normal = 1, Interactive = 2 };
+
+constexpr std::chrono::milliseconds default_slack(Priority p) {
+    switch (p) {
+    case Priority::Interactive:
+        return std::chrono::seconds(1);
+    case Priority::Bulk:
+        return std::chrono::hours(1);
+    default:
+        return std::chrono::minutes(1);
+    }
+}
+
+struct FrameHeader {
+    FrameType type = FrameType::Error;
+    uint8_t flags = 0;
+    uint32_t stream = 0;
+    uint32_t length = 0;
+    uint32_t aux = 0;
+};
+
+void encode_header(const FrameHeader& h, char out[kFrameHeaderSize]);
+/// Throws ProtocolError on bad magic or oversized payload.
+FrameHeader decode_header(const char in[kFrameHeaderSize]);
+
+/// Appends little-endian fields to a byte string.
+class WireWriter {
+public:
+    explicit WireWriter(std::string& out) : out_(out) {}
+
+    void u8(uint8_t v) { out_.push_back(static_cast<char>(v)); }
+    void u16(uint16_t v) { put(v); }
+    void u32(uint32_t v) { put(v); }
+    void u64(uint64_t v) { put(v); }
+    void i64(int64_t v) { put(static_cast<uint64_t>(v)); }
+    void str(std::string_view s) {
+        u32(static_cast<uint32_t>(s.size()));
+        out_.append(s.data(), s.size());
+    }
+    void bytes(const void* p, size_t n) { out_.append(static_cast<const char*>(p), n); }
+
+private:
+    template <typename T>
+    void put(T v) {
+        char b[sizeof(T)];
+        for (size_t i = 0; i < sizeof(T); ++i)
+            b[i] = static_cast<char>((v >> (8 * i)) & 0xff);
+        out_.append(b, sizeof(T));
+    }
+
+    std::string& out_;
+};
+
+/// Bounds-checked reader over a payload; throws ProtocolError on underflow.
+class WireReader {
+public:
+    WireReader(const char* p, size_t n) : p_(p), end_(p + n) {}
+    explicit WireReader(std::string_view s) : WireReader(s.data(), s.size()) {}
+
+    uint8_t u8() { return get<uint8_t>(); }
+    uint16_t u16() { return get<uint16_t>(); }
+    uint32_t u32() { return get<uint32_t>(); }
+    uint64_t u64() { return get<uint64_t>(); }
+    int64_t i64() { return static_cast<int64_t>(get<uint64_t>()); }
+    std::string str() {
+        uint32_t n = u32();
+        need(n);
+        std::string s(p_, n);
+        p_ += n;
+        return s;
+    }
+    /// Length-prefixed bytes, viewed in place.
+    std::string_view view() {
+        uint32_t n = u32();
+        need(n);
+        std::string_view v(p_, n);
+        p_ += n;
+        return v;
+    }
+    const char* pos() const { return p_; }
+    size_t remaining() const { return static_cast<size_t>(end_ - p_); }
+
+private:
+    void need(size_t n) const {
+        if (remaining() < n)
+            throw ProtocolError("truncated frame payload");
+    }
+    template <typename T>
+    T get() {
+        need(sizeof(T));
+        T v = 0;
+        for (size_t i = 0; i < sizeof(T); ++i)
+            v |= static_cast<T>(static_cast<T>(static_cast<uint8_t>(p_[i])) << (8 * i));
+        p_ += sizeof(T);
+        return v;
+    }
+
+    const char* p_;
+    const char* end_;
+};
+
+/// Builds a complete frame (header + payload) ready to be written.
+std::string make_frame(FrameType type, uint32_t stream, std::string_view payload,
+                       uint8_t flags = 0, uint32_t aux = 0);
+
+// Typed payloads. encode() returns the payload only; decode() takes it.
+
+struct HelloMsg {
+    uint16_t version = kProtocolVersion;
+    std::string token;
+    std::string client_id;
+
+    std::string encode() const;
+    static HelloMsg decode(std::string_view p);
+};
+
+struct HelloAckMsg {
+    uint16_t version = kProtocolVersion;
+    uint32_t max_payload = kMaxFramePayload;
+
+    std::string encode() const;
+    static HelloAckMsg decode(std::string_view p);
+};
+
+struct PutBeginMsg {
+    std::string remote_dir;
+    std::string name;
+    uint64_t size = 0;
+    uint32_t mode = 0644; ///< Permission bits; the server applies & 0777.
+    int64_t mtime_ns = 0;
+    uint32_t flags = 0;
+    // Optional trailer; older clients omit it.
+    Priority priority = Priority::Normal;
+    uint32_t deadline_ms = 0; ///< From receipt; 0 = default_slack(priority).
+    // FEC geometry, with kPutFec: every group of fec_data chunks of
+    // fec_chunk bytes (from offset 0) is followed by fec_parity Parity frames.
+    uint8_t fec_data = 0;
+    uint8_t fec_parity = 0;
+    uint32_t fec_chunk = 0;
+    /// Servers ("HOST:PORT") this one forwards the put to, in chain order;
+    /// each hop passes on the rest of the list.
+    std::vector<std::string> relay;
+    /// More directories that get a copy once the file is in, on every hop.
+    std::vector<std::string> mirrors;
+    // With kPutStriped: the file's chunks are dealt over stripes
+    // connections, each sending a PutBegin with the same stripe_key. Each
+    // PutEnd's CRC covers only the chunks of its own connection, in the
+    // order sent; every connection gets the PutAck once all have ended.
+    uint64_t stripe_key = 0;
+    uint8_t stripes = 0;
+
+    std::string encode() const;
+    static PutBeginMsg decode(std::string_view p);
+};
+
+struct PutEndMsg {
+    uint32_t crc32 = 0;
+
+    std::string encode() const;
+    static PutEndMsg decode(std::string_view p);
+};
+
+/// Parity shard index of chunk group group (chunks group * k .. + k - 1).
+/// Data chunks past the end of the file count as zeros; shorter last
+/// chunks are zero-padded to the chunk size.
+struct ParityMsg {
+    uint64_t group = 0;
+    uint8_t index = 0;
+    uint32_t crc32 = 0;              ///< Of shard.
+    std::vector<uint32_t> data_crcs; ///< Of each data chunk as sent, padding excluded.
+    std::string_view shard;          ///< Into the sender's buffer or the received payload.
+
+    std::string encode() const;
+    static ParityMsg decode(std::string_view p);
+};
+
+/// Read [offset, offset + length) of path, relative to the server root.
+/// The server answers with GetReady, then (if that is Ok) Data frames in
+/// offset order and a GetEnd. length 0 asks only for the metadata.
+struct GetMsg {
+    std::string path;
+    uint64_t offset = 0;
+    uint64_t length = kWholeFile;
+    uint32_t flags = 0; ///< GetFlags.
+
+    std::string encode() const;
+    static GetMsg decode(std::string_view p);
+};
+
+struct GetReadyMsg {
+    Status status = Status::Ok;
+    std::string message;
+    uint64_t size = 0; ///< Whole file.
+    uint32_t mode = 0644;
+    int64_t mtime_ns = 0;
+    uint64_t length = 0; ///< Of the range, clamped to the file.
+
+    std::string encode() const;
+    static GetReadyMsg decode(std::string_view p);
+};
+
+struct GetEndMsg {
+    uint32_t crc32 = 0; ///< With kGetChecksum.
+
+    std::string encode() const;
+    static GetEndMsg decode(std::string_view p);
+};
+
+/// Flow-control feedback for one Data frame.
+struct DataAckMsg {
+    uint64_t committed = 0; ///< Contiguous bytes written from offset 0.
+    uint32_t write_us = 0;  ///< Time the server spent writing the chunk.
+
+    std::string encode() const;
+    static DataAckMsg decode(std::string_view p);
+};
+
+/// Weak (rolling) and strong hash of one block of the receiver's file.
+struct BlockSignature {
+    uint32_t weak = 0;
+    uint64_t strong = 0;
+};
+
+/// Every full block_size block of the file already at the destination; an
+/// empty list means there is nothing to reuse.
+struct SignaturesMsg {
+    uint32_t block_size = 0;
+    uint64_t basis_size = 0;
+    std::vector<BlockSignature> blocks;
+
+    std::string encode() const;
+    static SignaturesMsg decode(std::string_view p);
+};
+
+/// Most bytes one CopyMsg may reuse; longer runs take several.
+constexpr uint64_t kMaxCopyFrame = 8 << 20;
+
+/// Most connections one striped put may use (PutBeginMsg::stripes).
+constexpr unsigned kMaxStripes = 64;
+
+/// Write length bytes at offset from source in the existing file.
+struct CopyMsg {
+    uint64_t offset = 0;
+    uint64_t source = 0;
+    uint64_t length = 0;
+
+    std::string encode() const;
+    static CopyMsg decode(std::string_view p);
+};
+
+/// One file of a directory sync, path relative to the synced directory.
+struct ManifestEntry {
+    std::string path;
+    uint64_t size = 0;
+    int64_t mtime_ns = 0;
+    uint64_t hash = 0; ///< content_hash() of the file.
+};
+
+/// A slice of the client's listing of remote_dir. A manifest is sent as
+/// consecutive parts on one stream; first numbers the part's entries.
+struct ManifestMsg {
+    std::string remote_dir;
+    uint32_t first = 0;
+    bool last = true;
+    std::vector<ManifestEntry> entries;
+
+    std::string encode() const;
+    static ManifestMsg decode(std::string_view p);
+};
+
+/// Reply to one ManifestMsg: indexes (counted from 0 over the whole
+/// manifest) of entries the server does not already have.
+struct ManifestDiffMsg {
+    uint32_t first = 0;
+    bool last = true;
+    std::vector<uint32_t> changed;
+
+    std::string encode() const;
+    static ManifestDiffMsg decode(std::string_view p);
+};
+
+/// One file of a BundleMsg; path is relative to the bundle's remote_dir.
+struct BundleEntry {
+    std::string path;
+    uint32_t mode = 0644;
+    int64_t mtime_ns = 0;
+    uint32_t crc32 = 0;    ///< Checked when the bundle has kPutChecksum.
+    std::string_view data; ///< Into the sender's buffers or the received payload.
+};
+
+/// Small files written whole under remote_dir, each committed (or
+/// rejected) on its own; saves the PutBegin/PutEnd round trip per file.
+struct BundleMsg {
+    std::string remote_dir;
+    uint32_t flags = 0; ///< PutFlags; only kPutChecksum applies.
+    std::vector<BundleEntry> files;
+
+    std::string encode() const;
+    static BundleMsg decode(std::string_view p);
+};
+
+struct StatusMsg {
+    Status status = Status::Ok;
+    uint64_t value = 0; ///< PutAck: bytes committed; PutReady: resume offset.
+    std::string message;
+
+    std::string encode() const;
+    static StatusMsg decode(std::string_view p);
+};
+
+/// Reply to a BundleMsg, in file order; value is the bytes written.
+struct BundleAckMsg {
+    std::vector<StatusMsg> results;
+
+    std::string encode() const;
+    static BundleAckMsg decode(std::string_view p);
+};
+
+} // namespace TcpTransfer
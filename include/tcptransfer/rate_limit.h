@@ -0,0 +1,63 @@
+// Token-bucket rate limiting for server-side bandwidth shaping.
+//
+// TokenBucket implements GCRA (the "virtual scheduling" form of a token
+// bucket): its whole state is one atomic theoretical arrival time, so
+// charging bytes is a single CAS loop and any thread may charge, re-rate or
+// read a bucket without taking a lock. Bytes are charged after they have
+// arrived; a bucket that goes into debt reports how long the caller should
+// stop reading for the debt to drain, and TCP flow control carries that
+// back to the sender.
+#pragma once
+
+#include <atomic>
+#include <chrono>
+#include <cstdint>
+#include <string>
+#include <vector>
+
+namespace TcpTransfer {
+
+struct RateLimit {
+    uint64_t bytes_per_sec = 0; ///< 0 = unlimited.
+    uint64_t burst = 0;         ///< Bytes allowed ahead of the rate; 0 = 100 ms worth.
+
+    bool limited() const { return bytes_per_sec != 0; }
+};
+
+/// Parses "RATE" or "RATE/BURST" where each is a byte count with an
+/// optional k/m/g suffix (powers of 1024); throws Error if malformed.
+RateLimit parse_rate_limit(const std::string& s);
+
+class TokenBucket {
+public:
+    using Clock = std::chrono::steady_clock;
+
+    explicit TokenBucket(RateLimit limit = {}) { set_limit(limit); }
+    TokenBucket(const TokenBucket&) = delete;
+    TokenBucket& operator=(const TokenBucket&) = delete;
+
+    /// Takes effect for the next charge; debt already owed is kept.
+    void set_limit(RateLimit limit);
+    RateLimit limit() const;
+
+    /// Charges n bytes received at now. Returns how long the caller should
+    /// pause before reading more; zero while within the burst.
+    Clock::duration charge(uint64_t n, Clock::time_point now = Clock::now());
+
+    /// Total bytes ever charged.
+    uint64_t charged() const { return charged_.load(std::memory_order_relaxed); }
+
+private:
+    std::atomic<uint64_t> rate_{0};
+    std::atomic<uint64_t> burst_{0};
+    std::atomic<int64_t> tat_ns_{0}; ///< Theoretical arrival time, steady clock.
+    std::atomic<uint64_t> charged_{0};
+};
+
+/// Splits capacity between weighted claimants, max-min fair: nobody gets
+/// more than its cap (0 = uncapped), and what a capped claimant cannot use
+/// is shared by weight among the rest.
+std::vector<uint64_t> weighted_fair_shares(uint64_t capacity, const std::vector<uint32_t>& weights,
+                                           const std::vector<uint64_t>& caps);
+
+} // namespace TcpTransfer
@@ -0,0 +1,81 @@
+// Forwarding side of relayed puts: one connection to the next server of a
+// chain.
+//
+// A relaying server passes each frame of a relayed put on as soon as it has
+// read it, so every hop receives the file at the same time instead of one
+// after another; a chain costs about one transfer plus a chunk per hop.
+// Frames are queued here and written by a sender thread while a reader
+// thread collects the next hop's PutAcks. The server stops reading from the
+// upstream connection while the queue is above its high-water mark, which
+// slows the source down to the slowest hop.
+#pragma once
+
+#include <chrono>
+#include <condition_variable>
+#include <cstdint>
+#include <deque>
+#include <functional>
+#include <mutex>
+#include <set>
+#include <string>
+#include <string_view>
+#include <thread>
+
+#include "tcptransfer/protocol.h"
+#include "tcptransfer/socket.h"
+
+namespace TcpTransfer {
+
+class RelayLink {
+public:
+    static constexpr size_t kHighWater = 16 << 20;
+    static constexpr size_t kLowWater = 4 << 20;
+
+    /// Final status of a relayed stream from the next hop. Also called, with
+    /// IoError, for every stream still open when the link fails.
+    using AckHandler = std::function<void(uint32_t stream, StatusMsg status)>;
+    /// The queue fell below kLowWater after reaching kHighWater.
+    using DrainHandler = std::function<void()>;
+
+    /// Connects in the background; handlers run on the link's threads.
+    RelayLink(Endpoint next, HelloMsg hello, std::chrono::milliseconds connect_timeout,
+              AckHandler on_ack, DrainHandler on_drain);
+    ~RelayLink();
+    RelayLink(const RelayLink&) = delete;
+    RelayLink& operator=(const RelayLink&) = delete;
+
+    /// Queues a frame for the next hop without blocking. A PutBegin opens
+    /// its stream; the matching PutAck (or a failure) closes it.
+    void forward(const FrameHeader& h, std::string_view payload);
+    /// Bytes queued and not yet written.
+    size_t queued() const;
+    bool congested() const { return queued() >= kHighWater; }
+    const Endpoint& next() const { return next_; }
+
+private:
+    void send_loop();
+    void read_loop();
+    /// Fails every open stream; later ones fail as they are forwarded.
+    void fail(const std::string& why);
+
+    Endpoint next_;
+    HelloMsg hello_;
+    std::chrono::milliseconds connect_timeout_;
+    AckHandler on_ack_;
+    DrainHandler on_drain_;
+
+    mutable std::mutex mu_;
+    std::condition_variable cv_;
+    std::deque<std::string> queue_;
+    size_t queued_ = 0;
+    bool above_ = false;     ///< Reached kHighWater since the last drain.
+    bool stopping_ = false;
+    std::string error_;      ///< Set once the link has failed.
+    std::set<uint32_t> open_; ///< Streams begun and not yet acked.
+    int sock_ = -1;          ///< fd_ once connected, for shutdown().
+    Fd fd_;
+    std::thread sender_;
+    std::thread reader_; ///< Started by the sender after the handshake.
+};
+
+} // namespace TcpTransfer
@@ -0,0 +1,40 @@
+// Holding area for chunks of a file that arrive ahead of their turn.
+//
+// A striped put deals a file's chunks over several connections, so the
+// server sees them out of order. Writing each where it lands turns one
+// sequential file into small scattered writes. Instead, a chunk past the
+// written prefix is held here until the chunks before it arrive; the run
+// that then continues the prefix goes to disk back to back, where the
+// disk writer merges it into large sequential writes.
+#pragma once
+
+#include <cstddef>
+#include <cstdint>
+#include <map>
+#include <utility>
+#include <vector>
+
+namespace TcpTransfer {
+
+class ReorderBuffer {
+public:
+    using Chunk = std::pair<uint64_t, std::vector<char>>; ///< (offset, data)
+
+    /// Holds [offset, offset + data.size()). False, holding nothing, if it
+    /// overlaps a chunk already held.
+    bool insert(uint64_t offset, std::vector<char> data);
+    /// Removes and returns the held chunks that continue a prefix ending at
+    /// next, in order.
+    std::vector<Chunk> take_from(uint64_t next);
+    /// Removes and returns every held chunk, lowest offset first.
+    std::vector<Chunk> take_all();
+
+    size_t bytes() const { return bytes_; }
+    bool empty() const { return chunks_.empty(); }
+
+private:
+    std::map<uint64_t, std::vector<char>> chunks_;
+    size_t bytes_ = 0;
+};
+
+} // namespace TcpTransfer
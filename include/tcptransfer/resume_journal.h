@@ -0,0 +1,60 @@
+// Server-side record of interrupted uploads, for cheap resumes.
+//
+// A part file alone tells a resumed put where to continue but not whether
+// its bytes are intact, so the server re-reads the whole file at the end to
+// check the CRC. When an upload stops (its connection closes, the server
+// stops or hands off to a successor), the journal keeps how far it got in
+// order and the CRC of that prefix. A resume of the same file (same size
+// and mtime) whose part file still holds the prefix then picks up the CRC
+// where it left off. Entries are used once.
+//
+// The journal lives in memory and is saved in the root as kFileName when
+// the server stops; the next server loads and removes it. A server handing
+// off passes it to its successor directly.
+#pragma once
+
+#include <cstdint>
+#include <mutex>
+#include <optional>
+#include <string>
+#include <string_view>
+#include <unordered_map>
+#include <vector>
+
+namespace TcpTransfer {
+
+struct JournalEntry {
+    uint64_t size = 0; ///< Of the whole file, as the client announced it.
+    int64_t mtime_ns = 0;
+    uint64_t offset = 0; ///< Bytes written in order from the start.
+    uint32_t crc = 0;    ///< Of [0, offset).
+};
+
+class ResumeJournal {
+public:
+    static constexpr char kFileName[] = ".tcptransfer-journal";
+
+    /// path is the upload's destination relative to the root.
+    void record(const std::string& path, const JournalEntry& e);
+    /// Removes and returns the entry for path.
+    std::optional<JournalEntry> take(const std::string& path);
+    size_t size() const;
+
+    /// Encoded entries, split into parts of about max_part bytes.
+    std::vector<std::string> encode(size_t max_part) const;
+    /// Adds encoded entries; throws ProtocolError on malformed input.
+    void merge(std::string_view encoded);
+
+    /// Merges kFileName from root_fd, if present, and removes the file. A
+    /// damaged file is dropped: the journal only saves work.
+    void load(int root_fd);
+    /// Writes kFileName in root_fd (replacing it atomically); nothing if
+    /// the journal is empty. Throws std::system_error.
+    void save(int root_fd) const;
+
+private:
+    mutable std::mutex mu_;
+    std::unordered_map<std::string, JournalEntry> entries_;
+};
+
+} // namespace TcpTransfer
@@ -0,0 +1,132 @@
+// Receiving side: accepts client connections and writes uploaded files
+// under a root directory.
+#pragma once
+
+#include <chrono>
+#include <cstdint>
+#include <map>
+#include <memory>
+#include <string>
+
+#include "tcptransfer/disk_writer.h"
+#include "tcptransfer/rate_limit.h"
+#include "tcptransfer/socket_tuning.h"
+
+namespace TcpTransfer {
+
+/// Shaping overrides for one client.
+struct ClientPolicy {
+    uint32_t weight = 1; ///< Share of max_ingest_rate relative to other active clients.
+    RateLimit limit;     ///< Replaces ServerConfig::client_limit when set.
+};
+
+struct ServerConfig {
+    std::string root;                 ///< Destination root; must exist.
+    std::string bind_addr = "0.0.0.0";
+    uint16_t port = 0;                ///< 0 picks an ephemeral port.
+    std::string token;                ///< Shared secret; empty disables auth.
+    bool fsync = false;               ///< fsync each file before rename.
+    size_t max_connections = 4096;
+    std::chrono::milliseconds idle_timeout{300000}; ///< Close silent connections.
+    SocketTuning tuning; ///< Receive buffers grow from each connection's measured BDP.
+    /// Prometheus endpoint, "HOST:PORT" or "unix:/path"; empty disables it.
+    std::string metrics_listen;
+    /// Work-stealing threads for delta signatures; 0 = one per CPU.
+    size_t cpu_threads = 0;
+    /// Threads that apply permissions, mtimes and renames (and fsync) to
+    /// received files, and write bundled ones, off the event loop.
+    size_t metadata_threads = 8;
+    /// Directory handles kept open to skip per-component path lookups;
+    /// 0 resolves every path from the root.
+    size_t dir_cache_size = 4096;
+    /// Files kept open, with their metadata, for downloads.
+    size_t file_cache_size = 1024;
+    /// Memory for extents of files downloaded repeatedly; 0 serves every
+    /// download from the page cache.
+    size_t read_cache_bytes = 256 << 20;
+    /// Writer threads per destination device kind (see disk_writer.h).
+    DiskWriterOptions disk_writers;
+    /// Accept puts that ask to be relayed on to further servers. Off by
+    /// default, since the server then connects wherever clients point it.
+    bool allow_relay = false;
+    std::string relay_token; ///< Presented to the next hop; empty reuses token.
+    /// Socket from a predecessor's spawn_successor(): the listener and the
+    /// resume journal come from it instead of bind_addr and port.
+    int handoff_fd = -1;
+
+    // Bandwidth shaping. Clients are identified by their Hello client_id,
+    // or by peer address if they send none; all connections of a client
+    // share its limit.
+    /// Whole-server ingest cap in bytes/s, split between the clients
+    /// currently uploading by weight; 0 = unlimited.
+    uint64_t max_ingest_rate = 0;
+    RateLimit client_limit; ///< Default cap per client.
+    std::map<std::string, ClientPolicy> clients;
+    /// Caps per destination directory. An upload is charged to the longest
+    /// configured prefix of its remote_dir; "" matches every upload.
+    std::map<std::string, RateLimit> dir_limits;
+};
+
+struct ServerStats {
+    uint64_t connections_accepted = 0;
+    uint64_t connections_open = 0;
+    uint64_t files_received = 0;
+    uint64_t bytes_received = 0;
+    uint64_t errors = 0;
+    uint64_t rcvbuf_resizes = 0; ///< Connections whose SO_RCVBUF we raised.
+    int max_rcvbuf = 0;          ///< Largest effective SO_RCVBUF after a resize.
+    uint64_t delta_bytes_reused = 0; ///< Bytes copied from old files by delta puts.
+    uint64_t throttle_pauses = 0;    ///< Reads paused to stay within a rate limit.
+    uint64_t dir_cache_hits = 0;     ///< Destination directories found open.
+    uint64_t dir_cache_misses = 0;
+    uint64_t fec_chunks_repaired = 0; ///< Lost or damaged chunks rebuilt from parity.
+    uint64_t fec_groups_lost = 0;     ///< FEC groups past repair; their puts failed.
+    uint64_t files_served = 0;        ///< Downloads (whole files or ranges) completed.
+    uint64_t bytes_served = 0;
+    uint64_t file_cache_hits = 0;     ///< Downloads whose file was found open.
+    uint64_t file_cache_misses = 0;
+    uint64_t read_cache_hits = 0;     ///< Download chunks sent from cached extents.
+    uint64_t read_cache_misses = 0;
+    uint64_t read_cache_bytes = 0;
+    uint64_t prefetches = 0;          ///< Read-aheads for chunks not in the page cache.
+    uint64_t journal_resumes = 0;     ///< Resumed puts whose prefix CRC came from the journal.
+    uint64_t disk_writes = 0;         ///< pwritev calls made by the disk writers.
+    uint64_t disk_writes_merged = 0;  ///< Data frames folded into another frame's write.
+    uint64_t chunks_reordered = 0;    ///< Striped put chunks held for earlier ones.
+    uint64_t reorder_spills = 0;      ///< Striped puts that outgrew their reorder buffer.
+};
+
+class Server {
+public:
+    explicit Server(ServerConfig cfg);
+    ~Server();
+    Server(const Server&) = delete;
+    Server& operator=(const Server&) = delete;
+
+    /// Binds and serves on a background thread.
+    void start();
+    /// Binds and serves on the calling thread until stop().
+    void run();
+    /// Stops serving and joins the background thread, if any. Uploads left
+    /// unfinished are saved in the resume journal unless handoff() passed
+    /// them on.
+    void stop();
+    /// Gives the listener to the process at the other end of sock (see
+    /// spawn_successor()), waits up to drain for running transfers while
+    /// refusing new ones, then passes the resume journal and closes what is
+    /// left. Returns once the successor has acked; stop() next. Needs
+    /// start(). Throws if the successor did not ack, in which case serving
+    /// goes on with the listener, which is kept until then.
+    void handoff(int sock, std::chrono::milliseconds drain);
+
+    /// Bound port; valid after start()/run() has bound the listener.
+    uint16_t port() const;
+    ServerStats stats() const;
+
+    struct Impl;
+
+private:
+    std::unique_ptr<Impl> impl_;
+};
+
+} // namespace TcpTransfer
@@ -0,0 +1,257 @@
+// Sending side: one authenticated connection to a server.
+#pragma once
+
+#include <sys/stat.h>
+
+#include <chrono>
+#include <cstdint>
+#include <memory>
+#include <random>
+#include <string>
+#include <vector>
+
+#include "tcptransfer/adaptive.h"
+#include "tcptransfer/codec.h"
+#include "tcptransfer/protocol.h"
+#include "tcptransfer/socket.h"
+#include "tcptransfer/socket_tuning.h"
+
+namespace TcpTransfer {
+
+class WorkStealingPool;
+
+/// Test shim: loses or damages outgoing Data and Parity frames at random,
+/// to exercise FEC and resume without a lossy network. Off by default.
+struct FaultInjection {
+    double drop = 0;    ///< Probability a frame is not sent at all.
+    double corrupt = 0; ///< Probability one file byte of a frame is flipped.
+    uint64_t seed = 1;
+
+    bool active() const { return drop > 0 || corrupt > 0; }
+};
+
+struct SessionOptions {
+    std::string token;
+    std::string client_id;
+    std::chrono::milliseconds connect_timeout{5000};
+    std::chrono::milliseconds io_timeout{30000}; ///< Max wait for a reply.
+    SocketTuning tuning;
+    FaultInjection faults;
+};
+
+/// Reed-Solomon geometry of an FEC put: every data chunks get parity
+/// extra ones, and the server rebuilds up to parity lost or damaged chunks
+/// per group without asking for them again.
+struct FecOptions {
+    uint8_t data = 0;   ///< 0 disables FEC.
+    uint8_t parity = 0;
+
+    bool enabled() const { return data > 0 && parity > 0; }
+};
+
+struct PutOptions {
+    /// Fixed chunk size, or the starting point when adaptive.
+    size_t chunk_size = 1 << 20;
+    /// Size chunks and bound in-flight data from server DataAck feedback.
+    bool adaptive = true;
+    AdaptiveOptions adaptive_opts;
+    bool checksum = true;
+    bool resume = false;
+    /// Send payload with sendfile(2). Only used when checksum and
+    /// compression are off, since both need the bytes in user space anyway.
+    bool use_sendfile = false;
+    /// Per-chunk compression; chunks that do not shrink are sent raw.
+    Codec compression = Codec::None;
+    int compression_level = 1;
+    /// Rebuild from blocks of the file already at the destination and send
+    /// only what changed (rsync-style). Ignored with resume; turns off
+    /// adaptive acks for the transfer.
+    bool delta = false;
+    /// Reads, hashes and compresses upcoming chunks, and runs delta
+    /// matching, in parallel; null does that work inline.
+    WorkStealingPool* pool = nullptr;
+    /// Orders this put against others in the client queue and the server's
+    /// read scheduling.
+    Priority priority = Priority::Normal;
+    /// Time allowed from when the put is queued; 0 = default_slack(priority).
+    std::chrono::milliseconds deadline{0};
+    /// Send parity with the data, chunk_size (at most 1 MiB) per shard.
+    /// Turns off adaptive, sendfile, compression and delta for the put; a
+    /// resume restarts at a group boundary.
+    FecOptions fec;
+    /// Further servers ("HOST:PORT"), in chain order, that the first one
+    /// relays the put to as it arrives; each writes it under the same
+    /// remote_dir and the PutAck covers them all. The servers must allow
+    /// relaying. Turns off resume and delta for the put.
+    std::vector<std::string> relay;
+    /// More directories (relative to each server's root) that get a copy.
+    std::vector<std::string> mirror_dirs;
+    std::string remote_name; ///< Defaults to the local basename.
+    /// Client puts: connections a large file's chunks are dealt over,
+    /// round-robin, at most kMaxStripes; the server puts them back in
+    /// order. Ignored with resume, delta, FEC and relays, and for files
+    /// under 16 MiB.
+    unsigned stripes = 1;
+};
+
+/// One connection's share of a striped put.
+struct PutStripe {
+    uint64_t key = 0;   ///< The same random value on every connection.
+    unsigned index = 0;
+    unsigned count = 1; ///< 1 is an ordinary put.
+};
+
+struct PutResult {
+    uint64_t file_size = 0;
+    uint64_t bytes_sent = 0;     ///< File bytes covered by Data frames.
+    uint64_t wire_bytes = 0;     ///< Payload bytes on the wire after compression.
+    uint64_t resumed_from = 0;
+    uint64_t delta_reused = 0;   ///< Bytes rebuilt from the server's old copy.
+    uint64_t parity_bytes = 0;   ///< FEC parity, included in wire_bytes.
+    std::chrono::nanoseconds elapsed{0};
+    AdaptiveController::Snapshot flow; ///< Final controller state when adaptive.
+    SocketStats socket;                ///< Effective socket settings at completion.
+};
+
+struct GetOptions {
+    /// Have the server send a CRC32 of each range and check it.
+    bool checksum = true;
+    /// Client::get(): ranges fetched in parallel, each on its own
+    /// connection. Small files always come in one.
+    unsigned stripes = 1;
+};
+
+struct GetResult {
+    uint64_t file_size = 0;
+    uint32_t mode = 0644;
+    int64_t mtime_ns = 0;
+    uint64_t offset = 0;
+    uint64_t bytes = 0; ///< Of the range received.
+    std::chrono::nanoseconds elapsed{0};
+};
+
+/// A small file for Session::put_bundle().
+struct BundleItem {
+    std::string local_path;
+    std::string remote_path; ///< Relative to the bundle's remote_dir.
+};
+
+/// Where a download of local_path is assembled: a hidden
+/// ".<name>.tcptransfer-part" next to it.
+std::string download_part_path(const std::string& local_path);
+/// Gives the part file the remote mode and mtime and renames it over
+/// local_path.
+void commit_download(int fd, const std::string& part_path, const std::string& local_path,
+                     const GetResult& meta);
+
+class Session {
+public:
+    using Clock = std::chrono::steady_clock;
+
+    /// Largest file put_bundle() accepts; bigger ones go through put_file().
+    static constexpr uint64_t kBundleFileMax = 64 << 10;
+    /// Consecutive chunks a striped put sends on one connection.
+    static constexpr size_t kStripeChunks = 4;
+
+    /// Connects and performs the Hello handshake; throws on failure.
+    static std::unique_ptr<Session> connect(const Endpoint& ep, const SessionOptions& opts);
+
+    /// Uploads local_path into remote_dir (relative to the server root).
+    /// Throws RemoteError if the server rejects the file; any other
+    /// exception leaves the session broken().
+    PutResult put_file(const std::string& local_path, const std::string& remote_dir,
+                       const PutOptions& opts = {});
+    /// Sends stripe.index's share of a striped put: every stripe.count-th
+    /// run of kStripeChunks chunks, from run stripe.index. Returns once all
+    /// stripes are in and the file is committed; errors as for put_file(),
+    /// and Error for more than kMaxStripes stripes.
+    PutResult put_stripe(const std::string& local_path, const std::string& remote_dir,
+                         const PutOptions& opts, const PutStripe& stripe);
+
+    /// Sends a manifest of remote_dir and returns the indexes of the
+    /// entries the server does not already have. Parts are pipelined and
+    /// their replies drained as they arrive, so the whole comparison costs
+    /// one round trip. Throws RemoteError if the server refuses the
+    /// directory.
+    std::vector<uint32_t> diff_manifest(const std::string& remote_dir,
+                                        const std::vector<ManifestEntry>& entries);
+
+    /// Uploads small files packed into Bundle frames of about 1 MiB, one
+    /// round trip per frame instead of per file. Returns a status per item,
+    /// in order: value is the size written; files that cannot be read
+    /// locally fail with IoError without reaching the server. Only
+    /// opts.checksum applies.
+    std::vector<StatusMsg> put_bundle(const std::string& remote_dir,
+                                      const std::vector<BundleItem>& items,
+                                      const PutOptions& opts = {});
+
+    /// Downloads remote_path (relative to the server root) to local_path
+    /// through a ".tcptransfer-part" file renamed into place, with the
+    /// remote mode and mtime. Throws RemoteError if the server refuses the
+    /// file or the checksum fails; transport errors leave the session
+    /// broken().
+    GetResult get_file(const std::string& remote_path, const std::string& local_path,
+                       const GetOptions& opts = {});
+
+    /// Writes [offset, offset + length) of remote_path into fd at the same
+    /// offsets; length kWholeFile reads to the end and 0 only fetches the
+    /// metadata. Errors as for get_file().
+    GetResult get_range(const std::string& remote_path, int fd, uint64_t offset,
+                        uint64_t length, const GetOptions& opts = {});
+
+    /// Round-trips a Ping; throws on failure.
+    std::chrono::microseconds ping();
+
+    /// Cheap liveness check without a round trip: false if the peer has
+    /// closed or sent something unsolicited.
+    bool probe();
+
+    const Endpoint& endpoint() const { return ep_; }
+    Clock::time_point last_used() const { return last_used_; }
+    bool broken() const { return broken_; }
+    int fd() const { return fd_.get(); }
+    SocketStats socket_stats() const;
+
+private:
+    Session(Endpoint ep, Fd fd, SessionOptions opts);
+
+    void handshake();
+    void send_frame(FrameType t, uint32_t stream, std::string_view payload);
+    /// Reads the next frame, waiting at most io_timeout.
+    FrameHeader read_frame(std::string& payload);
+    /// Reads frames until a PutAck/PutReady for stream arrives, feeding any
+    /// DataAck frames to flow.
+    StatusMsg expect_status(FrameType want, uint32_t stream, AdaptiveController* flow = nullptr);
+    /// Reads frames until the Signatures reply for a delta put arrives.
+    SignaturesMsg expect_signatures(uint32_t stream);
+    /// Consumes pending DataAck frames; with block, waits for at least one.
+    void drain_acks(uint32_t stream, AdaptiveController& flow, bool block);
+    /// Grows SO_SNDBUF when the measured BDP outgrew the last sizing.
+    void size_for_bdp(uint64_t bdp);
+    struct SendState;
+    /// Sends [offset, end) of the file as Data frames.
+    void send_range(SendState& s, uint64_t offset, uint64_t end);
+    /// Same for an FEC put, from a group boundary: each group's data
+    /// chunks, then its Parity frames.
+    void send_range_fec(SendState& s, uint64_t offset, uint64_t end);
+    GetResult get_range_impl(const std::string& remote_path, int fd, uint64_t offset,
+                             uint64_t length, const GetOptions& opts);
+    /// Applies opts_.faults to an outgoing frame carrying data[0, n): may
+    /// flip one byte. False if the frame is to be dropped instead.
+    bool inject_fault(char* data, size_t n);
+    PutResult put_file_impl(int file, const struct stat& st, const std::string& local_path,
+                            const std::string& remote_dir, const PutOptions& opts,
+                            const PutStripe& stripe);
+
+    Endpoint ep_;
+    Fd fd_;
+    SessionOptions opts_;
+    uint32_t next_stream_ = 1;
+    bool broken_ = false;
+    bool buffers_pinned_ = false;
+    uint64_t sized_bdp_ = 0;
+    Clock::time_point last_used_;
+    std::mt19937_64 fault_rng_;
+};
+
+} // namespace TcpTransfer
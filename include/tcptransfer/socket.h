@@ -0,0 +1,82 @@
+// Thin RAII and blocking-I/O helpers over POSIX sockets and file descriptors.
+#pragma once
+
+#include <chrono>
+#include <cstddef>
+#include <cstdint>
+#include <string>
+#include <utility>
+
+struct iovec;
+
+namespace TcpTransfer {
+
+/// Owning file descriptor.
+class Fd {
+public:
+    Fd() = default;
+    explicit Fd(int fd) : fd_(fd) {}
+    Fd(Fd&& o) noexcept : fd_(std::exchange(o.fd_, -1)) {}
+    Fd& operator=(Fd&& o) noexcept {
+        if (this != &o)
+            reset(std::exchange(o.fd_, -1));
+        return *this;
+    }
+    Fd(const Fd&) = delete;
+    Fd& operator=(const Fd&) = delete;
+    ~Fd() { reset(); }
+
+    int get() const { return fd_; }
+    explicit operator bool() const { return fd_ >= 0; }
+    int release() { return std::exchange(fd_, -1); }
+    void reset(int fd = -1);
+
+private:
+    int fd_ = -1;
+};
+
+/// host:port pair identifying a server.
+struct Endpoint {
+    std::string host;
+    uint16_t port = 0;
+
+    /// Parses "host:port"; throws Error on malformed input.
+    static Endpoint parse(const std::string& s);
+    std::string to_string() const { return host + ":" + std::to_string(port); }
+    bool operator==(const Endpoint& o) const { return host == o.host && port == o.port; }
+    bool operator<(const Endpoint& o) const {
+        return host != o.host ? host < o.host : port < o.port;
+    }
+};
+
+/// Resolves and connects with a timeout; returns a blocking socket.
+Fd connect_tcp(const Endpoint& ep, std::chrono::milliseconds timeout);
+
+/// Binds and listens; port 0 picks an ephemeral port.
+Fd listen_tcp(const std::string& bind_addr, uint16_t port, int backlog = 512);
+
+/// Local port a socket is bound to.
+uint16_t local_port(int fd);
+
+void set_nonblocking(int fd, bool on);
+void set_nodelay(int fd, bool on);
+
+/// Loops until all bytes are written; throws on error.
+void write_full(int fd, const void* buf, size_t n);
+/// Gathers and writes every iovec, advancing through partial writes. The
+/// array is modified in place.
+void writev_full(int fd, iovec* iov, int iovcnt);
+/// Loops until n bytes are read; returns false on clean EOF before the
+/// first byte, throws on error or EOF mid-buffer.
+bool read_full(int fd, void* buf, size_t n);
+
+/// CPU that last processed packets for the socket (SO_INCOMING_CPU), or -1.
+int socket_cpu(int fd);
+
+/// Numeric address of the connected peer, or "" if unknown.
+std::string peer_address(int fd);
+
+/// Waits for readability; returns false on timeout.
+bool wait_readable(int fd, std::chrono::milliseconds timeout);
+
+} // namespace TcpTransfer
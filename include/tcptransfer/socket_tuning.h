@@ -0,0 +1,66 @@
+// Per-socket TCP tuning and the effective values the kernel applied.
+//
+// Defaults keep the kernel's send queue shallow (TCP_NOTSENT_LOWAT) so the
+// adaptive window, not the socket buffer, decides what is in flight; control
+// frames go out immediately (TCP_NODELAY); header + sendfile payload pairs
+// are coalesced under TCP_CORK; and socket buffers are raised explicitly to
+// the measured bandwidth-delay product once it exceeds what autotuning
+// reaches. Buffers are only ever grown: setting SO_SNDBUF/SO_RCVBUF turns
+// kernel autotuning off, so we skip it when the sysctl cap (without
+// CAP_NET_ADMIN) would leave us below the current size.
+#pragma once
+
+#include <cstddef>
+#include <cstdint>
+
+namespace TcpTransfer {
+
+struct SocketTuning {
+    size_t notsent_lowat = 128 << 10; ///< 0 leaves the kernel default.
+    bool nodelay = true;              ///< For control frames.
+    bool cork_data = true;            ///< TCP_CORK around header + payload.
+    bool size_from_bdp = true;        ///< Grow buffers to bdp_gain x BDP.
+    double bdp_gain = 2.0;
+    size_t max_buffer = 256u << 20;
+};
+
+/// Effective socket settings read back from the kernel.
+struct SocketStats {
+    int sndbuf = 0;
+    int rcvbuf = 0;
+    int notsent_lowat = 0;
+    bool nodelay = false;
+    bool buffers_pinned = false; ///< We set SO_SNDBUF/SO_RCVBUF explicitly.
+    uint32_t rtt_us = 0;
+    uint32_t rttvar_us = 0;
+    uint32_t rcv_rtt_us = 0;     ///< Receiver-side RTT estimate.
+    uint32_t snd_cwnd = 0;       ///< Segments.
+    uint32_t snd_mss = 0;
+    uint32_t total_retrans = 0;
+};
+
+/// Applies NOTSENT_LOWAT and NODELAY; call once after connect/accept.
+void apply_socket_tuning(int fd, const SocketTuning& t);
+
+/// Raises SO_SNDBUF (send_side) or SO_RCVBUF to bdp_gain * bdp if that is
+/// larger than the current effective size. Returns true if it changed.
+bool grow_buffer_for_bdp(int fd, uint64_t bdp, const SocketTuning& t, bool send_side);
+
+/// Reads current settings and TCP_INFO.
+SocketStats read_socket_stats(int fd);
+
+/// Holds TCP_CORK for its lifetime so a header and the payload that follows
+/// leave in full-sized segments; uncorking flushes the tail.
+class CorkGuard {
+public:
+    CorkGuard(int fd, bool enable);
+    ~CorkGuard();
+    CorkGuard(const CorkGuard&) = delete;
+    CorkGuard& operator=(const CorkGuard&) = delete;
+
+private:
+    int fd_;
+    bool on_;
+};
+
+} // namespace TcpTransfer
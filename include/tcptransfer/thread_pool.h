@@ -0,0 +1,96 @@
+// Work-stealing pool for CPU-bound transfer work: chunk hashing,
+// compression and rolling-checksum delta matching.
+//
+// One worker per allowed CPU, each pinned to its CPU and owning a deque.
+// Work submitted with an affinity lands on the worker for that CPU
+// (typically the core the connection's packets arrive on, see
+// socket_cpu()), so the bytes it touches stay in that core's cache; owners
+// pop newest-first, idle workers steal oldest-first from the others.
+#pragma once
+
+#include <atomic>
+#include <condition_variable>
+#include <cstddef>
+#include <deque>
+#include <exception>
+#include <functional>
+#include <memory>
+#include <mutex>
+#include <thread>
+#include <vector>
+
+namespace TcpTransfer {
+
+class WorkStealingPool {
+public:
+    using Task = std::function<void()>;
+
+    /// threads == 0 uses one worker per CPU in the process affinity mask.
+    explicit WorkStealingPool(size_t threads = 0, bool pin = true);
+    ~WorkStealingPool();
+    WorkStealingPool(const WorkStealingPool&) = delete;
+    WorkStealingPool& operator=(const WorkStealingPool&) = delete;
+
+    size_t size() const { return workers_.size(); }
+
+    /// Queues a task. cpu >= 0 targets the worker pinned to that CPU (or
+    /// cpu % size()); -1 uses the calling worker's own deque, or spreads
+    /// round robin from outside the pool.
+    void submit(Task task, int cpu = -1);
+
+    /// Runs one queued task on the calling thread, preferring the worker for
+    /// cpu. Returns false if every deque was empty.
+    bool run_one(int cpu = -1);
+
+    /// Index of the calling worker, or -1 outside the pool.
+    int current_worker() const;
+
+private:
+    struct Worker {
+        std::mutex mu;
+        std::deque<Task> tasks;
+        int cpu = -1;
+        std::thread thread;
+    };
+
+    void worker_loop(size_t index);
+    bool pop_local(size_t index, Task& out);
+    bool steal(size_t thief, Task& out);
+    size_t worker_for_cpu(int cpu) const;
+
+    std::vector<std::unique_ptr<Worker>> workers_;
+    std::atomic<size_t> queued_{0};
+    std::atomic<size_t> next_{0};
+    std::mutex sleep_mu_;
+    std::condition_variable sleep_cv_;
+    bool stopping_ = false;
+};
+
+/// Fork-join group over a pool. wait() keeps executing queued pool tasks
+/// while the group's tasks are outstanding, so it may be called from a pool
+/// worker without deadlocking. A null pool runs each task inline.
+class TaskGroup {
+public:
+    explicit TaskGroup(WorkStealingPool* pool, int cpu = -1) : pool_(pool), cpu_(cpu) {}
+    ~TaskGroup();
+    TaskGroup(const TaskGroup&) = delete;
+    TaskGroup& operator=(const TaskGroup&) = delete;
+
+    void run(std::function<void()> fn);
+    /// Blocks until every task finished; rethrows the first failure.
+    void wait();
+
+private:
+    struct State {
+        std::mutex mu;
+        std::condition_variable cv;
+        size_t outstanding = 0;
+        std::exception_ptr error;
+    };
+
+    WorkStealingPool* pool_;
+    int cpu_;
+    std::shared_ptr<State> st_ = std::make_shared<State>();
+};
+
+} // namespace TcpTransfer
@@ -0,0 +1,85 @@
+// Span tracing for diagnosing pipeline stalls, exported as Chrome trace JSON
+// (loadable in Perfetto or chrome://tracing).
+//
+// Tracing is off until trace_start(). Each thread appends complete spans to
+// its own fixed-size ring, overwriting the oldest, so recording never locks
+// or allocates after the ring exists. Building with TCPTRANSFER_TRACE=0
+// removes every TCPTRANSFER_TRACE_SPAN site entirely.
+#pragma once
+
+#include <atomic>
+#include <chrono>
+#include <cstddef>
+#include <cstdint>
+#include <string>
+
+#ifndef TCPTRANSFER_TRACE
+#define TCPTRANSFER_TRACE 1
+#endif
+
+namespace TcpTransfer {
+
+namespace detail {
+
+struct TraceRing;
+
+extern std::atomic<bool> g_trace_on;
+
+/// Appends one span; name must be a string literal (it is stored by pointer).
+void trace_record(const char* name, std::chrono::steady_clock::time_point start,
+                  std::chrono::steady_clock::time_point end, uint64_t arg);
+
+} // namespace detail
+
+/// Starts (or restarts, dropping earlier spans) recording with room for
+/// events_per_thread spans in each thread's ring.
+void trace_start(size_t events_per_thread = 1 << 16);
+/// Stops recording; collected spans stay available to trace_json().
+void trace_stop();
+
+inline bool trace_enabled() { return detail::g_trace_on.load(std::memory_order_relaxed); }
+
+/// Names the calling thread in the exported trace.
+void trace_thread_name(const std::string& name);
+
+/// All spans currently held, as a Chrome trace JSON document.
+std::string trace_json();
+/// Writes trace_json() to path; throws on I/O failure.
+void trace_write(const std::string& path);
+
+/// Records the lifetime of a scope as one span. Costs a single relaxed load
+/// when tracing is compiled in but not started.
+class TraceSpan {
+public:
+    explicit TraceSpan(const char* name, uint64_t arg = 0) : name_(name), arg_(arg) {
+        if (trace_enabled())
+            start_ = std::chrono::steady_clock::now();
+    }
+    ~TraceSpan() {
+        if (start_.time_since_epoch().count() != 0)
+            detail::trace_record(name_, start_, std::chrono::steady_clock::now(), arg_);
+    }
+    TraceSpan(const TraceSpan&) = delete;
+    TraceSpan& operator=(const TraceSpan&) = delete;
+
+    void set_arg(uint64_t arg) { arg_ = arg; }
+
+private:
+    const char* name_;
+    uint64_t arg_;
+    std::chrono::steady_clock::time_point start_{};
+};
+
+} // namespace TcpTransfer
+
+#define TCPTRANSFER_TRACE_CAT2(a, b) a##b
+#define TCPTRANSFER_TRACE_CAT(a, b) TCPTRANSFER_TRACE_CAT2(a, b)
+
+#if TCPTRANSFER_TRACE
+/// Traces the rest of the enclosing scope as span name with an integer arg
+/// (bytes, offset...). name must be a string literal.
+#define TCPTRANSFER_TRACE_SPAN(name, arg) \
+    ::TcpTransfer::TraceSpan TCPTRANSFER_TRACE_CAT(trace_span_, __LINE__)(name, arg)
+#else
+#define TCPTRANSFER_TRACE_SPAN(name, arg) static_cast<void>(0)
+#endif
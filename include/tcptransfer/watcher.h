@@ -0,0 +1,76 @@
+// Recursive inotify watch of a directory tree with debounced batches.
+//
+// Reports the relative paths of regular files that were closed after
+// writing or moved into the tree. Events for a path are coalesced until it
+// has been quiet for WatchOptions::debounce (or max_delay has passed since
+// its first event), and every path that is ready at the same moment is
+// delivered in one batch, so a burst of small writes becomes one push.
+// Directories created or moved in are watched as they appear and their
+// existing files reported. If the kernel queue overflows the handler is
+// asked for a full rescan instead.
+#pragma once
+
+#include <chrono>
+#include <functional>
+#include <string>
+#include <thread>
+#include <unordered_map>
+#include <vector>
+
+#include "tcptransfer/event_loop.h"
+#include "tcptransfer/socket.h"
+
+namespace TcpTransfer {
+
+struct WatchOptions {
+    std::chrono::milliseconds debounce{200};   ///< Quiet time before a path is reported.
+    std::chrono::milliseconds max_delay{2000}; ///< Report a busy path at least this often.
+};
+
+class DirWatcher {
+public:
+    /// Called on the watcher thread with sorted, deduplicated paths; with
+    /// rescan set, events were lost and paths is empty. Blocking in the
+    /// handler is fine: events queue in the kernel and coalesce meanwhile.
+    using Handler = std::function<void(std::vector<std::string> paths, bool rescan)>;
+
+    /// Watches every directory under dir; throws if dir cannot be watched.
+    DirWatcher(std::string dir, WatchOptions opts, Handler handler);
+    ~DirWatcher();
+    DirWatcher(const DirWatcher&) = delete;
+    DirWatcher& operator=(const DirWatcher&) = delete;
+
+    /// Serves events on a background thread until stop().
+    void start();
+    void stop();
+
+    /// Directories currently watched.
+    size_t watches() const { return dirs_.size(); }
+
+private:
+    struct Pending {
+        EventLoop::Clock::time_point first;
+        EventLoop::Clock::time_point last;
+    };
+
+    /// Watches rel and its subdirectories; with report, queues their files.
+    void add_tree(const std::string& rel, bool report);
+    void forget_tree(const std::string& rel);
+    void on_readable();
+    void touch(std::string rel);
+    void schedule();
+    void deliver();
+
+    std::string dir_;
+    WatchOptions opts_;
+    Handler handler_;
+    Fd inotify_;
+    EventLoop loop_;
+    std::thread thread_;
+    std::unordered_map<int, std::string> dirs_; ///< Watch descriptor to relative dir.
+    std::unordered_map<std::string, Pending> pending_;
+    bool overflow_ = false;
+    bool timer_set_ = false;
+};
+
+} // namespace TcpTransfer
@@ -0,0 +1,130 @@
+#include "tcptransfer/adaptive.h"
+
+#include <algorithm>
+
+namespace TcpTransfer {
+
+namespace {
+
+constexpr double kProbeGrowth = 1.25; ///< Rate gain that keeps startup going.
+constexpr int kFlatRoundsToExit = 3;
+constexpr double kWindowGain = 2.0;
+/// A chunk is acked only once all of it is written, so large ones leave the
+/// window idle while they trickle in; a 1/8 window split lost 10-20% on
+/// 40-100 ms paths against 64 KiB chunks.
+constexpr size_t kChunksPerWindow = 32;
+constexpr double kEwma = 0.2;
+constexpr std::chrono::seconds kRttWindow{10};
+constexpr std::chrono::milliseconds kMinRateWindow{200};
+
+} // namespace
+
+AdaptiveController::AdaptiveController(AdaptiveOptions opts)
+    : opts_(opts),
+      chunk_(std::clamp(opts.initial_chunk, opts.min_chunk, opts.max_chunk)),
+      window_(std::clamp(std::max(opts.min_window, 4 * chunk_), opts.min_window,
+                         opts.max_window)) {}
+
+void AdaptiveController::on_send(uint64_t end, size_t bytes, Clock::time_point now) {
+    if (outstanding_.empty() && acked_ == sent_) {
+        // First send (possibly from a resume offset) or restart after idle.
+        acked_ = sent_ = end - bytes;
+        round_end_ = sent_;
+        last_ack_at_ = now;
+    }
+    outstanding_.push_back({end, now, acked_, last_ack_at_});
+    sent_ = std::max(sent_, end);
+}
+
+void AdaptiveController::on_ack(uint64_t committed, std::chrono::microseconds disk_latency,
+                                Clock::time_point now) {
+    if (committed <= acked_)
+        return;
+    const Sent* last = nullptr;
+    Sent popped{};
+    while (!outstanding_.empty() && outstanding_.front().end <= committed) {
+        popped = outstanding_.front();
+        outstanding_.pop_front();
+        last = &popped;
+    }
+    uint64_t newly = committed - acked_;
+    acked_ = committed;
+    last_ack_at_ = now;
+
+    double disk = static_cast<double>(disk_latency.count());
+    disk_us_ = disk_us_ == 0 ? disk : (1 - kEwma) * disk_us_ + kEwma * disk;
+    disk_bytes_ = disk_bytes_ == 0 ? static_cast<double>(newly)
+                                   : (1 - kEwma) * disk_bytes_ + kEwma * static_cast<double>(newly);
+
+    if (last) {
+        auto rtt = std::chrono::duration_cast<std::chrono::microseconds>(now - last->sent_at) -
+                   disk_latency;
+        double rtt_us = std::max<double>(20, static_cast<double>(rtt.count()));
+        while (!rtt_samples_.empty() && rtt_samples_.back().value >= rtt_us)
+            rtt_samples_.pop_back();
+        rtt_samples_.push_back({rtt_us, now});
+
+        auto interval = std::chrono::duration<double>(now - last->delivered_at).count();
+        if (interval > 0) {
+            double rate = static_cast<double>(acked_ - last->delivered) / interval;
+            while (!rate_samples_.empty() && rate_samples_.back().value <= rate)
+                rate_samples_.pop_back();
+            rate_samples_.push_back({rate, now});
+        }
+    }
+    update_model(now);
+}
+
+void AdaptiveController::update_model(Clock::time_point now) {
+    // Monotonic deques: the front is the current min RTT / max rate.
+    while (rtt_samples_.size() > 1 && now - rtt_samples_.front().at > kRttWindow)
+        rtt_samples_.pop_front();
+    double rtt_us = rtt_samples_.empty() ? 0 : rtt_samples_.front().value;
+    auto rate_window = std::max<Clock::duration>(
+        kMinRateWindow, std::chrono::microseconds(static_cast<int64_t>(8 * rtt_us)));
+    while (rate_samples_.size() > 1 && now - rate_samples_.front().at > rate_window)
+        rate_samples_.pop_front();
+    double rate = rate_samples_.empty() ? 0 : rate_samples_.front().value;
+    double bdp = rate * rtt_us / 1e6;
+
+    if (acked_ >= round_end_) {
+        // One round trip's worth of data has been acknowledged.
+        round_end_ = sent_;
+        if (probing_) {
+            if (rate >= round_start_rate_ * kProbeGrowth) {
+                round_start_rate_ = rate;
+                flat_rounds_ = 0;
+            } else if (++flat_rounds_ >= kFlatRoundsToExit) {
+                probing_ = false;
+            }
+            if (probing_)
+                window_ = std::min(opts_.max_window, window_ * 2);
+        }
+    }
+    if (!probing_ && bdp > 0) {
+        window_ = std::clamp(static_cast<size_t>(kWindowGain * bdp), opts_.min_window,
+                             opts_.max_window);
+    }
+
+    size_t chunk = window_ / kChunksPerWindow;
+    double target_us = static_cast<double>(opts_.disk_latency_target.count());
+    if (disk_us_ > target_us && disk_bytes_ > 0)
+        chunk = std::min(chunk, static_cast<size_t>(disk_bytes_ * target_us / disk_us_));
+    chunk = std::clamp(chunk, opts_.min_chunk, opts_.max_chunk);
+    chunk_ = std::max<size_t>(4096, chunk & ~size_t{4095});
+}
+
+AdaptiveController::Snapshot AdaptiveController::snapshot() const {
+    Snapshot s;
+    s.chunk = chunk_;
+    s.window = window_;
+    s.rate_bps = rate_samples_.empty() ? 0 : rate_samples_.front().value;
+    s.min_rtt = std::chrono::microseconds(
+        rtt_samples_.empty() ? 0 : static_cast<int64_t>(rtt_samples_.front().value));
+    s.disk_latency = std::chrono::microseconds(static_cast<int64_t>(disk_us_));
+    s.bdp = static_cast<uint64_t>(s.rate_bps * static_cast<double>(s.min_rtt.count()) / 1e6);
+    s.probing = probing_;
+    return s;
+}
+
+} // namespace TcpTransfer
@@ -0,0 +1,104 @@
+#include "tcptransfer/checksum.h"
+
+#include <zlib.h>
+
+#include <climits>
+#include <cstring>
+
+namespace TcpTransfer {
+
+uint32_t crc32_update(uint32_t crc, const void* data, size_t n) {
+    auto p = static_cast<const Bytef*>(data);
+    while (n > 0) {
+        uInt step = n > UINT_MAX ? UINT_MAX : static_cast<uInt>(n);
+        crc = static_cast<uint32_t>(::crc32(crc, p, step));
+        p += step;
+        n -= step;
+    }
+    return crc;
+}
+
+uint32_t crc32_combine(uint32_t crc_a, uint32_t crc_b, uint64_t len_b) {
+    return static_cast<uint32_t>(::crc32_combine64(crc_a, crc_b, static_cast<z_off64_t>(len_b)));
+}
+
+namespace {
+
+constexpr uint64_t kP1 = 11400714785074694791ull;
+constexpr uint64_t kP2 = 14029467366897019727ull;
+constexpr uint64_t kP3 = 1609587929392839161ull;
+constexpr uint64_t kP4 = 9650029242287828579ull;
+constexpr uint64_t kP5 = 2870177450012600261ull;
+
+inline uint64_t rotl(uint64_t x, int r) { return (x << r) | (x >> (64 - r)); }
+
+inline uint64_t load64(const unsigned char* p) {
+    uint64_t v;
+    std::memcpy(&v, p, 8);
+    return v; // little-endian hosts only, like the rest of the tree
+}
+
+inline uint32_t load32(const unsigned char* p) {
+    uint32_t v;
+    std::memcpy(&v, p, 4);
+    return v;
+}
+
+inline uint64_t xxh_round(uint64_t acc, uint64_t input) {
+    acc += input * kP2;
+    acc = rotl(acc, 31);
+    return acc * kP1;
+}
+
+inline uint64_t xxh_merge(uint64_t acc, uint64_t val) {
+    acc ^= xxh_round(0, val);
+    return acc * kP1 + kP4;
+}
+
+} // namespace
+
+uint64_t hash64(const void* data, size_t n, uint64_t seed) {
+    auto p = static_cast<const unsigned char*>(data);
+    const unsigned char* end = p + n;
+    uint64_t h;
+    if (n >= 32) {
+        uint64_t v1 = seed + kP1 + kP2, v2 = seed + kP2, v3 = seed, v4 = seed - kP1;
+        const unsigned char* limit = end - 32;
+        do {
+            v1 = xxh_round(v1, load64(p));
+            v2 = xxh_round(v2, load64(p + 8));
+            v3 = xxh_round(v3, load64(p + 16));
+            v4 = xxh_round(v4, load64(p + 24));
+            p += 32;
+        } while (p <= limit);
+        h = rotl(v1, 1) + rotl(v2, 7) + rotl(v3, 12) + rotl(v4, 18);
+        h = xxh_merge(h, v1);
+        h = xxh_merge(h, v2);
+        h = xxh_merge(h, v3);
+        h = xxh_merge(h, v4);
+    } else {
+        h = seed + kP5;
+    }
+    h += static_cast<uint64_t>(n);
+    for (; p + 8 <= end; p += 8) {
+        h ^= xxh_round(0, load64(p));
+        h = rotl(h, 27) * kP1 + kP4;
+    }
+    if (p + 4 <= end) {
+        h ^= static_cast<uint64_t>(load32(p)) * kP1;
+        h = rotl(h, 23) * kP2 + kP3;
+        p += 4;
+    }
+    for (; p < end; ++p) {
+        h ^= *p * kP5;
+        h = rotl(h, 11) * kP1;
+    }
+    h ^= h >> 33;
+    h *= kP2;
+    h ^= h >> 29;
+    h *= kP3;
+    h ^= h >> 32;
+    return h;
+}
+
+} // namespace TcpTransfer
@@ -0,0 +1,491 @@
+#include "tcptransfer/client.h"
+
+#include <fcntl.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include <algorithm>
+#include <atomic>
+#include <iterator>
+#include <random>
+
+#include "tcptransfer/error.h"
+#include "tcptransfer/hash_cache.h"
+#include "tcptransfer/manifest.h"
+#include "tcptransfer/path_util.h"
+#include "tcptransfer/trace.h"
+
+namespace TcpTransfer {
+
+namespace {
+
+/// Smallest range worth its own connection in a striped get or put.
+constexpr uint64_t kMinStripe = 8 << 20;
+
+std::chrono::steady_clock::time_point due_time(const PutOptions& opts) {
+    auto slack = opts.deadline.count() > 0 ? opts.deadline : default_slack(opts.priority);
+    return std::chrono::steady_clock::now() + slack;
+}
+
+/// What is left of a deadline, for the server; never zero, which would
+/// mean "use the default".
+std::chrono::milliseconds time_left(std::chrono::steady_clock::time_point due) {
+    auto left = std::chrono::ceil<std::chrono::milliseconds>(due -
+                                                             std::chrono::steady_clock::now());
+    return std::max(left, std::chrono::milliseconds(1));
+}
+
+} // namespace
+
+Client::Client(Endpoint server, ClientOptions opts)
+    : server_(std::move(server)), opts_(std::move(opts)), cpu_pool_(opts_.cpu_threads),
+      pool_(opts_.pool) {
+    if (!opts_.put.pool)
+        opts_.put.pool = &cpu_pool_;
+    loop_thread_ = std::thread([this] {
+        trace_thread_name("client-loop");
+        loop_.run();
+    });
+    size_t n = std::max<size_t>(1, opts_.workers);
+    for (size_t i = 0; i < n; ++i)
+        workers_.emplace_back([this, i] {
+            trace_thread_name("client-worker-" + std::to_string(i));
+            worker_loop();
+        });
+}
+
+Client::~Client() {
+    {
+        std::lock_guard<std::mutex> lk(mu_);
+        stopping_ = true;
+    }
+    cv_.notify_all();
+    for (auto& t : workers_)
+        t.join();
+    loop_.stop();
+    loop_thread_.join();
+}
+
+void Client::submit(Job job, Clock::time_point due) {
+    {
+        std::lock_guard<std::mutex> lk(mu_);
+        if (stopping_)
+            throw Error("client is shutting down");
+        jobs_.push_back({due, next_seq_++, std::move(job)});
+        std::push_heap(jobs_.begin(), jobs_.end(), LaterDue{});
+    }
+    cv_.notify_one();
+}
+
+void Client::worker_loop() {
+    for (;;) {
+        Job job;
+        {
+            std::unique_lock<std::mutex> lk(mu_);
+            cv_.wait(lk, [&] { return stopping_ || !jobs_.empty(); });
+            if (jobs_.empty())
+                return; // stopping and drained
+            std::pop_heap(jobs_.begin(), jobs_.end(), LaterDue{});
+            job = std::move(jobs_.back().job);
+            jobs_.pop_back();
+        }
+        job();
+    }
+}
+
+Async<PutResult> Client::put(std::string local_path, std::string remote_dir) {
+    return put(std::move(local_path), std::move(remote_dir), opts_.put);
+}
+
+Async<PutResult> Client::put(std::string local_path, std::string remote_dir, PutOptions opts) {
+    if (!opts.pool)
+        opts.pool = &cpu_pool_;
+    auto due = due_time(opts);
+    auto [result, st] = Async<PutResult>::make(&loop_);
+    submit(
+        [this, st = st, local_path = std::move(local_path), remote_dir = std::move(remote_dir),
+         opts = std::move(opts), due]() mutable {
+            try {
+                opts.deadline = time_left(due);
+                ConnectionPool::Lease lease;
+                st->set_value(put_striped(lease, local_path, remote_dir, opts));
+            } catch (...) {
+                st->set_error(std::current_exception());
+            }
+        },
+        due);
+    return result;
+}
+
+PutResult Client::put_resuming(ConnectionPool::Lease& lease, const std::string& local_path,
+                               const std::string& remote_dir, const PutOptions& opts) {
+    bool refused = false;
+    for (int attempt = 0;; ++attempt) {
+        if (!lease)
+            lease = pool_.acquire(server_);
+        try {
+            return lease->put_file(local_path, remote_dir, opts);
+        } catch (const RemoteError& e) {
+            if (e.status() == Status::Busy && !refused) {
+                // The server is handing off to a successor, which accepts
+                // fresh connections; the pooled ones all go to the old one.
+                refused = true;
+                lease.discard();
+                pool_.clear();
+                --attempt;
+                continue;
+            }
+            if (lease->broken())
+                lease = {};
+            throw;
+        } catch (const std::exception&) {
+            if (!lease->broken())
+                throw;
+            lease = {};
+            if (!opts.resume || attempt > 0)
+                throw;
+        }
+    }
+}
+
+PutResult Client::put_striped(ConnectionPool::Lease& lease, const std::string& local_path,
+                              const std::string& remote_dir, const PutOptions& opts) {
+    struct stat st{};
+    uint64_t stripes = opts.stripes;
+    if (stripes > 1 && !opts.resume && !opts.delta && !opts.fec.enabled() && opts.relay.empty() &&
+        ::stat(local_path.c_str(), &st) == 0)
+        stripes = std::min({stripes, uint64_t{kMaxStripes},
+                            static_cast<uint64_t>(st.st_size) / kMinStripe});
+    else
+        stripes = 1;
+    if (stripes < 2)
+        return put_resuming(lease, local_path, remote_dir, opts);
+
+    auto start = Clock::now();
+    PutStripe stripe;
+    stripe.key = (uint64_t{std::random_device{}()} << 32) | std::random_device{}();
+    stripe.count = static_cast<unsigned>(stripes);
+    std::vector<PutResult> results(stripes);
+    std::vector<std::exception_ptr> errors(stripes);
+    // Stripe i puts on its own session; one that fails leaves the others
+    // to the server, which fails the put for all of them.
+    auto run = [&](ConnectionPool::Lease& l, unsigned i) {
+        try {
+            if (!l)
+                l = pool_.acquire(server_);
+            PutStripe mine = stripe;
+            mine.index = i;
+            results[i] = l->put_stripe(local_path, remote_dir, opts, mine);
+        } catch (...) {
+            errors[i] = std::current_exception();
+            if (l && l->broken())
+                l = {};
+        }
+    };
+    std::vector<std::thread> others;
+    for (unsigned i = 1; i < stripes; ++i)
+        others.emplace_back([&, i] {
+            trace_thread_name("client-stripe-" + std::to_string(i));
+            ConnectionPool::Lease l;
+            run(l, i);
+        });
+    run(lease, 0);
+    for (auto& t : others)
+        t.join();
+    for (const auto& e : errors)
+        if (e)
+            std::rethrow_exception(e);
+    PutResult r = results[0];
+    for (size_t i = 1; i < stripes; ++i) {
+        r.bytes_sent += results[i].bytes_sent;
+        r.wire_bytes += results[i].wire_bytes;
+    }
+    r.elapsed = Clock::now() - start;
+    return r;
+}
+
+Async<GetResult> Client::get(std::string remote_path, std::string local_path) {
+    return get(std::move(remote_path), std::move(local_path), GetOptions{});
+}
+
+Async<GetResult> Client::get(std::string remote_path, std::string local_path, GetOptions opts) {
+    auto due = Clock::now() + default_slack(Priority::Normal);
+    auto [result, st] = Async<GetResult>::make(&loop_);
+    submit(
+        [this, st = st, remote_path = std::move(remote_path), local_path = std::move(local_path),
+         opts, due] {
+            struct Striped {
+                std::string remote_path;
+                std::string local_path;
+                std::string part;
+                Fd file;
+                GetResult meta;
+                GetOptions opts;
+                std::atomic<unsigned> pending{0};
+                std::mutex mu;
+                std::exception_ptr error; ///< First stripe failure.
+                Clock::time_point start;
+                std::shared_ptr<Async<GetResult>::State> st;
+            };
+            auto s = std::make_shared<Striped>();
+            s->st = st;
+            try {
+                auto lease = pool_.acquire(server_);
+                uint64_t stripes = std::max(1u, opts.stripes);
+                if (stripes == 1) {
+                    st->set_value(lease->get_file(remote_path, local_path, opts));
+                    return;
+                }
+                s->remote_path = remote_path;
+                s->local_path = local_path;
+                s->part = download_part_path(local_path);
+                s->opts = opts;
+                s->start = Clock::now();
+                s->file = Fd(::open(s->part.c_str(), O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0600));
+                if (!s->file)
+                    throw_errno("open " + s->part);
+                s->meta = lease->get_range(remote_path, s->file.get(), 0, 0, opts);
+                stripes = std::min(stripes, std::max<uint64_t>(1, s->meta.file_size / kMinStripe));
+                if (::ftruncate(s->file.get(), static_cast<off_t>(s->meta.file_size)) != 0)
+                    throw_errno("truncate " + s->part);
+                uint64_t span = (s->meta.file_size + stripes - 1) / stripes;
+                s->pending = static_cast<unsigned>(stripes);
+                auto fail = [s](std::exception_ptr e) {
+                    std::lock_guard<std::mutex> lk(s->mu);
+                    if (!s->error)
+                        s->error = e;
+                };
+                // Each stripe checks it saw the same file as the metadata
+                // query; the last one to finish commits or cleans up. A
+                // stripe without a session only counts itself done.
+                auto run = [s, fail](Session* session, uint64_t offset, uint64_t length) {
+                    try {
+                        if (session) {
+                            GetResult r = session->get_range(s->remote_path, s->file.get(),
+                                                             offset, length, s->opts);
+                            if (r.file_size != s->meta.file_size ||
+                                r.mtime_ns != s->meta.mtime_ns)
+                                throw RemoteError(Status::SizeMismatch,
+                                                  s->remote_path + " changed during download");
+                        }
+                    } catch (...) {
+                        fail(std::current_exception());
+                    }
+                    if (--s->pending > 0)
+                        return;
+                    try {
+                        if (s->error)
+                            std::rethrow_exception(s->error);
+                        commit_download(s->file.get(), s->part, s->local_path, s->meta);
+                        GetResult r = s->meta;
+                        r.bytes = s->meta.file_size;
+                        r.elapsed = Clock::now() - s->start;
+                        s->st->set_value(r);
+                    } catch (...) {
+                        ::unlink(s->part.c_str());
+                        s->st->set_error(std::current_exception());
+                    }
+                };
+                for (uint64_t i = 1; i < stripes; ++i)
+                    submit(
+                        [this, run, fail, offset = i * span, span] {
+                            ConnectionPool::Lease stripe;
+                            try {
+                                stripe = pool_.acquire(server_);
+                            } catch (...) {
+                                fail(std::current_exception());
+                            }
+                            run(stripe ? &*stripe : nullptr, offset, span);
+                        },
+                        due);
+                run(&*lease, 0, span);
+            } catch (...) {
+                if (!s->part.empty())
+                    ::unlink(s->part.c_str());
+                st->set_error(std::current_exception());
+            }
+        },
+        due);
+    return result;
+}
+
+Async<std::vector<PutOutcome>> Client::put_many(std::vector<std::string> paths,
+                                                std::string remote_dir) {
+    return put_many(std::move(paths), std::move(remote_dir), opts_.put);
+}
+
+Async<std::vector<PutOutcome>> Client::put_many(std::vector<std::string> paths,
+                                                std::string remote_dir, PutOptions opts) {
+    if (!opts.pool)
+        opts.pool = &cpu_pool_;
+    auto due = due_time(opts);
+    auto [result, st] = Async<std::vector<PutOutcome>>::make(&loop_);
+    std::vector<BatchItem> items;
+    items.reserve(paths.size());
+    for (auto& p : paths)
+        items.push_back({std::move(p), remote_dir});
+    run_batch(std::move(items), std::move(opts), due,
+              [st = st](std::vector<PutOutcome> outcomes) { st->set_value(std::move(outcomes)); });
+    return result;
+}
+
+void Client::run_batch(std::vector<BatchItem> items, PutOptions opts, Clock::time_point due,
+                       std::function<void(std::vector<PutOutcome>)> done) {
+    if (items.empty()) {
+        done({});
+        return;
+    }
+
+    struct Batch {
+        std::vector<BatchItem> items;
+        std::vector<PutOutcome> outcomes;
+        std::atomic<size_t> pending{0};
+        std::function<void(std::vector<PutOutcome>)> done;
+    };
+    auto batch = std::make_shared<Batch>();
+    batch->outcomes.resize(items.size());
+    for (size_t i = 0; i < items.size(); ++i)
+        batch->outcomes[i].path = items[i].local_path;
+    batch->items = std::move(items);
+    batch->done = std::move(done);
+
+    size_t groups = std::min(std::max<size_t>(1, workers_.size()), batch->items.size());
+    batch->pending = groups;
+    for (size_t g = 0; g < groups; ++g) {
+        submit(
+            [this, g, groups, batch, opts, due]() mutable {
+                ConnectionPool::Lease lease;
+                for (size_t i = g; i < batch->outcomes.size(); i += groups) {
+                    PutOutcome& out = batch->outcomes[i];
+                    try {
+                        opts.deadline = time_left(due);
+                        out.result = put_striped(lease, out.path, batch->items[i].remote_dir, opts);
+                    } catch (const std::exception& e) {
+                        out.error = e.what();
+                    }
+                }
+                lease = {};
+                if (batch->pending.fetch_sub(1, std::memory_order_acq_rel) == 1)
+                    batch->done(std::move(batch->outcomes));
+            },
+            due);
+    }
+}
+
+Async<SyncResult> Client::sync(std::string local_dir, std::string remote_dir) {
+    return sync(std::move(local_dir), std::move(remote_dir), opts_.put);
+}
+
+Async<SyncResult> Client::sync(std::string local_dir, std::string remote_dir, PutOptions opts) {
+    if (!opts.pool)
+        opts.pool = &cpu_pool_;
+    auto due = due_time(opts);
+    auto [result, st] = Async<SyncResult>::make(&loop_);
+    submit(
+        [this, st = st, local_dir = std::move(local_dir), remote_dir = std::move(remote_dir),
+         opts = std::move(opts), due]() mutable {
+            try {
+                // Opened per sync: it stays locked only while the tree is hashed.
+                auto cache = HashCache::try_open(opts_.hash_cache);
+                std::vector<ManifestEntry> manifest =
+                    build_manifest(local_dir, &cpu_pool_, cache.get());
+                size_t hashed = cache ? static_cast<size_t>(cache->misses()) : manifest.size();
+                cache.reset();
+                std::vector<uint32_t> changed;
+                {
+                    auto lease = pool_.acquire(server_);
+                    changed = lease->diff_manifest(remote_dir, manifest);
+                }
+                std::vector<std::string> rels;
+                rels.reserve(changed.size());
+                for (uint32_t i : changed)
+                    rels.push_back(std::move(manifest[i].path));
+                size_t files = manifest.size();
+                send_tree(local_dir, remote_dir, rels, std::move(opts), due,
+                          [st, files, hashed](std::vector<PutOutcome> outcomes) {
+                              st->set_value(SyncResult{files, hashed, std::move(outcomes)});
+                          });
+            } catch (...) {
+                st->set_error(std::current_exception());
+            }
+        },
+        due);
+    return result;
+}
+
+Async<std::vector<PutOutcome>> Client::push(std::string local_dir,
+                                            std::vector<std::string> rel_paths,
+                                            std::string remote_dir) {
+    return push(std::move(local_dir), std::move(rel_paths), std::move(remote_dir), opts_.put);
+}
+
+Async<std::vector<PutOutcome>> Client::push(std::string local_dir,
+                                            std::vector<std::string> rel_paths,
+                                            std::string remote_dir, PutOptions opts) {
+    if (!opts.pool)
+        opts.pool = &cpu_pool_;
+    auto due = due_time(opts);
+    auto [result, st] = Async<std::vector<PutOutcome>>::make(&loop_);
+    submit(
+        [this, st = st, local_dir = std::move(local_dir), rel_paths = std::move(rel_paths),
+         remote_dir = std::move(remote_dir), opts = std::move(opts), due]() mutable {
+            try {
+                send_tree(local_dir, remote_dir, rel_paths, std::move(opts), due,
+                          [st](std::vector<PutOutcome> outcomes) {
+                              st->set_value(std::move(outcomes));
+                          });
+            } catch (...) {
+                st->set_error(std::current_exception());
+            }
+        },
+        due);
+    return result;
+}
+
+void Client::send_tree(const std::string& local_dir, const std::string& remote_dir,
+                       const std::vector<std::string>& rel_paths, PutOptions opts,
+                       Clock::time_point due, std::function<void(std::vector<PutOutcome>)> done) {
+    std::vector<BundleItem> small;
+    std::vector<BatchItem> large;
+    for (const std::string& rel : rel_paths) {
+        std::string local = join_path(local_dir, rel);
+        struct stat st{};
+        if (::lstat(local.c_str(), &st) != 0 || !S_ISREG(st.st_mode))
+            continue; // removed or replaced since it was listed
+        if (static_cast<uint64_t>(st.st_size) <= Session::kBundleFileMax) {
+            small.push_back({std::move(local), rel});
+            continue;
+        }
+        auto slash = rel.find_last_of('/');
+        std::string sub = slash == std::string::npos ? "" : rel.substr(0, slash);
+        large.push_back({std::move(local), join_path(remote_dir, sub)});
+    }
+
+    std::vector<PutOutcome> outcomes(small.size());
+    for (size_t i = 0; i < small.size(); ++i)
+        outcomes[i].path = small[i].local_path;
+    if (!small.empty()) {
+        try {
+            auto lease = pool_.acquire(server_);
+            std::vector<StatusMsg> res = lease->put_bundle(remote_dir, small, opts);
+            for (size_t i = 0; i < small.size(); ++i) {
+                if (res[i].status == Status::Ok)
+                    outcomes[i].result.file_size = outcomes[i].result.bytes_sent = res[i].value;
+                else
+                    outcomes[i].error = RemoteError(res[i].status, res[i].message).what();
+            }
+        } catch (const std::exception& e) {
+            for (PutOutcome& out : outcomes)
+                out.error = e.what();
+        }
+    }
+    run_batch(std::move(large), std::move(opts), due,
+              [outcomes = std::move(outcomes), done = std::move(done)](
+                  std::vector<PutOutcome> rest) mutable {
+                  outcomes.insert(outcomes.end(), std::make_move_iterator(rest.begin()),
+                                  std::make_move_iterator(rest.end()));
+                  done(std::move(outcomes));
+              });
+}
+
+} // namespace TcpTransfer
@@ -0,0 +1,40 @@
+#include "tcptransfer/codec.h"
+
+#include <zlib.h>
+
+#include "tcptransfer/error.h"
+
+namespace TcpTransfer {
+
+const char* codec_name(Codec c) {
+    switch (c) {
+    case Codec::None: return "none";
+    case Codec::Zlib: return "zlib";
+    }
+    return "unknown";
+}
+
+size_t codec_compress(Codec c, int level, const char* in, size_t n, std::vector<char>& out) {
+    if (c != Codec::Zlib)
+        return 0;
+    uLongf bound = ::compressBound(static_cast<uLong>(n));
+    if (out.size() < bound)
+        out.resize(bound);
+    uLongf len = bound;
+    if (::compress2(reinterpret_cast<Bytef*>(out.data()), &len,
+                    reinterpret_cast<const Bytef*>(in), static_cast<uLong>(n), level) != Z_OK)
+        return 0;
+    return len < n ? static_cast<size_t>(len) : 0;
+}
+
+void codec_decompress(Codec c, const char* in, size_t n, char* out, size_t out_len) {
+    if (c != Codec::Zlib)
+        throw ProtocolError("unknown codec");
+    uLongf len = static_cast<uLongf>(out_len);
+    int rc = ::uncompress(reinterpret_cast<Bytef*>(out), &len, reinterpret_cast<const Bytef*>(in),
+                          static_cast<uLong>(n));
+    if (rc != Z_OK || len != out_len)
+        throw ProtocolError("corrupt compressed chunk");
+}
+
+} // namespace TcpTransfer
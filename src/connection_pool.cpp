@@ -0,0 +1,194 @@
+#include "tcptransfer/connection_pool.h"
+
+#include <algorithm>
+#include <vector>
+
+#include "tcptransfer/error.h"
+
+namespace TcpTransfer {
+
+ConnectionPool::Lease::Lease(Lease&& o) noexcept
+    : pool_(std::exchange(o.pool_, nullptr)), session_(std::move(o.session_)) {}
+
+ConnectionPool::Lease& ConnectionPool::Lease::operator=(Lease&& o) noexcept {
+    if (this != &o) {
+        release();
+        pool_ = std::exchange(o.pool_, nullptr);
+        session_ = std::move(o.session_);
+    }
+    return *this;
+}
+
+ConnectionPool::Lease::~Lease() { release(); }
+
+void ConnectionPool::Lease::discard() {
+    if (pool_ && session_)
+        pool_->give_back(std::move(session_), false);
+    pool_ = nullptr;
+}
+
+void ConnectionPool::Lease::release() {
+    if (pool_ && session_) {
+        bool reusable = !session_->broken();
+        pool_->give_back(std::move(session_), reusable);
+    }
+    pool_ = nullptr;
+}
+
+ConnectionPool::ConnectionPool(PoolOptions opts) : opts_(std::move(opts)) {
+    if (opts_.background_reaper)
+        reaper_ = std::thread([this] { reaper_loop(); });
+}
+
+ConnectionPool::~ConnectionPool() {
+    {
+        std::lock_guard<std::mutex> lk(mu_);
+        stopping_ = true;
+    }
+    reaper_cv_.notify_all();
+    if (reaper_.joinable())
+        reaper_.join();
+}
+
+bool ConnectionPool::healthy(Session& s) {
+    switch (opts_.health_check) {
+    case HealthCheck::None:
+        return true;
+    case HealthCheck::Probe:
+        return s.probe();
+    case HealthCheck::Ping:
+        if (!s.probe())
+            return false;
+        if (Session::Clock::now() - s.last_used() < opts_.health_check_interval)
+            return true;
+        try {
+            s.ping();
+            return true;
+        } catch (const std::exception&) {
+            return false;
+        }
+    }
+    return false;
+}
+
+ConnectionPool::Lease ConnectionPool::acquire(const Endpoint& ep) {
+    auto deadline = std::chrono::steady_clock::now() + opts_.acquire_timeout;
+    std::unique_lock<std::mutex> lk(mu_);
+    for (;;) {
+        Slot& slot = slots_[ep];
+        while (!slot.idle.empty()) {
+            std::unique_ptr<Session> s = std::move(slot.idle.back());
+            slot.idle.pop_back();
+            if (Session::Clock::now() - s->last_used() > opts_.idle_timeout) {
+                ++stats_.idle_evictions;
+                continue;
+            }
+            ++slot.in_use;
+            // Health checks may do a round trip; don't hold the pool lock.
+            lk.unlock();
+            bool ok = healthy(*s);
+            lk.lock();
+            if (ok) {
+                ++stats_.reuses;
+                return Lease(this, std::move(s));
+            }
+            --slots_[ep].in_use;
+            ++stats_.health_check_failures;
+        }
+        Slot& cur = slots_[ep];
+        if (opts_.max_per_endpoint == 0 || cur.in_use + cur.idle.size() < opts_.max_per_endpoint)
+            break;
+        if (slot_freed_.wait_until(lk, deadline) == std::cv_status::timeout)
+            throw Error("connection pool exhausted for " + ep.to_string());
+    }
+
+    ++slots_[ep].in_use;
+    lk.unlock();
+    try {
+        auto s = Session::connect(ep, opts_.session);
+        lk.lock();
+        ++stats_.connects;
+        return Lease(this, std::move(s));
+    } catch (...) {
+        if (!lk.owns_lock())
+            lk.lock();
+        --slots_[ep].in_use;
+        slot_freed_.notify_one();
+        throw;
+    }
+}
+
+void ConnectionPool::give_back(std::unique_ptr<Session> s, bool reusable) {
+    std::unique_ptr<Session> doomed;
+    {
+        std::lock_guard<std::mutex> lk(mu_);
+        Slot& slot = slots_[s->endpoint()];
+        --slot.in_use;
+        if (reusable && slot.idle.size() < opts_.max_idle_per_endpoint) {
+            slot.idle.push_back(std::move(s));
+        } else {
+            if (!reusable)
+                ++stats_.discarded;
+            doomed = std::move(s); // close outside the lock
+        }
+    }
+    slot_freed_.notify_one();
+}
+
+size_t ConnectionPool::reap() {
+    std::vector<std::unique_ptr<Session>> doomed;
+    {
+        std::lock_guard<std::mutex> lk(mu_);
+        auto now = Session::Clock::now();
+        for (auto& [ep, slot] : slots_) {
+            // Oldest sessions sit at the front.
+            while (!slot.idle.empty() && now - slot.idle.front()->last_used() > opts_.idle_timeout) {
+                doomed.push_back(std::move(slot.idle.front()));
+                slot.idle.pop_front();
+            }
+        }
+        stats_.idle_evictions += doomed.size();
+    }
+    if (!doomed.empty())
+        slot_freed_.notify_all();
+    return doomed.size();
+}
+
+void ConnectionPool::clear() {
+    std::vector<std::unique_ptr<Session>> doomed;
+    {
+        std::lock_guard<std::mutex> lk(mu_);
+        for (auto& [ep, slot] : slots_) {
+            for (auto& s : slot.idle)
+                doomed.push_back(std::move(s));
+            slot.idle.clear();
+        }
+    }
+    slot_freed_.notify_all();
+}
+
+PoolStats ConnectionPool::stats() const {
+    std::lock_guard<std::mutex> lk(mu_);
+    PoolStats s = stats_;
+    for (auto& [ep, slot] : slots_) {
+        s.in_use += slot.in_use;
+        s.idle += slot.idle.size();
+    }
+    return s;
+}
+
+void ConnectionPool::reaper_loop() {
+    auto period = std::max<std::chrono::milliseconds>(opts_.idle_timeout / 4,
+                                                      std::chrono::milliseconds(100));
+    std::unique_lock<std::mutex> lk(mu_);
+    while (!stopping_) {
+        reaper_cv_.wait_for(lk, period);
+        if (stopping_)
+            break;
+        lk.unlock();
+        reap();
+        lk.lock();
+    }
+}
+
+} // namespace TcpTransfer
@@ -0,0 +1,222 @@
+#include "tcptransfer/delta.h"
+
+#include <algorithm>
+#include <cerrno>
+#include <cmath>
+#include <memory>
+
+#include "tcptransfer/checksum.h"
+#include "tcptransfer/mapped_file.h"
+#include "tcptransfer/metrics.h"
+#include "tcptransfer/thread_pool.h"
+#include "tcptransfer/trace.h"
+
+namespace TcpTransfer {
+
+namespace {
+
+constexpr uint32_t kMinBlock = 2 << 10;
+constexpr uint32_t kMaxBlock = 1 << 20;
+constexpr uint64_t kSegmentBytes = 16 << 20;
+constexpr size_t kSignatureWireSize = 12;
+constexpr size_t kAdvanceEvery = 256 << 10;
+
+/// Segment length: a whole number of blocks, large enough to amortise the
+/// per-task setup and to lose little reuse at boundaries.
+uint64_t segment_bytes(uint32_t block) {
+    uint64_t seg = std::max<uint64_t>(kSegmentBytes, uint64_t{block} * 64);
+    return seg / block * block;
+}
+
+/// Chained hash index from weak checksum to block numbers.
+class BlockIndex {
+public:
+    explicit BlockIndex(const std::vector<BlockSignature>& blocks) : blocks_(blocks) {
+        size_t cap = 16;
+        while (cap < blocks.size() * 2)
+            cap <<= 1;
+        mask_ = cap - 1;
+        head_.assign(cap, -1);
+        next_.assign(blocks.size(), -1);
+        for (size_t i = blocks.size(); i-- > 0;) {
+            size_t slot = bucket(blocks[i].weak);
+            next_[i] = head_[slot];
+            head_[slot] = static_cast<int32_t>(i);
+        }
+    }
+
+    /// First block (lowest number) whose hashes match the window at p.
+    int64_t find(uint32_t weak, const unsigned char* p, size_t n) const {
+        uint64_t strong = 0;
+        bool have_strong = false;
+        for (int32_t i = head_[bucket(weak)]; i >= 0; i = next_[static_cast<size_t>(i)]) {
+            const BlockSignature& b = blocks_[static_cast<size_t>(i)];
+            if (b.weak != weak)
+                continue;
+            if (!have_strong) {
+                strong = hash64(p, n);
+                have_strong = true;
+            }
+            if (b.strong == strong)
+                return i;
+        }
+        return -1;
+    }
+
+private:
+    size_t bucket(uint32_t weak) const { return (weak * 0x9E3779B1u) & mask_; }
+
+    const std::vector<BlockSignature>& blocks_;
+    size_t mask_ = 0;
+    std::vector<int32_t> head_;
+    std::vector<int32_t> next_;
+};
+
+void push_op(std::vector<DeltaOp>& ops, DeltaOp op) {
+    if (op.length == 0)
+        return;
+    if (!ops.empty()) {
+        DeltaOp& last = ops.back();
+        bool adjacent = last.offset + last.length == op.offset;
+        if (adjacent && last.literal() && op.literal()) {
+            last.length += op.length;
+            return;
+        }
+        if (adjacent && !last.literal() && !op.literal() &&
+            static_cast<uint64_t>(last.source) + last.length == static_cast<uint64_t>(op.source)) {
+            last.length += op.length;
+            return;
+        }
+    }
+    ops.push_back(op);
+}
+
+struct SegmentResult {
+    std::vector<DeltaOp> ops;
+    uint32_t crc = 0;
+    uint64_t length = 0;
+};
+
+/// Scans one mapped segment, hashing it as it goes so pages can be
+/// released behind the cursor: neither the CRC nor the match loop ever
+/// looks back before p.
+void scan_segment(MappedFile& map, uint64_t base, uint32_t block, const BlockIndex* index,
+                  SegmentResult& out) {
+    const unsigned char* buf = map.data();
+    const size_t len = map.size();
+    size_t hashed = 0;
+    auto consumed = [&](size_t upto) {
+        out.crc = crc32_update(out.crc, buf + hashed, upto - hashed);
+        hashed = upto;
+        map.advance(upto);
+    };
+    size_t lit = 0;
+    size_t p = 0;
+    if (index && len >= block) {
+        size_t next_advance = kAdvanceEvery;
+        RollingChecksum roll;
+        roll.reset(buf, block);
+        while (p + block <= len) {
+            if (p >= next_advance) {
+                consumed(p);
+                next_advance = p + kAdvanceEvery;
+            }
+            int64_t hit = index->find(roll.value(), buf + p, block);
+            if (hit >= 0) {
+                push_op(out.ops, {base + lit, p - lit, -1});
+                push_op(out.ops, {base + p, block, hit * static_cast<int64_t>(block)});
+                p += block;
+                lit = p;
+                if (p + block <= len)
+                    roll.reset(buf + p, block);
+                continue;
+            }
+            if (p + block == len)
+                break;
+            roll.roll(buf[p], buf[p + block]);
+            ++p;
+        }
+    }
+    for (size_t at = hashed; at < len;)
+        consumed(at = std::min(len, at + kAdvanceEvery));
+    push_op(out.ops, {base + lit, len - lit, -1});
+}
+
+} // namespace
+
+uint32_t delta_block_size(uint64_t basis_size) {
+    auto root = static_cast<uint64_t>(std::sqrt(static_cast<double>(basis_size)));
+    uint32_t block = kMinBlock;
+    while (block < kMaxBlock && block < root)
+        block <<= 1;
+    // Keep the signature list within one frame.
+    while ((basis_size / block) * kSignatureWireSize + 64 > kMaxFramePayload)
+        block <<= 1;
+    return block;
+}
+
+SignaturesMsg compute_signatures(int fd, uint64_t size, WorkStealingPool* pool, int cpu) {
+    TCPTRANSFER_TRACE_SPAN("signatures", size);
+    SignaturesMsg sig;
+    sig.block_size = delta_block_size(size);
+    sig.basis_size = size;
+    const uint32_t block = sig.block_size;
+    sig.blocks.resize(static_cast<size_t>(size / block));
+    const uint64_t full = uint64_t{sig.blocks.size()} * block;
+    const uint64_t seg = segment_bytes(block);
+    TaskGroup group(pool, cpu);
+    for (uint64_t start = 0; start < full; start += seg) {
+        group.run([&sig, fd, start, seg, full, block] {
+            size_t len = static_cast<size_t>(std::min(seg, full - start));
+            MappedFile map(fd, start, len);
+            StageTimer t(Stage::Hash, len);
+            RollingChecksum roll;
+            for (size_t off = 0; off < len; off += block) {
+                map.advance(off);
+                BlockSignature& b = sig.blocks[static_cast<size_t>((start + off) / block)];
+                roll.reset(map.data() + off, block);
+                b.weak = roll.value();
+                b.strong = hash64(map.data() + off, block);
+            }
+        });
+    }
+    group.wait();
+    return sig;
+}
+
+DeltaPlan plan_delta(int fd, uint64_t size, const SignaturesMsg& sig, WorkStealingPool* pool,
+                     int cpu) {
+    TCPTRANSFER_TRACE_SPAN("plan_delta", size);
+    const uint32_t block = sig.block_size ? sig.block_size : kMinBlock;
+    std::unique_ptr<BlockIndex> index;
+    if (!sig.blocks.empty())
+        index = std::make_unique<BlockIndex>(sig.blocks);
+    const uint64_t seg = segment_bytes(block);
+    std::vector<SegmentResult> parts(static_cast<size_t>((size + seg - 1) / seg));
+    TaskGroup group(pool, cpu);
+    for (size_t i = 0; i < parts.size(); ++i) {
+        group.run([&, i] {
+            uint64_t start = i * seg;
+            size_t len = static_cast<size_t>(std::min(seg, size - start));
+            MappedFile map(fd, start, len);
+            SegmentResult& r = parts[i];
+            r.length = len;
+            StageTimer t(Stage::Hash, len);
+            scan_segment(map, start, block, index.get(), r);
+        });
+    }
+    group.wait();
+
+    DeltaPlan plan;
+    for (const SegmentResult& r : parts) {
+        plan.crc = crc32_combine(plan.crc, r.crc, r.length);
+        for (const DeltaOp& op : r.ops)
+            push_op(plan.ops, op);
+    }
+    for (const DeltaOp& op : plan.ops)
+        if (!op.literal())
+            plan.copied += op.length;
+    return plan;
+}
+
+} // namespace TcpTransfer
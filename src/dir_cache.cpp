@@ -0,0 +1,128 @@
+#include "tcptransfer/dir_cache.h"
+
+#include <fcntl.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include <cerrno>
+
+#include "tcptransfer/error.h"
+
+namespace TcpTransfer {
+
+namespace {
+
+/// rel without empty components: "/a//b/" becomes "a/b".
+std::string normalize(std::string_view rel) {
+    std::string out;
+    size_t start = 0;
+    while (start < rel.size()) {
+        size_t slash = rel.find('/', start);
+        size_t end = slash == std::string_view::npos ? rel.size() : slash;
+        if (end > start) {
+            if (!out.empty())
+                out.push_back('/');
+            out.append(rel.substr(start, end - start));
+        }
+        start = end + 1;
+    }
+    return out;
+}
+
+} // namespace
+
+DirCache::DirCache(int root_fd, size_t capacity, std::chrono::milliseconds ttl)
+    : root_(root_fd), capacity_(capacity), ttl_(ttl) {}
+
+DirCache::Handle DirCache::find_locked(const std::string& rel, Clock::time_point now) {
+    auto it = map_.find(rel);
+    if (it == map_.end())
+        return nullptr;
+    struct stat st{};
+    if (now - it->second.opened > ttl_ || ::fstat(it->second.handle->get(), &st) != 0 ||
+        st.st_nlink == 0) {
+        lru_.erase(it->second.lru);
+        map_.erase(it);
+        return nullptr;
+    }
+    lru_.splice(lru_.begin(), lru_, it->second.lru);
+    return it->second.handle;
+}
+
+void DirCache::insert(const std::string& rel, Handle h, Clock::time_point now) {
+    if (capacity_ == 0)
+        return;
+    std::lock_guard<std::mutex> lk(mu_);
+    auto it = map_.find(rel);
+    if (it != map_.end()) {
+        // Another thread resolved it meanwhile; the newer handle wins.
+        it->second.handle = std::move(h);
+        it->second.opened = now;
+        lru_.splice(lru_.begin(), lru_, it->second.lru);
+        return;
+    }
+    lru_.push_front(rel);
+    map_.emplace(rel, Entry{std::move(h), now, lru_.begin()});
+    while (map_.size() > capacity_) {
+        map_.erase(lru_.back());
+        lru_.pop_back();
+    }
+}
+
+DirCache::Handle DirCache::open(std::string_view rel_in, bool create) {
+    const std::string rel = normalize(rel_in);
+    const auto now = Clock::now();
+    // Nearest cached ancestor, rel itself first.
+    Handle cur;
+    size_t done = 0; ///< Length of the prefix cur stands for.
+    {
+        std::lock_guard<std::mutex> lk(mu_);
+        for (size_t len = rel.size();;) {
+            if (Handle h = find_locked(rel.substr(0, len), now)) {
+                cur = std::move(h);
+                done = len;
+                break;
+            }
+            if (len == 0)
+                break;
+            size_t slash = rel.rfind('/', len - 1);
+            len = slash == std::string::npos ? 0 : slash;
+        }
+        if (cur && done == rel.size()) {
+            hits_.fetch_add(1, std::memory_order_relaxed);
+            return cur;
+        }
+        misses_.fetch_add(1, std::memory_order_relaxed);
+    }
+    if (!cur) {
+        auto root = std::make_shared<Fd>(::openat(root_, ".", O_PATH | O_DIRECTORY | O_CLOEXEC));
+        if (!*root)
+            throw_errno("open root");
+        cur = root;
+        insert("", cur, now);
+    }
+    while (done < rel.size()) {
+        size_t start = done == 0 ? 0 : done + 1;
+        size_t slash = rel.find('/', start);
+        size_t end = slash == std::string::npos ? rel.size() : slash;
+        std::string comp = rel.substr(start, end - start);
+        if (create && ::mkdirat(cur->get(), comp.c_str(), 0755) != 0 && errno != EEXIST)
+            throw_errno("mkdir " + comp);
+        auto next = std::make_shared<Fd>(
+            ::openat(cur->get(), comp.c_str(), O_PATH | O_DIRECTORY | O_NOFOLLOW | O_CLOEXEC));
+        if (!*next)
+            throw_errno("open " + comp);
+        cur = next;
+        done = end;
+        insert(rel.substr(0, done), cur, now);
+    }
+    return cur;
+}
+
+void DirCache::clear() {
+    std::lock_guard<std::mutex> lk(mu_);
+    map_.clear();
+    lru_.clear();
+}
+
+} // namespace TcpTransfer
@@ -0,0 +1,274 @@
+#include "tcptransfer/dir_index.h"
+
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include <cstring>
+
+#include "tcptransfer/checksum.h"
+#include "tcptransfer/error.h"
+
+namespace TcpTransfer {
+
+namespace {
+
+constexpr char kMagic[8] = {'T', 'T', 'I', 'D', 'X', 0, 0, 0};
+constexpr uint32_t kVersion = 1;
+constexpr uint64_t kInitialCapacity = 1024;
+constexpr uint64_t kInitialArena = 64 << 10;
+constexpr char kTempSuffix[] = ".tmp";
+
+enum SlotState : uint32_t { kEmpty = 0, kValid = 1, kPending = 2, kStale = 3 };
+
+} // namespace
+
+struct DirIndex::Header {
+    char magic[8];
+    uint32_t version;
+    uint32_t dirty;
+    uint64_t capacity; ///< Slots; a power of two.
+    uint64_t count;
+    uint64_t arena_used;
+    uint64_t arena_cap;
+    uint64_t reserved[2];
+};
+
+struct DirIndex::Slot {
+    uint64_t path_hash;
+    uint64_t size;
+    int64_t mtime_ns;
+    uint64_t hash;
+    uint64_t path_off; ///< Into the arena.
+    uint32_t path_len;
+    uint32_t state;
+};
+
+namespace {
+
+uint64_t file_bytes(uint64_t capacity, uint64_t arena_cap, size_t header, size_t slot) {
+    return header + capacity * slot + arena_cap;
+}
+
+} // namespace
+
+DirIndex::DirIndex(int dirfd) : dir_(::fcntl(dirfd, F_DUPFD_CLOEXEC, 0)) {
+    static_assert(sizeof(Header) == 64 && sizeof(Slot) == 48, "on-disk layout");
+    if (!dir_)
+        throw_errno("dup index dir");
+    fd_ = Fd(::openat(dir_.get(), kFileName, O_RDWR | O_CREAT | O_NOFOLLOW | O_CLOEXEC, 0600));
+    if (!fd_)
+        throw_errno(std::string("open ") + kFileName);
+    struct stat st{};
+    if (::fstat(fd_.get(), &st) != 0)
+        throw_errno("fstat index");
+    if (static_cast<uint64_t>(st.st_size) >= sizeof(Header)) {
+        map(static_cast<uint64_t>(st.st_size));
+        if (valid())
+            return;
+    }
+    // Missing, foreign or not cleanly closed: start over.
+    init(kInitialCapacity, kInitialArena);
+}
+
+DirIndex::~DirIndex() {
+    try {
+        flush();
+    } catch (...) {
+        // Left dirty: the next open discards it.
+    }
+    if (base_)
+        ::munmap(base_, mapped_);
+}
+
+DirIndex::Header* DirIndex::header() const { return reinterpret_cast<Header*>(base_); }
+
+DirIndex::Slot* DirIndex::slots() const {
+    return reinterpret_cast<Slot*>(base_ + sizeof(Header));
+}
+
+char* DirIndex::arena() const {
+    return base_ + sizeof(Header) + header()->capacity * sizeof(Slot);
+}
+
+size_t DirIndex::size() const { return static_cast<size_t>(header()->count); }
+
+void DirIndex::map(uint64_t bytes) {
+    if (base_)
+        ::munmap(base_, mapped_);
+    base_ = nullptr;
+    void* p = ::mmap(nullptr, bytes, PROT_READ | PROT_WRITE, MAP_SHARED, fd_.get(), 0);
+    if (p == MAP_FAILED)
+        throw_errno("mmap index");
+    base_ = static_cast<char*>(p);
+    mapped_ = bytes;
+}
+
+bool DirIndex::valid() const {
+    const Header* h = header();
+    uint64_t cap = h->capacity;
+    return std::memcmp(h->magic, kMagic, sizeof(kMagic)) == 0 && h->version == kVersion &&
+           h->dirty == 0 && cap >= 16 && (cap & (cap - 1)) == 0 && cap < (uint64_t{1} << 40) &&
+           h->count < cap && h->arena_used <= h->arena_cap &&
+           mapped_ == file_bytes(cap, h->arena_cap, sizeof(Header), sizeof(Slot));
+}
+
+void DirIndex::init(uint64_t capacity, uint64_t arena_cap) {
+    uint64_t bytes = file_bytes(capacity, arena_cap, sizeof(Header), sizeof(Slot));
+    if (::ftruncate(fd_.get(), 0) != 0 ||
+        ::ftruncate(fd_.get(), static_cast<off_t>(bytes)) != 0)
+        throw_errno("size index");
+    map(bytes);
+    Header* h = header();
+    std::memcpy(h->magic, kMagic, sizeof(kMagic));
+    h->version = kVersion;
+    h->dirty = 0;
+    h->capacity = capacity;
+    h->count = 0;
+    h->arena_used = 0;
+    h->arena_cap = arena_cap;
+}
+
+void DirIndex::mark_dirty() {
+    if (header()->dirty)
+        return;
+    header()->dirty = 1;
+    // The flag must be on disk before any slot it protects changes.
+    ::msync(base_, sizeof(Header), MS_SYNC);
+}
+
+void DirIndex::flush() {
+    if (!base_ || !header()->dirty)
+        return;
+    if (::msync(base_, mapped_, MS_SYNC) != 0)
+        throw_errno("msync index");
+    header()->dirty = 0;
+    ::msync(base_, sizeof(Header), MS_SYNC);
+}
+
+DirIndex::Slot* DirIndex::find(std::string_view path, uint64_t h) const {
+    const uint64_t mask = header()->capacity - 1;
+    const uint64_t used = header()->arena_used;
+    const char* names = arena();
+    for (uint64_t i = h & mask;; i = (i + 1) & mask) {
+        Slot* s = &slots()[i];
+        if (s->state == kEmpty)
+            return s;
+        if (s->path_hash == h && s->path_len == path.size() && s->path_off <= used &&
+            s->path_len <= used - s->path_off &&
+            std::memcmp(names + s->path_off, path.data(), path.size()) == 0)
+            return s;
+    }
+}
+
+DirIndex::Slot* DirIndex::insert(std::string_view path) {
+    if ((header()->count + 1) * 10 > header()->capacity * 7)
+        grow_table();
+    const uint64_t h = hash64(path.data(), path.size());
+    Slot* s = find(path, h);
+    if (s->state != kEmpty)
+        return s;
+    reserve_arena(path.size());
+    s = find(path, h); // the mapping may have moved
+    s->path_hash = h;
+    s->path_off = header()->arena_used;
+    s->path_len = static_cast<uint32_t>(path.size());
+    std::memcpy(arena() + s->path_off, path.data(), path.size());
+    header()->arena_used += path.size();
+    ++header()->count;
+    s->state = kStale;
+    return s;
+}
+
+void DirIndex::reserve_arena(uint64_t extra) {
+    Header* h = header();
+    if (h->arena_used + extra <= h->arena_cap)
+        return;
+    uint64_t cap = h->arena_cap;
+    while (h->arena_used + extra > cap)
+        cap *= 2;
+    uint64_t bytes = file_bytes(h->capacity, cap, sizeof(Header), sizeof(Slot));
+    if (::ftruncate(fd_.get(), static_cast<off_t>(bytes)) != 0)
+        throw_errno("grow index");
+    void* p = ::mremap(base_, mapped_, bytes, MREMAP_MAYMOVE);
+    if (p == MAP_FAILED)
+        throw_errno("mremap index");
+    base_ = static_cast<char*>(p);
+    mapped_ = bytes;
+    header()->arena_cap = cap;
+}
+
+void DirIndex::grow_table() {
+    // Rehash into a new file and swap it in; the arena is compacted along
+    // the way. Rare enough (doubling) that the copy does not matter.
+    const Header old = *header();
+    const uint64_t cap = old.capacity * 2;
+    const uint64_t bytes = file_bytes(cap, old.arena_cap, sizeof(Header), sizeof(Slot));
+    std::string tmp = std::string(kFileName) + kTempSuffix;
+    Fd nfd(::openat(dir_.get(), tmp.c_str(), O_RDWR | O_CREAT | O_TRUNC | O_NOFOLLOW | O_CLOEXEC,
+                    0600));
+    if (!nfd)
+        throw_errno("create index");
+    if (::ftruncate(nfd.get(), static_cast<off_t>(bytes)) != 0)
+        throw_errno("size index");
+    void* p = ::mmap(nullptr, bytes, PROT_READ | PROT_WRITE, MAP_SHARED, nfd.get(), 0);
+    if (p == MAP_FAILED)
+        throw_errno("mmap index");
+    char* nbase = static_cast<char*>(p);
+    auto* nh = reinterpret_cast<Header*>(nbase);
+    *nh = old;
+    nh->capacity = cap;
+    nh->arena_used = 0;
+    nh->dirty = 1;
+    ::msync(nbase, sizeof(Header), MS_SYNC);
+    auto* nslots = reinterpret_cast<Slot*>(nbase + sizeof(Header));
+    char* narena = nbase + sizeof(Header) + cap * sizeof(Slot);
+    const char* oarena = arena();
+    for (uint64_t i = 0; i < old.capacity; ++i) {
+        const Slot& s = slots()[i];
+        if (s.state == kEmpty)
+            continue;
+        uint64_t j = s.path_hash & (cap - 1);
+        while (nslots[j].state != kEmpty)
+            j = (j + 1) & (cap - 1);
+        nslots[j] = s;
+        nslots[j].path_off = nh->arena_used;
+        std::memcpy(narena + nh->arena_used, oarena + s.path_off, s.path_len);
+        nh->arena_used += s.path_len;
+    }
+    if (::renameat(dir_.get(), tmp.c_str(), dir_.get(), kFileName) != 0) {
+        ::munmap(nbase, bytes);
+        throw_errno("replace index");
+    }
+    ::munmap(base_, mapped_);
+    base_ = nbase;
+    mapped_ = bytes;
+    fd_ = std::move(nfd);
+}
+
+bool DirIndex::matches(std::string_view path, const Entry& e) const {
+    const Slot* s = find(path, hash64(path.data(), path.size()));
+    return s->state == kValid && s->size == e.size && s->mtime_ns == e.mtime_ns &&
+           s->hash == e.hash;
+}
+
+void DirIndex::expect(std::string_view path, const Entry& e) {
+    mark_dirty();
+    Slot* s = insert(path);
+    s->size = e.size;
+    s->mtime_ns = e.mtime_ns;
+    s->hash = e.hash;
+    s->state = kPending;
+}
+
+void DirIndex::committed(std::string_view path, uint64_t size, int64_t mtime_ns) {
+    Slot* s = find(path, hash64(path.data(), path.size()));
+    if (s->state == kEmpty)
+        return; // never synced; nothing to keep consistent
+    mark_dirty();
+    bool landed = s->state == kPending && s->size == size && s->mtime_ns == mtime_ns;
+    s->state = landed ? kValid : kStale;
+}
+
+} // namespace TcpTransfer
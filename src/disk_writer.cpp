@@ -0,0 +1,194 @@
+#include "tcptransfer/disk_writer.h"
+
+#include <sys/sysmacros.h>
+#include <sys/uio.h>
+#include <unistd.h>
+
+#include <algorithm>
+#include <cerrno>
+#include <fstream>
+
+#include "tcptransfer/trace.h"
+
+namespace TcpTransfer {
+
+namespace {
+
+constexpr size_t kMaxMergeJobs = 64; ///< iovecs per pwritev.
+
+/// Contents of a sysfs attribute holding 0 or 1; -1 if unreadable.
+int read_flag(const std::string& path) {
+    std::ifstream in(path);
+    int v = -1;
+    in >> v;
+    return in ? v : -1;
+}
+
+} // namespace
+
+DeviceKind device_kind(dev_t dev) {
+    if (major(dev) == 0)
+        return DeviceKind::Other;
+    std::string base =
+        "/sys/dev/block/" + std::to_string(major(dev)) + ":" + std::to_string(minor(dev));
+    // Partitions have no queue of their own; their disk is the parent.
+    int rotational = read_flag(base + "/queue/rotational");
+    if (rotational < 0)
+        rotational = read_flag(base + "/../queue/rotational");
+    if (rotational < 0)
+        return DeviceKind::Other;
+    return rotational ? DeviceKind::Rotational : DeviceKind::Flash;
+}
+
+DiskWriters::DiskWriters(DiskWriterOptions opts) : opts_(opts) {}
+
+DiskWriters::~DiskWriters() {
+    std::lock_guard<std::mutex> lk(mu_);
+    for (auto& [dev, d] : devices_) {
+        for (auto& q : d.lanes) {
+            {
+                std::lock_guard<std::mutex> qlk(q->mu);
+                q->stop = true;
+            }
+            q->cv.notify_one();
+        }
+        for (auto& q : d.lanes)
+            q->thread.join();
+    }
+}
+
+DiskWriters::Lane DiskWriters::lane_for(dev_t dev, ino_t ino) {
+    std::lock_guard<std::mutex> lk(mu_);
+    auto [it, fresh] = devices_.try_emplace(dev);
+    Device& d = it->second;
+    if (fresh) {
+        d.kind = device_kind(dev);
+        size_t lanes = d.kind == DeviceKind::Rotational ? opts_.rotational_lanes
+                       : d.kind == DeviceKind::Flash    ? opts_.flash_lanes
+                                                        : opts_.other_lanes;
+        for (size_t i = 0; i < std::max<size_t>(1, lanes); ++i) {
+            auto q = std::make_unique<Queue>();
+            q->name = "writer-" + std::to_string(major(dev)) + ":" + std::to_string(minor(dev)) +
+                      "/" + std::to_string(i);
+            Queue* raw = q.get();
+            q->thread = std::thread([this, raw] { run(*raw); });
+            d.lanes.push_back(std::move(q));
+        }
+    }
+    return d.lanes[ino % d.lanes.size()].get();
+}
+
+void DiskWriters::submit(Lane lane, std::shared_ptr<const Fd> file, uint64_t offset,
+                         std::vector<char> data, Done done) {
+    enqueue(lane, {std::move(file), offset, std::move(data), std::move(done)});
+}
+
+void DiskWriters::truncate(Lane lane, std::shared_ptr<const Fd> file, uint64_t size, Done done) {
+    enqueue(lane, {std::move(file), size, {}, std::move(done), Kind::Truncate});
+}
+
+void DiskWriters::flush(Lane lane, Done done) {
+    enqueue(lane, {nullptr, 0, {}, std::move(done), Kind::Flush});
+}
+
+void DiskWriters::enqueue(Lane lane, Job job) {
+    {
+        std::lock_guard<std::mutex> lk(lane->mu);
+        lane->jobs.push_back(std::move(job));
+    }
+    lane->cv.notify_one();
+}
+
+size_t DiskWriters::devices() const {
+    std::lock_guard<std::mutex> lk(mu_);
+    return devices_.size();
+}
+
+void DiskWriters::run(Queue& q) {
+    trace_thread_name(q.name);
+    std::vector<Job> batch;
+    for (;;) {
+        {
+            std::unique_lock<std::mutex> lk(q.mu);
+            q.cv.wait(lk, [&] { return q.stop || !q.jobs.empty(); });
+            if (q.jobs.empty())
+                return; // stopping, with nothing left
+            // Take the first job and whatever queued behind it continues it.
+            batch.push_back(std::move(q.jobs.front()));
+            q.jobs.pop_front();
+            size_t bytes = batch.back().data.size();
+            while (batch.back().kind == Kind::Write && !q.jobs.empty() &&
+                   batch.size() < kMaxMergeJobs) {
+                const Job& next = q.jobs.front();
+                const Job& last = batch.back();
+                if (next.kind != Kind::Write || next.file != last.file ||
+                    next.offset != last.offset + last.data.size() ||
+                    bytes + next.data.size() > opts_.max_merge_bytes)
+                    break;
+                bytes += next.data.size();
+                batch.push_back(std::move(q.jobs.front()));
+                q.jobs.pop_front();
+            }
+        }
+        if (batch.front().kind == Kind::Flush) {
+            Done done = std::move(batch.front().done);
+            batch.clear();
+            done(0, {});
+            continue;
+        }
+        write_merged(batch);
+        batch.clear();
+    }
+}
+
+void DiskWriters::write_merged(std::vector<Job>& jobs) {
+    TCPTRANSFER_TRACE_SPAN("disk_write", jobs.size());
+    std::vector<iovec> iov;
+    iov.reserve(jobs.size());
+    for (Job& j : jobs)
+        iov.push_back({j.data.data(), j.data.size()});
+    int fd = jobs.front().file->get();
+    off_t pos = static_cast<off_t>(jobs.front().offset);
+    size_t first = 0;
+    int error = 0;
+    auto start = std::chrono::steady_clock::now();
+    const bool cut = jobs.front().kind == Kind::Truncate;
+    if (cut && ::ftruncate(fd, pos) != 0)
+        error = errno;
+    while (!cut) {
+        while (first < iov.size() && iov[first].iov_len == 0)
+            ++first;
+        if (first == iov.size())
+            break;
+        ssize_t w = ::pwritev(fd, iov.data() + first, static_cast<int>(iov.size() - first), pos);
+        if (w < 0 && errno == EINTR)
+            continue;
+        if (w <= 0) {
+            error = w < 0 ? errno : EIO;
+            break;
+        }
+        pos += w;
+        for (auto left = static_cast<size_t>(w); left > 0; ++first) {
+            size_t take = std::min(left, iov[first].iov_len);
+            iov[first].iov_base = static_cast<char*>(iov[first].iov_base) + take;
+            iov[first].iov_len -= take;
+            left -= take;
+            if (iov[first].iov_len > 0)
+                break;
+        }
+    }
+    // Each job is charged its share, so that per-job times add up.
+    auto took = (std::chrono::steady_clock::now() - start) / jobs.size();
+    if (!cut) {
+        writes_.fetch_add(1, std::memory_order_relaxed);
+        merged_.fetch_add(jobs.size() - 1, std::memory_order_relaxed);
+    }
+    for (Job& j : jobs) {
+        // Let go of the file before telling: the owner may close it then.
+        Done done = std::move(j.done);
+        j = Job{};
+        done(error, took);
+    }
+}
+
+} // namespace TcpTransfer
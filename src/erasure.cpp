@@ -0,0 +1,248 @@
+#include "tcptransfer/erasure.h"
+
+#include <array>
+#include <cstring>
+
+#if defined(__x86_64__)
+#include <immintrin.h>
+#endif
+
+#include "tcptransfer/error.h"
+
+namespace TcpTransfer {
+
+namespace {
+
+/// exp/log tables for GF(2^8) with the polynomial x^8+x^4+x^3+x^2+1.
+struct GfTables {
+    std::array<uint8_t, 512> exp{};
+    std::array<uint8_t, 256> log{};
+
+    GfTables() {
+        unsigned x = 1;
+        for (unsigned i = 0; i < 255; ++i) {
+            exp[i] = static_cast<uint8_t>(x);
+            log[x] = static_cast<uint8_t>(i);
+            x <<= 1;
+            if (x & 0x100)
+                x ^= 0x11d;
+        }
+        for (unsigned i = 255; i < exp.size(); ++i)
+            exp[i] = exp[i - 255];
+    }
+};
+
+const GfTables& gf() {
+    static const GfTables t;
+    return t;
+}
+
+uint8_t gf_mul(uint8_t a, uint8_t b) {
+    if (a == 0 || b == 0)
+        return 0;
+    const GfTables& t = gf();
+    return t.exp[t.log[a] + t.log[b]];
+}
+
+uint8_t gf_inv(uint8_t a) {
+    const GfTables& t = gf();
+    return t.exp[255 - t.log[a]];
+}
+
+/// Products of c with every low nibble, then every high nibble.
+struct NibbleTables {
+    alignas(32) uint8_t lo[16];
+    alignas(32) uint8_t hi[16];
+
+    explicit NibbleTables(uint8_t c) {
+        for (unsigned i = 0; i < 16; ++i) {
+            lo[i] = gf_mul(c, static_cast<uint8_t>(i));
+            hi[i] = gf_mul(c, static_cast<uint8_t>(i << 4));
+        }
+    }
+};
+
+/// Each kernel handles a prefix and returns its length; the scalar loop
+/// finishes the tail.
+using Kernel = size_t (*)(const NibbleTables&, const uint8_t*, uint8_t*, size_t);
+
+size_t mul_add_none(const NibbleTables&, const uint8_t*, uint8_t*, size_t) { return 0; }
+
+#if defined(__x86_64__)
+__attribute__((target("ssse3"))) size_t mul_add_ssse3(const NibbleTables& t, const uint8_t* src,
+                                                       uint8_t* dst, size_t n) {
+    const __m128i lo = _mm_load_si128(reinterpret_cast<const __m128i*>(t.lo));
+    const __m128i hi = _mm_load_si128(reinterpret_cast<const __m128i*>(t.hi));
+    const __m128i mask = _mm_set1_epi8(0x0f);
+    size_t i = 0;
+    for (; i + 16 <= n; i += 16) {
+        __m128i s = _mm_loadu_si128(reinterpret_cast<const __m128i*>(src + i));
+        __m128i l = _mm_shuffle_epi8(lo, _mm_and_si128(s, mask));
+        __m128i h = _mm_shuffle_epi8(hi, _mm_and_si128(_mm_srli_epi64(s, 4), mask));
+        __m128i d = _mm_loadu_si128(reinterpret_cast<const __m128i*>(dst + i));
+        _mm_storeu_si128(reinterpret_cast<__m128i*>(dst + i),
+                         _mm_xor_si128(d, _mm_xor_si128(l, h)));
+    }
+    return i;
+}
+
+__attribute__((target("avx2"))) size_t mul_add_avx2(const NibbleTables& t, const uint8_t* src,
+                                                    uint8_t* dst, size_t n) {
+    // vpshufb looks up within each 128-bit lane, so both lanes get the table.
+    const __m256i lo =
+        _mm256_broadcastsi128_si256(_mm_load_si128(reinterpret_cast<const __m128i*>(t.lo)));
+    const __m256i hi =
+        _mm256_broadcastsi128_si256(_mm_load_si128(reinterpret_cast<const __m128i*>(t.hi)));
+    const __m256i mask = _mm256_set1_epi8(0x0f);
+    size_t i = 0;
+    for (; i + 32 <= n; i += 32) {
+        __m256i s = _mm256_loadu_si256(reinterpret_cast<const __m256i*>(src + i));
+        __m256i l = _mm256_shuffle_epi8(lo, _mm256_and_si256(s, mask));
+        __m256i h = _mm256_shuffle_epi8(hi, _mm256_and_si256(_mm256_srli_epi64(s, 4), mask));
+        __m256i d = _mm256_loadu_si256(reinterpret_cast<const __m256i*>(dst + i));
+        _mm256_storeu_si256(reinterpret_cast<__m256i*>(dst + i),
+                            _mm256_xor_si256(d, _mm256_xor_si256(l, h)));
+    }
+    return i;
+}
+#endif
+
+struct KernelChoice {
+    Kernel fn = mul_add_none;
+    const char* name = "scalar";
+};
+
+bool supported(GfKernel k) {
+#if defined(__x86_64__)
+    if (k == GfKernel::Avx2)
+        return __builtin_cpu_supports("avx2");
+    if (k == GfKernel::Ssse3)
+        return __builtin_cpu_supports("ssse3");
+#endif
+    return k == GfKernel::Scalar;
+}
+
+KernelChoice choose(GfKernel k) {
+#if defined(__x86_64__)
+    if (k == GfKernel::Auto)
+        k = supported(GfKernel::Avx2)    ? GfKernel::Avx2
+            : supported(GfKernel::Ssse3) ? GfKernel::Ssse3
+                                         : GfKernel::Scalar;
+    if (k == GfKernel::Avx2)
+        return {mul_add_avx2, "avx2"};
+    if (k == GfKernel::Ssse3)
+        return {mul_add_ssse3, "ssse3"};
+#endif
+    (void)k;
+    return {};
+}
+
+KernelChoice& kernel() {
+    static KernelChoice k = choose(GfKernel::Auto);
+    return k;
+}
+
+} // namespace
+
+void gf_mul_add(uint8_t c, const uint8_t* src, uint8_t* dst, size_t n) {
+    if (c == 0)
+        return;
+    if (c == 1) {
+        for (size_t i = 0; i < n; ++i)
+            dst[i] ^= src[i];
+        return;
+    }
+    NibbleTables t(c);
+    size_t i = kernel().fn(t, src, dst, n);
+    for (; i < n; ++i)
+        dst[i] ^= t.lo[src[i] & 0x0f] ^ t.hi[src[i] >> 4];
+}
+
+const char* gf_kernel_name() { return kernel().name; }
+
+bool gf_use_kernel(GfKernel k) {
+    if (k != GfKernel::Auto && !supported(k))
+        return false;
+    kernel() = choose(k);
+    return true;
+}
+
+ReedSolomon::ReedSolomon(size_t data, size_t parity) : k_(data), m_(parity) {
+    if (k_ == 0 || k_ + m_ > 256)
+        throw Error("bad Reed-Solomon geometry");
+    // Cauchy: 1 / (x_j + y_i) with x_j = k + j and y_i = i, all distinct.
+    parity_.resize(m_ * k_);
+    for (size_t j = 0; j < m_; ++j)
+        for (size_t i = 0; i < k_; ++i)
+            parity_[j * k_ + i] = gf_inv(static_cast<uint8_t>((k_ + j) ^ i));
+}
+
+void ReedSolomon::encode(const uint8_t* const* data, uint8_t* const* parity, size_t len) const {
+    for (size_t j = 0; j < m_; ++j) {
+        std::memset(parity[j], 0, len);
+        for (size_t i = 0; i < k_; ++i)
+            gf_mul_add(parity_[j * k_ + i], data[i], parity[j], len);
+    }
+}
+
+bool ReedSolomon::reconstruct(uint8_t* const* shards, const std::vector<bool>& present,
+                              size_t len) const {
+    std::vector<size_t> rows; ///< First k intact shards.
+    for (size_t r = 0; r < k_ + m_ && rows.size() < k_; ++r)
+        if (present[r])
+            rows.push_back(r);
+    if (rows.size() < k_)
+        return false;
+    bool missing = false;
+    for (size_t i = 0; i < k_; ++i)
+        missing = missing || !present[i];
+    if (!missing)
+        return true;
+
+    // Generator rows of the intact shards, then invert by Gauss-Jordan.
+    std::vector<uint8_t> a(k_ * k_), inv(k_ * k_, 0);
+    for (size_t r = 0; r < k_; ++r) {
+        if (rows[r] < k_)
+            a[r * k_ + rows[r]] = 1;
+        else
+            std::memcpy(&a[r * k_], &parity_[(rows[r] - k_) * k_], k_);
+        inv[r * k_ + r] = 1;
+    }
+    for (size_t col = 0; col < k_; ++col) {
+        size_t pivot = col;
+        while (a[pivot * k_ + col] == 0)
+            ++pivot; // exists: Cauchy submatrices are invertible
+        if (pivot != col)
+            for (size_t c = 0; c < k_; ++c) {
+                std::swap(a[pivot * k_ + c], a[col * k_ + c]);
+                std::swap(inv[pivot * k_ + c], inv[col * k_ + c]);
+            }
+        uint8_t scale = gf_inv(a[col * k_ + col]);
+        for (size_t c = 0; c < k_; ++c) {
+            a[col * k_ + c] = gf_mul(a[col * k_ + c], scale);
+            inv[col * k_ + c] = gf_mul(inv[col * k_ + c], scale);
+        }
+        for (size_t r = 0; r < k_; ++r) {
+            uint8_t f = a[r * k_ + col];
+            if (r == col || f == 0)
+                continue;
+            for (size_t c = 0; c < k_; ++c) {
+                a[r * k_ + c] ^= gf_mul(f, a[col * k_ + c]);
+                inv[r * k_ + c] ^= gf_mul(f, inv[col * k_ + c]);
+            }
+        }
+    }
+
+    // Missing data shard i is row i of the inverse applied to the intact
+    // shards. Intact shards are only read, so rebuilding in place is safe.
+    for (size_t i = 0; i < k_; ++i) {
+        if (present[i])
+            continue;
+        std::memset(shards[i], 0, len);
+        for (size_t r = 0; r < k_; ++r)
+            gf_mul_add(inv[i * k_ + r], shards[rows[r]], shards[i], len);
+    }
+    return true;
+}
+
+} // namespace TcpTransfer
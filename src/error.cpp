@@ -0,0 +1,26 @@
+#include "tcptransfer/error.h"
+
+#include <cerrno>
+
+namespace TcpTransfer {
+
+const char* status_name(Status s) {
+    switch (s) {
+    case Status::Ok: return "ok";
+    case Status::BadRequest: return "bad request";
+    case Status::AuthFailed: return "authentication failed";
+    case Status::PathRejected: return "path rejected";
+    case Status::IoError: return "i/o error";
+    case Status::ChecksumMismatch: return "checksum mismatch";
+    case Status::SizeMismatch: return "size mismatch";
+    case Status::Unsupported: return "unsupported";
+    case Status::Busy: return "busy";
+    }
+    return "unknown status";
+}
+
+void throw_errno(const std::string& what) {
+    throw std::system_error(errno, std::generic_category(), what);
+}
+
+} // namespace TcpTransfer
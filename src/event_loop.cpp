@@ -0,0 +1,156 @@
+#include "tcptransfer/event_loop.h"
+
+#include <sys/eventfd.h>
+#include <unistd.h>
+
+#include <cerrno>
+#include <thread>
+
+#include "tcptransfer/error.h"
+
+namespace TcpTransfer {
+
+EventLoop::EventLoop()
+    : epfd_(::epoll_create1(EPOLL_CLOEXEC)), wakefd_(::eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC)) {
+    if (!epfd_ || !wakefd_)
+        throw_errno("epoll/eventfd");
+    epoll_event ev{};
+    ev.events = EPOLLIN;
+    ev.data.fd = wakefd_.get();
+    if (::epoll_ctl(epfd_.get(), EPOLL_CTL_ADD, wakefd_.get(), &ev) != 0)
+        throw_errno("epoll_ctl wakefd");
+}
+
+void EventLoop::add(int fd, uint32_t events, IoHandler handler) {
+    epoll_event ev{};
+    ev.events = events;
+    ev.data.fd = fd;
+    if (::epoll_ctl(epfd_.get(), EPOLL_CTL_ADD, fd, &ev) != 0)
+        throw_errno("epoll_ctl add");
+    handlers_[fd] = std::move(handler);
+}
+
+void EventLoop::modify(int fd, uint32_t events) {
+    epoll_event ev{};
+    ev.events = events;
+    ev.data.fd = fd;
+    if (::epoll_ctl(epfd_.get(), EPOLL_CTL_MOD, fd, &ev) != 0)
+        throw_errno("epoll_ctl mod");
+}
+
+void EventLoop::remove(int fd) {
+    ::epoll_ctl(epfd_.get(), EPOLL_CTL_DEL, fd, nullptr);
+    handlers_.erase(fd);
+}
+
+void EventLoop::post(Task task) {
+    {
+        std::lock_guard<std::mutex> lk(mu_);
+        tasks_.push_back(std::move(task));
+    }
+    wake();
+}
+
+EventLoop::TimerId EventLoop::run_after(std::chrono::milliseconds delay, Task fn) {
+    TimerId id = next_timer_++;
+    timer_heap_.push({Clock::now() + delay, id});
+    timers_.emplace(id, std::move(fn));
+    return id;
+}
+
+void EventLoop::defer(Task fn) { deferred_.push_back(std::move(fn)); }
+
+void EventLoop::cancel(TimerId id) { timers_.erase(id); }
+
+void EventLoop::stop() {
+    {
+        std::lock_guard<std::mutex> lk(mu_);
+        stopping_ = true;
+    }
+    wake();
+}
+
+bool EventLoop::in_loop_thread() const { return std::this_thread::get_id() == thread_id_; }
+
+void EventLoop::wake() {
+    uint64_t one = 1;
+    [[maybe_unused]] ssize_t n = ::write(wakefd_.get(), &one, sizeof(one));
+}
+
+void EventLoop::drain_tasks() {
+    std::vector<Task> tasks;
+    {
+        std::lock_guard<std::mutex> lk(mu_);
+        tasks.swap(tasks_);
+    }
+    for (auto& t : tasks)
+        t();
+}
+
+int EventLoop::next_timeout_ms() {
+    while (!timer_heap_.empty() && !timers_.count(timer_heap_.top().id))
+        timer_heap_.pop();
+    if (timer_heap_.empty())
+        return -1;
+    auto d = std::chrono::duration_cast<std::chrono::milliseconds>(timer_heap_.top().when -
+                                                                   Clock::now());
+    return d.count() < 0 ? 0 : static_cast<int>(d.count()) + 1;
+}
+
+void EventLoop::fire_timers() {
+    auto now = Clock::now();
+    while (!timer_heap_.empty() && timer_heap_.top().when <= now) {
+        TimerId id = timer_heap_.top().id;
+        timer_heap_.pop();
+        auto it = timers_.find(id);
+        if (it == timers_.end())
+            continue;
+        Task fn = std::move(it->second);
+        timers_.erase(it);
+        fn();
+    }
+}
+
+void EventLoop::run() {
+    thread_id_ = std::this_thread::get_id();
+    epoll_event events[128];
+    for (;;) {
+        {
+            std::lock_guard<std::mutex> lk(mu_);
+            if (stopping_) {
+                stopping_ = false;
+                return;
+            }
+        }
+        int n = ::epoll_wait(epfd_.get(), events, 128, next_timeout_ms());
+        if (n < 0) {
+            if (errno == EINTR)
+                continue;
+            throw_errno("epoll_wait");
+        }
+        for (int i = 0; i < n; ++i) {
+            int fd = events[i].data.fd;
+            if (fd == wakefd_.get()) {
+                uint64_t v;
+                [[maybe_unused]] ssize_t r = ::read(wakefd_.get(), &v, sizeof(v));
+                continue;
+            }
+            auto it = handlers_.find(fd);
+            if (it == handlers_.end())
+                continue;
+            // Copy: the handler may remove itself.
+            IoHandler h = it->second;
+            h(events[i].events);
+        }
+        drain_tasks();
+        fire_timers();
+        while (!deferred_.empty()) {
+            std::vector<Task> batch;
+            batch.swap(deferred_);
+            for (auto& t : batch)
+                t();
+        }
+    }
+}
+
+} // namespace TcpTransfer
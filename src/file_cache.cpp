@@ -0,0 +1,160 @@
+#include "tcptransfer/file_cache.h"
+
+#include <fcntl.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include <cerrno>
+
+#include "tcptransfer/error.h"
+
+namespace TcpTransfer {
+
+namespace {
+
+constexpr size_t kMaxCrcsPerFile = 16;
+
+int64_t mtime_ns(const struct stat& st) {
+    return static_cast<int64_t>(st.st_mtim.tv_sec) * 1000000000 + st.st_mtim.tv_nsec;
+}
+
+bool same_file(const FileCache::File& f, const struct stat& st) {
+    return f.dev == st.st_dev && f.ino == st.st_ino && f.size == static_cast<uint64_t>(st.st_size) &&
+           f.mtime_ns == mtime_ns(st) && f.mode == (st.st_mode & 0777);
+}
+
+} // namespace
+
+std::optional<uint32_t> FileCache::File::crc(uint64_t offset, uint64_t length) const {
+    std::lock_guard<std::mutex> lk(mu_);
+    auto it = crcs_.find({offset, length});
+    if (it == crcs_.end())
+        return std::nullopt;
+    return it->second;
+}
+
+void FileCache::File::remember_crc(uint64_t offset, uint64_t length, uint32_t crc) const {
+    std::lock_guard<std::mutex> lk(mu_);
+    if (crcs_.size() >= kMaxCrcsPerFile)
+        crcs_.clear();
+    crcs_[{offset, length}] = crc;
+}
+
+FileCache::FileCache(size_t max_files, size_t extent_bytes)
+    : max_files_(max_files), max_extent_bytes_(extent_bytes),
+      max_ghosts_(2 * (extent_bytes / kExtentSize)) {}
+
+FileCache::FileHandle FileCache::open(int dir_fd, const std::string& rel,
+                                      const std::string& name) {
+    struct stat st{};
+    if (max_files_ > 0 && ::fstatat(dir_fd, name.c_str(), &st, AT_SYMLINK_NOFOLLOW) == 0) {
+        std::lock_guard<std::mutex> lk(files_mu_);
+        auto it = files_.find(rel);
+        if (it != files_.end()) {
+            if (same_file(*it->second.file, st)) {
+                files_lru_.splice(files_lru_.begin(), files_lru_, it->second.lru);
+                file_hits_.fetch_add(1, std::memory_order_relaxed);
+                return it->second.file;
+            }
+            files_lru_.erase(it->second.lru);
+            files_.erase(it);
+        }
+    }
+    file_misses_.fetch_add(1, std::memory_order_relaxed);
+
+    auto f = std::make_shared<File>();
+    f->fd = Fd(::openat(dir_fd, name.c_str(), O_RDONLY | O_NOFOLLOW | O_CLOEXEC));
+    if (!f->fd || ::fstat(f->fd.get(), &st) != 0)
+        throw_errno(name);
+    f->size = static_cast<uint64_t>(st.st_size);
+    f->mode = st.st_mode & 0777;
+    f->mtime_ns = mtime_ns(st);
+    f->dev = st.st_dev;
+    f->ino = st.st_ino;
+    f->regular = S_ISREG(st.st_mode);
+    if (!f->regular || max_files_ == 0)
+        return f; // the caller rejects non-files; they are not worth keeping
+
+    std::lock_guard<std::mutex> lk(files_mu_);
+    auto it = files_.find(rel);
+    if (it != files_.end()) {
+        // Another thread opened it meanwhile; the newer handle wins.
+        it->second.file = f;
+        files_lru_.splice(files_lru_.begin(), files_lru_, it->second.lru);
+        return f;
+    }
+    files_lru_.push_front(rel);
+    files_.emplace(rel, FileEntry{f, files_lru_.begin()});
+    while (files_.size() > max_files_) {
+        files_.erase(files_lru_.back());
+        files_lru_.pop_back();
+    }
+    return f;
+}
+
+std::string FileCache::extent_key(const File& f, uint64_t index) {
+    std::string key;
+    key.reserve(5 * sizeof(uint64_t));
+    for (uint64_t v : {static_cast<uint64_t>(f.dev), static_cast<uint64_t>(f.ino), f.size,
+                       static_cast<uint64_t>(f.mtime_ns), index})
+        key.append(reinterpret_cast<const char*>(&v), sizeof(v));
+    return key;
+}
+
+FileCache::Extent FileCache::extent(const File& f, uint64_t index, bool& admit) {
+    admit = false;
+    if (max_extent_bytes_ == 0)
+        return nullptr;
+    std::string key = extent_key(f, index);
+    std::lock_guard<std::mutex> lk(extents_mu_);
+    auto it = extents_.find(key);
+    if (it != extents_.end()) {
+        extents_lru_.splice(extents_lru_.begin(), extents_lru_, it->second.lru);
+        extent_hits_.fetch_add(1, std::memory_order_relaxed);
+        return it->second.data;
+    }
+    extent_misses_.fetch_add(1, std::memory_order_relaxed);
+    if (auto g = ghosts_.find(key); g != ghosts_.end()) {
+        admit = true;
+        ghosts_lru_.splice(ghosts_lru_.begin(), ghosts_lru_, g->second);
+        return nullptr;
+    }
+    ghosts_lru_.push_front(key);
+    ghosts_.emplace(std::move(key), ghosts_lru_.begin());
+    while (ghosts_.size() > max_ghosts_) {
+        ghosts_.erase(ghosts_lru_.back());
+        ghosts_lru_.pop_back();
+    }
+    return nullptr;
+}
+
+FileCache::Extent FileCache::insert_extent(const File& f, uint64_t index, std::string data) {
+    auto extent = std::make_shared<const std::string>(std::move(data));
+    if (extent->size() > max_extent_bytes_)
+        return extent;
+    std::string key = extent_key(f, index);
+    std::lock_guard<std::mutex> lk(extents_mu_);
+    if (auto g = ghosts_.find(key); g != ghosts_.end()) {
+        ghosts_lru_.erase(g->second);
+        ghosts_.erase(g);
+    }
+    if (auto it = extents_.find(key); it != extents_.end())
+        return it->second.data;
+    extent_bytes_ += extent->size();
+    extents_lru_.push_front(key);
+    extents_.emplace(std::move(key), ExtentEntry{extent, extents_lru_.begin()});
+    while (extent_bytes_ > max_extent_bytes_) {
+        auto victim = extents_.find(extents_lru_.back());
+        extent_bytes_ -= victim->second.data->size();
+        extents_.erase(victim);
+        extents_lru_.pop_back();
+    }
+    return extent;
+}
+
+size_t FileCache::extent_bytes() const {
+    std::lock_guard<std::mutex> lk(extents_mu_);
+    return extent_bytes_;
+}
+
+} // namespace TcpTransfer
@@ -0,0 +1,107 @@
+#include "tcptransfer/handoff.h"
+
+#include <fcntl.h>
+#include <sys/socket.h>
+#include <unistd.h>
+
+#include <cerrno>
+#include <climits>
+#include <cstring>
+
+#include "tcptransfer/error.h"
+
+namespace TcpTransfer {
+
+void send_handoff(int sock, HandoffMsg type, std::string_view payload, int fd) {
+    if (payload.size() > kMaxHandoffPayload)
+        throw Error("handoff message too large");
+    std::string packet(1, static_cast<char>(type));
+    packet.append(payload);
+    iovec iov{packet.data(), packet.size()};
+    msghdr msg{};
+    msg.msg_iov = &iov;
+    msg.msg_iovlen = 1;
+    alignas(cmsghdr) char control[CMSG_SPACE(sizeof(int))];
+    if (fd >= 0) {
+        std::memset(control, 0, sizeof(control));
+        msg.msg_control = control;
+        msg.msg_controllen = sizeof(control);
+        cmsghdr* cm = CMSG_FIRSTHDR(&msg);
+        cm->cmsg_level = SOL_SOCKET;
+        cm->cmsg_type = SCM_RIGHTS;
+        cm->cmsg_len = CMSG_LEN(sizeof(int));
+        std::memcpy(CMSG_DATA(cm), &fd, sizeof(int));
+    }
+    while (::sendmsg(sock, &msg, MSG_NOSIGNAL) < 0)
+        if (errno != EINTR)
+            throw_errno("send handoff");
+}
+
+bool recv_handoff(int sock, std::chrono::milliseconds timeout, HandoffMsg& type,
+                  std::string& payload, Fd& fd) {
+    if (!wait_readable(sock, timeout))
+        return false;
+    std::string packet(1 + kMaxHandoffPayload, '\0');
+    iovec iov{packet.data(), packet.size()};
+    alignas(cmsghdr) char control[CMSG_SPACE(sizeof(int))];
+    msghdr msg{};
+    msg.msg_iov = &iov;
+    msg.msg_iovlen = 1;
+    msg.msg_control = control;
+    msg.msg_controllen = sizeof(control);
+    ssize_t n;
+    while ((n = ::recvmsg(sock, &msg, MSG_CMSG_CLOEXEC)) < 0)
+        if (errno != EINTR)
+            return false;
+    for (cmsghdr* cm = CMSG_FIRSTHDR(&msg); cm; cm = CMSG_NXTHDR(&msg, cm))
+        if (cm->cmsg_level == SOL_SOCKET && cm->cmsg_type == SCM_RIGHTS) {
+            int got = -1;
+            std::memcpy(&got, CMSG_DATA(cm), sizeof(int));
+            fd = Fd(got);
+        }
+    if (n == 0)
+        return false;
+    if (msg.msg_flags & (MSG_TRUNC | MSG_CTRUNC))
+        throw ProtocolError("truncated handoff message");
+    type = static_cast<HandoffMsg>(packet[0]);
+    payload.assign(packet.data() + 1, static_cast<size_t>(n) - 1);
+    return true;
+}
+
+std::string current_exe() {
+    char buf[PATH_MAX];
+    ssize_t n = ::readlink("/proc/self/exe", buf, sizeof(buf));
+    if (n < 0)
+        throw_errno("readlink /proc/self/exe");
+    std::string path(buf, static_cast<size_t>(n));
+    constexpr std::string_view kDeleted = " (deleted)";
+    if (path.ends_with(kDeleted))
+        path.resize(path.size() - kDeleted.size());
+    return path;
+}
+
+Fd spawn_successor(const std::string& exe, const std::vector<std::string>& args, pid_t& pid) {
+    int sv[2];
+    if (::socketpair(AF_UNIX, SOCK_SEQPACKET | SOCK_CLOEXEC, 0, sv) != 0)
+        throw_errno("socketpair");
+    Fd mine(sv[0]), theirs(sv[1]);
+    std::vector<std::string> argv = args;
+    argv.push_back("--handoff-fd");
+    argv.push_back(std::to_string(theirs.get()));
+    std::vector<char*> cargv;
+    for (std::string& a : argv)
+        cargv.push_back(a.data());
+    cargv.push_back(nullptr);
+    pid = ::fork();
+    if (pid < 0)
+        throw_errno("fork");
+    if (pid == 0) {
+        // Only async-signal-safe calls until exec.
+        ::fcntl(theirs.get(), F_SETFD, 0);
+        ::execv(exe.c_str(), cargv.data());
+        ::_exit(127);
+    }
+    return mine;
+}
+
+} // namespace TcpTransfer
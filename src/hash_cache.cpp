@@ -0,0 +1,271 @@
+#include "tcptransfer/hash_cache.h"
+
+#include <fcntl.h>
+#include <sys/file.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include <cerrno>
+#include <cstdlib>
+#include <cstring>
+
+#include "tcptransfer/checksum.h"
+#include "tcptransfer/error.h"
+
+namespace TcpTransfer {
+
+namespace {
+
+constexpr char kMagic[8] = {'T', 'T', 'H', 'C', 'A', 'C', 'H', 0};
+constexpr uint32_t kVersion = 1;
+constexpr uint64_t kInitialCapacity = 4096;
+constexpr char kTempSuffix[] = ".tmp";
+
+enum SlotState : uint32_t { kEmpty = 0, kUsed = 1 };
+
+uint64_t slot_home(uint64_t dev, uint64_t ino) {
+    uint64_t key[2] = {dev, ino};
+    return hash64(key, sizeof(key));
+}
+
+/// Creates every missing directory above path.
+void make_parents(const std::string& path) {
+    for (size_t slash = path.find('/', 1); slash != std::string::npos;
+         slash = path.find('/', slash + 1)) {
+        std::string dir = path.substr(0, slash);
+        if (::mkdir(dir.c_str(), 0700) != 0 && errno != EEXIST)
+            throw_errno("mkdir " + dir);
+    }
+}
+
+} // namespace
+
+struct HashCache::Header {
+    char magic[8];
+    uint32_t version;
+    uint32_t dirty;
+    uint64_t capacity; ///< Slots; a power of two.
+    uint64_t count;
+    uint32_t epoch;    ///< Bumped by every open.
+    uint32_t reserved0;
+    uint64_t reserved[3];
+};
+
+struct HashCache::Slot {
+    uint64_t dev;
+    uint64_t ino;
+    uint64_t size;
+    int64_t mtime_ns;
+    int64_t ctime_ns;
+    uint64_t hash;
+    uint32_t epoch; ///< Last open that looked this slot up.
+    uint32_t state;
+    uint64_t reserved;
+};
+
+HashCache::HashCache(const std::string& path) : path_(path) {
+    static_assert(sizeof(Header) == 64 && sizeof(Slot) == 64, "on-disk layout");
+    make_parents(path_);
+    fd_ = Fd(::open(path_.c_str(), O_RDWR | O_CREAT | O_NOFOLLOW | O_CLOEXEC, 0600));
+    if (!fd_)
+        throw_errno("open " + path_);
+    if (::flock(fd_.get(), LOCK_EX | LOCK_NB) != 0)
+        throw_errno("lock " + path_);
+    struct stat st{};
+    if (::fstat(fd_.get(), &st) != 0)
+        throw_errno("fstat " + path_);
+    if (static_cast<uint64_t>(st.st_size) >= sizeof(Header)) {
+        map(static_cast<uint64_t>(st.st_size));
+        if (valid()) {
+            ++header()->epoch; // plain write: only dirtied state is protected
+            return;
+        }
+    }
+    init(kInitialCapacity);
+}
+
+HashCache::~HashCache() {
+    try {
+        flush();
+    } catch (...) {
+        // Left dirty: the next open discards it.
+    }
+    if (base_)
+        ::munmap(base_, mapped_);
+}
+
+std::unique_ptr<HashCache> HashCache::try_open(const std::string& path) {
+    if (path.empty())
+        return nullptr;
+    try {
+        return std::make_unique<HashCache>(path);
+    } catch (const std::system_error&) {
+        return nullptr;
+    }
+}
+
+std::string HashCache::default_path() {
+    if (const char* xdg = std::getenv("XDG_CACHE_HOME"); xdg && *xdg == '/')
+        return std::string(xdg) + "/tcptransfer/hashes";
+    if (const char* home = std::getenv("HOME"); home && *home == '/')
+        return std::string(home) + "/.cache/tcptransfer/hashes";
+    return {};
+}
+
+HashCache::Header* HashCache::header() const { return reinterpret_cast<Header*>(base_); }
+
+HashCache::Slot* HashCache::slots() const {
+    return reinterpret_cast<Slot*>(base_ + sizeof(Header));
+}
+
+size_t HashCache::size() const { return static_cast<size_t>(header()->count); }
+
+void HashCache::map(uint64_t bytes) {
+    if (base_)
+        ::munmap(base_, mapped_);
+    base_ = nullptr;
+    void* p = ::mmap(nullptr, bytes, PROT_READ | PROT_WRITE, MAP_SHARED, fd_.get(), 0);
+    if (p == MAP_FAILED)
+        throw_errno("mmap " + path_);
+    base_ = static_cast<char*>(p);
+    mapped_ = bytes;
+}
+
+bool HashCache::valid() const {
+    const Header* h = header();
+    uint64_t cap = h->capacity;
+    return std::memcmp(h->magic, kMagic, sizeof(kMagic)) == 0 && h->version == kVersion &&
+           h->dirty == 0 && cap >= 16 && (cap & (cap - 1)) == 0 && cap < (uint64_t{1} << 40) &&
+           h->count < cap && mapped_ == sizeof(Header) + cap * sizeof(Slot);
+}
+
+void HashCache::init(uint64_t capacity) {
+    uint64_t bytes = sizeof(Header) + capacity * sizeof(Slot);
+    if (::ftruncate(fd_.get(), 0) != 0 ||
+        ::ftruncate(fd_.get(), static_cast<off_t>(bytes)) != 0)
+        throw_errno("size " + path_);
+    map(bytes);
+    Header* h = header();
+    std::memcpy(h->magic, kMagic, sizeof(kMagic));
+    h->version = kVersion;
+    h->dirty = 0;
+    h->capacity = capacity;
+    h->count = 0;
+    h->epoch = 1;
+}
+
+void HashCache::mark_dirty() {
+    if (header()->dirty)
+        return;
+    header()->dirty = 1;
+    // The flag must be on disk before any slot it protects changes.
+    ::msync(base_, sizeof(Header), MS_SYNC);
+}
+
+void HashCache::flush() {
+    if (!base_ || !header()->dirty)
+        return;
+    if (::msync(base_, mapped_, MS_SYNC) != 0)
+        throw_errno("msync " + path_);
+    header()->dirty = 0;
+    ::msync(base_, sizeof(Header), MS_SYNC);
+}
+
+HashCache::Slot* HashCache::find(uint64_t dev, uint64_t ino) const {
+    const uint64_t mask = header()->capacity - 1;
+    for (uint64_t i = slot_home(dev, ino) & mask;; i = (i + 1) & mask) {
+        Slot* s = &slots()[i];
+        if (s->state == kEmpty || (s->dev == dev && s->ino == ino))
+            return s;
+    }
+}
+
+bool HashCache::lookup(const Key& k, uint64_t& hash) {
+    Slot* s = find(k.dev, k.ino);
+    if (s->state == kEmpty || s->size != k.size || s->mtime_ns != k.mtime_ns ||
+        s->ctime_ns != k.ctime_ns) {
+        ++misses_;
+        return false;
+    }
+    // Touching the epoch does not need the dirty flag: a lost update only
+    // lets the slot expire a little early.
+    s->epoch = header()->epoch;
+    hash = s->hash;
+    ++hits_;
+    return true;
+}
+
+void HashCache::store(const Key& k, uint64_t hash) {
+    if ((header()->count + 1) * 10 > header()->capacity * 7)
+        rebuild(header()->capacity * 2);
+    mark_dirty();
+    Slot* s = find(k.dev, k.ino);
+    if (s->state == kEmpty) {
+        s->dev = k.dev;
+        s->ino = k.ino;
+        ++header()->count;
+    }
+    s->size = k.size;
+    s->mtime_ns = k.mtime_ns;
+    s->ctime_ns = k.ctime_ns;
+    s->hash = hash;
+    s->epoch = header()->epoch;
+    s->state = kUsed;
+}
+
+void HashCache::rebuild(uint64_t capacity) {
+    // Rehash the live slots into a new file and swap it in. Slots idle for
+    // kKeepEpochs opens are dropped, which usually frees enough room that
+    // the table does not have to grow after all.
+    const Header old = *header();
+    uint64_t live = 0;
+    for (uint64_t i = 0; i < old.capacity; ++i) {
+        const Slot& s = slots()[i];
+        if (s.state != kEmpty && old.epoch - s.epoch < kKeepEpochs)
+            ++live;
+    }
+    uint64_t cap = old.capacity;
+    while ((live + 1) * 10 > cap * 7 / 2 && cap < capacity)
+        cap *= 2;
+    const uint64_t bytes = sizeof(Header) + cap * sizeof(Slot);
+    std::string tmp = path_ + kTempSuffix;
+    Fd nfd(::open(tmp.c_str(), O_RDWR | O_CREAT | O_TRUNC | O_NOFOLLOW | O_CLOEXEC, 0600));
+    if (!nfd)
+        throw_errno("create " + tmp);
+    if (::flock(nfd.get(), LOCK_EX | LOCK_NB) != 0)
+        throw_errno("lock " + tmp);
+    if (::ftruncate(nfd.get(), static_cast<off_t>(bytes)) != 0)
+        throw_errno("size " + tmp);
+    void* p = ::mmap(nullptr, bytes, PROT_READ | PROT_WRITE, MAP_SHARED, nfd.get(), 0);
+    if (p == MAP_FAILED)
+        throw_errno("mmap " + tmp);
+    char* nbase = static_cast<char*>(p);
+    auto* nh = reinterpret_cast<Header*>(nbase);
+    *nh = old;
+    nh->capacity = cap;
+    nh->count = 0;
+    nh->dirty = 1;
+    ::msync(nbase, sizeof(Header), MS_SYNC);
+    auto* nslots = reinterpret_cast<Slot*>(nbase + sizeof(Header));
+    for (uint64_t i = 0; i < old.capacity; ++i) {
+        const Slot& s = slots()[i];
+        if (s.state == kEmpty || old.epoch - s.epoch >= kKeepEpochs)
+            continue;
+        uint64_t j = slot_home(s.dev, s.ino) & (cap - 1);
+        while (nslots[j].state != kEmpty)
+            j = (j + 1) & (cap - 1);
+        nslots[j] = s;
+        ++nh->count;
+    }
+    if (::rename(tmp.c_str(), path_.c_str()) != 0) {
+        ::munmap(nbase, bytes);
+        throw_errno("replace " + path_);
+    }
+    ::munmap(base_, mapped_);
+    base_ = nbase;
+    mapped_ = bytes;
+    fd_ = std::move(nfd);
+}
+
+} // namespace TcpTransfer
@@ -0,0 +1,162 @@
+#include "tcptransfer/manifest.h"
+
+#include <dirent.h>
+#include <fcntl.h>
+#include <sys/stat.h>
+#include <sys/sysmacros.h>
+#include <unistd.h>
+
+#include <algorithm>
+#include <cerrno>
+#include <ctime>
+
+#include "tcptransfer/checksum.h"
+#include "tcptransfer/dir_index.h"
+#include "tcptransfer/error.h"
+#include "tcptransfer/hash_cache.h"
+#include "tcptransfer/mapped_file.h"
+#include "tcptransfer/metrics.h"
+#include "tcptransfer/path_util.h"
+#include "tcptransfer/socket.h"
+#include "tcptransfer/thread_pool.h"
+#include "tcptransfer/trace.h"
+
+namespace TcpTransfer {
+
+namespace {
+
+constexpr size_t kHashBlock = 1 << 20;
+constexpr size_t kHashBatch = 64; ///< Files hashed per pool task.
+/// Files changed this close to the scan are hashed but not cached: a write
+/// landing in the same timestamp tick after the hash would go unnoticed.
+constexpr int64_t kRacyWindowNs = 1000000000;
+
+/// A file found by the walk, with the identity the hash cache is keyed on.
+struct Scanned {
+    ManifestEntry entry;
+    HashCache::Key key;
+};
+
+int64_t to_ns(const statx_timestamp& t) {
+    return static_cast<int64_t>(t.tv_sec) * 1000000000 + t.tv_nsec;
+}
+
+void walk(int dirfd, const std::string& prefix, std::vector<Scanned>& out) {
+    Fd self(::openat(dirfd, ".", O_RDONLY | O_DIRECTORY | O_CLOEXEC));
+    if (!self)
+        throw_errno("open " + prefix);
+    DIR* d = ::fdopendir(self.get());
+    if (!d)
+        throw_errno("opendir " + prefix);
+    self.release();
+    std::vector<std::string> subdirs;
+    errno = 0;
+    while (dirent* e = ::readdir(d)) {
+        std::string_view name = e->d_name;
+        if (name == "." || name == ".." || name == DirIndex::kFileName)
+            continue;
+        std::string rel = join_path(prefix, name);
+        // d_type spares a stat for everything but regular files on the
+        // file systems that fill it in.
+        if (e->d_type == DT_DIR) {
+            subdirs.push_back(std::move(rel));
+            continue;
+        }
+        if (e->d_type != DT_REG && e->d_type != DT_UNKNOWN)
+            continue;
+        // Only the fields the manifest and cache key need, served from the
+        // inode cache without forcing a sync on network file systems.
+        struct statx st{};
+        if (::statx(::dirfd(d), e->d_name, AT_SYMLINK_NOFOLLOW | AT_STATX_DONT_SYNC,
+                    STATX_TYPE | STATX_INO | STATX_SIZE | STATX_MTIME | STATX_CTIME, &st) != 0)
+            continue; // vanished meanwhile
+        if (S_ISDIR(st.stx_mode)) {
+            subdirs.push_back(std::move(rel));
+        } else if (S_ISREG(st.stx_mode)) {
+            Scanned f;
+            f.entry.path = std::move(rel);
+            f.entry.size = st.stx_size;
+            f.entry.mtime_ns = to_ns(st.stx_mtime);
+            f.key.dev = makedev(st.stx_dev_major, st.stx_dev_minor);
+            f.key.ino = st.stx_ino;
+            f.key.size = st.stx_size;
+            f.key.mtime_ns = f.entry.mtime_ns;
+            f.key.ctime_ns = to_ns(st.stx_ctime);
+            out.push_back(std::move(f));
+        }
+    }
+    int sub_root = ::dirfd(d);
+    for (const std::string& sub : subdirs) {
+        std::string name = sub.substr(sub.find_last_of('/') + 1);
+        Fd child(::openat(sub_root, name.c_str(), O_RDONLY | O_DIRECTORY | O_NOFOLLOW | O_CLOEXEC));
+        if (child)
+            walk(child.get(), sub, out);
+    }
+    ::closedir(d);
+}
+
+} // namespace
+
+uint64_t content_hash(int fd, uint64_t size) {
+    MappedFile map(fd, 0, static_cast<size_t>(size));
+    std::vector<uint64_t> blocks;
+    blocks.reserve(static_cast<size_t>(size / kHashBlock + 1));
+    for (size_t off = 0; off < map.size(); off += kHashBlock) {
+        map.advance(off);
+        blocks.push_back(hash64(map.data() + off, std::min(kHashBlock, map.size() - off)));
+    }
+    return hash64(blocks.data(), blocks.size() * sizeof(uint64_t), size);
+}
+
+std::vector<ManifestEntry> build_manifest(const std::string& dir, WorkStealingPool* pool,
+                                          HashCache* cache) {
+    TCPTRANSFER_TRACE_SPAN("build_manifest", 0);
+    Fd root(::open(dir.c_str(), O_RDONLY | O_DIRECTORY | O_CLOEXEC));
+    if (!root)
+        throw_errno("open " + dir);
+    timespec now{};
+    ::clock_gettime(CLOCK_REALTIME, &now);
+    const int64_t racy_after =
+        static_cast<int64_t>(now.tv_sec) * 1000000000 + now.tv_nsec - kRacyWindowNs;
+    std::vector<Scanned> files;
+    walk(root.get(), "", files);
+    std::sort(files.begin(), files.end(),
+              [](const Scanned& a, const Scanned& b) { return a.entry.path < b.entry.path; });
+
+    std::vector<size_t> todo;
+    for (size_t i = 0; i < files.size(); ++i)
+        if (!cache || !cache->lookup(files[i].key, files[i].entry.hash))
+            todo.push_back(i);
+
+    TaskGroup group(pool);
+    for (size_t start = 0; start < todo.size(); start += kHashBatch) {
+        group.run([&files, &todo, &root, start] {
+            size_t end = std::min(todo.size(), start + kHashBatch);
+            for (size_t i = start; i < end; ++i) {
+                ManifestEntry& e = files[todo[i]].entry;
+                Fd f(::openat(root.get(), e.path.c_str(), O_RDONLY | O_NOFOLLOW | O_CLOEXEC));
+                if (!f)
+                    throw_errno("open " + e.path);
+                StageTimer t(Stage::Hash, e.size);
+                e.hash = content_hash(f.get(), e.size);
+            }
+        });
+    }
+    group.wait();
+
+    std::vector<ManifestEntry> entries;
+    entries.reserve(files.size());
+    if (cache) {
+        for (size_t i : todo) {
+            const HashCache::Key& k = files[i].key;
+            if (k.mtime_ns < racy_after && k.ctime_ns < racy_after)
+                cache->store(k, files[i].entry.hash);
+        }
+        cache->flush();
+    }
+    for (Scanned& f : files)
+        entries.push_back(std::move(f.entry));
+    return entries;
+}
+
+} // namespace TcpTransfer
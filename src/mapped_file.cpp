@@ -0,0 +1,107 @@
+#include "tcptransfer/mapped_file.h"
+
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include <algorithm>
+#include <cerrno>
+
+#include "tcptransfer/error.h"
+#include "tcptransfer/metrics.h"
+#include "tcptransfer/trace.h"
+
+namespace TcpTransfer {
+
+namespace {
+
+size_t page_size() {
+    static const size_t size = static_cast<size_t>(::sysconf(_SC_PAGESIZE));
+    return size;
+}
+
+size_t page_down(size_t n) { return n & ~(page_size() - 1); }
+
+size_t page_up(size_t n) { return page_down(n + page_size() - 1); }
+
+uint64_t file_size(int fd) {
+    struct stat st;
+    if (::fstat(fd, &st) != 0)
+        throw_errno("fstat");
+    return static_cast<uint64_t>(st.st_size);
+}
+
+} // namespace
+
+MappedFile::MappedFile(int fd, uint64_t offset, size_t length, size_t window)
+    : fd_(fd), offset_(offset), length_(length), window_(page_up(std::max<size_t>(window, 1))) {
+    if (length_ == 0)
+        return;
+    if (file_size(fd_) < offset_ + length_)
+        throw Error("file shrank before it could be mapped");
+    uint64_t map_off = offset_ & ~static_cast<uint64_t>(page_size() - 1);
+    lead_ = static_cast<size_t>(offset_ - map_off);
+    map_len_ = lead_ + length_;
+    // A range that fits one window is faulted in up front; a longer one is
+    // read ahead window by window from advance().
+    int flags = MAP_PRIVATE | (map_len_ <= window_ ? MAP_POPULATE : 0);
+    void* p = ::mmap(nullptr, map_len_, PROT_READ, flags, fd_, static_cast<off_t>(map_off));
+    if (p != MAP_FAILED) {
+        base_ = static_cast<unsigned char*>(p);
+        data_ = base_ + lead_;
+        ::madvise(base_, map_len_, MADV_SEQUENTIAL);
+        if (map_len_ > window_)
+            read_ahead(window_);
+        else
+            advised_ = map_len_;
+        return;
+    }
+    // Not mappable (e.g. a pipe or some FUSE files): fall back to a read.
+    TCPTRANSFER_TRACE_SPAN("map_fallback", length_);
+    StageTimer t(Stage::DiskRead, length_);
+    fallback_.resize(length_);
+    size_t got = 0;
+    while (got < length_) {
+        ssize_t r = ::pread(fd_, fallback_.data() + got, length_ - got,
+                            static_cast<off_t>(offset_ + got));
+        if (r < 0 && errno == EINTR)
+            continue;
+        if (r < 0)
+            throw_errno("pread");
+        if (r == 0)
+            throw Error("file shrank while being read");
+        got += static_cast<size_t>(r);
+    }
+    data_ = fallback_.data();
+}
+
+MappedFile::~MappedFile() {
+    if (base_ && released_ < map_len_)
+        ::munmap(base_ + released_, map_len_ - released_);
+}
+
+void MappedFile::read_ahead(size_t upto) {
+    upto = std::min(page_up(upto), page_up(map_len_));
+    if (upto <= advised_)
+        return;
+    // Once per window: a truncated file would SIGBUS on the next fault.
+    if (file_size(fd_) < offset_ + length_)
+        throw Error("file shrank during scan");
+    ::madvise(base_ + advised_, upto - advised_, MADV_WILLNEED);
+    advised_ = upto;
+}
+
+void MappedFile::advance(size_t pos) {
+    if (!base_)
+        return;
+    size_t at = lead_ + std::min(pos, length_);
+    if (at + window_ > advised_)
+        read_ahead(at + 2 * window_);
+    size_t behind = page_down(at);
+    if (behind >= released_ + window_) {
+        ::munmap(base_ + released_, behind - released_);
+        released_ = behind;
+    }
+}
+
+} // namespace TcpTransfer
@@ -0,0 +1,185 @@
+#include "tcptransfer/metrics.h"
+
+#include <algorithm>
+#include <cstdio>
+
+namespace TcpTransfer {
+
+namespace detail {
+
+namespace {
+
+std::atomic<ThreadBlock*> g_blocks{nullptr};
+
+/// Returns the block to the free list when its thread exits; the counts stay
+/// so process totals never go backwards.
+struct BlockRelease {
+    ThreadBlock* block = nullptr;
+    ~BlockRelease() {
+        if (block)
+            block->in_use.store(false, std::memory_order_release);
+        tls_block = nullptr;
+    }
+};
+
+thread_local BlockRelease t_release;
+
+} // namespace
+
+ThreadBlock& acquire_thread_block() {
+    for (ThreadBlock* b = g_blocks.load(std::memory_order_acquire); b; b = b->next) {
+        bool expected = false;
+        if (!b->in_use.load(std::memory_order_relaxed) &&
+            b->in_use.compare_exchange_strong(expected, true, std::memory_order_acquire)) {
+            tls_block = t_release.block = b;
+            return *b;
+        }
+    }
+    auto* b = new ThreadBlock; // never freed: readers walk the list lock-free
+    b->in_use.store(true, std::memory_order_relaxed);
+    ThreadBlock* head = g_blocks.load(std::memory_order_relaxed);
+    do {
+        b->next = head;
+    } while (!g_blocks.compare_exchange_weak(head, b, std::memory_order_release,
+                                             std::memory_order_relaxed));
+    tls_block = t_release.block = b;
+    return *b;
+}
+
+} // namespace detail
+
+const char* stage_name(Stage s) {
+    switch (s) {
+    case Stage::Accept: return "accept";
+    case Stage::Handshake: return "handshake";
+    case Stage::DiskRead: return "disk_read";
+    case Stage::Hash: return "hash";
+    case Stage::Compress: return "compress";
+    case Stage::Send: return "send";
+    case Stage::Receive: return "receive";
+    case Stage::Write: return "write";
+    case Stage::Fsync: return "fsync";
+    case Stage::Count: break;
+    }
+    return "unknown";
+}
+
+uint64_t StageSummary::quantile(double q) const {
+    if (ops == 0)
+        return 0;
+    auto rank = static_cast<uint64_t>(q * static_cast<double>(ops));
+    if (rank >= ops)
+        rank = ops - 1;
+    uint64_t seen = 0;
+    for (size_t i = 0; i < buckets.size(); ++i) {
+        seen += buckets[i];
+        if (seen > rank) {
+            uint64_t lo = HistogramLayout::lower(i);
+            if (i + 1 == buckets.size())
+                return lo;
+            uint64_t hi = HistogramLayout::lower(i + 1);
+            return std::min(max_ns, lo + (hi - lo) / 2);
+        }
+    }
+    return max_ns;
+}
+
+MetricsSnapshot collect_metrics() {
+    MetricsSnapshot snap;
+    for (auto* b = detail::g_blocks.load(std::memory_order_acquire); b; b = b->next) {
+        for (size_t s = 0; s < kStageCount; ++s) {
+            const detail::StageCounters& c = b->stages[s];
+            StageSummary& out = snap.stages[s];
+            out.ops += c.ops.load(std::memory_order_relaxed);
+            out.bytes += c.bytes.load(std::memory_order_relaxed);
+            out.total_ns += c.total_ns.load(std::memory_order_relaxed);
+            out.max_ns = std::max(out.max_ns, c.max_ns.load(std::memory_order_relaxed));
+            for (size_t i = 0; i < HistogramLayout::kBuckets; ++i)
+                out.buckets[i] += c.buckets[i].load(std::memory_order_relaxed);
+        }
+    }
+    for (StageSummary& s : snap.stages) {
+        // Counters are read racily; keep ops consistent with the histogram.
+        uint64_t n = 0;
+        for (uint64_t v : s.buckets)
+            n += v;
+        s.ops = n;
+        s.p50_ns = s.quantile(0.50);
+        s.p90_ns = s.quantile(0.90);
+        s.p99_ns = s.quantile(0.99);
+    }
+    return snap;
+}
+
+namespace {
+
+void appendf(std::string& out, const char* fmt, const char* a, double v) {
+    char line[256];
+    int n = std::snprintf(line, sizeof(line), fmt, a, v);
+    if (n > 0)
+        out.append(line, std::min<size_t>(static_cast<size_t>(n), sizeof(line) - 1));
+}
+
+} // namespace
+
+std::string format_prometheus(const MetricsSnapshot& snap) {
+    std::string out;
+    out += "# HELP tcptransfer_stage_seconds Time spent in each hot-path stage.\n"
+           "# TYPE tcptransfer_stage_seconds summary\n";
+    for (size_t i = 0; i < kStageCount; ++i) {
+        const StageSummary& s = snap.stages[i];
+        const char* name = stage_name(static_cast<Stage>(i));
+        appendf(out, "tcptransfer_stage_seconds{stage=\"%s\",quantile=\"0.5\"} %.9g\n", name,
+                static_cast<double>(s.p50_ns) / 1e9);
+        appendf(out, "tcptransfer_stage_seconds{stage=\"%s\",quantile=\"0.9\"} %.9g\n", name,
+                static_cast<double>(s.p90_ns) / 1e9);
+        appendf(out, "tcptransfer_stage_seconds{stage=\"%s\",quantile=\"0.99\"} %.9g\n", name,
+                static_cast<double>(s.p99_ns) / 1e9);
+        appendf(out, "tcptransfer_stage_seconds{stage=\"%s\",quantile=\"1\"} %.9g\n", name,
+                static_cast<double>(s.max_ns) / 1e9);
+        appendf(out, "tcptransfer_stage_seconds_sum{stage=\"%s\"} %.9g\n", name,
+                static_cast<double>(s.total_ns) / 1e9);
+        appendf(out, "tcptransfer_stage_seconds_count{stage=\"%s\"} %.17g\n", name,
+                static_cast<double>(s.ops));
+    }
+    out += "# HELP tcptransfer_stage_bytes_total Bytes moved through each stage.\n"
+           "# TYPE tcptransfer_stage_bytes_total counter\n";
+    for (size_t i = 0; i < kStageCount; ++i)
+        appendf(out, "tcptransfer_stage_bytes_total{stage=\"%s\"} %.17g\n",
+                stage_name(static_cast<Stage>(i)), static_cast<double>(snap.stages[i].bytes));
+    return out;
+}
+
+std::string escape_label_value(const std::string& v) {
+    std::string out;
+    out.reserve(v.size());
+    for (char ch : v) {
+        if (ch == '\\' || ch == '"')
+            out += '\\';
+        if (ch == '\n') {
+            out += "\\n";
+            continue;
+        }
+        out += ch;
+    }
+    return out;
+}
+
+std::string format_socket_metrics(const SocketStats& s, const std::string& labels) {
+    const char* l = labels.c_str();
+    std::string out;
+    appendf(out, "tcptransfer_socket_sndbuf_bytes{%s} %.17g\n", l, s.sndbuf);
+    appendf(out, "tcptransfer_socket_rcvbuf_bytes{%s} %.17g\n", l, s.rcvbuf);
+    appendf(out, "tcptransfer_socket_notsent_lowat_bytes{%s} %.17g\n", l, s.notsent_lowat);
+    appendf(out, "tcptransfer_socket_nodelay{%s} %.17g\n", l, s.nodelay ? 1 : 0);
+    appendf(out, "tcptransfer_socket_buffers_pinned{%s} %.17g\n", l, s.buffers_pinned ? 1 : 0);
+    appendf(out, "tcptransfer_socket_rtt_seconds{%s} %.9g\n", l, s.rtt_us / 1e6);
+    appendf(out, "tcptransfer_socket_rttvar_seconds{%s} %.9g\n", l, s.rttvar_us / 1e6);
+    appendf(out, "tcptransfer_socket_rcv_rtt_seconds{%s} %.9g\n", l, s.rcv_rtt_us / 1e6);
+    appendf(out, "tcptransfer_socket_cwnd_segments{%s} %.17g\n", l, s.snd_cwnd);
+    appendf(out, "tcptransfer_socket_mss_bytes{%s} %.17g\n", l, s.snd_mss);
+    appendf(out, "tcptransfer_socket_retrans_total{%s} %.17g\n", l, s.total_retrans);
+    return out;
+}
+
+} // namespace TcpTransfer
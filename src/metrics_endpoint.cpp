@@ -0,0 +1,127 @@
+#include "tcptransfer/metrics_endpoint.h"
+
+#include <poll.h>
+#include <sys/eventfd.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/un.h>
+#include <unistd.h>
+
+#include <cerrno>
+#include <cstring>
+
+#include "tcptransfer/error.h"
+#include "tcptransfer/metrics.h"
+
+namespace TcpTransfer {
+
+namespace {
+
+constexpr char kUnixPrefix[] = "unix:";
+constexpr size_t kMaxRequest = 8 << 10;
+constexpr int kRequestTimeoutMs = 1000;
+
+Fd listen_unix(const std::string& path) {
+    sockaddr_un addr{};
+    if (path.empty() || path.size() >= sizeof(addr.sun_path))
+        throw Error("bad unix socket path: " + path);
+    // Replace a stale socket from a previous run, but never another file.
+    struct stat st{};
+    if (::lstat(path.c_str(), &st) == 0 && S_ISSOCK(st.st_mode))
+        ::unlink(path.c_str());
+    Fd fd(::socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0));
+    if (!fd)
+        throw_errno("socket");
+    addr.sun_family = AF_UNIX;
+    std::memcpy(addr.sun_path, path.data(), path.size());
+    if (::bind(fd.get(), reinterpret_cast<sockaddr*>(&addr), sizeof(addr)) != 0)
+        throw_errno("bind " + path);
+    if (::listen(fd.get(), 16) != 0)
+        throw_errno("listen");
+    return fd;
+}
+
+} // namespace
+
+MetricsEndpoint::MetricsEndpoint(const std::string& listen, Source extra)
+    : stopfd_(::eventfd(0, EFD_CLOEXEC)), extra_(std::move(extra)) {
+    if (!stopfd_)
+        throw_errno("eventfd");
+    if (listen.rfind(kUnixPrefix, 0) == 0) {
+        unix_path_ = listen.substr(sizeof(kUnixPrefix) - 1);
+        listener_ = listen_unix(unix_path_);
+    } else {
+        Endpoint ep = Endpoint::parse(listen);
+        listener_ = listen_tcp(ep.host, ep.port, 16);
+        port_ = local_port(listener_.get());
+    }
+    thread_ = std::thread([this] { serve(); });
+}
+
+MetricsEndpoint::~MetricsEndpoint() {
+    uint64_t one = 1;
+    ssize_t n = ::write(stopfd_.get(), &one, sizeof(one));
+    (void)n;
+    if (thread_.joinable())
+        thread_.join();
+    if (!unix_path_.empty())
+        ::unlink(unix_path_.c_str());
+}
+
+std::string MetricsEndpoint::render() const {
+    std::string body = format_prometheus(collect_metrics());
+    if (extra_)
+        body += extra_();
+    return body;
+}
+
+void MetricsEndpoint::serve() {
+    for (;;) {
+        pollfd p[2] = {{listener_.get(), POLLIN, 0}, {stopfd_.get(), POLLIN, 0}};
+        if (::poll(p, 2, -1) < 0) {
+            if (errno == EINTR)
+                continue;
+            return;
+        }
+        if (p[1].revents)
+            return;
+        Fd conn(::accept4(listener_.get(), nullptr, nullptr, SOCK_CLOEXEC));
+        if (!conn)
+            continue;
+        try {
+            answer(conn.get());
+        } catch (const std::exception&) {
+            // A scraper that goes away mid-response is not our problem.
+        }
+    }
+}
+
+void MetricsEndpoint::answer(int fd) const {
+    // Read the request head; any path is answered with the full exposition.
+    std::string req;
+    char buf[1024];
+    while (req.find("\r\n\r\n") == std::string::npos && req.find("\n\n") == std::string::npos &&
+           req.size() < kMaxRequest) {
+        pollfd p{fd, POLLIN, 0};
+        if (::poll(&p, 1, kRequestTimeoutMs) <= 0)
+            return;
+        ssize_t n = ::recv(fd, buf, sizeof(buf), 0);
+        if (n <= 0)
+            return;
+        req.append(buf, static_cast<size_t>(n));
+    }
+    std::string head;
+    std::string body;
+    if (req.rfind("GET ", 0) == 0) {
+        body = render();
+        head = "HTTP/1.0 200 OK\r\nContent-Type: text/plain; version=0.0.4\r\n";
+    } else {
+        body = "method not allowed\n";
+        head = "HTTP/1.0 405 Method Not Allowed\r\nContent-Type: text/plain\r\n";
+    }
+    head += "Content-Length: " + std::to_string(body.size()) + "\r\nConnection: close\r\n\r\n";
+    write_full(fd, head.data(), head.size());
+    write_full(fd, body.data(), body.size());
+}
+
+} // namespace TcpTransfer
@@ -0,0 +1,138 @@
+#include "tcptransfer/path_util.h"
+
+#include <cstdint>
+#include <cstring>
+
+#if defined(__SSE2__)
+#include <emmintrin.h>
+#endif
+
+namespace TcpTransfer {
+
+namespace {
+
+// Paths are classified 64 bytes at a time into bitmasks, bit i standing for
+// byte i: bytes never allowed, slashes and dots. The structural rules (no
+// empty, "." or ".." components) are then shifts and ANDs over the masks,
+// so a path costs a few instructions per 64 bytes whatever its shape.
+
+struct Classes {
+    uint64_t bad = 0; ///< Control bytes (NUL included), DEL and '\'.
+    uint64_t slash = 0;
+    uint64_t dot = 0;
+};
+
+constexpr size_t kBlock = 64;
+
+#if defined(__SSE2__)
+Classes classify(const char* p) {
+    const __m128i ctl = _mm_set1_epi8(0x1f);
+    const __m128i del = _mm_set1_epi8(0x7f);
+    const __m128i backslash = _mm_set1_epi8('\\');
+    const __m128i slash = _mm_set1_epi8('/');
+    const __m128i dot = _mm_set1_epi8('.');
+    Classes c;
+    for (int i = 0; i < 4; ++i) {
+        __m128i x = _mm_loadu_si128(reinterpret_cast<const __m128i*>(p + 16 * i));
+        // x <= 0x1f unsigned: max(x, 0x1f) is then 0x1f.
+        __m128i bad = _mm_or_si128(_mm_cmpeq_epi8(_mm_max_epu8(x, ctl), ctl),
+                                   _mm_or_si128(_mm_cmpeq_epi8(x, del),
+                                                _mm_cmpeq_epi8(x, backslash)));
+        const int shift = 16 * i;
+        c.bad |= static_cast<uint64_t>(static_cast<uint16_t>(_mm_movemask_epi8(bad))) << shift;
+        c.slash |= static_cast<uint64_t>(
+                       static_cast<uint16_t>(_mm_movemask_epi8(_mm_cmpeq_epi8(x, slash))))
+                   << shift;
+        c.dot |= static_cast<uint64_t>(
+                     static_cast<uint16_t>(_mm_movemask_epi8(_mm_cmpeq_epi8(x, dot))))
+                 << shift;
+    }
+    return c;
+}
+#else
+Classes classify(const char* p) {
+    Classes c;
+    for (size_t i = 0; i < kBlock; ++i) {
+        auto ch = static_cast<unsigned char>(p[i]);
+        uint64_t bit = uint64_t{1} << i;
+        if (ch < 0x20 || ch == 0x7f || ch == '\\')
+            c.bad |= bit;
+        else if (ch == '/')
+            c.slash |= bit;
+        else if (ch == '.')
+            c.dot |= bit;
+    }
+    return c;
+}
+#endif
+
+/// Classifies p[off, off + 64), padding past the end with a harmless byte.
+Classes classify_at(std::string_view p, size_t off) {
+    if (p.size() - off >= kBlock)
+        return classify(p.data() + off);
+    char tail[kBlock];
+    std::memset(tail, 'a', sizeof(tail));
+    std::memcpy(tail, p.data() + off, p.size() - off);
+    return classify(tail);
+}
+
+bool dot_name(std::string_view c) { return c == "." || c == ".."; }
+
+} // namespace
+
+bool is_safe_relative_path(std::string_view p) {
+    if (p.empty())
+        return true;
+    if (p.size() > 4096)
+        return false;
+    // Carried from the previous block: whether its last one or two bytes
+    // were dots and component starts. The byte before the path counts as a
+    // slash, so the path opens a component.
+    uint64_t prev_dot = 0, prev_start = 0, prev_slash_top = 1;
+    for (size_t off = 0; off < p.size(); off += kBlock) {
+        Classes c = classify_at(p, off);
+        if (c.bad)
+            return false;
+        uint64_t start = (c.slash << 1) | prev_slash_top; // byte follows a slash
+        // A slash that starts a component: leading '/' or "//".
+        if (c.slash & start)
+            return false;
+        // A slash that closes "." or "..".
+        uint64_t dot1 = (c.dot << 1) | (prev_dot >> 63);
+        uint64_t dot2 = (c.dot << 2) | (prev_dot >> 62);
+        uint64_t start1 = (start << 1) | (prev_start >> 63);
+        uint64_t start2 = (start << 2) | (prev_start >> 62);
+        if (c.slash & dot1 & (start1 | (dot2 & start2)))
+            return false;
+        prev_dot = c.dot;
+        prev_start = start;
+        prev_slash_top = c.slash >> 63;
+    }
+    // The last component has no slash after it. A single trailing slash
+    // ("a/b/") leaves it empty, which is fine.
+    size_t slash = p.rfind('/');
+    return !dot_name(p.substr(slash == std::string_view::npos ? 0 : slash + 1));
+}
+
+bool is_safe_file_name(std::string_view name) {
+    if (name.empty() || name.size() > 255 || dot_name(name))
+        return false;
+    for (size_t off = 0; off < name.size(); off += kBlock) {
+        Classes c = classify_at(name, off);
+        if (c.bad | c.slash)
+            return false;
+    }
+    return true;
+}
+
+std::string join_path(std::string_view a, std::string_view b) {
+    std::string out(a);
+    while (!out.empty() && out.back() == '/')
+        out.pop_back();
+    if (!out.empty() && !b.empty())
+        out.push_back('/');
+    out.append(b);
+    return out;
+}
+
+} // namespace TcpTransfer
@@ -0,0 +1,28 @@
+#include "tcptransfer/pipeline.h"
+
+namespace TcpTransfer {
+
+namespace {
+
+template <typename Checksum, typename Delta>
+ChunkFn with_codec(Codec codec) {
+    switch (codec) {
+    case Codec::Zlib:
+        return &Pipeline<Checksum, CodecStage<Codec::Zlib>, NoCipher, Delta>::run;
+    case Codec::None:
+        break;
+    }
+    return &Pipeline<Checksum, CodecStage<Codec::None>, NoCipher, Delta>::run;
+}
+
+} // namespace
+
+ChunkFn select_pipeline(bool checksum, Codec codec, bool delta) {
+    if (delta)
+        return with_codec<NoChecksum, DeltaLiterals>(codec);
+    if (checksum)
+        return with_codec<Crc32Checksum, WholeFile>(codec);
+    return with_codec<NoChecksum, WholeFile>(codec);
+}
+
+} // namespace TcpTransfer
@@ -0,0 +1,448 @@
+#include "tcptransfer/protocol.h"
+
+#include <algorithm>
+
+namespace TcpTransfer {
+
+void encode_header(const FrameHeader& h, char out[kFrameHeaderSize]) {
+    std::string s;
+    s.reserve(kFrameHeaderSize);
+    WireWriter w(s);
+    w.u16(kFrameMagic);
+    w.u8(static_cast<uint8_t>(h.type));
+    w.u8(h.flags);
+    w.u32(h.stream);
+    w.u32(h.length);
+    w.u32(h.aux);
+    std::memcpy(out, s.data(), kFrameHeaderSize);
+}
+
+FrameHeader decode_header(const char in[kFrameHeaderSize]) {
+    WireReader r(in, kFrameHeaderSize);
+    if (r.u16() != kFrameMagic)
+        throw ProtocolError("bad frame magic");
+    FrameHeader h;
+    h.type = static_cast<FrameType>(r.u8());
+    h.flags = r.u8();
+    h.stream = r.u32();
+    h.length = r.u32();
+    h.aux = r.u32();
+    if (h.length > kMaxFramePayload)
+        throw ProtocolError("frame payload too large");
+    return h;
+}
+
+std::string make_frame(FrameType type, uint32_t stream, std::string_view payload,
+                       uint8_t flags, uint32_t aux) {
+    std::string out(kFrameHeaderSize, '\0');
+    encode_header({type, flags, stream, static_cast<uint32_t>(payload.size()), aux}, out.data());
+    out.append(payload.data(), payload.size());
+    return out;
+}
+
+std::string HelloMsg::encode() const {
+    std::string s;
+    WireWriter w(s);
+    w.u16(version);
+    w.str(token);
+    w.str(client_id);
+    return s;
+}
+
+HelloMsg HelloMsg::decode(std::string_view p) {
+    WireReader r(p);
+    HelloMsg m;
+    m.version = r.u16();
+    m.token = r.str();
+    m.client_id = r.str();
+    return m;
+}
+
+std::string HelloAckMsg::encode() const {
+    std::string s;
+    WireWriter w(s);
+    w.u16(version);
+    w.u32(max_payload);
+    return s;
+}
+
+HelloAckMsg HelloAckMsg::decode(std::string_view p) {
+    WireReader r(p);
+    HelloAckMsg m;
+    m.version = r.u16();
+    m.max_payload = r.u32();
+    return m;
+}
+
+std::string PutBeginMsg::encode() const {
+    std::string s;
+    WireWriter w(s);
+    w.str(remote_dir);
+    w.str(name);
+    w.u64(size);
+    w.u32(mode);
+    w.i64(mtime_ns);
+    w.u32(flags);
+    w.u8(static_cast<uint8_t>(priority));
+    w.u32(deadline_ms);
+    w.u8(fec_data);
+    w.u8(fec_parity);
+    w.u32(fec_chunk);
+    w.u32(static_cast<uint32_t>(relay.size()));
+    for (const std::string& hop : relay)
+        w.str(hop);
+    w.u32(static_cast<uint32_t>(mirrors.size()));
+    for (const std::string& dir : mirrors)
+        w.str(dir);
+    w.u64(stripe_key);
+    w.u8(stripes);
+    return s;
+}
+
+PutBeginMsg PutBeginMsg::decode(std::string_view p) {
+    WireReader r(p);
+    PutBeginMsg m;
+    m.remote_dir = r.str();
+    m.name = r.str();
+    m.size = r.u64();
+    m.mode = r.u32();
+    m.mtime_ns = r.i64();
+    m.flags = r.u32();
+    if (r.remaining() > 0) {
+        m.priority = static_cast<Priority>(std::min<uint8_t>(r.u8(), 2));
+        m.deadline_ms = r.u32();
+    }
+    if (r.remaining() > 0) {
+        m.fec_data = r.u8();
+        m.fec_parity = r.u8();
+        m.fec_chunk = r.u32();
+    }
+    if (r.remaining() > 0) {
+        for (auto* list : {&m.relay, &m.mirrors}) {
+            uint32_t n = r.u32();
+            if (r.remaining() / 4 < n)
+                throw ProtocolError("truncated put begin");
+            list->resize(n);
+            for (std::string& s : *list)
+                s = r.str();
+        }
+    }
+    if (r.remaining() > 0) {
+        m.stripe_key = r.u64();
+        m.stripes = r.u8();
+    }
+    return m;
+}
+
+std::string PutEndMsg::encode() const {
+    std::string s;
+    WireWriter w(s);
+    w.u32(crc32);
+    return s;
+}
+
+PutEndMsg PutEndMsg::decode(std::string_view p) {
+    WireReader r(p);
+    PutEndMsg m;
+    m.crc32 = r.u32();
+    return m;
+}
+
+std::string DataAckMsg::encode() const {
+    std::string s;
+    WireWriter w(s);
+    w.u64(committed);
+    w.u32(write_us);
+    return s;
+}
+
+DataAckMsg DataAckMsg::decode(std::string_view p) {
+    WireReader r(p);
+    DataAckMsg m;
+    m.committed = r.u64();
+    m.write_us = r.u32();
+    return m;
+}
+
+std::string SignaturesMsg::encode() const {
+    std::string s;
+    s.reserve(16 + blocks.size() * 12);
+    WireWriter w(s);
+    w.u32(block_size);
+    w.u64(basis_size);
+    w.u32(static_cast<uint32_t>(blocks.size()));
+    for (const BlockSignature& b : blocks) {
+        w.u32(b.weak);
+        w.u64(b.strong);
+    }
+    return s;
+}
+
+SignaturesMsg SignaturesMsg::decode(std::string_view p) {
+    WireReader r(p);
+    SignaturesMsg m;
+    m.block_size = r.u32();
+    m.basis_size = r.u64();
+    uint32_t n = r.u32();
+    if (r.remaining() / 12 < n)
+        throw ProtocolError("truncated signature list");
+    m.blocks.resize(n);
+    for (BlockSignature& b : m.blocks) {
+        b.weak = r.u32();
+        b.strong = r.u64();
+    }
+    return m;
+}
+
+std::string CopyMsg::encode() const {
+    std::string s;
+    WireWriter w(s);
+    w.u64(offset);
+    w.u64(source);
+    w.u64(length);
+    return s;
+}
+
+CopyMsg CopyMsg::decode(std::string_view p) {
+    WireReader r(p);
+    CopyMsg m;
+    m.offset = r.u64();
+    m.source = r.u64();
+    m.length = r.u64();
+    return m;
+}
+
+std::string ManifestMsg::encode() const {
+    std::string s;
+    WireWriter w(s);
+    w.str(remote_dir);
+    w.u32(first);
+    w.u8(last ? 1 : 0);
+    w.u32(static_cast<uint32_t>(entries.size()));
+    for (const ManifestEntry& e : entries) {
+        w.str(e.path);
+        w.u64(e.size);
+        w.i64(e.mtime_ns);
+        w.u64(e.hash);
+    }
+    return s;
+}
+
+ManifestMsg ManifestMsg::decode(std::string_view p) {
+    WireReader r(p);
+    ManifestMsg m;
+    m.remote_dir = r.str();
+    m.first = r.u32();
+    m.last = r.u8() != 0;
+    uint32_t n = r.u32();
+    if (r.remaining() / 28 < n)
+        throw ProtocolError("truncated manifest");
+    m.entries.resize(n);
+    for (ManifestEntry& e : m.entries) {
+        e.path = r.str();
+        e.size = r.u64();
+        e.mtime_ns = r.i64();
+        e.hash = r.u64();
+    }
+    return m;
+}
+
+std::string ManifestDiffMsg::encode() const {
+    std::string s;
+    s.reserve(9 + changed.size() * 4);
+    WireWriter w(s);
+    w.u32(first);
+    w.u8(last ? 1 : 0);
+    w.u32(static_cast<uint32_t>(changed.size()));
+    for (uint32_t i : changed)
+        w.u32(i);
+    return s;
+}
+
+ManifestDiffMsg ManifestDiffMsg::decode(std::string_view p) {
+    WireReader r(p);
+    ManifestDiffMsg m;
+    m.first = r.u32();
+    m.last = r.u8() != 0;
+    uint32_t n = r.u32();
+    if (r.remaining() / 4 < n)
+        throw ProtocolError("truncated manifest diff");
+    m.changed.resize(n);
+    for (uint32_t& i : m.changed)
+        i = r.u32();
+    return m;
+}
+
+std::string BundleMsg::encode() const {
+    std::string s;
+    size_t bytes = remote_dir.size() + 12;
+    for (const BundleEntry& f : files)
+        bytes += f.path.size() + f.data.size() + 28;
+    s.reserve(bytes);
+    WireWriter w(s);
+    w.str(remote_dir);
+    w.u32(flags);
+    w.u32(static_cast<uint32_t>(files.size()));
+    for (const BundleEntry& f : files) {
+        w.str(f.path);
+        w.u32(f.mode);
+        w.i64(f.mtime_ns);
+        w.u32(f.crc32);
+        w.str(f.data);
+    }
+    return s;
+}
+
+BundleMsg BundleMsg::decode(std::string_view p) {
+    WireReader r(p);
+    BundleMsg m;
+    m.remote_dir = r.str();
+    m.flags = r.u32();
+    uint32_t n = r.u32();
+    if (r.remaining() / 24 < n)
+        throw ProtocolError("truncated bundle");
+    m.files.resize(n);
+    for (BundleEntry& f : m.files) {
+        f.path = r.str();
+        f.mode = r.u32();
+        f.mtime_ns = r.i64();
+        f.crc32 = r.u32();
+        f.data = r.view();
+    }
+    return m;
+}
+
+std::string ParityMsg::encode() const {
+    std::string s;
+    s.reserve(shard.size() + data_crcs.size() * 4 + 17);
+    WireWriter w(s);
+    w.u64(group);
+    w.u8(index);
+    w.u32(crc32);
+    w.u32(static_cast<uint32_t>(data_crcs.size()));
+    for (uint32_t c : data_crcs)
+        w.u32(c);
+    s.append(shard);
+    return s;
+}
+
+ParityMsg ParityMsg::decode(std::string_view p) {
+    WireReader r(p);
+    ParityMsg m;
+    m.group = r.u64();
+    m.index = r.u8();
+    m.crc32 = r.u32();
+    uint32_t n = r.u32();
+    if (r.remaining() / 4 < n)
+        throw ProtocolError("truncated parity");
+    m.data_crcs.resize(n);
+    for (uint32_t& c : m.data_crcs)
+        c = r.u32();
+    m.shard = std::string_view(r.pos(), r.remaining());
+    return m;
+}
+
+std::string GetMsg::encode() const {
+    std::string s;
+    WireWriter w(s);
+    w.str(path);
+    w.u64(offset);
+    w.u64(length);
+    w.u32(flags);
+    return s;
+}
+
+GetMsg GetMsg::decode(std::string_view p) {
+    WireReader r(p);
+    GetMsg m;
+    m.path = r.str();
+    m.offset = r.u64();
+    m.length = r.u64();
+    m.flags = r.u32();
+    return m;
+}
+
+std::string GetReadyMsg::encode() const {
+    std::string s;
+    WireWriter w(s);
+    w.u32(static_cast<uint32_t>(status));
+    w.str(message);
+    w.u64(size);
+    w.u32(mode);
+    w.i64(mtime_ns);
+    w.u64(length);
+    return s;
+}
+
+GetReadyMsg GetReadyMsg::decode(std::string_view p) {
+    WireReader r(p);
+    GetReadyMsg m;
+    m.status = static_cast<Status>(r.u32());
+    m.message = r.str();
+    m.size = r.u64();
+    m.mode = r.u32();
+    m.mtime_ns = r.i64();
+    m.length = r.u64();
+    return m;
+}
+
+std::string GetEndMsg::encode() const {
+    std::string s;
+    WireWriter w(s);
+    w.u32(crc32);
+    return s;
+}
+
+GetEndMsg GetEndMsg::decode(std::string_view p) {
+    WireReader r(p);
+    GetEndMsg m;
+    m.crc32 = r.u32();
+    return m;
+}
+
+std::string StatusMsg::encode() const {
+    std::string s;
+    WireWriter w(s);
+    w.u32(static_cast<uint32_t>(status));
+    w.u64(value);
+    w.str(message);
+    return s;
+}
+
+StatusMsg StatusMsg::decode(std::string_view p) {
+    WireReader r(p);
+    StatusMsg m;
+    m.status = static_cast<Status>(r.u32());
+    m.value = r.u64();
+    m.message = r.str();
+    return m;
+}
+
+std::string BundleAckMsg::encode() const {
+    std::string s;
+    WireWriter w(s);
+    w.u32(static_cast<uint32_t>(results.size()));
+    for (const StatusMsg& m : results) {
+        w.u32(static_cast<uint32_t>(m.status));
+        w.u64(m.value);
+        w.str(m.message);
+    }
+    return s;
+}
+
+BundleAckMsg BundleAckMsg::decode(std::string_view p) {
+    WireReader r(p);
+    BundleAckMsg m;
+    uint32_t n = r.u32();
+    if (r.remaining() / 16 < n)
+        throw ProtocolError("truncated bundle ack");
+    m.results.resize(n);
+    for (StatusMsg& s : m.results) {
+        s.status = static_cast<Status>(r.u32());
+        s.value = r.u64();
+        s.message = r.str();
+    }
+    return m;
+}
+
+} // namespace TcpTransfer
@@ -0,0 +1,130 @@
+#include "tcptransfer/rate_limit.h"
+
+#include <algorithm>
+#include <cctype>
+
+#include "tcptransfer/error.h"
+
+namespace TcpTransfer {
+
+namespace {
+
+constexpr int64_t kNsPerSec = 1000000000;
+
+int64_t to_ns(TokenBucket::Clock::time_point t) {
+    return std::chrono::duration_cast<std::chrono::nanoseconds>(t.time_since_epoch()).count();
+}
+
+/// Nanoseconds that n bytes occupy at rate bytes/s, saturating.
+int64_t bytes_to_ns(uint64_t n, uint64_t rate) {
+    unsigned __int128 ns = static_cast<unsigned __int128>(n) * kNsPerSec / rate;
+    return ns > static_cast<unsigned __int128>(INT64_MAX / 4) ? INT64_MAX / 4
+                                                              : static_cast<int64_t>(ns);
+}
+
+uint64_t parse_bytes(const std::string& s) {
+    size_t used = 0;
+    uint64_t v = 0;
+    try {
+        v = std::stoull(s, &used);
+    } catch (const std::exception&) {
+        throw Error("bad byte count: " + s);
+    }
+    std::string suffix = s.substr(used);
+    if (suffix.empty())
+        return v;
+    switch (std::tolower(static_cast<unsigned char>(suffix[0]))) {
+    case 'k':
+        v <<= 10;
+        break;
+    case 'm':
+        v <<= 20;
+        break;
+    case 'g':
+        v <<= 30;
+        break;
+    default:
+        throw Error("bad byte count: " + s);
+    }
+    if (suffix.size() > 1 && suffix.substr(1) != "b" && suffix.substr(1) != "B")
+        throw Error("bad byte count: " + s);
+    return v;
+}
+
+} // namespace
+
+RateLimit parse_rate_limit(const std::string& s) {
+    RateLimit r;
+    auto slash = s.find('/');
+    r.bytes_per_sec = parse_bytes(s.substr(0, slash));
+    if (slash != std::string::npos)
+        r.burst = parse_bytes(s.substr(slash + 1));
+    return r;
+}
+
+void TokenBucket::set_limit(RateLimit limit) {
+    burst_.store(limit.burst ? limit.burst : limit.bytes_per_sec / 10, std::memory_order_relaxed);
+    rate_.store(limit.bytes_per_sec, std::memory_order_release);
+}
+
+RateLimit TokenBucket::limit() const {
+    return {rate_.load(std::memory_order_acquire), burst_.load(std::memory_order_relaxed)};
+}
+
+TokenBucket::Clock::duration TokenBucket::charge(uint64_t n, Clock::time_point now) {
+    charged_.fetch_add(n, std::memory_order_relaxed);
+    uint64_t rate = rate_.load(std::memory_order_acquire);
+    if (rate == 0)
+        return Clock::duration::zero();
+    const int64_t t = to_ns(now);
+    const int64_t cost = bytes_to_ns(n, rate);
+    const int64_t tolerance = bytes_to_ns(burst_.load(std::memory_order_relaxed), rate);
+    int64_t tat = tat_ns_.load(std::memory_order_relaxed);
+    int64_t next;
+    do {
+        // An idle bucket does not bank credit beyond its burst.
+        next = std::max(tat, t) + cost;
+    } while (!tat_ns_.compare_exchange_weak(tat, next, std::memory_order_relaxed));
+    int64_t debt = next - t - tolerance;
+    return debt > 0 ? std::chrono::nanoseconds(debt) : Clock::duration::zero();
+}
+
+std::vector<uint64_t> weighted_fair_shares(uint64_t capacity, const std::vector<uint32_t>& weights,
+                                           const std::vector<uint64_t>& caps) {
+    const size_t n = weights.size();
+    std::vector<uint64_t> share(n, 0);
+    std::vector<bool> fixed(n, false);
+    uint64_t left = capacity;
+    // Water-filling: fix everyone whose cap is below their weighted share of
+    // what is left, then split the remainder again.
+    for (;;) {
+        uint64_t total_weight = 0;
+        for (size_t i = 0; i < n; ++i)
+            if (!fixed[i])
+                total_weight += std::max<uint32_t>(weights[i], 1);
+        if (total_weight == 0)
+            break;
+        auto fair = [&, pool = left](size_t i) {
+            return static_cast<uint64_t>(static_cast<unsigned __int128>(pool) *
+                                         std::max<uint32_t>(weights[i], 1) / total_weight);
+        };
+        bool capped = false;
+        for (size_t i = 0; i < n; ++i) {
+            if (!fixed[i] && caps[i] != 0 && caps[i] <= fair(i)) {
+                share[i] = caps[i];
+                fixed[i] = true;
+                left -= caps[i];
+                capped = true;
+            }
+        }
+        if (capped)
+            continue;
+        for (size_t i = 0; i < n; ++i)
+            if (!fixed[i])
+                share[i] = std::max<uint64_t>(fair(i), 1);
+        break;
+    }
+    return share;
+}
+
+} // namespace TcpTransfer
@@ -0,0 +1,177 @@
+#include "tcptransfer/relay.h"
+
+#include <sys/socket.h>
+
+#include <algorithm>
+
+#include "tcptransfer/error.h"
+#include "tcptransfer/trace.h"
+
+namespace TcpTransfer {
+
+RelayLink::RelayLink(Endpoint next, HelloMsg hello, std::chrono::milliseconds connect_timeout,
+                     AckHandler on_ack, DrainHandler on_drain)
+    : next_(std::move(next)), hello_(std::move(hello)), connect_timeout_(connect_timeout),
+      on_ack_(std::move(on_ack)), on_drain_(std::move(on_drain)) {
+    sender_ = std::thread([this] { send_loop(); });
+}
+
+RelayLink::~RelayLink() {
+    {
+        std::lock_guard<std::mutex> lk(mu_);
+        stopping_ = true;
+        if (sock_ >= 0)
+            ::shutdown(sock_, SHUT_RDWR);
+    }
+    cv_.notify_all();
+    if (sender_.joinable())
+        sender_.join();
+    if (reader_.joinable())
+        reader_.join();
+}
+
+void RelayLink::forward(const FrameHeader& h, std::string_view payload) {
+    std::string error;
+    {
+        std::lock_guard<std::mutex> lk(mu_);
+        if (error_.empty()) {
+            if (h.type == FrameType::PutBegin)
+                open_.insert(h.stream);
+            queue_.push_back(make_frame(h.type, h.stream, payload, h.flags, h.aux));
+            queued_ += queue_.back().size();
+            above_ = above_ || queued_ >= kHighWater;
+        } else if (h.type == FrameType::PutBegin) {
+            error = error_;
+        } else {
+            return;
+        }
+    }
+    if (error.empty())
+        cv_.notify_one();
+    else
+        on_ack_(h.stream, StatusMsg{Status::IoError, 0, error});
+}
+
+size_t RelayLink::queued() const {
+    std::lock_guard<std::mutex> lk(mu_);
+    return queued_;
+}
+
+void RelayLink::send_loop() {
+    trace_thread_name("relay-send");
+    try {
+        Fd fd = connect_tcp(next_, connect_timeout_);
+        int sock = fd.get();
+        {
+            std::lock_guard<std::mutex> lk(mu_);
+            if (stopping_)
+                return;
+            fd_ = std::move(fd);
+            sock_ = sock;
+        }
+        std::string hello = make_frame(FrameType::Hello, 0, hello_.encode());
+        write_full(sock, hello.data(), hello.size());
+        if (!wait_readable(sock, connect_timeout_))
+            throw Error("handshake timed out");
+        char hdr[kFrameHeaderSize];
+        if (!read_full(sock, hdr, sizeof(hdr)))
+            throw Error("closed during handshake");
+        FrameHeader h = decode_header(hdr);
+        std::string payload(h.length, '\0');
+        if (h.length > 0 && !read_full(sock, payload.data(), h.length))
+            throw Error("closed during handshake");
+        if (h.type == FrameType::Error) {
+            StatusMsg m = StatusMsg::decode(payload);
+            throw Error(std::string(status_name(m.status)) + ": " + m.message);
+        }
+        if (h.type != FrameType::HelloAck ||
+            HelloAckMsg::decode(payload).version != kProtocolVersion)
+            throw Error("bad handshake");
+        reader_ = std::thread([this] { read_loop(); });
+
+        for (;;) {
+            std::string frame;
+            {
+                std::unique_lock<std::mutex> lk(mu_);
+                cv_.wait(lk, [this] { return stopping_ || !error_.empty() || !queue_.empty(); });
+                if (stopping_ || !error_.empty())
+                    return;
+                frame = std::move(queue_.front());
+                queue_.pop_front();
+            }
+            {
+                TCPTRANSFER_TRACE_SPAN("relay_send", frame.size());
+                write_full(sock, frame.data(), frame.size());
+            }
+            bool drained = false;
+            {
+                std::lock_guard<std::mutex> lk(mu_);
+                queued_ -= std::min(queued_, frame.size());
+                if (above_ && queued_ <= kLowWater) {
+                    above_ = false;
+                    drained = true;
+                }
+            }
+            if (drained && on_drain_)
+                on_drain_();
+        }
+    } catch (const std::exception& e) {
+        fail(e.what());
+    }
+}
+
+void RelayLink::read_loop() {
+    trace_thread_name("relay-recv");
+    try {
+        for (;;) {
+            char hdr[kFrameHeaderSize];
+            if (!read_full(sock_, hdr, sizeof(hdr)))
+                throw Error("connection closed");
+            FrameHeader h = decode_header(hdr);
+            std::string payload(h.length, '\0');
+            if (h.length > 0 && !read_full(sock_, payload.data(), h.length))
+                throw Error("connection closed mid-frame");
+            if (h.type == FrameType::Error) {
+                StatusMsg m = StatusMsg::decode(payload);
+                throw Error(std::string(status_name(m.status)) + ": " + m.message);
+            }
+            if (h.type != FrameType::PutAck)
+                continue; // relayed puts ask for nothing else
+            bool known;
+            {
+                std::lock_guard<std::mutex> lk(mu_);
+                known = open_.erase(h.stream) > 0;
+            }
+            if (known)
+                on_ack_(h.stream, StatusMsg::decode(payload));
+        }
+    } catch (const std::exception& e) {
+        fail(e.what());
+    }
+}
+
+void RelayLink::fail(const std::string& why) {
+    std::set<uint32_t> open;
+    std::string error;
+    bool drained;
+    {
+        std::lock_guard<std::mutex> lk(mu_);
+        if (stopping_ || !error_.empty())
+            return;
+        error_ = error = next_.to_string() + ": " + why;
+        open.swap(open_);
+        queue_.clear();
+        queued_ = 0;
+        drained = above_;
+        above_ = false;
+        if (sock_ >= 0)
+            ::shutdown(sock_, SHUT_RDWR);
+    }
+    cv_.notify_all();
+    for (uint32_t stream : open)
+        on_ack_(stream, StatusMsg{Status::IoError, 0, error});
+    if (drained && on_drain_)
+        on_drain_();
+}
+
+} // namespace TcpTransfer
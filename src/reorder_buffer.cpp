@@ -0,0 +1,43 @@
+#include "tcptransfer/reorder_buffer.h"
+
+#include <iterator>
+
+namespace TcpTransfer {
+
+bool ReorderBuffer::insert(uint64_t offset, std::vector<char> data) {
+    const uint64_t end = offset + data.size();
+    auto next = chunks_.lower_bound(offset);
+    if (next != chunks_.end() && next->first < end)
+        return false;
+    if (next != chunks_.begin()) {
+        auto prev = std::prev(next);
+        if (prev->first + prev->second.size() > offset)
+            return false;
+    }
+    bytes_ += data.size();
+    chunks_.emplace_hint(next, offset, std::move(data));
+    return true;
+}
+
+std::vector<ReorderBuffer::Chunk> ReorderBuffer::take_from(uint64_t next) {
+    std::vector<Chunk> run;
+    for (auto it = chunks_.begin(); it != chunks_.end() && it->first == next;
+         it = chunks_.erase(it)) {
+        next += it->second.size();
+        bytes_ -= it->second.size();
+        run.emplace_back(it->first, std::move(it->second));
+    }
+    return run;
+}
+
+std::vector<ReorderBuffer::Chunk> ReorderBuffer::take_all() {
+    std::vector<Chunk> all;
+    all.reserve(chunks_.size());
+    for (auto& [offset, data] : chunks_)
+        all.emplace_back(offset, std::move(data));
+    chunks_.clear();
+    bytes_ = 0;
+    return all;
+}
+
+} // namespace TcpTransfer
@@ -0,0 +1,155 @@
+#include "tcptransfer/resume_journal.h"
+
+#include <fcntl.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include <cerrno>
+
+#include "tcptransfer/error.h"
+#include "tcptransfer/protocol.h"
+#include "tcptransfer/socket.h"
+
+namespace TcpTransfer {
+
+namespace {
+
+constexpr char kTempName[] = ".tcptransfer-journal.tmp";
+constexpr size_t kMaxFileBytes = 64 << 20;
+
+bool read_all(int fd, char* p, size_t n) {
+    while (n > 0) {
+        ssize_t r = ::read(fd, p, n);
+        if (r < 0 && errno == EINTR)
+            continue;
+        if (r <= 0)
+            return false;
+        p += r;
+        n -= static_cast<size_t>(r);
+    }
+    return true;
+}
+
+void write_all(int fd, const char* p, size_t n) {
+    while (n > 0) {
+        ssize_t w = ::write(fd, p, n);
+        if (w < 0 && errno == EINTR)
+            continue;
+        if (w < 0)
+            throw_errno(std::string("write ") + kTempName);
+        p += w;
+        n -= static_cast<size_t>(w);
+    }
+}
+
+} // namespace
+
+void ResumeJournal::record(const std::string& path, const JournalEntry& e) {
+    std::lock_guard<std::mutex> lk(mu_);
+    entries_[path] = e;
+}
+
+std::optional<JournalEntry> ResumeJournal::take(const std::string& path) {
+    std::lock_guard<std::mutex> lk(mu_);
+    auto it = entries_.find(path);
+    if (it == entries_.end())
+        return std::nullopt;
+    JournalEntry e = it->second;
+    entries_.erase(it);
+    return e;
+}
+
+size_t ResumeJournal::size() const {
+    std::lock_guard<std::mutex> lk(mu_);
+    return entries_.size();
+}
+
+std::vector<std::string> ResumeJournal::encode(size_t max_part) const {
+    std::lock_guard<std::mutex> lk(mu_);
+    std::vector<std::string> parts;
+    std::string cur;
+    uint32_t count = 0;
+    std::string body;
+    auto close_part = [&] {
+        if (count == 0)
+            return;
+        cur.clear();
+        WireWriter(cur).u32(count);
+        cur += body;
+        parts.push_back(std::move(cur));
+        body.clear();
+        count = 0;
+    };
+    for (const auto& [path, e] : entries_) {
+        WireWriter w(body);
+        w.str(path);
+        w.u64(e.size);
+        w.i64(e.mtime_ns);
+        w.u64(e.offset);
+        w.u32(e.crc);
+        ++count;
+        if (body.size() >= max_part)
+            close_part();
+    }
+    close_part();
+    return parts;
+}
+
+void ResumeJournal::merge(std::string_view encoded) {
+    WireReader r(encoded);
+    uint32_t n = r.u32();
+    std::vector<std::pair<std::string, JournalEntry>> got;
+    for (uint32_t i = 0; i < n; ++i) {
+        std::string path = r.str();
+        JournalEntry e;
+        e.size = r.u64();
+        e.mtime_ns = r.i64();
+        e.offset = r.u64();
+        e.crc = r.u32();
+        got.emplace_back(std::move(path), e);
+    }
+    std::lock_guard<std::mutex> lk(mu_);
+    for (auto& [path, e] : got)
+        entries_[std::move(path)] = e;
+}
+
+void ResumeJournal::load(int root_fd) {
+    Fd fd(::openat(root_fd, kFileName, O_RDONLY | O_NOFOLLOW | O_CLOEXEC));
+    if (!fd)
+        return;
+    std::string data;
+    struct stat st{};
+    if (::fstat(fd.get(), &st) == 0 && S_ISREG(st.st_mode) &&
+        static_cast<uint64_t>(st.st_size) <= kMaxFileBytes) {
+        data.resize(static_cast<size_t>(st.st_size));
+        if (!read_all(fd.get(), data.data(), data.size()))
+            data.clear();
+    }
+    ::unlinkat(root_fd, kFileName, 0);
+    try {
+        WireReader r(data);
+        while (r.remaining() > 0)
+            merge(r.view());
+    } catch (const ProtocolError&) {
+        // Whatever merged before the damage is still right.
+    }
+}
+
+void ResumeJournal::save(int root_fd) const {
+    std::string data;
+    for (const std::string& part : encode(1 << 20))
+        WireWriter(data).str(part);
+    if (data.empty())
+        return;
+    Fd fd(::openat(root_fd, kTempName, O_WRONLY | O_CREAT | O_TRUNC | O_NOFOLLOW | O_CLOEXEC,
+                   0600));
+    if (!fd)
+        throw_errno(std::string("open ") + kTempName);
+    write_all(fd.get(), data.data(), data.size());
+    if (::fsync(fd.get()) != 0)
+        throw_errno(std::string("fsync ") + kTempName);
+    if (::renameat(root_fd, kTempName, root_fd, kFileName) != 0)
+        throw_errno(std::string("rename ") + kTempName);
+}
+
+} // namespace TcpTransfer
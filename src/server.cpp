@@ -0,0 +1,2753 @@
+#include "tcptransfer/server.h"
+
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/sendfile.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/uio.h>
+#include <unistd.h>
+
+#include <algorithm>
+#include <atomic>
+#include <cerrno>
+#include <cstring>
+#include <deque>
+#include <future>
+#include <limits>
+#include <map>
+#include <optional>
+#include <thread>
+#include <vector>
+
+#include "tcptransfer/checksum.h"
+#include "tcptransfer/codec.h"
+#include "tcptransfer/delta.h"
+#include "tcptransfer/dir_cache.h"
+#include "tcptransfer/dir_index.h"
+#include "tcptransfer/disk_writer.h"
+#include "tcptransfer/erasure.h"
+#include "tcptransfer/error.h"
+#include "tcptransfer/event_loop.h"
+#include "tcptransfer/file_cache.h"
+#include "tcptransfer/handoff.h"
+#include "tcptransfer/lazy.h"
+#include "tcptransfer/metrics.h"
+#include "tcptransfer/metrics_endpoint.h"
+#include "tcptransfer/path_util.h"
+#include "tcptransfer/protocol.h"
+#include "tcptransfer/relay.h"
+#include "tcptransfer/reorder_buffer.h"
+#include "tcptransfer/resume_journal.h"
+#include "tcptransfer/socket.h"
+#include "tcptransfer/thread_pool.h"
+#include "tcptransfer/trace.h"
+
+namespace TcpTransfer {
+
+namespace {
+
+constexpr size_t kReadBufferSize = 256 << 10;
+constexpr size_t kMaxReadPerEvent = 4 << 20;
+/// Per-round read budget of connections outranked by a more urgent one;
+/// keeps them moving without letting them crowd it out.
+constexpr size_t kBackgroundReadSlice = 256 << 10;
+constexpr size_t kOutputHighWater = 4 << 20;
+constexpr size_t kMaxWritePerEvent = 4 << 20;
+/// Received bytes a connection may have queued for the disk writers before
+/// it stops being read; reading resumes at half.
+constexpr size_t kMaxWriteBehind = 16 << 20;
+/// A striped put fails if not all its connections joined within this
+/// (longer than a client's pool acquire timeout).
+constexpr std::chrono::seconds kStripeJoinTimeout{60};
+/// Chunks a striped put may hold waiting for earlier ones; past this it
+/// writes them where they land.
+constexpr size_t kMaxReorderBytes = 64 << 20;
+/// Most file bytes per Data frame of a download; chunks never straddle
+/// an extent of the read cache.
+constexpr size_t kGetChunk = FileCache::kExtentSize;
+/// Read ahead by a blocking worker when a download reaches pages that are
+/// not in the page cache, so the loop's sendfile never waits for the disk.
+constexpr uint64_t kPrefetchWindow = 8 << 20;
+constexpr char kPartSuffix[] = ".tcptransfer-part";
+constexpr size_t kMaxSocketSeries = 64; ///< Connections exported per scrape.
+constexpr auto kRebalanceInterval = std::chrono::milliseconds(100);
+constexpr size_t kCommitBatch = 32; ///< Files finished per metadata pool task.
+constexpr auto kDirCacheTtl = std::chrono::seconds(30);
+constexpr size_t kMaxFecGroupBytes = 64 << 20; ///< Data plus parity of one FEC group.
+constexpr size_t kMaxRelayHops = 64;
+constexpr size_t kMaxMirrors = 16;
+constexpr auto kRelayConnectTimeout = std::chrono::seconds(5);
+constexpr auto kHandoffTimeout = std::chrono::seconds(5); ///< For the other process's messages.
+constexpr auto kHandoffPoll = std::chrono::milliseconds(50); ///< Drain checks while handing off.
+
+std::string part_name(const std::string& name) { return "." + name + kPartSuffix; }
+
+/// Whether [offset, offset + n) of fd is in the page cache. Errs towards
+/// yes when it cannot tell.
+bool resident(int fd, uint64_t offset, size_t n) {
+    static const uint64_t page = static_cast<uint64_t>(::sysconf(_SC_PAGESIZE));
+    const uint64_t start = offset - offset % page;
+    const size_t len = static_cast<size_t>(offset + n - start);
+    void* map = ::mmap(nullptr, len, PROT_READ, MAP_SHARED, fd, static_cast<off_t>(start));
+    if (map == MAP_FAILED)
+        return true;
+    std::vector<unsigned char> pages((len + page - 1) / page);
+    bool all = ::mincore(map, len, pages.data()) != 0 ||
+               std::all_of(pages.begin(), pages.end(), [](unsigned char p) { return p & 1; });
+    ::munmap(map, len);
+    return all;
+}
+
+/// Fills buf from the page cache only; false if any of it would need the disk.
+bool read_nowait(int fd, char* buf, size_t n, uint64_t offset) {
+    while (n > 0) {
+        struct iovec iov{buf, n};
+        ssize_t r = ::preadv2(fd, &iov, 1, static_cast<off_t>(offset), RWF_NOWAIT);
+        if (r < 0 && errno == EINTR)
+            continue;
+        if (r <= 0)
+            return false;
+        buf += r;
+        n -= static_cast<size_t>(r);
+        offset += static_cast<uint64_t>(r);
+    }
+    return true;
+}
+
+/// CRC32 of size bytes of fd from offset.
+uint32_t file_crc(int fd, uint64_t size, uint64_t offset = 0) {
+    std::vector<char> buf(1 << 20);
+    uint32_t crc = 0;
+    uint64_t off = offset;
+    const uint64_t end = offset + size;
+    while (off < end) {
+        size_t want = static_cast<size_t>(std::min<uint64_t>(buf.size(), end - off));
+        ssize_t n;
+        {
+            StageTimer t(Stage::DiskRead);
+            n = ::pread(fd, buf.data(), want, static_cast<off_t>(off));
+            t.set_bytes(n > 0 ? static_cast<uint64_t>(n) : 0);
+        }
+        if (n <= 0)
+            break;
+        StageTimer t(Stage::Hash, static_cast<uint64_t>(n));
+        crc = crc32_update(crc, buf.data(), static_cast<size_t>(n));
+        off += static_cast<uint64_t>(n);
+    }
+    return crc;
+}
+
+/// Writes all of buf at offset; false with errno set on failure.
+bool pwrite_full(int fd, const void* buf, size_t n, uint64_t offset) {
+    const char* p = static_cast<const char*>(buf);
+    while (n > 0) {
+        ssize_t w = ::pwrite(fd, p, n, static_cast<off_t>(offset));
+        if (w < 0 && errno == EINTR)
+            continue;
+        if (w <= 0)
+            return false;
+        p += w;
+        n -= static_cast<size_t>(w);
+        offset += static_cast<uint64_t>(w);
+    }
+    return true;
+}
+
+/// Copies length bytes of src from source to dst at offset: in the kernel
+/// (a reflink where the filesystem can), or by reads and writes when the
+/// files are on different filesystems. False with errno set on failure,
+/// ENODATA if src ends first.
+bool copy_range(int src, uint64_t source, int dst, uint64_t offset, uint64_t length) {
+    uint64_t done = 0;
+    while (done < length) {
+        auto in = static_cast<off_t>(source + done);
+        auto out = static_cast<off_t>(offset + done);
+        ssize_t n = ::copy_file_range(src, &in, dst, &out, static_cast<size_t>(length - done), 0);
+        if (n < 0 && errno == EINTR)
+            continue;
+        if (n < 0 && (errno == EXDEV || errno == ENOSYS || errno == EINVAL || errno == EOPNOTSUPP))
+            break;
+        if (n == 0)
+            errno = ENODATA;
+        if (n <= 0)
+            return false;
+        done += static_cast<uint64_t>(n);
+    }
+    std::vector<char> buf;
+    while (done < length) {
+        buf.resize(static_cast<size_t>(std::min<uint64_t>(1 << 20, length - done)));
+        ssize_t n = ::pread(src, buf.data(), buf.size(), static_cast<off_t>(source + done));
+        if (n < 0 && errno == EINTR)
+            continue;
+        if (n == 0)
+            errno = ENODATA;
+        if (n <= 0 || !pwrite_full(dst, buf.data(), static_cast<size_t>(n), offset + done))
+            return false;
+        done += static_cast<uint64_t>(n);
+    }
+    return true;
+}
+
+/// Orderly shutdown by the client; not an error.
+struct PeerClosed {};
+
+struct StreamError {
+    Status status;
+    std::string message;
+};
+
+/// An FEC chunk group being collected.
+struct FecGroup {
+    std::vector<std::vector<uint8_t>> shards; ///< k data then m parity; allocated on arrival.
+    std::vector<bool> have;
+    std::vector<uint32_t> crcs; ///< Of the data chunks; empty until a Parity frame came.
+    size_t parity = 0;          ///< Parity frames received, intact or not.
+};
+
+/// Receive side of an FEC put. Data is written as it comes and also kept
+/// per group until the group's parity is in; lost or damaged chunks are
+/// then rebuilt and written over.
+struct FecState {
+    FecState(size_t k, size_t m, size_t chunk) : rs(k, m), chunk(chunk) {}
+
+    ReedSolomon rs;
+    size_t chunk;
+    uint64_t settled = 0;                ///< Groups before this one are final.
+    std::map<uint64_t, FecGroup> groups; ///< Rarely more than one.
+};
+
+/// A put stream of a connection, for acks sent later; the connection may
+/// be gone by then.
+struct StreamRef {
+    int conn_fd = -1;
+    uint64_t conn_id = 0;
+    uint32_t stream = 0;
+};
+
+/// A connection's share of a striped put. Dropped before the connection's
+/// PutEnd (an error, a closed connection), it fails the whole put.
+struct StripeSeat {
+    std::string key;               ///< Into Server::Impl::striped.
+    std::function<void()> on_drop; ///< Cleared at PutEnd.
+
+    ~StripeSeat() {
+        if (on_drop)
+            on_drop();
+    }
+};
+
+struct Upload {
+    DirCache::Handle dir;
+    std::shared_ptr<Fd> file; ///< Shared with queued disk writes.
+    std::string rel_dir; ///< remote_dir without leading or trailing slashes.
+    std::string name;
+    uint64_t size = 0;
+    uint32_t mode = 0644;
+    int64_t mtime_ns = 0;
+    uint32_t flags = 0;
+    uint64_t next_offset = 0;
+    uint32_t crc = 0;
+    bool crc_valid = true; ///< crc covers [0, next_offset) written in order.
+    /// Existing destination file for delta Copy frames; shared with copies
+    /// in flight.
+    std::shared_ptr<const Fd> basis;
+    uint64_t basis_size = 0;
+    std::shared_ptr<TokenBucket> dir_bucket; ///< Destination directory's limit, if any.
+    Priority priority = Priority::Normal;
+    EventLoop::Clock::time_point due;
+    bool deadline_set = false; ///< The client gave an explicit deadline.
+    std::unique_ptr<FecState> fec;
+    RelayLink* relay = nullptr;       ///< Next hop, owned by the connection.
+    std::vector<std::string> mirrors; ///< Trimmed directories that get a copy.
+    /// Data goes through this disk writer lane. FEC puts, whose repairs
+    /// must land after the data they fix, and delta puts, whose Copy frames
+    /// are written on the loop, write everything on the loop instead.
+    DiskWriters::Lane lane = nullptr;
+    uint64_t serial = 0; ///< Tells this upload's write completions from a predecessor's.
+    size_t writes_pending = 0;
+    std::optional<PutEndMsg> end; ///< PutEnd waiting for writes_pending.
+    /// Set on a striped put's connections, whose data goes to the shared
+    /// StripedPut; their own crc covers what each sent.
+    std::unique_ptr<StripeSeat> stripe;
+};
+
+/// A put whose chunks are dealt over several connections (kPutStriped),
+/// so they arrive out of order. Each chunk is held until it continues the
+/// written prefix; the run that then follows goes to the disk writer back
+/// to back and is merged into large sequential writes.
+struct StripedPut {
+    Upload u;            ///< The file; its next_offset is the written prefix.
+    size_t stripes = 0;
+    std::vector<StreamRef> members; ///< Joined so far.
+    size_t ended = 0;               ///< Members whose PutEnd checked out.
+    ReorderBuffer held;
+    bool spilled = false; ///< Held more than kMaxReorderBytes; now writes on arrival.
+    uint64_t received = 0;
+    /// Kept after failing until every stripe connected or the join timeout
+    /// passed, so that a late one is refused rather than starting over.
+    bool failed = false;
+};
+
+/// A relayed put is acked upstream once both its local commit and the next
+/// hop are done.
+struct RelayAck {
+    std::optional<StatusMsg> local;
+    std::optional<StatusMsg> remote;
+};
+
+/// A range being sent to the client. Chunks go out with sendfile straight
+/// from the page cache; the CRC, if asked for, is computed on the CPU pool
+/// meanwhile and sent in the GetEnd.
+struct Download {
+    uint32_t stream = 0;
+    FileCache::FileHandle file;
+    uint64_t next = 0; ///< Start of the next chunk to frame.
+    uint64_t end = 0;
+    off_t sent = 0;    ///< sendfile position within the chunk in flight.
+    bool crc_ready = true;
+    uint32_t crc = 0;
+    bool prefetching = false;   ///< A worker is reading ahead; nothing to frame.
+    uint64_t prefetched_to = 0; ///< Sent without a residency check below this.
+};
+
+struct Connection {
+    uint64_t id = 0; ///< Tells a reused fd apart in deferred completions.
+    Fd fd;
+    std::vector<char> in;
+    size_t in_len = 0;
+    std::vector<char> scratch; ///< Decompression target.
+    std::string out;
+    size_t out_pos = 0;
+    bool authed = false;
+    bool want_write = false;
+    bool reading = true;
+    std::string client_id;
+    std::string shaping_key;             ///< Key into Impl::shaping once authed.
+    std::shared_ptr<TokenBucket> bucket; ///< The client's limit, shared by its connections.
+    bool throttled = false;              ///< Reading paused until the buckets drain.
+    bool write_paused = false;           ///< Throttled by write_behind.
+    size_t write_behind = 0;             ///< Bytes queued to the disk writers.
+    bool read_queued = false;            ///< Waiting in Impl::read_ready.
+    std::map<uint32_t, Upload> uploads;
+    std::map<Endpoint, std::unique_ptr<RelayLink>> relays; ///< By next hop.
+    std::map<uint32_t, RelayAck> relay_acks;
+    std::deque<Download> downloads; ///< Served one after another.
+    // While a chunk's file bytes are pending, out[splice_at..) waits behind them.
+    size_t splice_at = 0;
+    uint64_t splice_left = 0;
+    EventLoop::Clock::time_point last_activity;
+    // Receive-rate sampling for SO_RCVBUF sizing.
+    EventLoop::Clock::time_point rate_since;
+    uint64_t rate_bytes = 0;
+    uint64_t sized_bdp = 0;
+};
+
+/// The last steps of a received file, applied on the metadata pool: fsync,
+/// permissions, mtime and the rename into place.
+struct Commit {
+    int conn_fd = -1;
+    uint64_t conn_id = 0;
+    uint32_t stream = 0;
+    std::vector<StreamRef> also_ack; ///< A striped put's other connections.
+    DirCache::Handle dir;
+    Fd file;
+    std::string rel_dir;
+    std::string name;
+    std::vector<std::string> mirrors;
+    uint32_t mode = 0644;
+    int64_t mtime_ns = 0;
+    uint64_t size = 0;
+    /// CRC32 the file must have, re-read before committing it when the
+    /// loop could not follow it as it arrived (resumed, FEC, out of order).
+    std::optional<uint32_t> verify_crc;
+    Status status = Status::Ok;
+    std::string message;
+};
+
+/// A bundle whose files are written in parallel batches; the last batch to
+/// finish posts the ack.
+struct BundleJob {
+    int conn_fd = -1;
+    uint64_t conn_id = 0;
+    uint32_t stream = 0;
+    std::string payload; ///< Owns the bytes msg's entries view.
+    BundleMsg msg;
+    BundleAckMsg ack;
+    std::vector<std::pair<std::string, std::string>> placed; ///< (rel_dir, name) per file.
+    std::atomic<size_t> pending{0};
+};
+
+/// Rate state of one client across its connections.
+struct ClientShaping {
+    std::shared_ptr<TokenBucket> bucket = std::make_shared<TokenBucket>();
+    uint32_t weight = 1;
+    RateLimit cap;
+    size_t conns = 0;
+    uint64_t seen = 0; ///< bucket->charged() at the last rebalance.
+};
+
+/// True if dir is prefix, or inside it, comparing whole components.
+bool dir_has_prefix(const std::string& dir, const std::string& prefix) {
+    if (prefix.empty())
+        return true;
+    if (dir.compare(0, prefix.size(), prefix) != 0)
+        return false;
+    return dir.size() == prefix.size() || dir[prefix.size()] == '/';
+}
+
+/// Sets the modification time; access time is left alone.
+void set_mtime(int fd, int64_t mtime_ns) {
+    if (mtime_ns == 0)
+        return;
+    timespec ts[2];
+    ts[0].tv_sec = 0;
+    ts[0].tv_nsec = UTIME_OMIT;
+    ts[1].tv_sec = mtime_ns / 1000000000;
+    ts[1].tv_nsec = mtime_ns % 1000000000;
+    ::futimens(fd, ts);
+}
+
+/// Key of an upload in the resume journal.
+std::string journal_key(const std::string& rel_dir, const std::string& name) {
+    return rel_dir.empty() ? name : rel_dir + "/" + name;
+}
+
+std::string trim_slashes(std::string s) {
+    while (!s.empty() && s.back() == '/')
+        s.pop_back();
+    size_t lead = s.find_first_not_of('/');
+    return lead == std::string::npos ? std::string() : s.substr(lead);
+}
+
+} // namespace
+
+struct Server::Impl {
+    explicit Impl(ServerConfig c) : cfg(std::move(c)) {}
+
+    ServerConfig cfg;
+    EventLoop loop;
+    Fd listener;
+    Fd root;
+    uint16_t bound_port = 0;
+    std::thread thread;
+    std::atomic<bool> running_elsewhere{false}; ///< In run() on a thread of the caller's.
+    std::map<int, std::unique_ptr<Connection>> conns;
+
+    std::atomic<uint64_t> accepted{0};
+    std::atomic<uint64_t> open{0};
+    std::atomic<uint64_t> files{0};
+    std::atomic<uint64_t> bytes{0};
+    std::atomic<uint64_t> errors{0};
+    std::atomic<uint64_t> rcvbuf_resizes{0};
+    std::atomic<int> max_rcvbuf{0};
+    std::atomic<uint64_t> delta_reused{0};
+    std::atomic<uint64_t> throttle_pauses{0};
+    std::atomic<uint64_t> fec_repaired{0};
+    std::atomic<uint64_t> fec_lost{0};
+    std::atomic<uint64_t> files_served{0};
+    std::atomic<uint64_t> bytes_served{0};
+    std::atomic<uint64_t> prefetches{0};
+    std::atomic<uint64_t> journal_resumes{0};
+    std::atomic<uint64_t> chunks_reordered{0};
+    std::atomic<uint64_t> reorder_spills{0};
+    uint64_t next_conn_id = 1;
+    uint64_t next_upload_serial = 1;
+    std::map<std::string, ClientShaping> shaping;
+    uint32_t last_active_weight = 0; ///< Weight of the clients active at the last rebalance.
+    std::vector<int> read_ready; ///< Readable connections awaiting this round.
+    bool read_round_pending = false;
+    /// By trimmed dir_limits prefix, longest first.
+    std::vector<std::pair<std::string, std::shared_ptr<TokenBucket>>> dir_buckets;
+    /// Sync indexes by trimmed directory, longest first; opened on demand.
+    std::vector<std::pair<std::string, std::unique_ptr<DirIndex>>> indexes;
+    std::unique_ptr<DirCache> dirs;
+    std::unique_ptr<FileCache> file_cache; ///< Downloads' fds, metadata and hot extents.
+    /// Received data, written by threads of the destination's device.
+    std::unique_ptr<DiskWriters> writers;
+    /// Striped puts by stripe_key(); declared after writers, whose queued
+    /// writes reference their files.
+    std::map<std::string, StripedPut> striped;
+    std::vector<Commit> commits; ///< Awaiting submit_commits() this iteration.
+    size_t commit_batches = 0;   ///< On the metadata pool.
+    size_t bundle_jobs = 0;      ///< Bundles with files still on the metadata pool.
+    /// Loaded from the root on first use; given to a successor by a handoff
+    /// or saved back by stop().
+    Lazy<ResumeJournal> journal{[this] {
+        auto j = std::make_unique<ResumeJournal>();
+        j->load(root.get());
+        return j;
+    }};
+    bool journal_passed = false; ///< Handed off or saved; not to be saved again.
+    Fd handoff_sock;             ///< From the predecessor, until its Done.
+    // Handing off to a successor. The listener stays open, though not
+    // polled, until the successor acks: if it never does, serving resumes.
+    int successor = -1;
+    EventLoop::Clock::time_point drain_until;
+    std::promise<void>* handed_off = nullptr;
+    uint64_t handoff_round = 0; ///< Tells a later handoff's timers apart.
+    // Pools are started by warmer after the listener is up, or by their
+    // first task if that comes sooner.
+    Lazy<WorkStealingPool> cpu_pool{
+        [this] { return std::make_unique<WorkStealingPool>(cfg.cpu_threads); }};
+    /// Blocking metadata syscalls; declared after what its tasks touch.
+    Lazy<WorkStealingPool> meta_pool{[this] {
+        return std::make_unique<WorkStealingPool>(std::max<size_t>(1, cfg.metadata_threads), false);
+    }};
+    std::thread warmer;
+    std::unique_ptr<MetricsEndpoint> metrics; ///< Last: its thread reads the above.
+
+    void bind();
+    ServerStats stats() const;
+    /// Server counters and per-connection socket gauges for a scrape.
+    std::string metrics_text();
+    void on_accept();
+    /// budget 0 queues reads of authenticated connections for read_round();
+    /// otherwise reads up to budget bytes right away.
+    void on_event(int fd, uint32_t events, size_t budget = 0);
+    void on_readable(Connection& c, size_t budget);
+    void queue_read(Connection& c);
+    /// Reads the connections that became readable this iteration, earliest
+    /// deadline first, with full budgets only for the most urgent class.
+    void read_round();
+    bool flush(Connection& c);
+    /// Queues the next chunk header (or the GetEnd) of c's first download;
+    /// false if it has nothing ready.
+    bool frame_download(Connection& c);
+    /// Reads ahead of d on a blocking worker, then resumes it.
+    void prefetch(Connection& c, Download& d);
+    void update_interest(Connection& c);
+    void close_conn(int fd);
+    /// Records c's unfinished uploads whose prefix CRC is known.
+    void journal_uploads(Connection& c);
+    /// Merges the predecessor's journal; acks and drops the socket at Done.
+    void on_handoff();
+    /// While handing off, new transfers are refused as Busy so that the
+    /// drain ends; clients retry them on the successor.
+    bool draining() const { return handed_off != nullptr; }
+    /// Waits, a poll at a time, for transfers to finish, then calls
+    /// finish_handoff().
+    void drain_for_handoff();
+    /// Sends the journal and Done, then waits on the loop for the Ack.
+    void finish_handoff();
+    void on_successor_ack();
+    /// Settles handed_off: closes what is left on success, takes the
+    /// listener back on failure.
+    void end_handoff(std::exception_ptr error);
+    void sweep_idle();
+    void size_rcvbuf(Connection& c, size_t n);
+    /// Processes complete frames buffered in c.in until a limit pauses it.
+    void process_frames(Connection& c);
+
+    // Bandwidth shaping.
+    void attach_client(Connection& c);
+    void detach_client(Connection& c);
+    /// Charges n received bytes to c's and u's buckets and pauses reading
+    /// from c while either is in debt.
+    void charge(Connection& c, const Upload& u, size_t n);
+    void resume_reading(int fd, uint64_t id);
+    /// Re-splits max_ingest_rate between the clients that sent data since
+    /// the last pass; reschedules itself.
+    void rebalance();
+    /// Rate for a client that starts sending alongside the active ones.
+    uint64_t joining_share(const ClientShaping& cs) const;
+    std::shared_ptr<TokenBucket> dir_bucket(const std::string& remote_dir) const;
+
+    void send(Connection& c, FrameType t, uint32_t stream, std::string_view payload);
+    void send_status(Connection& c, FrameType t, uint32_t stream, Status s, uint64_t value,
+                     const std::string& msg);
+    /// Returns false if the connection must be closed.
+    bool handle_frame(Connection& c, const FrameHeader& h, std::string_view payload);
+    void handle_hello(Connection& c, std::string_view payload);
+    void handle_put_begin(Connection& c, uint32_t stream, std::string_view payload);
+    void handle_data(Connection& c, const FrameHeader& h, std::string_view payload);
+    void handle_put_end(Connection& c, uint32_t stream, std::string_view payload);
+    /// Checks and commits a put whose data is all on disk.
+    void finish_put_end(Connection& c, uint32_t stream, const PutEndMsg& m);
+    /// Checks u's size and CRC against m and queues its commit, acked to
+    /// ack; throws StreamError.
+    void commit_upload(Upload& u, const PutEndMsg& m, const StreamRef& ack,
+                       std::vector<StreamRef> also_ack = {});
+    /// Where a striped put's connections meet in striped.
+    static std::string stripe_key(const PutBeginMsg& m);
+    /// A connection's Upload for its share of the striped put key.
+    Upload stripe_member(const PutBeginMsg& m, const std::string& key);
+    /// Joins c to the striped put key, opened by another connection.
+    void join_striped(Connection& c, uint32_t stream, const PutBeginMsg& m, StripedPut& sp);
+    /// Holds or writes a chunk of a striped put.
+    void striped_data(Connection& c, Upload& member, uint64_t offset, const char* data, size_t n);
+    /// Queues a contiguous chunk of sp's file, charged to c's write_behind.
+    void write_striped(Connection& c, const std::string& key, StripedPut& sp, uint64_t offset,
+                       std::vector<char> data);
+    void on_striped_written(const std::string& key, uint64_t serial, int fd, uint64_t id,
+                            size_t n, int error, std::chrono::nanoseconds took);
+    /// Commits sp once every member ended and its writes landed.
+    void check_striped(const std::string& key);
+    /// Fails every member of the striped put key.
+    void fail_striped(const std::string& key, Status s, const std::string& msg);
+    /// Gives back n bytes of c's write_behind, resuming reads below the
+    /// low-water mark; false if c was closed meanwhile.
+    bool release_write_behind(Connection& c, size_t n);
+    /// Where the resumed put u continues: what is on disk, cut back to the
+    /// journaled prefix or to nothing where it cannot be trusted. With a
+    /// lane, only once the file's earlier writes have landed.
+    void resume_from_disk(Connection& c, uint32_t stream, Upload& u, uint64_t size,
+                          int64_t mtime_ns, const std::optional<JournalEntry>& entry);
+    /// Lane flush completion of a resumed put: settles it and sends PutReady.
+    void on_resume_flushed(int fd, uint64_t id, uint32_t stream, uint64_t serial, uint64_t size,
+                           int64_t mtime_ns, const std::optional<JournalEntry>& entry);
+    /// Stops reading c while it has too much queued for the disk.
+    void throttle_write_behind(Connection& c);
+    /// Disk writer callback that hands the completion of [end - n, end)
+    /// back to the loop.
+    DiskWriters::Done written_callback(const Connection& c, uint32_t stream, uint64_t serial,
+                                       uint64_t end, size_t n);
+    void on_written(int fd, uint64_t id, uint32_t stream, uint64_t serial, uint64_t end, size_t n,
+                    int error, std::chrono::nanoseconds took);
+    void handle_copy(Connection& c, uint32_t stream, std::string_view payload);
+    /// Sends a put's final status, or holds it until the next hop answers
+    /// when the put is relayed.
+    void ack_put(Connection& c, uint32_t stream, Status s, uint64_t value,
+                 const std::string& msg);
+    /// c's link to next, connected on first use.
+    RelayLink& relay_link(Connection& c, const Endpoint& next);
+    void on_relay_ack(int fd, uint64_t id, uint32_t stream, StatusMsg m);
+    /// Stops reading from c while its relay queue is over the high-water mark.
+    void check_relay(Connection& c, const Upload& u);
+    /// Copies a committed file into the mirror directory rel. Runs on the
+    /// metadata pool; throws StreamError.
+    void mirror_file(const Commit& c, const std::string& rel);
+    void handle_parity(Connection& c, uint32_t stream, std::string_view payload);
+    void handle_get(Connection& c, uint32_t stream, std::string_view payload);
+    /// Collection slot of an FEC group. The client sends groups in order,
+    /// so earlier ones are settled first. Throws StreamError.
+    FecGroup& fec_group(Upload& u, uint64_t group);
+    /// Repairs and finalizes the pending groups before end.
+    void settle_fec(Upload& u, uint64_t end);
+    /// Rebuilds the group's lost or damaged data chunks into the file. If
+    /// too many are gone, cuts the file back to the group's start (so a
+    /// resume restarts there) and throws StreamError.
+    void repair_group(Upload& u, uint64_t group, FecGroup& g);
+    void handle_manifest(Connection& c, uint32_t stream, std::string_view payload);
+    DirIndex& index_for(const std::string& dir);
+    void note_committed(const std::string& rel_dir, const std::string& name, uint64_t size,
+                        int64_t mtime_ns);
+    void handle_bundle(Connection& c, uint32_t stream, std::string_view payload);
+    /// Writes one bundled file and returns where it went; throws
+    /// StreamError. Runs on the metadata pool.
+    std::pair<std::string, std::string> write_bundled(const BundleMsg& m, const BundleEntry& f);
+    void finish_bundle(BundleJob& job);
+    /// Hands this iteration's commits to the metadata pool in batches.
+    void submit_commits();
+    void apply_commit(Commit& c);
+    void finish_commits(std::vector<Commit>& batch);
+    /// Flushes fd if it is still connection id; closes it on failure.
+    void flush_conn(int fd, uint64_t id);
+    /// Computes the basis file's signatures on the CPU pool and answers
+    /// with a Signatures frame from the loop thread.
+    void send_signatures(Connection& c, uint32_t stream, const Upload& u);
+};
+
+void Server::Impl::bind() {
+    // Listen first: clients retrying through a restart are queued by the
+    // kernel while the rest is set up.
+    root = Fd(::open(cfg.root.c_str(), O_PATH | O_DIRECTORY | O_CLOEXEC));
+    if (!root)
+        throw_errno("open root " + cfg.root);
+    if (cfg.handoff_fd >= 0) {
+        // Hot restart: the predecessor's listener, with its queue intact.
+        handoff_sock = Fd(cfg.handoff_fd);
+        HandoffMsg type{};
+        std::string payload;
+        if (!recv_handoff(handoff_sock.get(), kHandoffTimeout, type, payload, listener) ||
+            type != HandoffMsg::Listener || !listener)
+            throw Error("no listener from the previous server");
+    } else {
+        listener = listen_tcp(cfg.bind_addr, cfg.port);
+    }
+    set_nonblocking(listener.get(), true);
+    bound_port = local_port(listener.get());
+    loop.add(listener.get(), EPOLLIN, [this](uint32_t) { on_accept(); });
+    if (handoff_sock)
+        loop.add(handoff_sock.get(), EPOLLIN, [this](uint32_t) { on_handoff(); });
+    warmer = std::thread([this] {
+        trace_thread_name("server-warmup");
+        cpu_pool.warm();
+        meta_pool.warm();
+        journal.warm();
+    });
+    dirs = std::make_unique<DirCache>(root.get(), cfg.dir_cache_size, kDirCacheTtl);
+    file_cache = std::make_unique<FileCache>(cfg.file_cache_size, cfg.read_cache_bytes);
+    writers = std::make_unique<DiskWriters>(cfg.disk_writers);
+    auto sweep = std::min<std::chrono::milliseconds>(cfg.idle_timeout / 2,
+                                                     std::chrono::milliseconds(5000));
+    loop.run_after(sweep, [this] { sweep_idle(); });
+    for (const auto& [prefix, limit] : cfg.dir_limits)
+        dir_buckets.emplace_back(trim_slashes(prefix), std::make_shared<TokenBucket>(limit));
+    std::stable_sort(dir_buckets.begin(), dir_buckets.end(), [](const auto& a, const auto& b) {
+        return a.first.size() > b.first.size();
+    });
+    if (cfg.max_ingest_rate)
+        loop.run_after(kRebalanceInterval, [this] { rebalance(); });
+    if (!cfg.metrics_listen.empty())
+        metrics = std::make_unique<MetricsEndpoint>(cfg.metrics_listen,
+                                                    [this] { return metrics_text(); });
+}
+
+ServerStats Server::Impl::stats() const {
+    ServerStats s;
+    s.connections_accepted = accepted.load(std::memory_order_relaxed);
+    s.connections_open = open.load(std::memory_order_relaxed);
+    s.files_received = files.load(std::memory_order_relaxed);
+    s.bytes_received = bytes.load(std::memory_order_relaxed);
+    s.errors = errors.load(std::memory_order_relaxed);
+    s.rcvbuf_resizes = rcvbuf_resizes.load(std::memory_order_relaxed);
+    s.max_rcvbuf = max_rcvbuf.load(std::memory_order_relaxed);
+    s.delta_bytes_reused = delta_reused.load(std::memory_order_relaxed);
+    s.throttle_pauses = throttle_pauses.load(std::memory_order_relaxed);
+    s.fec_chunks_repaired = fec_repaired.load(std::memory_order_relaxed);
+    s.fec_groups_lost = fec_lost.load(std::memory_order_relaxed);
+    s.files_served = files_served.load(std::memory_order_relaxed);
+    s.bytes_served = bytes_served.load(std::memory_order_relaxed);
+    if (dirs) {
+        s.dir_cache_hits = dirs->hits();
+        s.dir_cache_misses = dirs->misses();
+    }
+    if (file_cache) {
+        s.file_cache_hits = file_cache->file_hits();
+        s.file_cache_misses = file_cache->file_misses();
+        s.read_cache_hits = file_cache->extent_hits();
+        s.read_cache_misses = file_cache->extent_misses();
+        s.read_cache_bytes = file_cache->extent_bytes();
+    }
+    s.prefetches = prefetches.load(std::memory_order_relaxed);
+    s.chunks_reordered = chunks_reordered.load(std::memory_order_relaxed);
+    s.reorder_spills = reorder_spills.load(std::memory_order_relaxed);
+    if (writers) {
+        s.disk_writes = writers->writes();
+        s.disk_writes_merged = writers->merged();
+    }
+    s.journal_resumes = journal_resumes.load(std::memory_order_relaxed);
+    return s;
+}
+
+std::string Server::Impl::metrics_text() {
+    ServerStats s = stats();
+    std::string out;
+    auto counter = [&out](const char* name, uint64_t v) {
+        out += std::string("# TYPE ") + name + " counter\n" + name + " " + std::to_string(v) + "\n";
+    };
+    auto gauge = [&out](const char* name, uint64_t v) {
+        out += std::string("# TYPE ") + name + " gauge\n" + name + " " + std::to_string(v) + "\n";
+    };
+    counter("tcptransfer_server_connections_accepted_total", s.connections_accepted);
+    gauge("tcptransfer_server_connections_open", s.connections_open);
+    counter("tcptransfer_server_files_received_total", s.files_received);
+    counter("tcptransfer_server_bytes_received_total", s.bytes_received);
+    counter("tcptransfer_server_errors_total", s.errors);
+    counter("tcptransfer_server_rcvbuf_resizes_total", s.rcvbuf_resizes);
+    counter("tcptransfer_server_delta_bytes_reused_total", s.delta_bytes_reused);
+    counter("tcptransfer_server_throttle_pauses_total", s.throttle_pauses);
+    counter("tcptransfer_server_dir_cache_hits_total", s.dir_cache_hits);
+    counter("tcptransfer_server_dir_cache_misses_total", s.dir_cache_misses);
+    counter("tcptransfer_server_fec_chunks_repaired_total", s.fec_chunks_repaired);
+    counter("tcptransfer_server_fec_groups_lost_total", s.fec_groups_lost);
+    counter("tcptransfer_server_files_served_total", s.files_served);
+    counter("tcptransfer_server_bytes_served_total", s.bytes_served);
+    counter("tcptransfer_server_file_cache_hits_total", s.file_cache_hits);
+    counter("tcptransfer_server_file_cache_misses_total", s.file_cache_misses);
+    counter("tcptransfer_server_read_cache_hits_total", s.read_cache_hits);
+    counter("tcptransfer_server_read_cache_misses_total", s.read_cache_misses);
+    gauge("tcptransfer_server_read_cache_bytes", s.read_cache_bytes);
+    counter("tcptransfer_server_prefetches_total", s.prefetches);
+    counter("tcptransfer_server_journal_resumes_total", s.journal_resumes);
+    counter("tcptransfer_server_disk_writes_total", s.disk_writes);
+    counter("tcptransfer_server_disk_writes_merged_total", s.disk_writes_merged);
+    counter("tcptransfer_server_chunks_reordered_total", s.chunks_reordered);
+    counter("tcptransfer_server_reorder_spills_total", s.reorder_spills);
+    gauge("tcptransfer_server_max_rcvbuf_bytes", static_cast<uint64_t>(s.max_rcvbuf));
+
+    // Connections belong to the loop thread; read their sockets there.
+    auto sockets = std::make_shared<std::promise<std::string>>();
+    std::future<std::string> ready = sockets->get_future();
+    loop.post([this, sockets] {
+        std::string text;
+        size_t n = 0;
+        for (auto& [fd, c] : conns) {
+            if (n++ == kMaxSocketSeries)
+                break;
+            text += format_socket_metrics(read_socket_stats(fd),
+                                          "conn=\"" + std::to_string(fd) + "\",client=\"" +
+                                              escape_label_value(c->client_id) + "\"");
+        }
+        sockets->set_value(std::move(text));
+    });
+    if (ready.wait_for(std::chrono::seconds(1)) == std::future_status::ready)
+        out += ready.get();
+    return out;
+}
+
+void Server::Impl::sweep_idle() {
+    auto now = EventLoop::Clock::now();
+    std::vector<int> idle;
+    for (auto& [fd, c] : conns)
+        if (now - c->last_activity > cfg.idle_timeout)
+            idle.push_back(fd);
+    for (int fd : idle)
+        close_conn(fd);
+    for (auto& [dir, index] : indexes) {
+        try {
+            index->flush();
+        } catch (const std::system_error&) {
+            // Stays dirty and is rebuilt by the next sync.
+        }
+    }
+    auto sweep = std::min<std::chrono::milliseconds>(cfg.idle_timeout / 2,
+                                                     std::chrono::milliseconds(5000));
+    loop.run_after(sweep, [this] { sweep_idle(); });
+}
+
+void Server::Impl::on_accept() {
+    for (;;) {
+        auto accept_start = stage_now();
+        int fd = ::accept4(listener.get(), nullptr, nullptr, SOCK_NONBLOCK | SOCK_CLOEXEC);
+        if (fd < 0) {
+            if (errno == EINTR)
+                continue;
+            return; // EAGAIN or transient (EMFILE...): retry on next readiness
+        }
+        if (conns.size() >= cfg.max_connections) {
+            ::close(fd);
+            continue;
+        }
+        apply_socket_tuning(fd, cfg.tuning);
+        auto c = std::make_unique<Connection>();
+        c->id = next_conn_id++;
+        c->fd = Fd(fd);
+        c->in.resize(kReadBufferSize);
+        c->last_activity = EventLoop::Clock::now();
+        c->rate_since = c->last_activity;
+        conns[fd] = std::move(c);
+        loop.add(fd, EPOLLIN | EPOLLRDHUP, [this, fd](uint32_t ev) { on_event(fd, ev); });
+        accepted.fetch_add(1, std::memory_order_relaxed);
+        open.fetch_add(1, std::memory_order_relaxed);
+        record_since(Stage::Accept, accept_start);
+    }
+}
+
+void Server::Impl::close_conn(int fd) {
+    auto it = conns.find(fd);
+    if (it == conns.end())
+        return;
+    loop.remove(fd);
+    detach_client(*it->second);
+    journal_uploads(*it->second);
+    conns.erase(it); // partial uploads keep their .part file for resume
+    open.fetch_sub(1, std::memory_order_relaxed);
+}
+
+void Server::Impl::journal_uploads(Connection& c) {
+    for (const auto& [stream, u] : c.uploads)
+        if ((u.flags & kPutChecksum) && u.crc_valid && u.next_offset > 0 &&
+            u.next_offset < u.size)
+            journal->record(journal_key(u.rel_dir, u.name),
+                            {u.size, u.mtime_ns, u.next_offset, u.crc});
+}
+
+void Server::Impl::on_handoff() {
+    HandoffMsg type{};
+    std::string payload;
+    Fd fd;
+    bool done = true;
+    try {
+        if (recv_handoff(handoff_sock.get(), std::chrono::milliseconds(0), type, payload, fd)) {
+            done = type == HandoffMsg::Done;
+            if (type == HandoffMsg::Journal)
+                journal->merge(payload);
+            else if (done)
+                send_handoff(handoff_sock.get(), HandoffMsg::Ack, "");
+        }
+    } catch (const std::exception&) {
+        errors.fetch_add(1, std::memory_order_relaxed);
+    }
+    if (done) {
+        loop.remove(handoff_sock.get());
+        handoff_sock.reset();
+    }
+}
+
+void Server::Impl::drain_for_handoff() {
+    bool busy = !commits.empty() || commit_batches > 0 || bundle_jobs > 0 ||
+                std::any_of(striped.begin(), striped.end(),
+                            [](const auto& e) { return !e.second.failed; });
+    for (const auto& [fd, c] : conns)
+        busy = busy || !c->uploads.empty() || !c->downloads.empty() || c->write_behind > 0;
+    if (busy && EventLoop::Clock::now() < drain_until) {
+        loop.run_after(kHandoffPoll, [this] { drain_for_handoff(); });
+        return;
+    }
+    finish_handoff();
+}
+
+void Server::Impl::finish_handoff() {
+    try {
+        // The journal goes first so that clients reconnecting once their
+        // connections close find their progress on the other side.
+        for (const auto& [fd, c] : conns)
+            journal_uploads(*c);
+        for (const std::string& part : journal->encode(kMaxHandoffPayload / 2))
+            send_handoff(successor, HandoffMsg::Journal, part);
+        send_handoff(successor, HandoffMsg::Done, "");
+    } catch (...) {
+        return end_handoff(std::current_exception());
+    }
+    loop.add(successor, EPOLLIN, [this](uint32_t) { on_successor_ack(); });
+    loop.run_after(kHandoffTimeout, [this, round = handoff_round] {
+        if (handed_off && round == handoff_round) {
+            loop.remove(successor);
+            end_handoff(std::make_exception_ptr(Error("successor did not take the journal")));
+        }
+    });
+}
+
+void Server::Impl::on_successor_ack() {
+    HandoffMsg type{};
+    std::string payload;
+    Fd fd;
+    std::exception_ptr error;
+    try {
+        if (!recv_handoff(successor, std::chrono::milliseconds(0), type, payload, fd) ||
+            type != HandoffMsg::Ack)
+            throw Error("successor did not take the journal");
+    } catch (...) {
+        error = std::current_exception();
+    }
+    loop.remove(successor);
+    end_handoff(error);
+}
+
+void Server::Impl::end_handoff(std::exception_ptr error) {
+    if (error) {
+        // Running transfers carry on; stop() saves the journal later.
+        loop.add(listener.get(), EPOLLIN, [this](uint32_t) { on_accept(); });
+        handed_off->set_exception(error);
+    } else {
+        journal_passed = true;
+        while (!conns.empty())
+            close_conn(conns.begin()->first);
+        listener.reset();
+        handed_off->set_value();
+    }
+    successor = -1;
+    handed_off = nullptr;
+}
+
+void Server::Impl::on_event(int fd, uint32_t events, size_t budget) {
+    auto it = conns.find(fd);
+    if (it == conns.end())
+        return;
+    Connection& c = *it->second;
+    c.last_activity = EventLoop::Clock::now();
+    if ((events & (EPOLLRDHUP | EPOLLHUP | EPOLLERR)) && !c.reading)
+        return close_conn(fd);
+    try {
+        if (events & EPOLLOUT) {
+            if (!flush(c))
+                return close_conn(fd);
+        }
+        if (events & (EPOLLIN | EPOLLRDHUP | EPOLLHUP | EPOLLERR)) {
+            if (budget == 0 && c.authed && !(events & (EPOLLRDHUP | EPOLLHUP | EPOLLERR)))
+                queue_read(c);
+            else
+                on_readable(c, budget ? budget : kMaxReadPerEvent);
+        }
+    } catch (const PeerClosed&) {
+        return close_conn(fd);
+    } catch (const std::exception&) {
+        errors.fetch_add(1, std::memory_order_relaxed);
+        return close_conn(fd);
+    }
+}
+
+void Server::Impl::size_rcvbuf(Connection& c, size_t n) {
+    constexpr auto kSampleInterval = std::chrono::milliseconds(100);
+    if (!cfg.tuning.size_from_bdp)
+        return;
+    c.rate_bytes += n;
+    auto now = EventLoop::Clock::now();
+    auto elapsed = now - c.rate_since;
+    if (elapsed < kSampleInterval)
+        return;
+    SocketStats ss = read_socket_stats(c.fd.get());
+    double rate = static_cast<double>(c.rate_bytes) / std::chrono::duration<double>(elapsed).count();
+    uint32_t rtt_us = ss.rcv_rtt_us ? ss.rcv_rtt_us : ss.rtt_us;
+    uint64_t bdp = static_cast<uint64_t>(rate * rtt_us / 1e6);
+    c.rate_since = now;
+    c.rate_bytes = 0;
+    if (bdp <= c.sized_bdp + c.sized_bdp / 4)
+        return;
+    c.sized_bdp = bdp;
+    if (grow_buffer_for_bdp(c.fd.get(), bdp, cfg.tuning, false)) {
+        rcvbuf_resizes.fetch_add(1, std::memory_order_relaxed);
+        int eff = read_socket_stats(c.fd.get()).rcvbuf;
+        int prev = max_rcvbuf.load(std::memory_order_relaxed);
+        while (eff > prev && !max_rcvbuf.compare_exchange_weak(prev, eff)) {
+        }
+    }
+}
+
+void Server::Impl::on_readable(Connection& c, size_t budget) {
+    TCPTRANSFER_TRACE_SPAN("read_batch", static_cast<uint64_t>(c.fd.get()));
+    // Frames left over from a rate-limit pause go first.
+    process_frames(c);
+    while (c.reading && budget > 0) {
+        if (c.in_len == c.in.size())
+            c.in.resize(c.in.size() * 2);
+        auto recv_start = stage_now();
+        ssize_t n = ::recv(c.fd.get(), c.in.data() + c.in_len, c.in.size() - c.in_len, 0);
+        if (n > 0)
+            record_since(Stage::Receive, recv_start, static_cast<uint64_t>(n));
+        if (n < 0) {
+            if (errno == EINTR)
+                continue;
+            if (errno == EAGAIN || errno == EWOULDBLOCK)
+                break;
+            throw_errno("recv");
+        }
+        if (n == 0)
+            throw PeerClosed{};
+        c.in_len += static_cast<size_t>(n);
+        budget -= std::min(budget, static_cast<size_t>(n));
+        size_rcvbuf(c, static_cast<size_t>(n));
+        process_frames(c);
+    }
+    if (!flush(c))
+        throw Error("send failed");
+}
+
+void Server::Impl::queue_read(Connection& c) {
+    if (c.read_queued)
+        return;
+    c.read_queued = true;
+    read_ready.push_back(c.fd.get());
+    if (!read_round_pending) {
+        read_round_pending = true;
+        loop.defer([this] { read_round(); });
+    }
+}
+
+void Server::Impl::read_round() {
+    read_round_pending = false;
+    struct Ready {
+        int fd;
+        uint64_t id;
+        int level; ///< Higher is more urgent.
+        EventLoop::Clock::time_point due;
+    };
+    auto now = EventLoop::Clock::now();
+    std::vector<Ready> round;
+    for (int fd : std::exchange(read_ready, {})) {
+        auto it = conns.find(fd);
+        if (it == conns.end())
+            continue;
+        Connection& c = *it->second;
+        c.read_queued = false;
+        // Between uploads a connection only carries small control frames;
+        // read those promptly.
+        Ready r{fd, c.id, 3, now};
+        bool first = true;
+        for (const auto& [stream, u] : c.uploads) {
+            // Deadlines that are near or already missed rank with
+            // interactive work, so a bulk upload left waiting past its
+            // slack catches up.
+            bool pressing = u.due <= now ||
+                            (u.deadline_set && u.due - now <= default_slack(Priority::Normal));
+            int level = pressing ? 2 : static_cast<int>(u.priority);
+            if (first || level > r.level || (level == r.level && u.due < r.due)) {
+                r.level = level;
+                r.due = u.due;
+                first = false;
+            }
+        }
+        round.push_back(r);
+    }
+    std::sort(round.begin(), round.end(), [](const Ready& a, const Ready& b) {
+        return a.due != b.due ? a.due < b.due : a.fd < b.fd;
+    });
+    int top = 0;
+    for (const Ready& r : round)
+        top = std::max(top, std::min(r.level, 2));
+    TCPTRANSFER_TRACE_SPAN("read_round", round.size());
+    for (const Ready& r : round) {
+        auto it = conns.find(r.fd);
+        if (it == conns.end() || it->second->id != r.id)
+            continue;
+        on_event(r.fd, EPOLLIN, r.level >= top ? kMaxReadPerEvent : kBackgroundReadSlice);
+    }
+}
+
+void Server::Impl::process_frames(Connection& c) {
+    size_t pos = 0;
+    while (!c.throttled && c.in_len - pos >= kFrameHeaderSize) {
+        FrameHeader h = decode_header(c.in.data() + pos);
+        size_t total = kFrameHeaderSize + h.length;
+        if (c.in_len - pos < total) {
+            if (total > c.in.size())
+                c.in.resize(total);
+            break;
+        }
+        std::string_view payload(c.in.data() + pos + kFrameHeaderSize, h.length);
+        pos += total;
+        if (!handle_frame(c, h, payload))
+            throw Error("connection rejected");
+    }
+    if (pos > 0) {
+        std::memmove(c.in.data(), c.in.data() + pos, c.in_len - pos);
+        c.in_len -= pos;
+    }
+}
+
+bool Server::Impl::flush(Connection& c) {
+    // A budget keeps one fast download from holding the loop; EPOLLOUT
+    // brings it back.
+    size_t budget = kMaxWritePerEvent;
+    bool blocked = false;
+    while (!blocked) {
+        const size_t limit = c.splice_left ? c.splice_at : c.out.size();
+        while (c.out_pos < limit) {
+            StageTimer t(Stage::Send);
+            ssize_t n = ::send(c.fd.get(), c.out.data() + c.out_pos, limit - c.out_pos,
+                               MSG_NOSIGNAL);
+            t.set_bytes(n > 0 ? static_cast<uint64_t>(n) : 0);
+            if (n < 0) {
+                if (errno == EINTR)
+                    continue;
+                if (errno == EAGAIN || errno == EWOULDBLOCK) {
+                    blocked = true;
+                    break;
+                }
+                return false;
+            }
+            c.out_pos += static_cast<size_t>(n);
+            budget -= std::min(budget, static_cast<size_t>(n));
+        }
+        if (blocked || budget == 0)
+            break;
+        if (c.splice_left) {
+            Download& d = c.downloads.front();
+            StageTimer t(Stage::Send);
+            TCPTRANSFER_TRACE_SPAN("sendfile", c.splice_left);
+            ssize_t n = ::sendfile(c.fd.get(), d.file->fd.get(), &d.sent,
+                                   static_cast<size_t>(std::min<uint64_t>(c.splice_left, budget)));
+            if (n < 0 && errno == EINTR)
+                continue;
+            if (n < 0 && (errno == EAGAIN || errno == EWOULDBLOCK))
+                break;
+            if (n <= 0)
+                return false; // error, or the file shrank under a framed chunk
+            t.set_bytes(static_cast<uint64_t>(n));
+            c.splice_left -= static_cast<uint64_t>(n);
+            budget -= std::min(budget, static_cast<size_t>(n));
+            bytes_served.fetch_add(static_cast<uint64_t>(n), std::memory_order_relaxed);
+            continue;
+        }
+        if (!frame_download(c))
+            break;
+    }
+    if (c.out_pos == c.out.size()) {
+        c.splice_at -= std::min(c.splice_at, c.out_pos);
+        c.out.clear();
+        c.out_pos = 0;
+    }
+    update_interest(c);
+    return true;
+}
+
+bool Server::Impl::frame_download(Connection& c) {
+    if (c.downloads.empty())
+        return false;
+    Download& d = c.downloads.front();
+    if (d.prefetching)
+        return false;
+    if (d.next < d.end) {
+        const FileCache::File& f = *d.file;
+        const uint64_t index = d.next / kGetChunk;
+        const uint64_t base = index * kGetChunk;
+        const size_t n = static_cast<size_t>(std::min(base + kGetChunk, d.end) - d.next);
+        bool admit = false;
+        FileCache::Extent extent = file_cache->extent(f, index, admit);
+        if (!extent && d.next >= d.prefetched_to && !resident(f.fd.get(), d.next, n)) {
+            prefetch(c, d);
+            return false;
+        }
+        if (!extent && admit) {
+            // Fetched twice lately: keep a copy, if the page cache can
+            // supply it without waiting.
+            std::string data(static_cast<size_t>(std::min<uint64_t>(kGetChunk, f.size - base)),
+                             '\0');
+            if (read_nowait(f.fd.get(), data.data(), data.size(), base))
+                extent = file_cache->insert_extent(f, index, std::move(data));
+        }
+        char hdr[kFrameHeaderSize];
+        encode_header({FrameType::Data, 0, d.stream, static_cast<uint32_t>(8 + n), 0}, hdr);
+        c.out.append(hdr, sizeof(hdr));
+        WireWriter(c.out).u64(d.next);
+        if (extent && d.next + n <= base + extent->size()) {
+            c.out.append(*extent, static_cast<size_t>(d.next - base), n);
+            bytes_served.fetch_add(n, std::memory_order_relaxed);
+        } else {
+            c.splice_at = c.out.size();
+            c.splice_left = n;
+            d.sent = static_cast<off_t>(d.next);
+        }
+        d.next += n;
+        return true;
+    }
+    if (!d.crc_ready)
+        return false;
+    send(c, FrameType::GetEnd, d.stream, GetEndMsg{d.crc}.encode());
+    c.downloads.pop_front();
+    files_served.fetch_add(1, std::memory_order_relaxed);
+    return true;
+}
+
+void Server::Impl::prefetch(Connection& c, Download& d) {
+    d.prefetching = true;
+    prefetches.fetch_add(1, std::memory_order_relaxed);
+    const uint64_t from = d.next;
+    const uint64_t len = std::min(kPrefetchWindow, d.end - d.next);
+    meta_pool->submit([this, file = d.file, fd = c.fd.get(), id = c.id, stream = d.stream, from,
+                       len] {
+        {
+            TCPTRANSFER_TRACE_SPAN("readahead", len);
+            StageTimer t(Stage::DiskRead, len);
+            ::readahead(file->fd.get(), static_cast<off64_t>(from), static_cast<size_t>(len));
+        }
+        loop.post([this, fd, id, stream, to = from + len] {
+            auto it = conns.find(fd);
+            if (it == conns.end() || it->second->id != id)
+                return;
+            for (Download& d : it->second->downloads)
+                if (d.stream == stream) {
+                    d.prefetching = false;
+                    d.prefetched_to = to;
+                }
+            flush_conn(fd, id);
+        });
+    });
+}
+
+void Server::Impl::update_interest(Connection& c) {
+    bool want_write = c.out_pos < c.out.size() || c.splice_left > 0;
+    if (!c.downloads.empty()) {
+        const Download& d = c.downloads.front();
+        want_write = want_write || (!d.prefetching && (d.next < d.end || d.crc_ready));
+    }
+    // Stop reading from a client that does not drain our replies, or that
+    // is over its rate limit.
+    bool reading = !c.throttled && c.out.size() - c.out_pos < kOutputHighWater;
+    if (want_write == c.want_write && reading == c.reading)
+        return;
+    c.want_write = want_write;
+    c.reading = reading;
+    uint32_t ev = EPOLLRDHUP;
+    if (reading)
+        ev |= EPOLLIN;
+    if (want_write)
+        ev |= EPOLLOUT;
+    loop.modify(c.fd.get(), ev);
+}
+
+void Server::Impl::send(Connection& c, FrameType t, uint32_t stream, std::string_view payload) {
+    c.out += make_frame(t, stream, payload);
+}
+
+void Server::Impl::send_status(Connection& c, FrameType t, uint32_t stream, Status s,
+                               uint64_t value, const std::string& msg) {
+    send(c, t, stream, StatusMsg{s, value, msg}.encode());
+}
+
+bool Server::Impl::handle_frame(Connection& c, const FrameHeader& h, std::string_view payload) {
+    if (!c.authed && h.type != FrameType::Hello) {
+        send_status(c, FrameType::Error, 0, Status::AuthFailed, 0, "hello required");
+        flush(c);
+        return false;
+    }
+    switch (h.type) {
+    case FrameType::Hello:
+        handle_hello(c, payload);
+        return c.authed;
+    case FrameType::Ping:
+        send(c, FrameType::Pong, h.stream, payload);
+        return true;
+    case FrameType::PutBegin:
+        handle_put_begin(c, h.stream, payload);
+        return true;
+    case FrameType::Data:
+        handle_data(c, h, payload);
+        return true;
+    case FrameType::PutEnd:
+        handle_put_end(c, h.stream, payload);
+        return true;
+    case FrameType::Copy:
+        handle_copy(c, h.stream, payload);
+        return true;
+    case FrameType::Parity:
+        handle_parity(c, h.stream, payload);
+        return true;
+    case FrameType::GetBegin:
+        handle_get(c, h.stream, payload);
+        return true;
+    case FrameType::Manifest:
+        handle_manifest(c, h.stream, payload);
+        return true;
+    case FrameType::Bundle:
+        handle_bundle(c, h.stream, payload);
+        return true;
+    default:
+        send_status(c, FrameType::Error, h.stream, Status::BadRequest, 0, "unexpected frame");
+        return false;
+    }
+}
+
+void Server::Impl::handle_hello(Connection& c, std::string_view payload) {
+    StageTimer t(Stage::Handshake);
+    HelloMsg m = HelloMsg::decode(payload);
+    // Constant-time compare so the token cannot be probed byte by byte.
+    unsigned diff = m.token.size() != cfg.token.size();
+    for (size_t i = 0; i < m.token.size() && i < cfg.token.size(); ++i)
+        diff |= static_cast<unsigned char>(m.token[i] ^ cfg.token[i]);
+    if (diff != 0 || m.version != kProtocolVersion) {
+        send_status(c, FrameType::Error, 0, Status::AuthFailed, 0,
+                    diff ? "bad token" : "protocol version mismatch");
+        flush(c);
+        return;
+    }
+    c.authed = true;
+    c.client_id = m.client_id;
+    attach_client(c);
+    send(c, FrameType::HelloAck, 0, HelloAckMsg{}.encode());
+}
+
+void Server::Impl::handle_put_begin(Connection& c, uint32_t stream, std::string_view payload) {
+    PutBeginMsg m = PutBeginMsg::decode(payload);
+    try {
+        if (!is_safe_relative_path(m.remote_dir) || !is_safe_file_name(m.name) ||
+            m.name.size() > 200 || m.name == DirIndex::kFileName ||
+            m.name == ResumeJournal::kFileName)
+            throw StreamError{Status::PathRejected, m.remote_dir + "/" + m.name};
+        std::string skey;
+        if (m.flags & kPutStriped) {
+            if (m.stripes < 2 || m.stripes > kMaxStripes || !m.relay.empty() ||
+                (m.flags & (kPutResume | kPutAcked | kPutDelta | kPutFec)))
+                throw StreamError{Status::BadRequest, "bad striped put"};
+            skey = stripe_key(m);
+            if (auto sp = striped.find(skey); sp != striped.end()) {
+                join_striped(c, stream, m, sp->second);
+                return;
+            }
+        }
+        if (draining())
+            throw StreamError{Status::Busy, "server restarting"};
+        Upload u;
+        try {
+            u.dir = dirs->open(m.remote_dir, true);
+        } catch (const std::system_error& e) {
+            throw StreamError{Status::IoError, e.what()};
+        }
+        u.rel_dir = trim_slashes(m.remote_dir);
+        // Taken either way: a fresh put makes an old entry stale.
+        std::optional<JournalEntry> entry = journal->take(journal_key(u.rel_dir, m.name));
+        bool resume = m.flags & kPutResume;
+        u.file = std::make_shared<Fd>(::openat(u.dir->get(), part_name(m.name).c_str(),
+                                               O_WRONLY | O_CREAT | O_CLOEXEC | O_NOFOLLOW, 0600));
+        if (!*u.file)
+            throw StreamError{Status::IoError, std::strerror(errno)};
+        struct stat st{};
+        if (::fstat(u.file->get(), &st) != 0)
+            throw StreamError{Status::IoError, std::strerror(errno)};
+        u.serial = next_upload_serial++;
+        if (!(m.flags & (kPutFec | kPutDelta)))
+            u.lane = writers->lane_for(st.st_dev, st.st_ino);
+        bool resume_later = false;
+        if (!resume) {
+            // Through the lane, so that writes an earlier upload of the file
+            // still has queued land before it.
+            if (u.lane && !skey.empty()) {
+                ++u.writes_pending;
+                writers->truncate(u.lane, u.file, 0,
+                                  [this, skey, serial = u.serial, fd = c.fd.get(),
+                                   id = c.id](int error, std::chrono::nanoseconds took) {
+                                      loop.post([=, this] {
+                                          on_striped_written(skey, serial, fd, id, 0, error, took);
+                                      });
+                                  });
+            } else if (u.lane) {
+                ++u.writes_pending;
+                writers->truncate(u.lane, u.file, 0, written_callback(c, stream, u.serial, 0, 0));
+            } else {
+                ::ftruncate(u.file->get(), 0);
+            }
+        } else if (u.lane) {
+            // The file's size is only known once an earlier upload's queued
+            // writes have landed; PutReady waits for them.
+            ++u.writes_pending;
+            resume_later = true;
+            writers->flush(u.lane, [this, fd = c.fd.get(), id = c.id, stream, serial = u.serial,
+                                    size = m.size, mtime_ns = m.mtime_ns,
+                                    entry](int, std::chrono::nanoseconds) {
+                loop.post([=, this] {
+                    on_resume_flushed(fd, id, stream, serial, size, mtime_ns, entry);
+                });
+            });
+        } else {
+            resume_from_disk(c, stream, u, m.size, m.mtime_ns, entry);
+        }
+        if (m.flags & kPutFec) {
+            size_t shards = size_t{m.fec_data} + m.fec_parity;
+            if (m.fec_data == 0 || m.fec_parity == 0 || m.fec_chunk == 0 ||
+                shards * m.fec_chunk > kMaxFecGroupBytes || (m.flags & kPutDelta))
+                throw StreamError{Status::BadRequest, "bad FEC geometry"};
+            u.fec = std::make_unique<FecState>(m.fec_data, m.fec_parity, m.fec_chunk);
+            u.crc_valid = false; // repairs land out of order
+        }
+        u.name = m.name;
+        u.size = m.size;
+        u.mode = m.mode & 0777; // never setuid, setgid or sticky from a client
+        u.mtime_ns = m.mtime_ns;
+        u.flags = m.flags;
+        u.dir_bucket = dir_bucket(m.remote_dir);
+        u.priority = m.priority;
+        u.deadline_set = m.deadline_ms != 0;
+        u.due = EventLoop::Clock::now() + (u.deadline_set ? std::chrono::milliseconds(m.deadline_ms)
+                                                         : default_slack(m.priority));
+        if ((m.flags & kPutDelta) && !resume) {
+            auto basis = std::make_shared<const Fd>(
+                ::openat(u.dir->get(), m.name.c_str(), O_RDONLY | O_NOFOLLOW | O_CLOEXEC));
+            struct stat st{};
+            if (*basis && ::fstat(basis->get(), &st) == 0 && S_ISREG(st.st_mode)) {
+                u.basis = std::move(basis);
+                u.basis_size = static_cast<uint64_t>(st.st_size);
+            }
+        }
+        if (m.mirrors.size() > kMaxMirrors)
+            throw StreamError{Status::BadRequest, "too many mirrors"};
+        for (const std::string& dir : m.mirrors) {
+            if (!is_safe_relative_path(dir))
+                throw StreamError{Status::PathRejected, dir + "/" + m.name};
+            u.mirrors.push_back(trim_slashes(dir));
+        }
+        if (!m.relay.empty()) {
+            if (!cfg.allow_relay)
+                throw StreamError{Status::Unsupported, "relaying is disabled"};
+            if (m.relay.size() > kMaxRelayHops || (m.flags & (kPutResume | kPutDelta)))
+                throw StreamError{Status::BadRequest, "bad relay request"};
+            Endpoint next;
+            try {
+                next = Endpoint::parse(m.relay.front());
+            } catch (const Error&) {
+                throw StreamError{Status::BadRequest, "bad relay hop " + m.relay.front()};
+            }
+            // The next hop gets the rest of the chain; its acks are not needed.
+            PutBeginMsg fwd = m;
+            fwd.relay.erase(fwd.relay.begin());
+            fwd.flags &= ~kPutAcked;
+            u.relay = &relay_link(c, next);
+            u.relay->forward({FrameType::PutBegin, 0, stream, 0, 0}, fwd.encode());
+            c.relay_acks[stream] = {};
+        }
+        if (!skey.empty()) {
+            StripedPut& sp = striped[skey];
+            sp.stripes = m.stripes;
+            sp.u = std::move(u);
+            join_striped(c, stream, m, sp);
+            loop.run_after(kStripeJoinTimeout, [this, skey, serial = sp.u.serial] {
+                auto it = striped.find(skey);
+                if (it == striped.end() || it->second.u.serial != serial)
+                    return;
+                if (it->second.members.size() < it->second.stripes)
+                    fail_striped(skey, Status::IoError, "not every stripe connected");
+                if (auto left = striped.find(skey); left != striped.end() && left->second.failed)
+                    striped.erase(left);
+            });
+            return;
+        }
+        uint64_t offset = u.next_offset;
+        Upload& stored = c.uploads[stream] = std::move(u);
+        if (resume && !resume_later)
+            send_status(c, FrameType::PutReady, stream, Status::Ok, offset, "");
+        if ((m.flags & kPutDelta) && !resume)
+            send_signatures(c, stream, stored);
+    } catch (const StreamError& e) {
+        errors.fetch_add(1, std::memory_order_relaxed);
+        ack_put(c, stream, e.status, 0, e.message);
+    }
+}
+
+void Server::Impl::resume_from_disk(Connection& c, uint32_t stream, Upload& u, uint64_t size,
+                                    int64_t mtime_ns, const std::optional<JournalEntry>& entry) {
+    struct stat st{};
+    if (::fstat(u.file->get(), &st) != 0)
+        throw StreamError{Status::IoError, std::strerror(errno)};
+    const auto have = static_cast<uint64_t>(st.st_size);
+    uint64_t keep = have > size ? 0 : have;
+    // The journaled prefix's CRC is known; PutEnd need not re-read it.
+    const bool journaled = entry && entry->size == size && entry->mtime_ns == mtime_ns &&
+                           entry->offset <= keep;
+    if (journaled)
+        keep = entry->offset;
+    if (keep < have) {
+        if (u.lane) {
+            ++u.writes_pending;
+            writers->truncate(u.lane, u.file, keep, written_callback(c, stream, u.serial, keep, 0));
+        } else if (::ftruncate(u.file->get(), static_cast<off_t>(keep)) != 0) {
+            throw StreamError{Status::IoError, std::strerror(errno)};
+        }
+    }
+    u.next_offset = keep;
+    u.crc_valid = journaled || keep == 0;
+    if (journaled) {
+        u.crc = entry->crc;
+        journal_resumes.fetch_add(1, std::memory_order_relaxed);
+    }
+}
+
+void Server::Impl::on_resume_flushed(int fd, uint64_t id, uint32_t stream, uint64_t serial,
+                                     uint64_t size, int64_t mtime_ns,
+                                     const std::optional<JournalEntry>& entry) {
+    auto cit = conns.find(fd);
+    if (cit == conns.end() || cit->second->id != id)
+        return;
+    Connection& c = *cit->second;
+    auto it = c.uploads.find(stream);
+    if (it == c.uploads.end() || it->second.serial != serial)
+        return;
+    Upload& u = it->second;
+    --u.writes_pending;
+    try {
+        resume_from_disk(c, stream, u, size, mtime_ns, entry);
+        send_status(c, FrameType::PutReady, stream, Status::Ok, u.next_offset, "");
+        if (u.writes_pending == 0 && u.end) { // PutEnd sent without waiting
+            PutEndMsg m = std::move(*u.end);
+            finish_put_end(c, stream, m);
+        }
+    } catch (const StreamError& e) {
+        errors.fetch_add(1, std::memory_order_relaxed);
+        ack_put(c, stream, e.status, 0, e.message);
+        c.uploads.erase(it);
+    }
+    flush_conn(fd, id);
+}
+
+void Server::Impl::handle_data(Connection& c, const FrameHeader& h, std::string_view payload) {
+    const uint32_t stream = h.stream;
+    auto it = c.uploads.find(stream);
+    if (it == c.uploads.end())
+        return; // stream already failed and was acked with an error
+    Upload& u = it->second;
+    if (u.relay)
+        u.relay->forward(h, payload);
+    WireReader r(payload);
+    uint64_t offset = r.u64();
+    const char* data = r.pos();
+    size_t n = r.remaining();
+    if (auto codec = static_cast<Codec>(h.flags & kDataCodecMask); codec != Codec::None) {
+        if (h.aux > kMaxFramePayload)
+            throw ProtocolError("compressed chunk too large");
+        c.scratch.resize(h.aux);
+        StageTimer t(Stage::Compress, h.aux);
+        codec_decompress(codec, data, n, c.scratch.data(), h.aux);
+        data = c.scratch.data();
+        n = h.aux;
+    }
+    if (offset > u.size || n > u.size - offset) {
+        ack_put(c, stream, Status::SizeMismatch, 0, "data past end");
+        c.uploads.erase(it);
+        return;
+    }
+    if (u.stripe) {
+        if (u.flags & kPutChecksum) {
+            StageTimer t(Stage::Hash, n);
+            u.crc = crc32_update(u.crc, data, n);
+        }
+        bytes.fetch_add(n, std::memory_order_relaxed);
+        striped_data(c, u, offset, data, n);
+        charge(c, u, payload.size());
+        return;
+    }
+    if (u.fec) {
+        // Kept as received; a damaged copy is caught by its CRC later.
+        try {
+            const FecState& f = *u.fec;
+            if (offset % f.chunk != 0 || n > f.chunk)
+                throw StreamError{Status::BadRequest, "FEC chunk out of place"};
+            const uint64_t index = offset / f.chunk;
+            const size_t k = f.rs.data_shards();
+            FecGroup& g = fec_group(u, index / k);
+            std::vector<uint8_t>& shard = g.shards[index % k];
+            shard.assign(f.chunk, 0);
+            std::memcpy(shard.data(), data, n);
+            g.have[index % k] = true;
+        } catch (const StreamError& e) {
+            errors.fetch_add(1, std::memory_order_relaxed);
+            ack_put(c, stream, e.status, 0, e.message);
+            c.uploads.erase(it);
+            return;
+        }
+    }
+    std::chrono::microseconds took{};
+    if (u.lane) {
+        // Acked from on_written() once it is on disk.
+        ++u.writes_pending;
+        c.write_behind += n;
+        writers->submit(u.lane, u.file, offset, std::vector<char>(data, data + n),
+                        written_callback(c, stream, u.serial, offset + n, n));
+    } else {
+        TCPTRANSFER_TRACE_SPAN("pwrite", n);
+        auto write_start = std::chrono::steady_clock::now();
+        size_t done = 0;
+        while (done < n) {
+            ssize_t w = ::pwrite(u.file->get(), data + done, n - done,
+                                 static_cast<off_t>(offset + done));
+            if (w < 0) {
+                if (errno == EINTR)
+                    continue;
+                errors.fetch_add(1, std::memory_order_relaxed);
+                ack_put(c, stream, Status::IoError, 0, std::strerror(errno));
+                c.uploads.erase(it);
+                return;
+            }
+            done += static_cast<size_t>(w);
+        }
+        auto write_end = std::chrono::steady_clock::now();
+        record_stage(Stage::Write, elapsed_ns(write_start, write_end), n);
+        took = std::chrono::duration_cast<std::chrono::microseconds>(write_end - write_start);
+    }
+    if (u.crc_valid && offset == u.next_offset && (u.flags & kPutChecksum)) {
+        StageTimer t(Stage::Hash, n);
+        u.crc = crc32_update(u.crc, data, n);
+    } else if (offset != u.next_offset)
+        u.crc_valid = false;
+    u.next_offset = offset + n;
+    bytes.fetch_add(n, std::memory_order_relaxed);
+    if ((u.flags & kPutAcked) && !u.lane)
+        send(c, FrameType::DataAck, stream,
+             DataAckMsg{u.next_offset, static_cast<uint32_t>(took.count())}.encode());
+    charge(c, u, payload.size());
+    check_relay(c, u);
+    throttle_write_behind(c);
+}
+
+void Server::Impl::throttle_write_behind(Connection& c) {
+    if (c.write_behind > kMaxWriteBehind && !c.throttled) {
+        // The disk is behind the network: let the socket buffer fill.
+        c.throttled = true;
+        c.write_paused = true;
+        update_interest(c);
+    }
+}
+
+DiskWriters::Done Server::Impl::written_callback(const Connection& c, uint32_t stream,
+                                                 uint64_t serial, uint64_t end, size_t n) {
+    return [this, fd = c.fd.get(), id = c.id, stream, serial, end,
+            n](int error, std::chrono::nanoseconds took) {
+        loop.post([this, fd, id, stream, serial, end, n, error, took] {
+            on_written(fd, id, stream, serial, end, n, error, took);
+        });
+    };
+}
+
+void Server::Impl::on_written(int fd, uint64_t id, uint32_t stream, uint64_t serial,
+                              uint64_t end, size_t n, int error, std::chrono::nanoseconds took) {
+    if (n > 0)
+        record_stage(Stage::Write, static_cast<uint64_t>(took.count()), n);
+    auto cit = conns.find(fd);
+    if (cit == conns.end() || cit->second->id != id)
+        return;
+    Connection& c = *cit->second;
+    auto it = c.uploads.find(stream);
+    if (it != c.uploads.end() && it->second.serial == serial) {
+        Upload& u = it->second;
+        --u.writes_pending;
+        if (error != 0) {
+            errors.fetch_add(1, std::memory_order_relaxed);
+            ack_put(c, stream, Status::IoError, 0, std::strerror(error));
+            c.uploads.erase(it);
+        } else {
+            if ((u.flags & kPutAcked) && n > 0) {
+                auto us = std::chrono::duration_cast<std::chrono::microseconds>(took);
+                send(c, FrameType::DataAck, stream,
+                     DataAckMsg{end, static_cast<uint32_t>(us.count())}.encode());
+            }
+            if (u.writes_pending == 0 && u.end) {
+                PutEndMsg m = std::move(*u.end);
+                finish_put_end(c, stream, m);
+            }
+        }
+    }
+    if (release_write_behind(c, n))
+        flush_conn(fd, id);
+}
+
+bool Server::Impl::release_write_behind(Connection& c, size_t n) {
+    c.write_behind -= n;
+    if (!c.write_paused || c.write_behind > kMaxWriteBehind / 2)
+        return true;
+    const int fd = c.fd.get();
+    c.write_paused = false;
+    resume_reading(fd, c.id);
+    return conns.count(fd) > 0;
+}
+
+std::string Server::Impl::stripe_key(const PutBeginMsg& m) {
+    return trim_slashes(m.remote_dir) + "/" + m.name + "#" + std::to_string(m.stripe_key);
+}
+
+Upload Server::Impl::stripe_member(const PutBeginMsg& m, const std::string& key) {
+    Upload member;
+    member.rel_dir = trim_slashes(m.remote_dir);
+    member.name = m.name;
+    member.size = m.size;
+    member.flags = m.flags;
+    member.crc_valid = false; // nothing of it to journal
+    member.dir_bucket = dir_bucket(m.remote_dir);
+    member.priority = m.priority;
+    member.deadline_set = m.deadline_ms != 0;
+    member.due = EventLoop::Clock::now() + (member.deadline_set
+                                                ? std::chrono::milliseconds(m.deadline_ms)
+                                                : default_slack(m.priority));
+    member.stripe = std::make_unique<StripeSeat>();
+    member.stripe->key = key;
+    member.stripe->on_drop = [this, key] {
+        // Runs while the connection or its uploads are being torn down.
+        loop.post([this, key] { fail_striped(key, Status::IoError, "a stripe was lost"); });
+    };
+    return member;
+}
+
+void Server::Impl::join_striped(Connection& c, uint32_t stream, const PutBeginMsg& m,
+                                StripedPut& sp) {
+    const std::string key = stripe_key(m);
+    if (sp.failed) {
+        sp.members.push_back({c.fd.get(), c.id, stream});
+        if (sp.members.size() >= sp.stripes)
+            striped.erase(key);
+        throw StreamError{Status::IoError, "another stripe of the put failed"};
+    }
+    if (sp.members.size() >= sp.stripes || m.stripes != sp.stripes || m.size != sp.u.size ||
+        m.mtime_ns != sp.u.mtime_ns)
+        throw StreamError{Status::BadRequest, "striped put does not match its other stripes"};
+    sp.members.push_back({c.fd.get(), c.id, stream});
+    c.uploads[stream] = stripe_member(m, key);
+}
+
+void Server::Impl::striped_data(Connection& c, Upload& member, uint64_t offset, const char* data,
+                                size_t n) {
+    const std::string& key = member.stripe->key;
+    auto it = striped.find(key);
+    if (it == striped.end() || it->second.failed)
+        return; // the member is dropped with it
+    StripedPut& sp = it->second;
+    sp.received += n;
+    std::vector<char> chunk(data, data + n);
+    if (sp.spilled) {
+        write_striped(c, key, sp, offset, std::move(chunk));
+        return;
+    }
+    if (offset != sp.u.next_offset) {
+        if (offset < sp.u.next_offset || !sp.held.insert(offset, std::move(chunk))) {
+            fail_striped(key, Status::BadRequest, "striped chunks overlap");
+            return;
+        }
+        chunks_reordered.fetch_add(1, std::memory_order_relaxed);
+        if (sp.held.bytes() > kMaxReorderBytes) {
+            // The stripes drifted too far apart; stop waiting for the gap.
+            sp.spilled = true;
+            reorder_spills.fetch_add(1, std::memory_order_relaxed);
+            for (auto& [at, held] : sp.held.take_all())
+                write_striped(c, key, sp, at, std::move(held));
+        }
+        return;
+    }
+    sp.u.next_offset += n;
+    write_striped(c, key, sp, offset, std::move(chunk));
+    for (auto& [at, held] : sp.held.take_from(sp.u.next_offset)) {
+        sp.u.next_offset += held.size();
+        write_striped(c, key, sp, at, std::move(held));
+    }
+}
+
+void Server::Impl::write_striped(Connection& c, const std::string& key, StripedPut& sp,
+                                 uint64_t offset, std::vector<char> data) {
+    const size_t n = data.size();
+    ++sp.u.writes_pending;
+    c.write_behind += n;
+    writers->submit(sp.u.lane, sp.u.file, offset, std::move(data),
+                    [this, key, serial = sp.u.serial, fd = c.fd.get(), id = c.id,
+                     n](int error, std::chrono::nanoseconds took) {
+                        loop.post([=, this] {
+                            on_striped_written(key, serial, fd, id, n, error, took);
+                        });
+                    });
+    if (c.write_behind > kMaxWriteBehind && !c.throttled) {
+        c.throttled = true;
+        c.write_paused = true;
+        update_interest(c);
+    }
+}
+
+void Server::Impl::on_striped_written(const std::string& key, uint64_t serial, int fd,
+                                      uint64_t id, size_t n, int error,
+                                      std::chrono::nanoseconds took) {
+    if (n > 0)
+        record_stage(Stage::Write, static_cast<uint64_t>(took.count()), n);
+    if (auto cit = conns.find(fd); cit != conns.end() && cit->second->id == id) {
+        if (release_write_behind(*cit->second, n))
+            flush_conn(fd, id);
+    }
+    auto it = striped.find(key);
+    if (it == striped.end() || it->second.u.serial != serial || it->second.failed)
+        return;
+    --it->second.u.writes_pending;
+    if (error != 0)
+        fail_striped(key, Status::IoError, std::strerror(error));
+    else
+        check_striped(key);
+}
+
+void Server::Impl::check_striped(const std::string& key) {
+    auto it = striped.find(key);
+    StripedPut& sp = it->second;
+    if (sp.failed || sp.ended < sp.stripes || sp.u.writes_pending > 0)
+        return;
+    if (!sp.held.empty() || sp.received != sp.u.size) {
+        fail_striped(key, Status::SizeMismatch,
+                     "received " + std::to_string(sp.received) + " of " +
+                         std::to_string(sp.u.size));
+        return;
+    }
+    StripedPut done = std::move(sp);
+    striped.erase(it);
+    // Each connection's CRC was checked at its PutEnd.
+    done.u.flags &= ~kPutChecksum;
+    TCPTRANSFER_TRACE_SPAN("put_end", done.u.size);
+    try {
+        commit_upload(done.u, PutEndMsg{}, done.members.front(),
+                      {done.members.begin() + 1, done.members.end()});
+    } catch (const StreamError& e) {
+        errors.fetch_add(1, std::memory_order_relaxed);
+        for (const StreamRef& r : done.members) {
+            auto cit = conns.find(r.conn_fd);
+            if (cit == conns.end() || cit->second->id != r.conn_id)
+                continue;
+            ack_put(*cit->second, r.stream, e.status, 0, e.message);
+            flush_conn(r.conn_fd, r.conn_id);
+        }
+    }
+}
+
+void Server::Impl::fail_striped(const std::string& key, Status s, const std::string& msg) {
+    auto it = striped.find(key);
+    if (it == striped.end() || it->second.failed)
+        return;
+    StripedPut& sp = it->second;
+    sp.failed = true;
+    sp.held = {};
+    errors.fetch_add(1, std::memory_order_relaxed);
+    // Writes still queued hold the file; the .part is left for a later put.
+    for (const StreamRef& r : sp.members) {
+        auto cit = conns.find(r.conn_fd);
+        if (cit == conns.end() || cit->second->id != r.conn_id)
+            continue;
+        Connection& c = *cit->second;
+        if (auto u = c.uploads.find(r.stream); u != c.uploads.end() && u->second.stripe) {
+            u->second.stripe->on_drop = nullptr;
+            c.uploads.erase(u);
+        }
+        ack_put(c, r.stream, s, 0, msg);
+        flush_conn(r.conn_fd, r.conn_id);
+    }
+    if (sp.members.size() >= sp.stripes)
+        striped.erase(key);
+}
+
+void Server::Impl::attach_client(Connection& c) {
+    c.shaping_key = c.client_id.empty() ? std::string("@").append(peer_address(c.fd.get()))
+                                          : c.client_id;
+    auto [it, fresh] = shaping.try_emplace(c.shaping_key);
+    ClientShaping& cs = it->second;
+    if (fresh) {
+        cs.cap = cfg.client_limit;
+        if (auto p = cfg.clients.find(c.client_id); p != cfg.clients.end()) {
+            cs.weight = std::max<uint32_t>(p->second.weight, 1);
+            if (p->second.limit.limited())
+                cs.cap = p->second.limit;
+        }
+        cs.bucket->set_limit(cfg.max_ingest_rate ? RateLimit{joining_share(cs), cs.cap.burst}
+                                                 : cs.cap);
+    }
+    ++cs.conns;
+    c.bucket = cs.bucket;
+}
+
+void Server::Impl::detach_client(Connection& c) {
+    auto it = shaping.find(c.shaping_key);
+    if (c.shaping_key.empty() || it == shaping.end())
+        return;
+    if (--it->second.conns == 0)
+        shaping.erase(it);
+}
+
+std::shared_ptr<TokenBucket> Server::Impl::dir_bucket(const std::string& remote_dir) const {
+    std::string dir = trim_slashes(remote_dir);
+    for (const auto& [prefix, bucket] : dir_buckets)
+        if (dir_has_prefix(dir, prefix))
+            return bucket;
+    return nullptr;
+}
+
+void Server::Impl::charge(Connection& c, const Upload& u, size_t n) {
+    auto now = TokenBucket::Clock::now();
+    TokenBucket::Clock::duration wait{};
+    if (c.bucket)
+        wait = c.bucket->charge(n, now);
+    if (u.dir_bucket)
+        wait = std::max(wait, u.dir_bucket->charge(n, now));
+    if (wait <= TokenBucket::Clock::duration::zero() || c.throttled)
+        return;
+    // Stop reading; the socket buffer fills and TCP slows the sender down.
+    c.throttled = true;
+    throttle_pauses.fetch_add(1, std::memory_order_relaxed);
+    update_interest(c);
+    auto ms = std::max(std::chrono::ceil<std::chrono::milliseconds>(wait),
+                       std::chrono::milliseconds(1));
+    TCPTRANSFER_TRACE_SPAN("throttle", static_cast<uint64_t>(ms.count()));
+    loop.run_after(ms, [this, fd = c.fd.get(), id = c.id] { resume_reading(fd, id); });
+}
+
+void Server::Impl::resume_reading(int fd, uint64_t id) {
+    auto it = conns.find(fd);
+    if (it == conns.end() || it->second->id != id)
+        return;
+    if (it->second->write_paused)
+        return; // on_written() resumes it
+    it->second->throttled = false;
+    update_interest(*it->second);
+    // Frames already buffered will not raise another readiness event.
+    on_event(fd, EPOLLIN);
+}
+
+void Server::Impl::rebalance() {
+    std::vector<ClientShaping*> active;
+    std::vector<uint32_t> weights;
+    std::vector<uint64_t> caps;
+    uint32_t active_weight = 0;
+    for (auto& [key, cs] : shaping) {
+        uint64_t charged = cs.bucket->charged();
+        bool sending = charged != cs.seen;
+        cs.seen = charged;
+        if (!sending)
+            continue;
+        active.push_back(&cs);
+        weights.push_back(cs.weight);
+        caps.push_back(cs.cap.bytes_per_sec);
+        active_weight += cs.weight;
+    }
+    std::vector<uint64_t> shares = weighted_fair_shares(cfg.max_ingest_rate, weights, caps);
+    for (size_t i = 0; i < active.size(); ++i)
+        active[i]->bucket->set_limit({shares[i], active[i]->cap.burst});
+    // Idle clients get the share they would have if they started now, so a
+    // new small upload is not stuck behind a stale rate until the next pass.
+    last_active_weight = active_weight;
+    for (auto& [key, cs] : shaping)
+        if (std::find(active.begin(), active.end(), &cs) == active.end())
+            cs.bucket->set_limit({joining_share(cs), cs.cap.burst});
+    loop.run_after(kRebalanceInterval, [this] { rebalance(); });
+}
+
+uint64_t Server::Impl::joining_share(const ClientShaping& cs) const {
+    uint64_t share = static_cast<uint64_t>(static_cast<unsigned __int128>(cfg.max_ingest_rate) *
+                                           cs.weight / (last_active_weight + cs.weight));
+    if (cs.cap.limited())
+        share = std::min(share, cs.cap.bytes_per_sec);
+    return std::max<uint64_t>(share, 1);
+}
+
+void Server::Impl::send_signatures(Connection& c, uint32_t stream, const Upload& u) {
+    if (!u.basis || u.basis_size == 0) {
+        send(c, FrameType::Signatures, stream, SignaturesMsg{}.encode());
+        return;
+    }
+    // Hashing a large basis must not stall the loop: run it on the pool,
+    // holding the basis so a connection closing meanwhile cannot pull it away.
+    auto basis = u.basis;
+    int fd = c.fd.get();
+    uint64_t id = c.id;
+    uint64_t size = u.basis_size;
+    int cpu = socket_cpu(fd);
+    cpu_pool->submit(
+        [this, basis, fd, id, size, stream, cpu] {
+            std::string payload;
+            try {
+                payload = compute_signatures(basis->get(), size, cpu_pool.get(), cpu).encode();
+            } catch (const std::exception&) {
+                payload = SignaturesMsg{}.encode(); // unreadable basis: send everything
+            }
+            loop.post([this, fd, id, stream, payload = std::move(payload)] {
+                auto it = conns.find(fd);
+                if (it == conns.end() || it->second->id != id)
+                    return;
+                Connection& c = *it->second;
+                if (!c.uploads.count(stream))
+                    return;
+                send(c, FrameType::Signatures, stream, payload);
+                if (!flush(c))
+                    close_conn(fd);
+            });
+        },
+        cpu);
+}
+
+void Server::Impl::handle_copy(Connection& c, uint32_t stream, std::string_view payload) {
+    auto it = c.uploads.find(stream);
+    if (it == c.uploads.end())
+        return;
+    Upload& u = it->second;
+    CopyMsg m = CopyMsg::decode(payload);
+    if (!u.basis || m.length > kMaxCopyFrame || m.offset > u.size ||
+        m.length > u.size - m.offset || m.source > u.basis_size ||
+        m.length > u.basis_size - m.source) {
+        errors.fetch_add(1, std::memory_order_relaxed);
+        ack_put(c, stream, Status::BadRequest, 0, "bad copy range");
+        c.uploads.erase(it);
+        return;
+    }
+    // On the metadata pool, so a slow disk stalls no other connection;
+    // acked like a queued write, from on_written(). The bytes are not seen
+    // here, so the CRC is taken from the file at PutEnd.
+    ++u.writes_pending;
+    c.write_behind += m.length;
+    u.crc_valid = false;
+    u.next_offset = m.offset + m.length;
+    meta_pool->submit([this, src = u.basis, dst = u.file, m,
+                       done = written_callback(c, stream, u.serial, m.offset + m.length,
+                                               static_cast<size_t>(m.length))] {
+        TCPTRANSFER_TRACE_SPAN("copy", m.length);
+        auto start = std::chrono::steady_clock::now();
+        int error = copy_range(src->get(), m.source, dst->get(), m.offset, m.length) ? 0 : errno;
+        done(error, std::chrono::steady_clock::now() - start);
+    });
+    charge(c, u, static_cast<size_t>(m.length));
+    throttle_write_behind(c);
+    delta_reused.fetch_add(m.length, std::memory_order_relaxed);
+}
+
+void Server::Impl::ack_put(Connection& c, uint32_t stream, Status s, uint64_t value,
+                           const std::string& msg) {
+    auto it = c.relay_acks.find(stream);
+    if (it == c.relay_acks.end()) {
+        send_status(c, FrameType::PutAck, stream, s, value, msg);
+        return;
+    }
+    RelayAck& r = it->second;
+    if (s == Status::Ok && !r.remote) {
+        r.local = StatusMsg{s, value, msg};
+        return; // the next hop's answer completes it
+    }
+    // A local failure is final; the next hop's answer no longer matters.
+    if (s == Status::Ok && r.remote->status != Status::Ok)
+        send_status(c, FrameType::PutAck, stream, r.remote->status, 0, r.remote->message);
+    else
+        send_status(c, FrameType::PutAck, stream, s, value, msg);
+    c.relay_acks.erase(it);
+}
+
+RelayLink& Server::Impl::relay_link(Connection& c, const Endpoint& next) {
+    std::unique_ptr<RelayLink>& link = c.relays[next];
+    if (!link) {
+        HelloMsg hello;
+        hello.token = cfg.relay_token.empty() ? cfg.token : cfg.relay_token;
+        hello.client_id = c.client_id;
+        int fd = c.fd.get();
+        uint64_t id = c.id;
+        link = std::make_unique<RelayLink>(
+            next, std::move(hello), kRelayConnectTimeout,
+            [this, fd, id](uint32_t stream, StatusMsg m) {
+                loop.post([this, fd, id, stream, m = std::move(m)]() mutable {
+                    on_relay_ack(fd, id, stream, std::move(m));
+                });
+            },
+            [this, fd, id] { loop.post([this, fd, id] { resume_reading(fd, id); }); });
+    }
+    return *link;
+}
+
+void Server::Impl::on_relay_ack(int fd, uint64_t id, uint32_t stream, StatusMsg m) {
+    auto it = conns.find(fd);
+    if (it == conns.end() || it->second->id != id)
+        return;
+    Connection& c = *it->second;
+    auto ack = c.relay_acks.find(stream);
+    if (ack == c.relay_acks.end())
+        return;
+    if (m.status != Status::Ok)
+        m.message = "relay: " + m.message;
+    ack->second.remote = std::move(m);
+    if (!ack->second.local)
+        return;
+    StatusMsg local = std::move(*ack->second.local);
+    ack_put(c, stream, local.status, local.value, local.message);
+    flush_conn(fd, id);
+}
+
+void Server::Impl::check_relay(Connection& c, const Upload& u) {
+    if (!u.relay || c.throttled || !u.relay->congested())
+        return;
+    c.throttled = true;
+    update_interest(c);
+}
+
+void Server::Impl::handle_get(Connection& c, uint32_t stream, std::string_view payload) {
+    GetMsg m = GetMsg::decode(payload);
+    GetReadyMsg ready;
+    try {
+        if (draining())
+            throw StreamError{Status::Busy, "server restarting"};
+        size_t slash = m.path.rfind('/');
+        std::string dir = slash == std::string::npos ? "" : m.path.substr(0, slash);
+        std::string name = slash == std::string::npos ? m.path : m.path.substr(slash + 1);
+        if (!is_safe_relative_path(m.path) || !is_safe_file_name(name))
+            throw StreamError{Status::PathRejected, m.path};
+        Download d;
+        try {
+            d.file = file_cache->open(dirs->open(dir, false)->get(), m.path, name);
+        } catch (const std::system_error& e) {
+            throw StreamError{Status::IoError, m.path + ": " + e.code().message()};
+        }
+        if (!d.file->regular)
+            throw StreamError{Status::BadRequest, m.path + " is not a regular file"};
+        ready.size = d.file->size;
+        ready.mode = d.file->mode;
+        ready.mtime_ns = d.file->mtime_ns;
+        if (m.offset > ready.size)
+            throw StreamError{Status::BadRequest, "range past end of " + m.path};
+        ready.length = std::min(m.length, ready.size - m.offset);
+        d.stream = stream;
+        d.next = m.offset;
+        d.end = m.offset + ready.length;
+        if ((m.flags & kGetChecksum) && ready.length > 0) {
+            if (auto crc = d.file->crc(m.offset, ready.length)) {
+                d.crc = *crc;
+            } else {
+                d.crc_ready = false;
+                cpu_pool->submit([this, file = d.file, fd = c.fd.get(), id = c.id, stream,
+                                  offset = m.offset, length = ready.length] {
+                    uint32_t crc = file_crc(file->fd.get(), length, offset);
+                    file->remember_crc(offset, length, crc);
+                    loop.post([this, fd, id, stream, crc] {
+                        auto it = conns.find(fd);
+                        if (it == conns.end() || it->second->id != id)
+                            return;
+                        for (Download& d : it->second->downloads)
+                            if (d.stream == stream) {
+                                d.crc = crc;
+                                d.crc_ready = true;
+                            }
+                        flush_conn(fd, id);
+                    });
+                });
+            }
+        }
+        send(c, FrameType::GetReady, stream, ready.encode());
+        c.downloads.push_back(std::move(d));
+    } catch (const StreamError& e) {
+        errors.fetch_add(1, std::memory_order_relaxed);
+        ready.status = e.status;
+        ready.message = e.message;
+        send(c, FrameType::GetReady, stream, ready.encode());
+    }
+}
+
+void Server::Impl::handle_parity(Connection& c, uint32_t stream, std::string_view payload) {
+    auto it = c.uploads.find(stream);
+    if (it == c.uploads.end())
+        return;
+    Upload& u = it->second;
+    if (u.relay)
+        u.relay->forward({FrameType::Parity, 0, stream, 0, 0}, payload);
+    ParityMsg m = ParityMsg::decode(payload);
+    try {
+        if (!u.fec || m.index >= u.fec->rs.parity_shards() || m.shard.size() != u.fec->chunk ||
+            m.data_crcs.size() != u.fec->rs.data_shards())
+            throw StreamError{Status::BadRequest, "bad parity frame"};
+        const size_t k = u.fec->rs.data_shards();
+        FecGroup& g = fec_group(u, m.group);
+        bool intact;
+        {
+            StageTimer t(Stage::Hash, m.shard.size());
+            intact = crc32_update(0, m.shard.data(), m.shard.size()) == m.crc32;
+        }
+        if (intact) {
+            g.shards[k + m.index].assign(m.shard.begin(), m.shard.end());
+            g.have[k + m.index] = true;
+            if (g.crcs.empty())
+                g.crcs = std::move(m.data_crcs);
+        }
+        if (++g.parity == u.fec->rs.parity_shards())
+            settle_fec(u, m.group + 1);
+    } catch (const StreamError& e) {
+        errors.fetch_add(1, std::memory_order_relaxed);
+        ack_put(c, stream, e.status, 0, e.message);
+        c.uploads.erase(it);
+        return;
+    }
+    charge(c, u, payload.size());
+    check_relay(c, u);
+}
+
+FecGroup& Server::Impl::fec_group(Upload& u, uint64_t group) {
+    FecState& f = *u.fec;
+    if (group < f.settled)
+        throw StreamError{Status::BadRequest, "FEC group out of order"};
+    settle_fec(u, group);
+    auto [it, fresh] = f.groups.try_emplace(group);
+    if (fresh) {
+        size_t n = f.rs.data_shards() + f.rs.parity_shards();
+        it->second.shards.resize(n);
+        it->second.have.assign(n, false);
+    }
+    return it->second;
+}
+
+void Server::Impl::settle_fec(Upload& u, uint64_t end) {
+    FecState& f = *u.fec;
+    while (!f.groups.empty() && f.groups.begin()->first < end) {
+        auto node = f.groups.extract(f.groups.begin());
+        repair_group(u, node.key(), node.mapped());
+    }
+    f.settled = std::max(f.settled, end);
+}
+
+void Server::Impl::repair_group(Upload& u, uint64_t group, FecGroup& g) {
+    const FecState& f = *u.fec;
+    const size_t k = f.rs.data_shards();
+    const size_t m = f.rs.parity_shards();
+    const uint64_t base = group * k * f.chunk;
+    std::vector<bool> present(k + m);
+    std::vector<size_t> lens(k);
+    size_t lost = 0;
+    for (size_t i = 0; i < k; ++i) {
+        uint64_t at = base + i * f.chunk;
+        lens[i] = at < u.size ? static_cast<size_t>(std::min<uint64_t>(f.chunk, u.size - at)) : 0;
+        if (lens[i] == 0) {
+            present[i] = true; // past the end: zeros
+            g.shards[i].assign(f.chunk, 0);
+            continue;
+        }
+        if (g.have[i] && !g.crcs.empty()) {
+            StageTimer t(Stage::Hash, lens[i]);
+            present[i] = crc32_update(0, g.shards[i].data(), lens[i]) == g.crcs[i];
+        } else {
+            present[i] = g.have[i];
+        }
+        lost += present[i] ? 0 : 1;
+    }
+    if (lost == 0)
+        return;
+    for (size_t j = 0; j < m; ++j)
+        present[k + j] = g.have[k + j];
+    std::vector<uint8_t*> shards(k + m);
+    for (size_t i = 0; i < k + m; ++i) {
+        g.shards[i].resize(f.chunk);
+        shards[i] = g.shards[i].data();
+    }
+    TCPTRANSFER_TRACE_SPAN("fec_repair", lost);
+    if (!f.rs.reconstruct(shards.data(), present, f.chunk)) {
+        fec_lost.fetch_add(1, std::memory_order_relaxed);
+        // Every group before this one is intact on disk.
+        struct stat st{};
+        if (::fstat(u.file->get(), &st) == 0 && static_cast<uint64_t>(st.st_size) > base)
+            ::ftruncate(u.file->get(), static_cast<off_t>(base));
+        throw StreamError{Status::ChecksumMismatch, "FEC group " + std::to_string(group) +
+                                                        " lost " + std::to_string(lost) +
+                                                        " chunks"};
+    }
+    for (size_t i = 0; i < k; ++i) {
+        if (present[i])
+            continue;
+        StageTimer t(Stage::Write, lens[i]);
+        if (!pwrite_full(u.file->get(), shards[i], lens[i], base + i * f.chunk))
+            throw StreamError{Status::IoError, std::strerror(errno)};
+    }
+    fec_repaired.fetch_add(lost, std::memory_order_relaxed);
+}
+
+void Server::Impl::handle_put_end(Connection& c, uint32_t stream, std::string_view payload) {
+    auto it = c.uploads.find(stream);
+    if (it == c.uploads.end())
+        return;
+    Upload& pending = it->second;
+    if (pending.relay)
+        pending.relay->forward({FrameType::PutEnd, 0, stream, 0, 0}, payload);
+    PutEndMsg m = PutEndMsg::decode(payload);
+    if (pending.stripe) {
+        std::string key = pending.stripe->key;
+        bool intact = !(pending.flags & kPutChecksum) || pending.crc == m.crc32;
+        pending.stripe->on_drop = nullptr;
+        c.uploads.erase(it);
+        auto sp = striped.find(key);
+        if (sp == striped.end() || sp->second.failed)
+            return;
+        if (!intact) {
+            fail_striped(key, Status::ChecksumMismatch, sp->second.u.name);
+            return;
+        }
+        ++sp->second.ended;
+        check_striped(key); // acked with the others once the file is in
+        return;
+    }
+    if (pending.writes_pending > 0) {
+        pending.end = std::move(m); // on_written() finishes it
+        return;
+    }
+    finish_put_end(c, stream, m);
+}
+
+void Server::Impl::finish_put_end(Connection& c, uint32_t stream, const PutEndMsg& m) {
+    auto it = c.uploads.find(stream);
+    Upload u = std::move(it->second);
+    c.uploads.erase(it);
+    TCPTRANSFER_TRACE_SPAN("put_end", u.size);
+    try {
+        commit_upload(u, m, {c.fd.get(), c.id, stream});
+    } catch (const StreamError& e) {
+        errors.fetch_add(1, std::memory_order_relaxed);
+        ack_put(c, stream, e.status, 0, e.message);
+    }
+}
+
+void Server::Impl::commit_upload(Upload& u, const PutEndMsg& m, const StreamRef& ack,
+                                 std::vector<StreamRef> also_ack) {
+    std::string part = part_name(u.name);
+    if (u.fec)
+        settle_fec(u, std::numeric_limits<uint64_t>::max());
+    struct stat st{};
+    if (::fstat(u.file->get(), &st) != 0 || static_cast<uint64_t>(st.st_size) != u.size)
+        throw StreamError{Status::SizeMismatch, "received " + std::to_string(st.st_size) +
+                                                    " of " + std::to_string(u.size)};
+    const bool tracked = u.crc_valid && u.next_offset == u.size;
+    if ((u.flags & kPutChecksum) && tracked && u.crc != m.crc32) {
+        ::unlinkat(u.dir->get(), part.c_str(), 0);
+        throw StreamError{Status::ChecksumMismatch, u.name};
+    }
+    // The rest is disk reads and metadata syscalls; the ack is sent when
+    // they are done.
+    Commit& done = commits.emplace_back();
+    if ((u.flags & kPutChecksum) && !tracked)
+        done.verify_crc = m.crc32;
+    done.conn_fd = ack.conn_fd;
+    done.conn_id = ack.conn_id;
+    done.stream = ack.stream;
+    done.also_ack = std::move(also_ack);
+    done.dir = std::move(u.dir);
+    done.file = std::move(*u.file);
+    done.rel_dir = std::move(u.rel_dir);
+    done.name = std::move(u.name);
+    done.mirrors = std::move(u.mirrors);
+    done.mode = u.mode;
+    done.mtime_ns = u.mtime_ns;
+    done.size = u.size;
+    if (commits.size() == 1)
+        loop.defer([this] { submit_commits(); });
+}
+
+DirIndex& Server::Impl::index_for(const std::string& dir) {
+    for (auto& [d, index] : indexes)
+        if (d == dir)
+            return *index;
+    auto index = std::make_unique<DirIndex>(dirs->open(dir, true)->get());
+    auto at = std::find_if(indexes.begin(), indexes.end(),
+                           [&](const auto& e) { return e.first.size() < dir.size(); });
+    return *indexes.emplace(at, dir, std::move(index))->second;
+}
+
+void Server::Impl::handle_manifest(Connection& c, uint32_t stream, std::string_view payload) {
+    ManifestMsg m = ManifestMsg::decode(payload);
+    TCPTRANSFER_TRACE_SPAN("manifest", m.entries.size());
+    ManifestDiffMsg diff;
+    diff.first = m.first;
+    diff.last = m.last;
+    try {
+        if (!is_safe_relative_path(m.remote_dir))
+            throw StreamError{Status::PathRejected, m.remote_dir};
+        DirIndex* index = nullptr;
+        try {
+            index = &index_for(trim_slashes(m.remote_dir));
+        } catch (const std::system_error& e) {
+            throw StreamError{Status::IoError, e.what()};
+        }
+        for (size_t i = 0; i < m.entries.size(); ++i) {
+            const ManifestEntry& e = m.entries[i];
+            DirIndex::Entry want{e.size, e.mtime_ns, e.hash};
+            bool safe = !e.path.empty() && e.path.back() != '/' && is_safe_relative_path(e.path);
+            if (safe && index->matches(e.path, want))
+                continue;
+            // Unsafe paths are still reported so the put surfaces the rejection.
+            diff.changed.push_back(m.first + static_cast<uint32_t>(i));
+            if (safe)
+                index->expect(e.path, want);
+        }
+    } catch (const StreamError& e) {
+        errors.fetch_add(1, std::memory_order_relaxed);
+        send_status(c, FrameType::PutAck, stream, e.status, 0, e.message);
+        return;
+    }
+    send(c, FrameType::ManifestDiff, stream, diff.encode());
+}
+
+void Server::Impl::note_committed(const std::string& rel_dir, const std::string& name,
+                                  uint64_t size, int64_t mtime_ns) {
+    for (auto& [dir, index] : indexes) {
+        if (!dir_has_prefix(rel_dir, dir))
+            continue;
+        std::string sub = rel_dir.substr(dir.size());
+        if (!sub.empty() && sub[0] == '/')
+            sub.erase(0, 1);
+        std::string path = sub.empty() ? name : sub + "/" + name;
+        try {
+            index->committed(path, size, mtime_ns);
+        } catch (const std::system_error&) {
+            // The index is left dirty and discarded on the next open.
+        }
+    }
+}
+
+void Server::Impl::handle_bundle(Connection& c, uint32_t stream, std::string_view payload) {
+    auto job = std::make_shared<BundleJob>();
+    job->conn_fd = c.fd.get();
+    job->conn_id = c.id;
+    job->stream = stream;
+    job->payload.assign(payload);
+    job->msg = BundleMsg::decode(job->payload);
+    TCPTRANSFER_TRACE_SPAN("bundle", job->msg.files.size());
+    const size_t n = job->msg.files.size();
+    job->ack.results.resize(n);
+    job->placed.resize(n);
+    if (draining()) {
+        for (StatusMsg& r : job->ack.results) {
+            r.status = Status::Busy;
+            r.message = "server restarting";
+        }
+        errors.fetch_add(n, std::memory_order_relaxed);
+        send(c, FrameType::BundleAck, stream, job->ack.encode());
+        return;
+    }
+    Upload charged;
+    charged.dir_bucket = dir_bucket(job->msg.remote_dir);
+    charge(c, charged, payload.size());
+    if (n == 0) {
+        send(c, FrameType::BundleAck, stream, job->ack.encode());
+        return;
+    }
+    job->pending = (n + kCommitBatch - 1) / kCommitBatch;
+    ++bundle_jobs;
+    for (size_t start = 0; start < n; start += kCommitBatch) {
+        meta_pool->submit([this, job, start, n] {
+            for (size_t i = start; i < std::min(n, start + kCommitBatch); ++i) {
+                try {
+                    job->placed[i] = write_bundled(job->msg, job->msg.files[i]);
+                    job->ack.results[i].value = job->msg.files[i].data.size();
+                } catch (const StreamError& e) {
+                    job->ack.results[i].status = e.status;
+                    job->ack.results[i].message = e.message;
+                }
+            }
+            if (job->pending.fetch_sub(1, std::memory_order_acq_rel) == 1)
+                loop.post([this, job] { finish_bundle(*job); });
+        });
+    }
+}
+
+void Server::Impl::finish_bundle(BundleJob& job) {
+    --bundle_jobs;
+    for (size_t i = 0; i < job.msg.files.size(); ++i) {
+        const StatusMsg& r = job.ack.results[i];
+        if (r.status != Status::Ok) {
+            errors.fetch_add(1, std::memory_order_relaxed);
+            continue;
+        }
+        files.fetch_add(1, std::memory_order_relaxed);
+        bytes.fetch_add(r.value, std::memory_order_relaxed);
+        note_committed(job.placed[i].first, job.placed[i].second, r.value,
+                       job.msg.files[i].mtime_ns);
+    }
+    auto it = conns.find(job.conn_fd);
+    if (it == conns.end() || it->second->id != job.conn_id)
+        return;
+    send(*it->second, FrameType::BundleAck, job.stream, job.ack.encode());
+    flush_conn(job.conn_fd, job.conn_id);
+}
+
+std::pair<std::string, std::string> Server::Impl::write_bundled(const BundleMsg& m,
+                                                                const BundleEntry& f) {
+    auto slash = f.path.find_last_of('/');
+    std::string sub = slash == std::string::npos ? "" : f.path.substr(0, slash);
+    std::string name = f.path.substr(slash == std::string::npos ? 0 : slash + 1);
+    std::string rel_dir = trim_slashes(join_path(m.remote_dir, sub));
+    if (!is_safe_relative_path(m.remote_dir) || !is_safe_relative_path(sub) ||
+        !is_safe_file_name(name) || name.size() > 200 || name == DirIndex::kFileName)
+        throw StreamError{Status::PathRejected, join_path(m.remote_dir, f.path)};
+    if ((m.flags & kPutChecksum) && crc32_update(0, f.data.data(), f.data.size()) != f.crc32)
+        throw StreamError{Status::ChecksumMismatch, f.path};
+    Commit c;
+    try {
+        c.dir = dirs->open(rel_dir, true);
+    } catch (const std::system_error& e) {
+        throw StreamError{Status::IoError, e.what()};
+    }
+    std::string part = part_name(name);
+    c.file = Fd(::openat(c.dir->get(), part.c_str(),
+                         O_WRONLY | O_CREAT | O_TRUNC | O_NOFOLLOW | O_CLOEXEC, 0600));
+    if (!c.file)
+        throw StreamError{Status::IoError, std::strerror(errno)};
+    StageTimer t(Stage::Write, f.data.size());
+    for (size_t done = 0; done < f.data.size();) {
+        ssize_t w = ::write(c.file.get(), f.data.data() + done, f.data.size() - done);
+        if (w < 0 && errno == EINTR)
+            continue;
+        if (w < 0) {
+            int err = errno;
+            ::unlinkat(c.dir->get(), part.c_str(), 0);
+            throw StreamError{Status::IoError, std::strerror(err)};
+        }
+        done += static_cast<size_t>(w);
+    }
+    c.name = name;
+    c.mode = f.mode & 0777;
+    c.mtime_ns = f.mtime_ns;
+    c.size = f.data.size();
+    apply_commit(c);
+    if (c.status != Status::Ok)
+        throw StreamError{c.status, c.message};
+    return {std::move(rel_dir), std::move(name)};
+}
+
+void Server::Impl::submit_commits() {
+    std::vector<Commit> all = std::move(commits);
+    commits.clear();
+    for (size_t start = 0; start < all.size(); start += kCommitBatch) {
+        auto batch = std::make_shared<std::vector<Commit>>(
+            std::make_move_iterator(all.begin() + start),
+            std::make_move_iterator(all.begin() + std::min(all.size(), start + kCommitBatch)));
+        ++commit_batches;
+        meta_pool->submit([this, batch] {
+            TCPTRANSFER_TRACE_SPAN("commit_batch", batch->size());
+            for (Commit& c : *batch)
+                apply_commit(c);
+            loop.post([this, batch] { finish_commits(*batch); });
+        });
+    }
+}
+
+void Server::Impl::apply_commit(Commit& c) {
+    std::string part = part_name(c.name);
+    if (c.verify_crc) {
+        TCPTRANSFER_TRACE_SPAN("verify", c.size);
+        Fd rd(::openat(c.dir->get(), part.c_str(), O_RDONLY | O_CLOEXEC | O_NOFOLLOW));
+        if (!rd) {
+            c.status = Status::IoError;
+            c.message = std::strerror(errno);
+            return;
+        }
+        if (file_crc(rd.get(), c.size) != *c.verify_crc) {
+            ::unlinkat(c.dir->get(), part.c_str(), 0);
+            c.status = Status::ChecksumMismatch;
+            c.message = c.name;
+            return;
+        }
+    }
+    if (cfg.fsync) {
+        StageTimer t(Stage::Fsync, c.size);
+        TCPTRANSFER_TRACE_SPAN("fsync", c.size);
+        if (::fsync(c.file.get()) != 0) {
+            c.status = Status::IoError;
+            c.message = std::strerror(errno);
+            return;
+        }
+    }
+    ::fchmod(c.file.get(), c.mode);
+    set_mtime(c.file.get(), c.mtime_ns);
+    if (::renameat(c.dir->get(), part.c_str(), c.dir->get(), c.name.c_str()) != 0) {
+        c.status = Status::IoError;
+        c.message = std::strerror(errno);
+    }
+    c.file.reset();
+    for (const std::string& rel : c.mirrors) {
+        if (c.status != Status::Ok)
+            break;
+        try {
+            mirror_file(c, rel);
+        } catch (const StreamError& e) {
+            c.status = e.status;
+            c.message = e.message;
+        }
+    }
+}
+
+void Server::Impl::mirror_file(const Commit& c, const std::string& rel) {
+    TCPTRANSFER_TRACE_SPAN("mirror", c.size);
+    DirCache::Handle dir;
+    try {
+        dir = dirs->open(rel, true);
+    } catch (const std::system_error& e) {
+        throw StreamError{Status::IoError, rel + ": " + e.what()};
+    }
+    auto fail = [&rel](const char* what) {
+        return StreamError{Status::IoError, rel + ": " + what + ": " + std::strerror(errno)};
+    };
+    Fd src(::openat(c.dir->get(), c.name.c_str(), O_RDONLY | O_NOFOLLOW | O_CLOEXEC));
+    if (!src)
+        throw fail("open");
+    std::string part = part_name(c.name);
+    Fd dst(::openat(dir->get(), part.c_str(), O_WRONLY | O_CREAT | O_TRUNC | O_NOFOLLOW | O_CLOEXEC,
+                    0600));
+    if (!dst)
+        throw fail("create");
+    if (!copy_range(src.get(), 0, dst.get(), 0, c.size))
+        throw fail("copy");
+    if (cfg.fsync && ::fsync(dst.get()) != 0)
+        throw fail("fsync");
+    ::fchmod(dst.get(), c.mode);
+    set_mtime(dst.get(), c.mtime_ns);
+    if (::renameat(dir->get(), part.c_str(), dir->get(), c.name.c_str()) != 0)
+        throw fail("rename");
+}
+
+void Server::Impl::finish_commits(std::vector<Commit>& batch) {
+    --commit_batches;
+    std::vector<std::pair<int, uint64_t>> touched;
+    for (Commit& c : batch) {
+        if (c.status == Status::Ok) {
+            files.fetch_add(1, std::memory_order_relaxed);
+            note_committed(c.rel_dir, c.name, c.size, c.mtime_ns);
+            for (const std::string& rel : c.mirrors)
+                note_committed(rel, c.name, c.size, c.mtime_ns);
+        } else {
+            errors.fetch_add(1, std::memory_order_relaxed);
+        }
+        c.also_ack.insert(c.also_ack.begin(), {c.conn_fd, c.conn_id, c.stream});
+        for (const StreamRef& r : c.also_ack) {
+            auto it = conns.find(r.conn_fd);
+            if (it == conns.end() || it->second->id != r.conn_id)
+                continue;
+            ack_put(*it->second, r.stream, c.status, c.status == Status::Ok ? c.size : 0,
+                    c.message);
+            if (touched.empty() || touched.back().first != r.conn_fd)
+                touched.emplace_back(r.conn_fd, r.conn_id);
+        }
+    }
+    for (auto [fd, id] : touched)
+        flush_conn(fd, id);
+}
+
+void Server::Impl::flush_conn(int fd, uint64_t id) {
+    auto it = conns.find(fd);
+    if (it == conns.end() || it->second->id != id)
+        return;
+    if (!flush(*it->second))
+        close_conn(fd);
+}
+
+Server::Server(ServerConfig cfg) : impl_(std::make_unique<Impl>(std::move(cfg))) {}
+
+Server::~Server() { stop(); }
+
+void Server::start() {
+    impl_->bind();
+    impl_->thread = std::thread([this] {
+        trace_thread_name("server-loop");
+        impl_->loop.run();
+    });
+}
+
+void Server::run() {
+    impl_->bind();
+    impl_->running_elsewhere = true;
+    impl_->loop.run();
+    impl_->running_elsewhere = false;
+}
+
+void Server::stop() {
+    impl_->metrics.reset();
+    auto capture = [this] {
+        if (!impl_->journal_passed && impl_->root)
+            for (const auto& [fd, c] : impl_->conns)
+                impl_->journal_uploads(*c);
+    };
+    if (impl_->running_elsewhere && !impl_->loop.in_loop_thread()) {
+        // run() is serving on another thread: capture the uploads there, as
+        // the loop's last task, the way handoff() reaches them.
+        std::promise<void> captured;
+        std::future<void> done = captured.get_future();
+        impl_->loop.post([this, &capture, &captured] {
+            capture();
+            impl_->loop.stop();
+            captured.set_value();
+        });
+        done.wait();
+    } else {
+        impl_->loop.stop();
+        if (impl_->thread.joinable())
+            impl_->thread.join();
+        capture();
+    }
+    if (impl_->warmer.joinable())
+        impl_->warmer.join();
+    if (impl_->journal_passed || !impl_->root)
+        return;
+    if (ResumeJournal* j = impl_->journal.peek(); j && j->size() > 0) {
+        try {
+            j->save(impl_->root.get());
+        } catch (const std::system_error&) {
+            // Resumes then re-read their part files, as without a journal.
+        }
+    }
+    impl_->journal_passed = true;
+}
+
+void Server::handoff(int sock, std::chrono::milliseconds drain) {
+    // The successor binds the metrics endpoint anew.
+    impl_->metrics.reset();
+    std::promise<void> handed_off;
+    std::future<void> done = handed_off.get_future();
+    impl_->loop.post([this, sock, drain, &handed_off] {
+        Impl& s = *impl_;
+        s.loop.remove(s.listener.get());
+        try {
+            send_handoff(sock, HandoffMsg::Listener, "", s.listener.get());
+        } catch (...) {
+            s.loop.add(s.listener.get(), EPOLLIN, [&s](uint32_t) { s.on_accept(); });
+            handed_off.set_exception(std::current_exception());
+            return;
+        }
+        s.successor = sock;
+        s.drain_until = EventLoop::Clock::now() + drain;
+        s.handed_off = &handed_off;
+        ++s.handoff_round;
+        s.drain_for_handoff();
+    });
+    try {
+        done.get();
+    } catch (...) {
+        if (impl_->listener && !impl_->cfg.metrics_listen.empty())
+            impl_->metrics = std::make_unique<MetricsEndpoint>(
+                impl_->cfg.metrics_listen, [this] { return impl_->metrics_text(); });
+        throw;
+    }
+}
+
+uint16_t Server::port() const { return impl_->bound_port; }
+
+ServerStats Server::stats() const { return impl_->stats(); }
+
+} // namespace TcpTransfer
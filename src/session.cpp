@@ -0,0 +1,936 @@
+#include "tcptransfer/session.h"
+
+#include <fcntl.h>
+#include <poll.h>
+#include <sys/sendfile.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/uio.h>
+#include <unistd.h>
+
+#include <algorithm>
+#include <cerrno>
+#include <cstring>
+#include <deque>
+#include <limits>
+#include <vector>
+
+#include "tcptransfer/checksum.h"
+#include "tcptransfer/delta.h"
+#include "tcptransfer/erasure.h"
+#include "tcptransfer/error.h"
+#include "tcptransfer/mapped_file.h"
+#include "tcptransfer/metrics.h"
+#include "tcptransfer/pipeline.h"
+#include "tcptransfer/thread_pool.h"
+#include "tcptransfer/trace.h"
+
+namespace TcpTransfer {
+
+namespace {
+
+constexpr size_t kMaxPrepareAhead = 8;
+constexpr size_t kManifestPartBytes = 4 << 20;
+constexpr size_t kBundleBytes = 1 << 20;
+constexpr size_t kMaxFecChunk = 1 << 20;
+
+std::string base_name(const std::string& path) {
+    auto slash = path.find_last_of('/');
+    return slash == std::string::npos ? path : path.substr(slash + 1);
+}
+
+/// CRC32 of [0, n) of fd; used to seed the checksum when resuming.
+uint32_t prefix_crc(int fd, uint64_t n) {
+    TCPTRANSFER_TRACE_SPAN("prefix_crc", n);
+    MappedFile map(fd, 0, static_cast<size_t>(n));
+    StageTimer t(Stage::Hash, n);
+    uint32_t crc = 0;
+    for (size_t off = 0; off < map.size(); off += MappedFile::kDefaultWindow) {
+        map.advance(off);
+        size_t len = std::min(map.size() - off, MappedFile::kDefaultWindow);
+        crc = crc32_update(crc, map.data() + off, len);
+    }
+    return crc;
+}
+
+void pwrite_all(int fd, const char* p, size_t n, off_t offset) {
+    while (n > 0) {
+        ssize_t w = ::pwrite(fd, p, n, offset);
+        if (w < 0 && errno == EINTR)
+            continue;
+        if (w <= 0)
+            throw_errno("write downloaded data");
+        p += w;
+        n -= static_cast<size_t>(w);
+        offset += w;
+    }
+}
+
+} // namespace
+
+Session::Session(Endpoint ep, Fd fd, SessionOptions opts)
+    : ep_(std::move(ep)), fd_(std::move(fd)), opts_(std::move(opts)), last_used_(Clock::now()),
+      fault_rng_(opts_.faults.seed) {
+    apply_socket_tuning(fd_.get(), opts_.tuning);
+}
+
+std::unique_ptr<Session> Session::connect(const Endpoint& ep, const SessionOptions& opts) {
+    StageTimer t(Stage::Handshake);
+    Fd fd = connect_tcp(ep, opts.connect_timeout);
+    std::unique_ptr<Session> s(new Session(ep, std::move(fd), opts));
+    s->handshake();
+    return s;
+}
+
+void Session::handshake() {
+    HelloMsg hello;
+    hello.token = opts_.token;
+    hello.client_id = opts_.client_id;
+    send_frame(FrameType::Hello, 0, hello.encode());
+    std::string payload;
+    FrameHeader h = read_frame(payload);
+    if (h.type == FrameType::Error) {
+        StatusMsg m = StatusMsg::decode(payload);
+        throw RemoteError(m.status, m.message);
+    }
+    if (h.type != FrameType::HelloAck)
+        throw ProtocolError("expected HelloAck");
+    HelloAckMsg ack = HelloAckMsg::decode(payload);
+    if (ack.version != kProtocolVersion)
+        throw ProtocolError("server protocol version mismatch");
+}
+
+void Session::send_frame(FrameType t, uint32_t stream, std::string_view payload) {
+    std::string f = make_frame(t, stream, payload);
+    write_full(fd_.get(), f.data(), f.size());
+}
+
+FrameHeader Session::read_frame(std::string& payload) {
+    if (!wait_readable(fd_.get(), opts_.io_timeout))
+        throw Error("timed out waiting for " + ep_.to_string());
+    StageTimer t(Stage::Receive);
+    char hdr[kFrameHeaderSize];
+    if (!read_full(fd_.get(), hdr, sizeof(hdr)))
+        throw Error("connection closed by " + ep_.to_string());
+    FrameHeader h = decode_header(hdr);
+    payload.resize(h.length);
+    if (h.length > 0 && !read_full(fd_.get(), payload.data(), h.length))
+        throw Error("connection closed mid-frame");
+    t.set_bytes(kFrameHeaderSize + h.length);
+    return h;
+}
+
+StatusMsg Session::expect_status(FrameType want, uint32_t stream, AdaptiveController* flow) {
+    std::string payload;
+    for (;;) {
+        FrameHeader h = read_frame(payload);
+        if (h.type == FrameType::Error) {
+            StatusMsg m = StatusMsg::decode(payload);
+            throw ProtocolError(std::string("server error: ") + status_name(m.status) + ": " +
+                                m.message);
+        }
+        if (h.stream != stream)
+            continue; // late reply for an abandoned stream
+        if (h.type == FrameType::DataAck) {
+            if (flow) {
+                DataAckMsg m = DataAckMsg::decode(payload);
+                flow->on_ack(m.committed, std::chrono::microseconds(m.write_us), Clock::now());
+            }
+            continue;
+        }
+        if (h.type == want || h.type == FrameType::PutAck)
+            return StatusMsg::decode(payload);
+        throw ProtocolError("unexpected reply frame");
+    }
+}
+
+PutResult Session::put_file(const std::string& local_path, const std::string& remote_dir,
+                            const PutOptions& opts) {
+    return put_stripe(local_path, remote_dir, opts, PutStripe{});
+}
+
+PutResult Session::put_stripe(const std::string& local_path, const std::string& remote_dir,
+                              const PutOptions& opts, const PutStripe& stripe) {
+    if (broken_)
+        throw Error("session to " + ep_.to_string() + " is broken");
+    if (stripe.count > kMaxStripes || stripe.index >= stripe.count)
+        throw Error("bad stripe " + std::to_string(stripe.index) + " of " +
+                    std::to_string(stripe.count));
+    // Local errors before the first frame leave the session usable.
+    Fd file(::open(local_path.c_str(), O_RDONLY | O_CLOEXEC));
+    if (!file)
+        throw_errno("open " + local_path);
+    struct stat st{};
+    if (::fstat(file.get(), &st) != 0)
+        throw_errno("stat " + local_path);
+    if (!S_ISREG(st.st_mode))
+        throw Error(local_path + " is not a regular file");
+    try {
+        PutResult r = put_file_impl(file.get(), st, local_path, remote_dir, opts, stripe);
+        last_used_ = Clock::now();
+        return r;
+    } catch (const RemoteError&) {
+        last_used_ = Clock::now();
+        throw;
+    } catch (...) {
+        // Transport or local read errors can leave a frame half written.
+        broken_ = true;
+        throw;
+    }
+}
+
+/// Shared by every range sent for one file.
+struct Session::SendState {
+    int file = -1;
+    uint32_t stream = 0;
+    const std::string* local_path = nullptr;
+    const PutOptions* opts = nullptr;
+    size_t fixed_chunk = 0;
+    bool zero_copy = false;
+    bool hash = false;        ///< Fold each chunk into crc.
+    ChunkFn pipeline = nullptr; ///< Per-chunk work, chosen once for the put.
+    uint32_t crc = 0;
+    AdaptiveController* flow = nullptr;
+    WorkStealingPool* pool = nullptr;
+    int cpu = -1;             ///< Core that services this socket.
+    size_t depth = 1;         ///< Chunks prepared ahead of the sender.
+    PutResult* result = nullptr;
+};
+
+namespace {
+
+/// A chunk read, hashed and compressed ahead of the sender.
+struct Prepared {
+    uint64_t offset = 0;
+    size_t n = 0;
+    std::vector<char> buf;
+    std::vector<char> zbuf;
+    size_t z = 0; ///< Compressed size; 0 sends raw.
+    uint32_t crc = 0;
+    // Last, so it is destroyed (and waits for the task) before the buffers.
+    std::unique_ptr<TaskGroup> done;
+};
+
+/// Reads [offset, offset + n) of file into buf.
+void read_chunk(int file, char* buf, size_t n, uint64_t offset, const std::string& local_path) {
+    auto read_start = stage_now();
+    {
+        TCPTRANSFER_TRACE_SPAN("read", n);
+        size_t got = 0;
+        while (got < n) {
+            ssize_t r = ::pread(file, buf + got, n - got, static_cast<off_t>(offset + got));
+            if (r < 0 && errno == EINTR)
+                continue;
+            if (r <= 0)
+                throw Error(local_path + " changed size during transfer");
+            got += static_cast<size_t>(r);
+        }
+    }
+    record_since(Stage::DiskRead, read_start, n);
+}
+
+void prepare_chunk(int file, Prepared& p, ChunkFn pipeline, int level,
+                   const std::string& local_path) {
+    if (p.buf.size() < p.n)
+        p.buf.resize(p.n);
+    read_chunk(file, p.buf.data(), p.n, p.offset, local_path);
+    ChunkResult r = pipeline(p.buf.data(), p.n, level, p.zbuf);
+    p.crc = r.crc;
+    p.z = r.z;
+}
+
+} // namespace
+
+void Session::send_range(SendState& s, uint64_t offset, uint64_t end) {
+    const PutOptions& opts = *s.opts;
+    std::deque<Prepared> ahead;
+    std::vector<std::pair<std::vector<char>, std::vector<char>>> spare; // buf, zbuf
+    uint64_t next_prep = offset;
+    while (offset < end) {
+        if (s.flow) {
+            // Block for acks only when the window is full.
+            drain_acks(s.stream, *s.flow, !s.flow->can_send());
+            size_for_bdp(s.flow->snapshot().bdp);
+            if (!s.flow->can_send())
+                continue;
+        }
+        char hdr[kFrameHeaderSize + 8];
+        size_t n;
+        if (s.zero_copy) {
+            size_t chunk = s.flow ? s.flow->chunk_size() : s.fixed_chunk;
+            n = static_cast<size_t>(std::min<uint64_t>(chunk, end - offset));
+            TCPTRANSFER_TRACE_SPAN("chunk", offset);
+            encode_header({FrameType::Data, 0, s.stream, static_cast<uint32_t>(8 + n), 0}, hdr);
+            std::string off_bytes;
+            WireWriter(off_bytes).u64(offset);
+            std::memcpy(hdr + kFrameHeaderSize, off_bytes.data(), 8);
+            StageTimer t(Stage::Send, sizeof(hdr) + n);
+            TCPTRANSFER_TRACE_SPAN("sendfile", n);
+            CorkGuard cork(fd_.get(), opts_.tuning.cork_data);
+            write_full(fd_.get(), hdr, sizeof(hdr));
+            off_t pos = static_cast<off_t>(offset);
+            size_t left = n;
+            while (left > 0) {
+                ssize_t w = ::sendfile(fd_.get(), s.file, &pos, left);
+                if (w < 0 && errno == EINTR)
+                    continue;
+                if (w <= 0)
+                    throw_errno("sendfile");
+                left -= static_cast<size_t>(w);
+            }
+            s.result->wire_bytes += n;
+        } else {
+            // Keep up to depth chunks being read/hashed/compressed on the
+            // pool while this thread sends them in order.
+            while (ahead.size() < s.depth && next_prep < end) {
+                size_t chunk = s.flow ? s.flow->chunk_size() : s.fixed_chunk;
+                Prepared& p = ahead.emplace_back();
+                p.offset = next_prep;
+                p.n = static_cast<size_t>(std::min<uint64_t>(chunk, end - next_prep));
+                if (!spare.empty()) {
+                    p.buf = std::move(spare.back().first);
+                    p.zbuf = std::move(spare.back().second);
+                    spare.pop_back();
+                }
+                p.done = std::make_unique<TaskGroup>(s.pool, s.cpu);
+                p.done->run([&p, &s, &opts] {
+                    prepare_chunk(s.file, p, s.pipeline, opts.compression_level, *s.local_path);
+                });
+                next_prep += p.n;
+            }
+            Prepared& p = ahead.front();
+            p.done->wait();
+            n = p.n;
+            TCPTRANSFER_TRACE_SPAN("chunk", offset);
+            const char* payload = p.z ? p.zbuf.data() : p.buf.data();
+            size_t wire = p.z ? p.z : n;
+            encode_header({FrameType::Data,
+                           static_cast<uint8_t>(p.z ? opts.compression : Codec::None), s.stream,
+                           static_cast<uint32_t>(8 + wire), p.z ? static_cast<uint32_t>(n) : 0},
+                          hdr);
+            std::string off_bytes;
+            WireWriter(off_bytes).u64(offset);
+            std::memcpy(hdr + kFrameHeaderSize, off_bytes.data(), 8);
+            iovec iov[2] = {{hdr, sizeof(hdr)}, {const_cast<char*>(payload), wire}};
+            // Compressed frames are never damaged: the server would reject
+            // the whole connection rather than the chunk.
+            if (inject_fault(p.z ? nullptr : p.buf.data(), p.z ? 0 : n)) {
+                StageTimer t(Stage::Send, sizeof(hdr) + wire);
+                TCPTRANSFER_TRACE_SPAN("send", wire);
+                writev_full(fd_.get(), iov, 2);
+            }
+            if (s.hash)
+                s.crc = crc32_combine(s.crc, p.crc, n);
+            s.result->wire_bytes += wire;
+            spare.emplace_back(std::move(p.buf), std::move(p.zbuf));
+            ahead.pop_front();
+        }
+        offset += n;
+        s.result->bytes_sent += n;
+        if (s.flow)
+            s.flow->on_send(offset, n, Clock::now());
+    }
+}
+
+void Session::send_range_fec(SendState& s, uint64_t offset, uint64_t end) {
+    const size_t k = s.opts->fec.data;
+    const size_t m = s.opts->fec.parity;
+    const size_t chunk = s.fixed_chunk;
+    const uint64_t group_bytes = static_cast<uint64_t>(k) * chunk;
+    ReedSolomon rs(k, m);
+    std::vector<std::vector<uint8_t>> shards(k + m, std::vector<uint8_t>(chunk));
+    std::vector<const uint8_t*> data(k);
+    std::vector<uint8_t*> parity(m);
+    for (size_t i = 0; i < k; ++i)
+        data[i] = shards[i].data();
+    for (size_t j = 0; j < m; ++j)
+        parity[j] = shards[k + j].data();
+    std::vector<size_t> lens(k);
+    ParityMsg pm;
+    pm.data_crcs.resize(k);
+    for (pm.group = offset / group_bytes; pm.group * group_bytes < end; ++pm.group) {
+        TCPTRANSFER_TRACE_SPAN("fec_group", pm.group);
+        const uint64_t base = pm.group * group_bytes;
+        for (size_t i = 0; i < k; ++i) {
+            uint64_t at = base + i * chunk;
+            lens[i] = at < end ? static_cast<size_t>(std::min<uint64_t>(chunk, end - at)) : 0;
+            char* buf = reinterpret_cast<char*>(shards[i].data());
+            read_chunk(s.file, buf, lens[i], at, *s.local_path);
+            std::memset(buf + lens[i], 0, chunk - lens[i]);
+            StageTimer t(Stage::Hash, lens[i]);
+            pm.data_crcs[i] = crc32_update(0, buf, lens[i]);
+        }
+        {
+            TCPTRANSFER_TRACE_SPAN("fec_encode", group_bytes);
+            rs.encode(data.data(), parity.data(), chunk);
+        }
+        // Parity is computed before the shim may damage a chunk in place.
+        for (size_t i = 0; i < k && lens[i] > 0; ++i) {
+            const uint64_t at = base + i * chunk;
+            const size_t n = lens[i];
+            char hdr[kFrameHeaderSize + 8];
+            encode_header({FrameType::Data, 0, s.stream, static_cast<uint32_t>(8 + n), 0}, hdr);
+            std::string off_bytes;
+            WireWriter(off_bytes).u64(at);
+            std::memcpy(hdr + kFrameHeaderSize, off_bytes.data(), 8);
+            char* buf = reinterpret_cast<char*>(shards[i].data());
+            iovec iov[2] = {{hdr, sizeof(hdr)}, {buf, n}};
+            if (s.hash)
+                s.crc = crc32_combine(s.crc, pm.data_crcs[i], n);
+            if (inject_fault(buf, n)) {
+                StageTimer t(Stage::Send, sizeof(hdr) + n);
+                TCPTRANSFER_TRACE_SPAN("send", n);
+                writev_full(fd_.get(), iov, 2);
+            }
+            s.result->wire_bytes += n;
+            s.result->bytes_sent += n;
+        }
+        for (size_t j = 0; j < m; ++j) {
+            char* buf = reinterpret_cast<char*>(parity[j]);
+            pm.index = static_cast<uint8_t>(j);
+            pm.crc32 = crc32_update(0, buf, chunk);
+            pm.shard = std::string_view(buf, chunk);
+            if (inject_fault(buf, chunk))
+                send_frame(FrameType::Parity, s.stream, pm.encode());
+            s.result->wire_bytes += chunk;
+            s.result->parity_bytes += chunk;
+        }
+    }
+}
+
+bool Session::inject_fault(char* data, size_t n) {
+    const FaultInjection& f = opts_.faults;
+    if (!f.active())
+        return true;
+    double roll = std::uniform_real_distribution<double>(0, 1)(fault_rng_);
+    if (roll < f.drop)
+        return false;
+    if (n > 0 && roll < f.drop + f.corrupt)
+        data[std::uniform_int_distribution<size_t>(0, n - 1)(fault_rng_)] ^= 0x5a;
+    return true;
+}
+
+PutResult Session::put_file_impl(int file, const struct stat& st, const std::string& local_path,
+                                 const std::string& remote_dir, const PutOptions& opts,
+                                 const PutStripe& stripe) {
+    auto start = Clock::now();
+    // Delta rebuilds from Copy frames, which carry no per-chunk acks, and
+    // does not combine with resume. FEC sends fixed, raw chunks in order.
+    // A relay chain has no way to resume or rebuild from the hops' old copies.
+    // A stripe's chunks are acked only as a whole, with the other stripes'.
+    const bool striped = stripe.count > 1;
+    const bool fec = opts.fec.enabled() && !striped;
+    const bool relayed = !opts.relay.empty() && !striped;
+    const bool resume = opts.resume && !relayed && !striped;
+    const bool delta = opts.delta && !resume && !fec && !relayed && !striped;
+    const bool adaptive = opts.adaptive && !delta && !fec && !striped;
+    const size_t chunk = std::max<size_t>(4096, std::min<size_t>(opts.chunk_size,
+                                                                 fec ? kMaxFecChunk
+                                                                     : kMaxFramePayload - 8));
+
+    PutBeginMsg begin;
+    begin.remote_dir = remote_dir;
+    begin.name = opts.remote_name.empty() ? base_name(local_path) : opts.remote_name;
+    begin.size = static_cast<uint64_t>(st.st_size);
+    begin.mode = st.st_mode & 0777;
+    begin.mtime_ns = static_cast<int64_t>(st.st_mtim.tv_sec) * 1000000000 + st.st_mtim.tv_nsec;
+    begin.flags = (resume ? kPutResume : 0u) | (opts.checksum ? kPutChecksum : 0u) |
+                  (adaptive ? kPutAcked : 0u) | (delta ? kPutDelta : 0u) | (fec ? kPutFec : 0u) |
+                  (striped ? kPutStriped : 0u);
+    begin.priority = opts.priority;
+    begin.deadline_ms = static_cast<uint32_t>(
+        std::clamp<int64_t>(opts.deadline.count(), 0, std::numeric_limits<uint32_t>::max()));
+    if (relayed)
+        begin.relay = opts.relay;
+    begin.mirrors = opts.mirror_dirs;
+    if (striped) {
+        begin.stripe_key = stripe.key;
+        begin.stripes = static_cast<uint8_t>(stripe.count);
+    }
+    if (fec) {
+        begin.fec_data = opts.fec.data;
+        begin.fec_parity = opts.fec.parity;
+        begin.fec_chunk = static_cast<uint32_t>(chunk);
+    }
+
+    TCPTRANSFER_TRACE_SPAN("put_file", begin.size);
+    uint32_t stream = next_stream_++;
+    send_frame(FrameType::PutBegin, stream, begin.encode());
+
+    PutResult result;
+    result.file_size = begin.size;
+    uint64_t offset = 0;
+    if (resume) {
+        StatusMsg ready = expect_status(FrameType::PutReady, stream);
+        if (ready.status != Status::Ok)
+            throw RemoteError(ready.status, ready.message);
+        offset = std::min(ready.value, begin.size);
+        if (fec)
+            offset -= offset % (static_cast<uint64_t>(opts.fec.data) * chunk);
+        result.resumed_from = offset;
+    }
+
+    SendState s;
+    s.file = file;
+    s.stream = stream;
+    s.local_path = &local_path;
+    s.opts = &opts;
+    s.fixed_chunk = chunk;
+    s.zero_copy = opts.use_sendfile && !opts.checksum && opts.compression == Codec::None &&
+                  !fec && !opts_.faults.active();
+    s.hash = opts.checksum && !delta;
+    s.pipeline = select_pipeline(opts.checksum, opts.compression, delta);
+    s.pool = opts.pool;
+    s.cpu = opts.pool ? socket_cpu(fd_.get()) : -1;
+    s.depth = opts.pool ? std::min<size_t>(opts.pool->size() + 1, kMaxPrepareAhead) : 1;
+    s.result = &result;
+    if (s.hash && offset > 0)
+        s.crc = prefix_crc(file, offset);
+
+    AdaptiveOptions aopts = opts.adaptive_opts;
+    aopts.initial_chunk = s.fixed_chunk;
+    aopts.max_chunk = std::min<size_t>(aopts.max_chunk, kMaxFramePayload - 8);
+    AdaptiveController ctl(aopts);
+    s.flow = adaptive ? &ctl : nullptr;
+
+    if (delta) {
+        SignaturesMsg sig = expect_signatures(stream);
+        DeltaPlan plan = plan_delta(file, begin.size, sig, opts.pool, s.cpu);
+        for (const DeltaOp& op : plan.ops) {
+            if (op.literal()) {
+                send_range(s, op.offset, op.offset + op.length);
+                continue;
+            }
+            // The server refuses longer Copy frames.
+            for (uint64_t done = 0; done < op.length; done += kMaxCopyFrame) {
+                CopyMsg m;
+                m.offset = op.offset + done;
+                m.source = static_cast<uint64_t>(op.source) + done;
+                m.length = std::min<uint64_t>(kMaxCopyFrame, op.length - done);
+                send_frame(FrameType::Copy, stream, m.encode());
+            }
+        }
+        s.crc = opts.checksum ? plan.crc : 0;
+        result.delta_reused = plan.copied;
+    } else if (fec) {
+        send_range_fec(s, offset, begin.size);
+    } else if (striped) {
+        // s.crc covers this stripe's chunks in the order sent.
+        const uint64_t run = kStripeChunks * chunk;
+        for (uint64_t at = stripe.index * run; at < begin.size; at += stripe.count * run)
+            send_range(s, at, std::min(at + run, begin.size));
+    } else {
+        send_range(s, offset, begin.size);
+    }
+
+    send_frame(FrameType::PutEnd, stream, PutEndMsg{s.crc}.encode());
+    TCPTRANSFER_TRACE_SPAN("wait_put_ack", stream);
+    StatusMsg ack = expect_status(FrameType::PutAck, stream, s.flow);
+    if (ack.status != Status::Ok)
+        throw RemoteError(ack.status, ack.message);
+    result.elapsed = Clock::now() - start;
+    if (s.flow)
+        result.flow = s.flow->snapshot();
+    result.socket = socket_stats();
+    return result;
+}
+
+SignaturesMsg Session::expect_signatures(uint32_t stream) {
+    std::string payload;
+    for (;;) {
+        FrameHeader h = read_frame(payload);
+        if (h.type == FrameType::Error) {
+            StatusMsg m = StatusMsg::decode(payload);
+            throw ProtocolError(std::string("server error: ") + status_name(m.status) + ": " +
+                                m.message);
+        }
+        if (h.stream != stream)
+            continue;
+        if (h.type == FrameType::Signatures)
+            return SignaturesMsg::decode(payload);
+        if (h.type == FrameType::PutAck) {
+            StatusMsg m = StatusMsg::decode(payload);
+            throw RemoteError(m.status == Status::Ok ? Status::BadRequest : m.status, m.message);
+        }
+        throw ProtocolError("unexpected reply frame");
+    }
+}
+
+void Session::size_for_bdp(uint64_t bdp) {
+    if (bdp <= sized_bdp_ + sized_bdp_ / 4)
+        return;
+    sized_bdp_ = bdp;
+    if (grow_buffer_for_bdp(fd_.get(), bdp, opts_.tuning, true))
+        buffers_pinned_ = true;
+}
+
+SocketStats Session::socket_stats() const {
+    SocketStats s = read_socket_stats(fd_.get());
+    s.buffers_pinned = buffers_pinned_;
+    return s;
+}
+
+void Session::drain_acks(uint32_t stream, AdaptiveController& flow, bool block) {
+    std::string payload;
+    for (bool first = true;; first = false) {
+        auto wait = first && block ? opts_.io_timeout : std::chrono::milliseconds(0);
+        bool ready;
+        if (first && block) {
+            TCPTRANSFER_TRACE_SPAN("wait_ack", stream); // window-full stall
+            ready = wait_readable(fd_.get(), wait);
+        } else {
+            ready = wait_readable(fd_.get(), wait);
+        }
+        if (!ready) {
+            if (first && block)
+                throw Error("timed out waiting for " + ep_.to_string());
+            return;
+        }
+        FrameHeader h = read_frame(payload);
+        if (h.type == FrameType::Error) {
+            StatusMsg m = StatusMsg::decode(payload);
+            throw ProtocolError(std::string("server error: ") + status_name(m.status) + ": " +
+                                m.message);
+        }
+        if (h.stream != stream)
+            continue;
+        if (h.type == FrameType::DataAck) {
+            DataAckMsg m = DataAckMsg::decode(payload);
+            flow.on_ack(m.committed, std::chrono::microseconds(m.write_us), Clock::now());
+        } else if (h.type == FrameType::PutAck) {
+            // The server gave up on this stream early.
+            StatusMsg m = StatusMsg::decode(payload);
+            throw RemoteError(m.status == Status::Ok ? Status::BadRequest : m.status, m.message);
+        } else {
+            throw ProtocolError("unexpected reply frame");
+        }
+    }
+}
+
+std::vector<uint32_t> Session::diff_manifest(const std::string& remote_dir,
+                                             const std::vector<ManifestEntry>& entries) {
+    if (broken_)
+        throw Error("session to " + ep_.to_string() + " is broken");
+    TCPTRANSFER_TRACE_SPAN("diff_manifest", entries.size());
+    std::vector<uint32_t> changed;
+    uint32_t stream = next_stream_++;
+    bool done = false;
+    auto on_reply = [&](bool block) {
+        std::string payload;
+        while (!done && (block || wait_readable(fd_.get(), std::chrono::milliseconds(0)))) {
+            FrameHeader h = read_frame(payload);
+            if (h.type == FrameType::Error) {
+                StatusMsg m = StatusMsg::decode(payload);
+                throw ProtocolError(std::string("server error: ") + status_name(m.status) +
+                                    ": " + m.message);
+            }
+            if (h.stream != stream)
+                continue;
+            if (h.type == FrameType::PutAck) {
+                StatusMsg m = StatusMsg::decode(payload);
+                done = true;
+                throw RemoteError(m.status, m.message);
+            }
+            if (h.type != FrameType::ManifestDiff)
+                throw ProtocolError("unexpected reply frame");
+            ManifestDiffMsg d = ManifestDiffMsg::decode(payload);
+            for (uint32_t i : d.changed) {
+                if (i >= entries.size())
+                    throw ProtocolError("manifest diff out of range");
+                changed.push_back(i);
+            }
+            done = d.last;
+        }
+    };
+    try {
+        size_t i = 0;
+        do {
+            ManifestMsg part;
+            part.remote_dir = remote_dir;
+            part.first = static_cast<uint32_t>(i);
+            size_t bytes = 0;
+            while (i < entries.size() && bytes < kManifestPartBytes) {
+                bytes += 32 + entries[i].path.size();
+                part.entries.push_back(entries[i++]);
+            }
+            part.last = i == entries.size();
+            send_frame(FrameType::Manifest, stream, part.encode());
+            // Keep the server's replies flowing so neither side stalls on
+            // a full socket buffer.
+            on_reply(false);
+        } while (i < entries.size());
+        on_reply(true);
+    } catch (const RemoteError&) {
+        // Refused before the remaining parts were read; they are answered
+        // with nothing further, so the session stays usable.
+        last_used_ = Clock::now();
+        throw;
+    } catch (...) {
+        broken_ = true;
+        throw;
+    }
+    last_used_ = Clock::now();
+    return changed;
+}
+
+std::vector<StatusMsg> Session::put_bundle(const std::string& remote_dir,
+                                          const std::vector<BundleItem>& items,
+                                          const PutOptions& opts) {
+    if (broken_)
+        throw Error("session to " + ep_.to_string() + " is broken");
+    TCPTRANSFER_TRACE_SPAN("put_bundle", items.size());
+    std::vector<StatusMsg> results(items.size());
+    // Sized up front: entries view into these buffers.
+    std::vector<std::string> contents(items.size());
+    BundleMsg bundle;
+    bundle.remote_dir = remote_dir;
+    bundle.flags = opts.checksum ? kPutChecksum : 0u;
+    std::vector<size_t> slots; ///< Item index of each bundled file.
+    size_t bytes = 0;
+
+    auto send_bundle = [&] {
+        if (bundle.files.empty())
+            return;
+        uint32_t stream = next_stream_++;
+        send_frame(FrameType::Bundle, stream, bundle.encode());
+        std::string payload;
+        for (;;) {
+            FrameHeader h = read_frame(payload);
+            if (h.type == FrameType::Error) {
+                StatusMsg m = StatusMsg::decode(payload);
+                throw ProtocolError(std::string("server error: ") + status_name(m.status) +
+                                    ": " + m.message);
+            }
+            if (h.stream != stream)
+                continue;
+            if (h.type != FrameType::BundleAck)
+                throw ProtocolError("unexpected reply frame");
+            break;
+        }
+        BundleAckMsg ack = BundleAckMsg::decode(payload);
+        if (ack.results.size() != slots.size())
+            throw ProtocolError("bundle ack size mismatch");
+        for (size_t i = 0; i < slots.size(); ++i) {
+            results[slots[i]] = std::move(ack.results[i]);
+            contents[slots[i]] = {};
+        }
+        bundle.files.clear();
+        slots.clear();
+        bytes = 0;
+    };
+
+    try {
+        for (size_t i = 0; i < items.size(); ++i) {
+            const BundleItem& item = items[i];
+            try {
+                Fd file(::open(item.local_path.c_str(), O_RDONLY | O_CLOEXEC));
+                if (!file)
+                    throw_errno("open " + item.local_path);
+                struct stat st{};
+                if (::fstat(file.get(), &st) != 0)
+                    throw_errno("stat " + item.local_path);
+                if (!S_ISREG(st.st_mode))
+                    throw Error(item.local_path + " is not a regular file");
+                if (static_cast<uint64_t>(st.st_size) > kBundleFileMax)
+                    throw Error(item.local_path + " is too large for a bundle");
+                std::string& data = contents[i];
+                data.resize(static_cast<size_t>(st.st_size));
+                StageTimer t(Stage::DiskRead, data.size());
+                for (size_t got = 0; got < data.size();) {
+                    ssize_t r = ::pread(file.get(), data.data() + got, data.size() - got,
+                                        static_cast<off_t>(got));
+                    if (r < 0 && errno == EINTR)
+                        continue;
+                    if (r <= 0)
+                        throw Error(item.local_path + " changed size during transfer");
+                    got += static_cast<size_t>(r);
+                }
+                BundleEntry& e = bundle.files.emplace_back();
+                e.path = item.remote_path;
+                e.mode = st.st_mode & 0777;
+                e.mtime_ns =
+                    static_cast<int64_t>(st.st_mtim.tv_sec) * 1000000000 + st.st_mtim.tv_nsec;
+                e.crc32 = opts.checksum ? crc32_update(0, data.data(), data.size()) : 0;
+                e.data = data;
+                slots.push_back(i);
+                bytes += data.size() + item.remote_path.size();
+            } catch (const std::exception& e) {
+                results[i].status = Status::IoError;
+                results[i].message = e.what();
+                continue;
+            }
+            if (bytes >= kBundleBytes)
+                send_bundle();
+        }
+        send_bundle();
+    } catch (...) {
+        broken_ = true;
+        throw;
+    }
+    last_used_ = Clock::now();
+    return results;
+}
+
+GetResult Session::get_file(const std::string& remote_path, const std::string& local_path,
+                            const GetOptions& opts) {
+    if (broken_)
+        throw Error("session to " + ep_.to_string() + " is broken");
+    std::string part = download_part_path(local_path);
+    Fd file(::open(part.c_str(), O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0600));
+    if (!file)
+        throw_errno("open " + part);
+    try {
+        GetResult r = get_range(remote_path, file.get(), 0, kWholeFile, opts);
+        if (::ftruncate(file.get(), static_cast<off_t>(r.file_size)) != 0)
+            throw_errno("truncate " + part);
+        commit_download(file.get(), part, local_path, r);
+        return r;
+    } catch (...) {
+        ::unlink(part.c_str());
+        throw;
+    }
+}
+
+GetResult Session::get_range(const std::string& remote_path, int fd, uint64_t offset,
+                             uint64_t length, const GetOptions& opts) {
+    if (broken_)
+        throw Error("session to " + ep_.to_string() + " is broken");
+    try {
+        GetResult r = get_range_impl(remote_path, fd, offset, length, opts);
+        last_used_ = Clock::now();
+        return r;
+    } catch (const RemoteError&) {
+        last_used_ = Clock::now();
+        throw;
+    } catch (...) {
+        // The rest of the range may still be on its way.
+        broken_ = true;
+        throw;
+    }
+}
+
+GetResult Session::get_range_impl(const std::string& remote_path, int fd, uint64_t offset,
+                                  uint64_t length, const GetOptions& opts) {
+    auto start = Clock::now();
+    uint32_t stream = next_stream_++;
+    GetMsg get;
+    get.path = remote_path;
+    get.offset = offset;
+    get.length = length;
+    get.flags = opts.checksum ? kGetChecksum : 0u;
+    send_frame(FrameType::GetBegin, stream, get.encode());
+
+    std::string payload;
+    FrameHeader h;
+    do
+        h = read_frame(payload);
+    while (h.stream != stream && h.type != FrameType::Error);
+    if (h.type == FrameType::Error) {
+        StatusMsg m = StatusMsg::decode(payload);
+        throw ProtocolError(std::string("server error: ") + status_name(m.status) + ": " +
+                            m.message);
+    }
+    if (h.type != FrameType::GetReady)
+        throw ProtocolError("unexpected reply frame");
+    GetReadyMsg ready = GetReadyMsg::decode(payload);
+    if (ready.status != Status::Ok)
+        throw RemoteError(ready.status, ready.message);
+
+    GetResult r;
+    r.file_size = ready.size;
+    r.mode = ready.mode;
+    r.mtime_ns = ready.mtime_ns;
+    r.offset = offset;
+    uint64_t next = offset;
+    const uint64_t end = offset + ready.length;
+    uint32_t crc = 0;
+    for (;;) {
+        h = read_frame(payload);
+        if (h.stream != stream)
+            continue; // late reply for an abandoned stream
+        if (h.type == FrameType::GetEnd)
+            break;
+        if (h.type != FrameType::Data || payload.size() < 8)
+            throw ProtocolError("unexpected frame in download");
+        uint64_t at = WireReader(payload).u64();
+        std::string_view data = std::string_view(payload).substr(8);
+        if (at != next || data.size() > end - next)
+            throw ProtocolError("download data out of order");
+        {
+            StageTimer t(Stage::Write, data.size());
+            pwrite_all(fd, data.data(), data.size(), static_cast<off_t>(at));
+        }
+        if (opts.checksum)
+            crc = crc32_update(crc, data.data(), data.size());
+        next += data.size();
+    }
+    if (next != end)
+        throw ProtocolError("download ended short");
+    if (opts.checksum && ready.length > 0 && GetEndMsg::decode(payload).crc32 != crc)
+        throw RemoteError(Status::ChecksumMismatch, remote_path + ": crc mismatch");
+    r.bytes = ready.length;
+    r.elapsed = Clock::now() - start;
+    return r;
+}
+
+std::string download_part_path(const std::string& local_path) {
+    size_t slash = local_path.rfind('/');
+    size_t at = slash == std::string::npos ? 0 : slash + 1;
+    return local_path.substr(0, at) + "." + local_path.substr(at) + ".tcptransfer-part";
+}
+
+void commit_download(int fd, const std::string& part_path, const std::string& local_path,
+                     const GetResult& meta) {
+    if (::fchmod(fd, static_cast<mode_t>(meta.mode & 0777)) != 0)
+        throw_errno("chmod " + part_path);
+    struct timespec times[2];
+    times[0].tv_sec = 0;
+    times[0].tv_nsec = UTIME_OMIT;
+    times[1].tv_sec = static_cast<time_t>(meta.mtime_ns / 1000000000);
+    times[1].tv_nsec = static_cast<long>(meta.mtime_ns % 1000000000);
+    if (::futimens(fd, times) != 0)
+        throw_errno("set mtime of " + part_path);
+    if (::rename(part_path.c_str(), local_path.c_str()) != 0)
+        throw_errno("rename " + part_path);
+}
+
+std::chrono::microseconds Session::ping() {
+    if (broken_)
+        throw Error("session to " + ep_.to_string() + " is broken");
+    try {
+        auto start = Clock::now();
+        std::string nonce;
+        WireWriter(nonce).u64(static_cast<uint64_t>(start.time_since_epoch().count()));
+        uint32_t stream = next_stream_++;
+        send_frame(FrameType::Ping, stream, nonce);
+        std::string payload;
+        for (;;) {
+            FrameHeader h = read_frame(payload);
+            if (h.type == FrameType::Pong && h.stream == stream && payload == nonce)
+                break;
+            if (h.type == FrameType::Error)
+                throw ProtocolError("server error during ping");
+        }
+        last_used_ = Clock::now();
+        return std::chrono::duration_cast<std::chrono::microseconds>(last_used_ - start);
+    } catch (...) {
+        broken_ = true;
+        throw;
+    }
+}
+
+bool Session::probe() {
+    if (broken_)
+        return false;
+    pollfd p{fd_.get(), POLLIN | POLLRDHUP, 0};
+    int n = ::poll(&p, 1, 0);
+    if (n != 0) {
+        // Idle sessions must have nothing to read: any readiness means EOF,
+        // an error, or a stray frame that would desynchronise the stream.
+        broken_ = true;
+        return false;
+    }
+    return true;
+}
+
+} // namespace TcpTransfer
@@ -0,0 +1,231 @@
+#include "tcptransfer/socket.h"
+
+#include <arpa/inet.h>
+#include <fcntl.h>
+#include <netdb.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <poll.h>
+#include <sys/socket.h>
+#include <sys/uio.h>
+#include <unistd.h>
+
+#include <cerrno>
+#include <cstdlib>
+#include <cstring>
+
+#include "tcptransfer/error.h"
+
+namespace TcpTransfer {
+
+void Fd::reset(int fd) {
+    if (fd_ >= 0)
+        ::close(fd_);
+    fd_ = fd;
+}
+
+Endpoint Endpoint::parse(const std::string& s) {
+    auto colon = s.rfind(':');
+    if (colon == std::string::npos || colon == 0 || colon + 1 == s.size())
+        throw Error("endpoint must be host:port: " + s);
+    Endpoint ep;
+    ep.host = s.substr(0, colon);
+    if (ep.host.size() > 2 && ep.host.front() == '[' && ep.host.back() == ']')
+        ep.host = ep.host.substr(1, ep.host.size() - 2);
+    unsigned long port = std::strtoul(s.c_str() + colon + 1, nullptr, 10);
+    if (port == 0 || port > 65535)
+        throw Error("bad port in endpoint: " + s);
+    ep.port = static_cast<uint16_t>(port);
+    return ep;
+}
+
+Fd connect_tcp(const Endpoint& ep, std::chrono::milliseconds timeout) {
+    addrinfo hints{};
+    hints.ai_family = AF_UNSPEC;
+    hints.ai_socktype = SOCK_STREAM;
+    addrinfo* res = nullptr;
+    std::string port = std::to_string(ep.port);
+    int rc = ::getaddrinfo(ep.host.c_str(), port.c_str(), &hints, &res);
+    if (rc != 0)
+        throw Error("cannot resolve " + ep.host + ": " + ::gai_strerror(rc));
+
+    int last_errno = ECONNREFUSED;
+    for (addrinfo* ai = res; ai; ai = ai->ai_next) {
+        Fd fd(::socket(ai->ai_family, ai->ai_socktype | SOCK_CLOEXEC, ai->ai_protocol));
+        if (!fd)
+            continue;
+        set_nonblocking(fd.get(), true);
+        if (::connect(fd.get(), ai->ai_addr, ai->ai_addrlen) != 0) {
+            if (errno != EINPROGRESS) {
+                last_errno = errno;
+                continue;
+            }
+            pollfd p{fd.get(), POLLOUT, 0};
+            int n = ::poll(&p, 1, static_cast<int>(timeout.count()));
+            if (n <= 0) {
+                last_errno = n == 0 ? ETIMEDOUT : errno;
+                continue;
+            }
+            int err = 0;
+            socklen_t len = sizeof(err);
+            ::getsockopt(fd.get(), SOL_SOCKET, SO_ERROR, &err, &len);
+            if (err != 0) {
+                last_errno = err;
+                continue;
+            }
+        }
+        set_nonblocking(fd.get(), false);
+        set_nodelay(fd.get(), true);
+        ::freeaddrinfo(res);
+        return fd;
+    }
+    ::freeaddrinfo(res);
+    errno = last_errno;
+    throw_errno("connect " + ep.to_string());
+}
+
+Fd listen_tcp(const std::string& bind_addr, uint16_t port, int backlog) {
+    addrinfo hints{};
+    hints.ai_family = AF_UNSPEC;
+    hints.ai_socktype = SOCK_STREAM;
+    hints.ai_flags = AI_PASSIVE;
+    addrinfo* res = nullptr;
+    std::string port_s = std::to_string(port);
+    int rc = ::getaddrinfo(bind_addr.empty() ? nullptr : bind_addr.c_str(), port_s.c_str(),
+                           &hints, &res);
+    if (rc != 0)
+        throw Error("cannot resolve " + bind_addr + ": " + ::gai_strerror(rc));
+
+    Fd fd(::socket(res->ai_family, res->ai_socktype | SOCK_CLOEXEC, res->ai_protocol));
+    if (!fd) {
+        ::freeaddrinfo(res);
+        throw_errno("socket");
+    }
+    int one = 1;
+    ::setsockopt(fd.get(), SOL_SOCKET, SO_REUSEADDR, &one, sizeof(one));
+    if (::bind(fd.get(), res->ai_addr, res->ai_addrlen) != 0) {
+        ::freeaddrinfo(res);
+        throw_errno("bind " + bind_addr + ":" + port_s);
+    }
+    ::freeaddrinfo(res);
+    if (::listen(fd.get(), backlog) != 0)
+        throw_errno("listen");
+    return fd;
+}
+
+uint16_t local_port(int fd) {
+    sockaddr_storage ss{};
+    socklen_t len = sizeof(ss);
+    if (::getsockname(fd, reinterpret_cast<sockaddr*>(&ss), &len) != 0)
+        throw_errno("getsockname");
+    if (ss.ss_family == AF_INET6)
+        return ntohs(reinterpret_cast<sockaddr_in6*>(&ss)->sin6_port);
+    return ntohs(reinterpret_cast<sockaddr_in*>(&ss)->sin_port);
+}
+
+void set_nonblocking(int fd, bool on) {
+    int flags = ::fcntl(fd, F_GETFL);
+    if (flags < 0 || ::fcntl(fd, F_SETFL, on ? flags | O_NONBLOCK : flags & ~O_NONBLOCK) < 0)
+        throw_errno("fcntl O_NONBLOCK");
+}
+
+void set_nodelay(int fd, bool on) {
+    int v = on ? 1 : 0;
+    ::setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &v, sizeof(v));
+}
+
+void write_full(int fd, const void* buf, size_t n) {
+    auto p = static_cast<const char*>(buf);
+    while (n > 0) {
+        ssize_t w = ::send(fd, p, n, MSG_NOSIGNAL);
+        if (w < 0) {
+            if (errno == EINTR)
+                continue;
+            throw_errno("send");
+        }
+        p += w;
+        n -= static_cast<size_t>(w);
+    }
+}
+
+void writev_full(int fd, iovec* iov, int iovcnt) {
+    while (iovcnt > 0) {
+        msghdr msg{};
+        msg.msg_iov = iov;
+        msg.msg_iovlen = static_cast<size_t>(iovcnt);
+        ssize_t w = ::sendmsg(fd, &msg, MSG_NOSIGNAL);
+        if (w < 0) {
+            if (errno == EINTR)
+                continue;
+            throw_errno("sendmsg");
+        }
+        auto left = static_cast<size_t>(w);
+        while (iovcnt > 0 && left >= iov->iov_len) {
+            left -= iov->iov_len;
+            ++iov;
+            --iovcnt;
+        }
+        if (iovcnt > 0) {
+            iov->iov_base = static_cast<char*>(iov->iov_base) + left;
+            iov->iov_len -= left;
+        }
+    }
+}
+
+bool read_full(int fd, void* buf, size_t n) {
+    auto p = static_cast<char*>(buf);
+    size_t got = 0;
+    while (got < n) {
+        ssize_t r = ::recv(fd, p + got, n - got, 0);
+        if (r < 0) {
+            if (errno == EINTR)
+                continue;
+            throw_errno("recv");
+        }
+        if (r == 0) {
+            if (got == 0)
+                return false;
+            throw Error("connection closed mid-frame");
+        }
+        got += static_cast<size_t>(r);
+    }
+    return true;
+}
+
+int socket_cpu(int fd) {
+    int cpu = -1;
+    socklen_t len = sizeof(cpu);
+    if (::getsockopt(fd, SOL_SOCKET, SO_INCOMING_CPU, &cpu, &len) != 0)
+        return -1;
+    return cpu;
+}
+
+std::string peer_address(int fd) {
+    sockaddr_storage ss{};
+    socklen_t len = sizeof(ss);
+    if (::getpeername(fd, reinterpret_cast<sockaddr*>(&ss), &len) != 0)
+        return {};
+    char buf[INET6_ADDRSTRLEN] = {};
+    const void* addr = nullptr;
+    if (ss.ss_family == AF_INET)
+        addr = &reinterpret_cast<sockaddr_in*>(&ss)->sin_addr;
+    else if (ss.ss_family == AF_INET6)
+        addr = &reinterpret_cast<sockaddr_in6*>(&ss)->sin6_addr;
+    if (!addr || !::inet_ntop(ss.ss_family, addr, buf, sizeof(buf)))
+        return {};
+    return buf;
+}
+
+bool wait_readable(int fd, std::chrono::milliseconds timeout) {
+    pollfd p{fd, POLLIN, 0};
+    for (;;) {
+        int n = ::poll(&p, 1, static_cast<int>(timeout.count()));
+        if (n < 0 && errno == EINTR)
+            continue;
+        if (n < 0)
+            throw_errno("poll");
+        return n > 0;
+    }
+}
+
+} // namespace TcpTransfer
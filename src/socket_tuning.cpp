@@ -0,0 +1,104 @@
+#include "tcptransfer/socket_tuning.h"
+
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <sys/socket.h>
+
+#include <algorithm>
+#include <fstream>
+#include <limits>
+
+namespace TcpTransfer {
+
+namespace {
+
+/// net.core.{w,r}mem_max: the ceiling for unprivileged SO_*BUF.
+long sysctl_buffer_max(bool send_side) {
+    static const long wmem = [] {
+        long v = 0;
+        std::ifstream("/proc/sys/net/core/wmem_max") >> v;
+        return v;
+    }();
+    static const long rmem = [] {
+        long v = 0;
+        std::ifstream("/proc/sys/net/core/rmem_max") >> v;
+        return v;
+    }();
+    return send_side ? wmem : rmem;
+}
+
+int get_int(int fd, int level, int opt) {
+    int v = 0;
+    socklen_t len = sizeof(v);
+    ::getsockopt(fd, level, opt, &v, &len);
+    return v;
+}
+
+} // namespace
+
+void apply_socket_tuning(int fd, const SocketTuning& t) {
+    if (t.notsent_lowat > 0) {
+        int v = static_cast<int>(t.notsent_lowat);
+        ::setsockopt(fd, IPPROTO_TCP, TCP_NOTSENT_LOWAT, &v, sizeof(v));
+    }
+    int nd = t.nodelay ? 1 : 0;
+    ::setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &nd, sizeof(nd));
+}
+
+bool grow_buffer_for_bdp(int fd, uint64_t bdp, const SocketTuning& t, bool send_side) {
+    if (!t.size_from_bdp || bdp == 0)
+        return false;
+    const int opt = send_side ? SO_SNDBUF : SO_RCVBUF;
+    const int force = send_side ? SO_SNDBUFFORCE : SO_RCVBUFFORCE;
+    uint64_t want = std::min<uint64_t>(static_cast<uint64_t>(t.bdp_gain * static_cast<double>(bdp)),
+                                       t.max_buffer);
+    int current = get_int(fd, SOL_SOCKET, opt);
+    if (want <= static_cast<uint64_t>(current))
+        return false;
+    // The kernel doubles the request to cover skb overhead, so asking for
+    // `want` leaves roughly `want` bytes of payload room.
+    int request = static_cast<int>(
+        std::min<uint64_t>(want, std::numeric_limits<int>::max() / 2));
+    if (::setsockopt(fd, SOL_SOCKET, force, &request, sizeof(request)) != 0) {
+        long cap = sysctl_buffer_max(send_side);
+        if (2 * std::min<long>(request, cap) <= current)
+            return false; // would shrink us and disable autotuning
+        ::setsockopt(fd, SOL_SOCKET, opt, &request, sizeof(request));
+    }
+    return get_int(fd, SOL_SOCKET, opt) != current;
+}
+
+SocketStats read_socket_stats(int fd) {
+    SocketStats s;
+    s.sndbuf = get_int(fd, SOL_SOCKET, SO_SNDBUF);
+    s.rcvbuf = get_int(fd, SOL_SOCKET, SO_RCVBUF);
+    s.notsent_lowat = get_int(fd, IPPROTO_TCP, TCP_NOTSENT_LOWAT);
+    s.nodelay = get_int(fd, IPPROTO_TCP, TCP_NODELAY) != 0;
+    tcp_info info{};
+    socklen_t len = sizeof(info);
+    if (::getsockopt(fd, IPPROTO_TCP, TCP_INFO, &info, &len) == 0) {
+        s.rtt_us = info.tcpi_rtt;
+        s.rttvar_us = info.tcpi_rttvar;
+        s.rcv_rtt_us = info.tcpi_rcv_rtt;
+        s.snd_cwnd = info.tcpi_snd_cwnd;
+        s.snd_mss = info.tcpi_snd_mss;
+        s.total_retrans = info.tcpi_total_retrans;
+    }
+    return s;
+}
+
+CorkGuard::CorkGuard(int fd, bool enable) : fd_(fd), on_(enable) {
+    if (on_) {
+        int one = 1;
+        ::setsockopt(fd_, IPPROTO_TCP, TCP_CORK, &one, sizeof(one));
+    }
+}
+
+CorkGuard::~CorkGuard() {
+    if (on_) {
+        int zero = 0;
+        ::setsockopt(fd_, IPPROTO_TCP, TCP_CORK, &zero, sizeof(zero));
+    }
+}
+
+} // namespace TcpTransfer
@@ -0,0 +1,217 @@
+#include "tcptransfer/thread_pool.h"
+
+#include <pthread.h>
+#include <sched.h>
+
+#include <chrono>
+#include <utility>
+
+namespace TcpTransfer {
+
+namespace {
+
+thread_local const WorkStealingPool* t_pool = nullptr;
+thread_local int t_worker = -1;
+
+std::vector<int> allowed_cpus() {
+    std::vector<int> cpus;
+    cpu_set_t set;
+    CPU_ZERO(&set);
+    if (::sched_getaffinity(0, sizeof(set), &set) == 0)
+        for (int c = 0; c < CPU_SETSIZE; ++c)
+            if (CPU_ISSET(c, &set))
+                cpus.push_back(c);
+    if (cpus.empty())
+        cpus.push_back(0);
+    return cpus;
+}
+
+} // namespace
+
+WorkStealingPool::WorkStealingPool(size_t threads, bool pin) {
+    std::vector<int> cpus = allowed_cpus();
+    size_t n = threads ? threads : cpus.size();
+    for (size_t i = 0; i < n; ++i) {
+        auto w = std::make_unique<Worker>();
+        w->cpu = cpus[i % cpus.size()];
+        workers_.push_back(std::move(w));
+    }
+    for (size_t i = 0; i < n; ++i) {
+        Worker& w = *workers_[i];
+        w.thread = std::thread([this, i] { worker_loop(i); });
+        if (pin && n <= cpus.size()) {
+            cpu_set_t set;
+            CPU_ZERO(&set);
+            CPU_SET(w.cpu, &set);
+            ::pthread_setaffinity_np(w.thread.native_handle(), sizeof(set), &set);
+        }
+    }
+}
+
+WorkStealingPool::~WorkStealingPool() {
+    {
+        std::lock_guard<std::mutex> lk(sleep_mu_);
+        stopping_ = true;
+    }
+    sleep_cv_.notify_all();
+    for (auto& w : workers_)
+        w->thread.join();
+}
+
+int WorkStealingPool::current_worker() const { return t_pool == this ? t_worker : -1; }
+
+size_t WorkStealingPool::worker_for_cpu(int cpu) const {
+    for (size_t i = 0; i < workers_.size(); ++i)
+        if (workers_[i]->cpu == cpu)
+            return i;
+    return static_cast<size_t>(cpu) % workers_.size();
+}
+
+void WorkStealingPool::submit(Task task, int cpu) {
+    size_t target;
+    if (cpu >= 0)
+        target = worker_for_cpu(cpu);
+    else if (int self = current_worker(); self >= 0)
+        target = static_cast<size_t>(self);
+    else
+        target = next_.fetch_add(1, std::memory_order_relaxed) % workers_.size();
+    {
+        std::lock_guard<std::mutex> lk(workers_[target]->mu);
+        workers_[target]->tasks.push_back(std::move(task));
+    }
+    queued_.fetch_add(1, std::memory_order_release);
+    {
+        // Pairs with the predicate check in worker_loop so a wakeup is never lost.
+        std::lock_guard<std::mutex> lk(sleep_mu_);
+    }
+    sleep_cv_.notify_one();
+}
+
+bool WorkStealingPool::pop_local(size_t index, Task& out) {
+    Worker& w = *workers_[index];
+    std::lock_guard<std::mutex> lk(w.mu);
+    if (w.tasks.empty())
+        return false;
+    out = std::move(w.tasks.back());
+    w.tasks.pop_back();
+    queued_.fetch_sub(1, std::memory_order_relaxed);
+    return true;
+}
+
+bool WorkStealingPool::steal(size_t thief, Task& out) {
+    size_t n = workers_.size();
+    for (size_t k = 1; k < n; ++k) {
+        Worker& w = *workers_[(thief + k) % n];
+        std::unique_lock<std::mutex> lk(w.mu, std::try_to_lock);
+        if (!lk.owns_lock() || w.tasks.empty())
+            continue;
+        out = std::move(w.tasks.front());
+        w.tasks.pop_front();
+        queued_.fetch_sub(1, std::memory_order_relaxed);
+        return true;
+    }
+    return false;
+}
+
+bool WorkStealingPool::run_one(int cpu) {
+    size_t home;
+    if (int self = current_worker(); self >= 0)
+        home = static_cast<size_t>(self);
+    else
+        home = worker_for_cpu(cpu >= 0 ? cpu : 0);
+    Task task;
+    if (!pop_local(home, task) && !steal(home, task))
+        return false;
+    task();
+    return true;
+}
+
+void WorkStealingPool::worker_loop(size_t index) {
+    t_pool = this;
+    t_worker = static_cast<int>(index);
+    for (;;) {
+        Task task;
+        if (pop_local(index, task) || steal(index, task)) {
+            task();
+            continue;
+        }
+        std::unique_lock<std::mutex> lk(sleep_mu_);
+        if (stopping_ && queued_.load(std::memory_order_acquire) == 0)
+            return;
+        if (queued_.load(std::memory_order_acquire) > 0) {
+            // Work exists but try_lock lost a race; retry without sleeping.
+            lk.unlock();
+            std::this_thread::yield();
+            continue;
+        }
+        sleep_cv_.wait(lk, [&] {
+            return stopping_ || queued_.load(std::memory_order_acquire) > 0;
+        });
+    }
+}
+
+TaskGroup::~TaskGroup() {
+    try {
+        wait();
+    } catch (...) {
+        // The owner already saw, or chose to ignore, the failure.
+    }
+}
+
+void TaskGroup::run(std::function<void()> fn) {
+    if (!pool_) {
+        try {
+            fn();
+        } catch (...) {
+            std::lock_guard<std::mutex> lk(st_->mu);
+            if (!st_->error)
+                st_->error = std::current_exception();
+        }
+        return;
+    }
+    {
+        std::lock_guard<std::mutex> lk(st_->mu);
+        ++st_->outstanding;
+    }
+    pool_->submit(
+        [st = st_, fn = std::move(fn)] {
+            std::exception_ptr err;
+            try {
+                fn();
+            } catch (...) {
+                err = std::current_exception();
+            }
+            std::lock_guard<std::mutex> lk(st->mu);
+            if (err && !st->error)
+                st->error = err;
+            if (--st->outstanding == 0)
+                st->cv.notify_all();
+        },
+        cpu_);
+}
+
+void TaskGroup::wait() {
+    for (;;) {
+        {
+            std::unique_lock<std::mutex> lk(st_->mu);
+            if (st_->outstanding == 0)
+                break;
+        }
+        if (pool_ && pool_->run_one(cpu_))
+            continue;
+        // Our tasks are running elsewhere; doze briefly in case more work
+        // that we could help with gets queued meanwhile.
+        std::unique_lock<std::mutex> lk(st_->mu);
+        st_->cv.wait_for(lk, std::chrono::microseconds(200),
+                         [&] { return st_->outstanding == 0; });
+    }
+    std::exception_ptr err;
+    {
+        std::lock_guard<std::mutex> lk(st_->mu);
+        err = std::exchange(st_->error, nullptr);
+    }
+    if (err)
+        std::rethrow_exception(err);
+}
+
+} // namespace TcpTransfer
@@ -0,0 +1,220 @@
+#include "tcptransfer/trace.h"
+
+#include <sys/syscall.h>
+#include <unistd.h>
+
+#include <algorithm>
+#include <cstdio>
+#include <fstream>
+#include <memory>
+#include <mutex>
+#include <vector>
+
+#include "tcptransfer/error.h"
+
+namespace TcpTransfer {
+
+namespace detail {
+
+std::atomic<bool> g_trace_on{false};
+
+struct TraceEvent {
+    std::atomic<uintptr_t> name{0};
+    std::atomic<int64_t> start_ns{0}; ///< Relative to the trace epoch.
+    std::atomic<int64_t> dur_ns{0};
+    std::atomic<uint64_t> arg{0};
+};
+
+/// One thread's spans. The owner writes slots and then publishes head;
+/// readers copy a window and drop any slot the owner may have lapped
+/// meanwhile (seqlock style), so neither side blocks the other.
+struct TraceRing {
+    std::mutex mu; ///< Guards events/cap/name against a concurrent dump.
+    std::unique_ptr<TraceEvent[]> events;
+    size_t cap = 0;
+    std::atomic<uint64_t> head{0};
+    uint64_t generation = 0;
+    uint32_t tid = 0;
+    std::string name;
+    std::atomic<bool> in_use{false};
+    TraceRing* next = nullptr;
+};
+
+namespace {
+
+std::atomic<TraceRing*> g_rings{nullptr};
+std::atomic<uint64_t> g_generation{0};
+std::atomic<size_t> g_capacity{1 << 16};
+std::atomic<int64_t> g_epoch_ns{0};
+
+int64_t to_ns(std::chrono::steady_clock::time_point t) {
+    return std::chrono::duration_cast<std::chrono::nanoseconds>(t.time_since_epoch()).count();
+}
+
+struct RingRelease {
+    TraceRing* ring = nullptr;
+    ~RingRelease() {
+        if (ring)
+            ring->in_use.store(false, std::memory_order_release);
+    }
+};
+
+thread_local RingRelease t_ring;
+
+TraceRing& thread_ring() {
+    if (t_ring.ring)
+        return *t_ring.ring;
+    TraceRing* r = nullptr;
+    for (TraceRing* b = g_rings.load(std::memory_order_acquire); b && !r; b = b->next) {
+        bool expected = false;
+        if (!b->in_use.load(std::memory_order_relaxed) &&
+            b->in_use.compare_exchange_strong(expected, true, std::memory_order_acquire))
+            r = b;
+    }
+    if (!r) {
+        r = new TraceRing; // never freed: dumps walk the list without a lock
+        r->in_use.store(true, std::memory_order_relaxed);
+        TraceRing* head = g_rings.load(std::memory_order_relaxed);
+        do {
+            r->next = head;
+        } while (!g_rings.compare_exchange_weak(head, r, std::memory_order_release,
+                                                std::memory_order_relaxed));
+    }
+    std::lock_guard<std::mutex> lock(r->mu);
+    // A recycled ring belongs to a new thread: its old spans would be
+    // misattributed, so start it over.
+    r->tid = static_cast<uint32_t>(::syscall(SYS_gettid));
+    r->name.clear();
+    r->generation = 0;
+    r->head.store(0, std::memory_order_release);
+    t_ring.ring = r;
+    return *r;
+}
+
+void append_json_string(std::string& out, const std::string& s) {
+    out += '"';
+    for (char ch : s) {
+        if (ch == '"' || ch == '\\')
+            out += '\\';
+        if (static_cast<unsigned char>(ch) < 0x20)
+            continue;
+        out += ch;
+    }
+    out += '"';
+}
+
+} // namespace
+
+void trace_record(const char* name, std::chrono::steady_clock::time_point start,
+                  std::chrono::steady_clock::time_point end, uint64_t arg) {
+    if (!g_trace_on.load(std::memory_order_relaxed))
+        return;
+    int64_t rel = to_ns(start) - g_epoch_ns.load(std::memory_order_relaxed);
+    if (rel < 0)
+        return; // began before trace_start()
+    TraceRing& r = thread_ring();
+    uint64_t gen = g_generation.load(std::memory_order_acquire);
+    if (r.generation != gen) {
+        std::lock_guard<std::mutex> lock(r.mu);
+        size_t cap = g_capacity.load(std::memory_order_relaxed);
+        if (r.cap != cap) {
+            r.events.reset(new TraceEvent[cap]);
+            r.cap = cap;
+        }
+        r.head.store(0, std::memory_order_release);
+        r.generation = gen;
+    }
+    uint64_t idx = r.head.load(std::memory_order_relaxed);
+    TraceEvent& e = r.events[idx % r.cap];
+    e.name.store(reinterpret_cast<uintptr_t>(name), std::memory_order_relaxed);
+    e.start_ns.store(rel, std::memory_order_relaxed);
+    e.dur_ns.store(to_ns(end) - to_ns(start), std::memory_order_relaxed);
+    e.arg.store(arg, std::memory_order_relaxed);
+    r.head.store(idx + 1, std::memory_order_release);
+}
+
+} // namespace detail
+
+void trace_start(size_t events_per_thread) {
+    detail::g_trace_on.store(false, std::memory_order_relaxed);
+    detail::g_capacity.store(std::max<size_t>(events_per_thread, 16), std::memory_order_relaxed);
+    detail::g_epoch_ns.store(detail::to_ns(std::chrono::steady_clock::now()),
+                             std::memory_order_relaxed);
+    detail::g_generation.fetch_add(1, std::memory_order_release);
+    detail::g_trace_on.store(true, std::memory_order_release);
+}
+
+void trace_stop() { detail::g_trace_on.store(false, std::memory_order_release); }
+
+void trace_thread_name(const std::string& name) {
+    detail::TraceRing& r = detail::thread_ring();
+    std::lock_guard<std::mutex> lock(r.mu);
+    r.name = name;
+}
+
+std::string trace_json() {
+    const uint64_t gen = detail::g_generation.load(std::memory_order_acquire);
+    const int pid = static_cast<int>(::getpid());
+    std::string out = "{\"displayTimeUnit\":\"ns\",\"traceEvents\":[";
+    bool first = true;
+    char line[320];
+    for (auto* r = detail::g_rings.load(std::memory_order_acquire); r; r = r->next) {
+        std::lock_guard<std::mutex> lock(r->mu);
+        if (!r->name.empty()) {
+            std::snprintf(line, sizeof(line),
+                          "%s{\"name\":\"thread_name\",\"ph\":\"M\",\"pid\":%d,\"tid\":%u,"
+                          "\"args\":{\"name\":",
+                          first ? "" : ",", pid, r->tid);
+            out += line;
+            detail::append_json_string(out, r->name);
+            out += "}}";
+            first = false;
+        }
+        if (r->generation != gen || r->cap == 0)
+            continue;
+        uint64_t h1 = r->head.load(std::memory_order_acquire);
+        uint64_t lo = h1 > r->cap ? h1 - r->cap : 0;
+        struct Copy {
+            uintptr_t name;
+            int64_t start, dur;
+            uint64_t arg;
+        };
+        std::vector<Copy> spans;
+        spans.reserve(static_cast<size_t>(h1 - lo));
+        for (uint64_t i = lo; i < h1; ++i) {
+            const detail::TraceEvent& e = r->events[i % r->cap];
+            spans.push_back({e.name.load(std::memory_order_relaxed),
+                             e.start_ns.load(std::memory_order_relaxed),
+                             e.dur_ns.load(std::memory_order_relaxed),
+                             e.arg.load(std::memory_order_relaxed)});
+        }
+        std::atomic_thread_fence(std::memory_order_acquire);
+        uint64_t h2 = r->head.load(std::memory_order_relaxed);
+        // The owner may be writing slot h2 already, which overwrites index h2 - cap.
+        uint64_t valid = h2 >= r->cap ? h2 - r->cap + 1 : 0;
+        for (uint64_t i = std::max(lo, valid); i < h1; ++i) {
+            const Copy& c = spans[static_cast<size_t>(i - lo)];
+            if (c.name == 0)
+                continue;
+            std::snprintf(line, sizeof(line),
+                          "%s{\"name\":\"%s\",\"ph\":\"X\",\"pid\":%d,\"tid\":%u,\"ts\":%.3f,"
+                          "\"dur\":%.3f,\"args\":{\"v\":%llu}}",
+                          first ? "" : ",", reinterpret_cast<const char*>(c.name), pid, r->tid,
+                          static_cast<double>(c.start) / 1e3, static_cast<double>(c.dur) / 1e3,
+                          static_cast<unsigned long long>(c.arg));
+            out += line;
+            first = false;
+        }
+    }
+    out += "]}\n";
+    return out;
+}
+
+void trace_write(const std::string& path) {
+    std::string json = trace_json();
+    std::ofstream f(path, std::ios::binary | std::ios::trunc);
+    if (!f.write(json.data(), static_cast<std::streamsize>(json.size())))
+        throw Error("cannot write trace to " + path);
+}
+
+} // namespace TcpTransfer
@@ -0,0 +1,190 @@
+#include "tcptransfer/watcher.h"
+
+#include <dirent.h>
+#include <fcntl.h>
+#include <sys/inotify.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include <algorithm>
+#include <cerrno>
+
+#include "tcptransfer/error.h"
+#include "tcptransfer/path_util.h"
+#include "tcptransfer/trace.h"
+
+namespace TcpTransfer {
+
+namespace {
+
+// IN_CREATE only matters for directories: a new file is reported once it
+// is closed after writing.
+constexpr uint32_t kWatchMask = IN_CLOSE_WRITE | IN_MOVED_TO | IN_MOVED_FROM | IN_CREATE |
+                                IN_DELETE_SELF | IN_ONLYDIR | IN_DONT_FOLLOW;
+
+} // namespace
+
+DirWatcher::DirWatcher(std::string dir, WatchOptions opts, Handler handler)
+    : dir_(std::move(dir)), opts_(opts), handler_(std::move(handler)),
+      inotify_(::inotify_init1(IN_NONBLOCK | IN_CLOEXEC)) {
+    if (!inotify_)
+        throw_errno("inotify_init1");
+    add_tree("", false);
+    if (dirs_.empty())
+        throw Error("cannot watch " + dir_);
+}
+
+DirWatcher::~DirWatcher() { stop(); }
+
+void DirWatcher::start() {
+    loop_.add(inotify_.get(), EPOLLIN, [this](uint32_t) { on_readable(); });
+    thread_ = std::thread([this] {
+        trace_thread_name("dir-watcher");
+        loop_.run();
+    });
+}
+
+void DirWatcher::stop() {
+    loop_.stop();
+    if (thread_.joinable())
+        thread_.join();
+}
+
+void DirWatcher::add_tree(const std::string& rel, bool report) {
+    std::string path = rel.empty() ? dir_ : join_path(dir_, rel);
+    int wd = ::inotify_add_watch(inotify_.get(), path.c_str(), kWatchMask);
+    if (wd < 0)
+        return; // gone again, or out of watches; a rescan still covers it
+    dirs_[wd] = rel;
+    // Files created before the watch existed are picked up here.
+    DIR* d = ::opendir(path.c_str());
+    if (!d)
+        return;
+    std::vector<std::string> subdirs;
+    while (dirent* e = ::readdir(d)) {
+        std::string_view name = e->d_name;
+        if (name == "." || name == "..")
+            continue;
+        unsigned char type = e->d_type;
+        if (type == DT_UNKNOWN) {
+            struct stat st{};
+            if (::fstatat(::dirfd(d), e->d_name, &st, AT_SYMLINK_NOFOLLOW) != 0)
+                continue;
+            type = S_ISDIR(st.st_mode) ? DT_DIR : S_ISREG(st.st_mode) ? DT_REG : DT_UNKNOWN;
+        }
+        if (type == DT_DIR)
+            subdirs.push_back(join_path(rel, name));
+        else if (type == DT_REG && report)
+            touch(join_path(rel, name));
+    }
+    ::closedir(d);
+    for (const std::string& sub : subdirs)
+        add_tree(sub, report);
+}
+
+void DirWatcher::forget_tree(const std::string& rel) {
+    // A directory moved away keeps its watches under a path we no longer
+    // know; drop them and let the move's destination (if watched) re-add.
+    for (auto it = dirs_.begin(); it != dirs_.end();) {
+        const std::string& d = it->second;
+        bool inside = d == rel || (d.size() > rel.size() && d.compare(0, rel.size(), rel) == 0 &&
+                                   d[rel.size()] == '/');
+        if (inside) {
+            ::inotify_rm_watch(inotify_.get(), it->first);
+            it = dirs_.erase(it);
+        } else {
+            ++it;
+        }
+    }
+}
+
+void DirWatcher::on_readable() {
+    alignas(inotify_event) char buf[64 << 10];
+    for (;;) {
+        ssize_t n = ::read(inotify_.get(), buf, sizeof(buf));
+        if (n < 0 && errno == EINTR)
+            continue;
+        if (n <= 0)
+            break;
+        for (char* p = buf; p < buf + n;) {
+            auto* ev = reinterpret_cast<inotify_event*>(p);
+            p += sizeof(inotify_event) + ev->len;
+            if (ev->mask & IN_Q_OVERFLOW) {
+                overflow_ = true;
+                continue;
+            }
+            auto it = dirs_.find(ev->wd);
+            if (it == dirs_.end())
+                continue;
+            if (ev->mask & IN_IGNORED) {
+                dirs_.erase(it);
+                continue;
+            }
+            if (ev->len == 0)
+                continue;
+            std::string rel = join_path(it->second, ev->name);
+            if (ev->mask & IN_ISDIR) {
+                if (ev->mask & IN_MOVED_FROM)
+                    forget_tree(rel);
+                else if (ev->mask & (IN_CREATE | IN_MOVED_TO))
+                    add_tree(rel, true);
+            } else if (ev->mask & (IN_CLOSE_WRITE | IN_MOVED_TO)) {
+                touch(std::move(rel));
+            }
+        }
+    }
+    if (overflow_) {
+        // Everything pending is covered by the rescan.
+        pending_.clear();
+        overflow_ = false;
+        TCPTRANSFER_TRACE_SPAN("watch_rescan", 0);
+        handler_({}, true);
+        return;
+    }
+    schedule();
+}
+
+void DirWatcher::touch(std::string rel) {
+    auto now = EventLoop::Clock::now();
+    auto [it, fresh] = pending_.try_emplace(std::move(rel), Pending{now, now});
+    if (!fresh)
+        it->second.last = now;
+}
+
+void DirWatcher::schedule() {
+    if (timer_set_ || pending_.empty())
+        return;
+    auto now = EventLoop::Clock::now();
+    auto next = EventLoop::Clock::time_point::max();
+    for (const auto& [path, p] : pending_)
+        next = std::min(next, std::min(p.last + opts_.debounce, p.first + opts_.max_delay));
+    auto delay = std::max(std::chrono::ceil<std::chrono::milliseconds>(next - now),
+                          std::chrono::milliseconds(1));
+    timer_set_ = true;
+    loop_.run_after(delay, [this] {
+        timer_set_ = false;
+        deliver();
+    });
+}
+
+void DirWatcher::deliver() {
+    auto now = EventLoop::Clock::now();
+    std::vector<std::string> ready;
+    for (auto it = pending_.begin(); it != pending_.end();) {
+        const Pending& p = it->second;
+        if (now - p.last >= opts_.debounce || now - p.first >= opts_.max_delay) {
+            ready.push_back(it->first);
+            it = pending_.erase(it);
+        } else {
+            ++it;
+        }
+    }
+    if (!ready.empty()) {
+        std::sort(ready.begin(), ready.end());
+        TCPTRANSFER_TRACE_SPAN("watch_batch", ready.size());
+        handler_(std::move(ready), false);
+    }
+    schedule();
+}
+
+} // namespace TcpTransfer
@@ -0,0 +1,76 @@
+// Async<T>: move-only, completed from another thread, taken once by get()
+// or by the coroutine awaiting it, with failures rethrown.
+
+#include <memory>
+#include <stdexcept>
+#include <string>
+#include <thread>
+#include <type_traits>
+
+#include "tcptransfer/async.h"
+#include "test_util.h"
+
+using namespace TcpTransfer;
+
+namespace {
+
+static_assert(!std::is_copy_constructible_v<Async<int>>);
+static_assert(!std::is_copy_assignable_v<Async<int>>);
+static_assert(std::is_nothrow_move_constructible_v<Async<int>>);
+
+void get_takes_the_result() {
+    auto [a, st] = Async<std::unique_ptr<std::string>>::make();
+    CHECK(!a.ready());
+    std::thread t([st = st] { st->set_value(std::make_unique<std::string>("done")); });
+    std::unique_ptr<std::string> v = a.get();
+    t.join();
+    CHECK(v && *v == "done");
+    CHECK(!a.valid());
+
+    auto [failed, fst] = Async<int>::make();
+    fst->set_error(std::make_exception_ptr(std::runtime_error("no")));
+    CHECK_THROWS(std::runtime_error, failed.get());
+}
+
+Async<int> add_one(Async<int> in) {
+    int v = co_await in;
+    co_return v + 1;
+}
+
+Async<void> rethrows(Async<int> in) {
+    co_await in;
+}
+
+void await_resumes_the_waiter() {
+    // Awaited before completion: resumed inline by set_value().
+    auto [in, st] = Async<int>::make();
+    Async<int> out = add_one(std::move(in));
+    CHECK(!out.ready());
+    st->set_value(41);
+    CHECK(out.ready() && out.get() == 42);
+
+    // Already complete: no suspension.
+    auto [done, dst] = Async<int>::make();
+    dst->set_value(1);
+    CHECK(add_one(std::move(done)).get() == 2);
+
+    // Completed from another thread.
+    auto [late, lst] = Async<int>::make();
+    Async<int> chained = add_one(std::move(late));
+    std::thread t([lst = lst] { lst->set_value(9); });
+    CHECK(chained.get() == 10);
+    t.join();
+
+    auto [bad, bst] = Async<int>::make();
+    Async<void> r = rethrows(std::move(bad));
+    bst->set_error(std::make_exception_ptr(std::logic_error("bad")));
+    CHECK_THROWS(std::logic_error, r.get());
+}
+
+} // namespace
+
+int main() {
+    get_takes_the_result();
+    await_resumes_the_waiter();
+    return 0;
+}
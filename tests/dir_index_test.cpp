@@ -0,0 +1,114 @@
+// DirIndex: entry states, growth of the table and arena across reopens,
+// and an index left dirty by a crash being discarded.
+
+#include <fcntl.h>
+#include <sys/wait.h>
+#include <unistd.h>
+
+#include <string>
+
+#include "tcptransfer/dir_index.h"
+#include "test_util.h"
+
+using namespace TcpTransfer;
+using namespace TcpTransfer::test;
+
+namespace {
+
+std::string path_of(int i) {
+    return "some/fairly/deep/directory/" + std::to_string(i % 97) + "/file-" + std::to_string(i);
+}
+
+DirIndex::Entry entry_of(int i) {
+    return {static_cast<uint64_t>(i) * 4096 + 1, int64_t{1700000000} * 1000000000 + i,
+            0x9E3779B97F4A7C15ull * static_cast<uint64_t>(i + 1)};
+}
+
+Fd open_dir(const TempDir& dir) {
+    Fd fd(::open(dir.path().c_str(), O_PATH | O_DIRECTORY | O_CLOEXEC));
+    CHECK(fd);
+    return fd;
+}
+
+void entry_states() {
+    TempDir dir;
+    Fd dfd = open_dir(dir);
+    DirIndex idx(dfd.get());
+    const DirIndex::Entry e{10, 20, 30};
+    CHECK(!idx.matches("a", e));
+    idx.expect("a", e);
+    CHECK(!idx.matches("a", e)); // pending until committed
+    idx.committed("a", 10, 20);
+    CHECK(idx.matches("a", e));
+    CHECK(!idx.matches("a", {10, 20, 31}));
+
+    // Written outside a sync, or not as expected: stale.
+    idx.committed("a", 11, 20);
+    CHECK(!idx.matches("a", e));
+    idx.expect("b", e);
+    idx.committed("b", 10, 21);
+    CHECK(!idx.matches("b", e));
+    // Never synced: not recorded at all.
+    idx.committed("c", 10, 20);
+    CHECK(idx.size() == 2);
+}
+
+void grows_and_reopens() {
+    constexpr int kPaths = 5000; // several table doublings and arena growths
+    TempDir dir;
+    Fd dfd = open_dir(dir);
+    {
+        DirIndex idx(dfd.get());
+        for (int i = 0; i < kPaths; ++i) {
+            DirIndex::Entry e = entry_of(i);
+            idx.expect(path_of(i), e);
+            idx.committed(path_of(i), e.size, e.mtime_ns);
+        }
+        CHECK(idx.size() == kPaths);
+        for (int i = 0; i < kPaths; ++i)
+            CHECK(idx.matches(path_of(i), entry_of(i)));
+    }
+    CHECK(!std::filesystem::exists(dir.path() + "/" + DirIndex::kFileName + ".tmp"));
+    DirIndex idx(dfd.get());
+    CHECK(idx.size() == kPaths);
+    for (int i = 0; i < kPaths; ++i)
+        CHECK(idx.matches(path_of(i), entry_of(i)));
+    CHECK(!idx.matches(path_of(kPaths), entry_of(kPaths)));
+}
+
+void dirty_index_is_discarded() {
+    TempDir dir;
+    Fd dfd = open_dir(dir);
+    {
+        DirIndex idx(dfd.get());
+        idx.expect("kept", {1, 2, 3});
+        idx.committed("kept", 1, 2);
+    }
+    // A process that dies mid-update leaves the dirty flag set.
+    pid_t pid = ::fork();
+    CHECK(pid >= 0);
+    if (pid == 0) {
+        DirIndex idx(dfd.get());
+        idx.expect("half", {4, 5, 6});
+        ::_exit(0);
+    }
+    int status = 0;
+    CHECK(::waitpid(pid, &status, 0) == pid && WIFEXITED(status) && WEXITSTATUS(status) == 0);
+
+    DirIndex idx(dfd.get());
+    CHECK(idx.size() == 0);
+    CHECK(!idx.matches("kept", {1, 2, 3}));
+    // And the fresh index works.
+    idx.expect("kept", {1, 2, 3});
+    idx.committed("kept", 1, 2);
+    CHECK(idx.matches("kept", {1, 2, 3}));
+}
+
+} // namespace
+
+int main() {
+    entry_states();
+    grows_and_reopens();
+    dirty_index_is_discarded();
+    return 0;
+}
@@ -0,0 +1,189 @@
+// DiskWriters lanes: queued writes that continue each other fold into one
+// pwritev up to the merge limits, truncates and flushes keep their place,
+// and a merged write the kernel cuts short fails every job it carried
+// while what did land is in place.
+
+#include <fcntl.h>
+#include <sys/resource.h>
+#include <sys/stat.h>
+
+#include <algorithm>
+#include <cerrno>
+#include <csignal>
+#include <future>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <vector>
+
+#include "tcptransfer/disk_writer.h"
+#include "test_util.h"
+
+using namespace TcpTransfer;
+using namespace TcpTransfer::test;
+
+namespace {
+
+/// One lane per device, so every file of a test shares it.
+DiskWriterOptions one_lane(size_t max_merge_bytes = 4 << 20) {
+    DiskWriterOptions opts;
+    opts.rotational_lanes = opts.flash_lanes = opts.other_lanes = 1;
+    opts.max_merge_bytes = max_merge_bytes;
+    return opts;
+}
+
+std::shared_ptr<const Fd> open_file(const std::string& path) {
+    auto fd = std::make_shared<const Fd>(::open(path.c_str(), O_RDWR | O_CREAT | O_CLOEXEC, 0644));
+    CHECK(*fd);
+    return fd;
+}
+
+DiskWriters::Lane lane_of(DiskWriters& w, const Fd& fd) {
+    struct stat st{};
+    CHECK(::fstat(fd.get(), &st) == 0);
+    return w.lane_for(st.st_dev, st.st_ino);
+}
+
+std::vector<char> slice(const std::string& data, size_t offset, size_t n) {
+    return std::vector<char>(data.begin() + offset, data.begin() + offset + n);
+}
+
+/// Holds a lane's thread until release(), so that what is submitted
+/// meanwhile is queued together.
+class Gate {
+public:
+    Gate(DiskWriters& w, DiskWriters::Lane lane) {
+        auto opened = open_.get_future().share();
+        w.flush(lane, [opened](int, std::chrono::nanoseconds) { opened.wait(); });
+    }
+    void release() { open_.set_value(); }
+
+private:
+    std::promise<void> open_;
+};
+
+/// Errors the jobs reported, in the order they finished.
+class Results {
+public:
+    DiskWriters::Done done() {
+        return [this](int error, std::chrono::nanoseconds) {
+            std::lock_guard<std::mutex> lk(mu_);
+            errors_.push_back(error);
+        };
+    }
+    /// Waits for the jobs queued on lane so far.
+    std::vector<int> wait(DiskWriters& w, DiskWriters::Lane lane) {
+        std::promise<void> flushed;
+        w.flush(lane, [&](int, std::chrono::nanoseconds) { flushed.set_value(); });
+        flushed.get_future().wait();
+        std::lock_guard<std::mutex> lk(mu_);
+        return errors_;
+    }
+
+private:
+    std::mutex mu_;
+    std::vector<int> errors_;
+};
+
+void merge_cut_offs() {
+    TempDir dir;
+    const std::string data = random_bytes(64 << 10, 49);
+    auto a = open_file(dir.file("a"));
+    auto b = open_file(dir.file("b"));
+    DiskWriters w(one_lane(16 << 10));
+    auto lane = lane_of(w, *a);
+    CHECK(lane_of(w, *b) == lane);
+    Results r;
+
+    Gate gate(w, lane);
+    // [0, 16K) of a in four jobs: one pwritev.
+    for (size_t off = 0; off < (16 << 10); off += 4 << 10)
+        w.submit(lane, a, off, slice(data, off, 4 << 10), r.done());
+    // Continues a, but past max_merge_bytes: a new pwritev.
+    w.submit(lane, a, 16 << 10, slice(data, 16 << 10, 4 << 10), r.done());
+    // Continues by offset, but in another file.
+    w.submit(lane, b, 20 << 10, slice(data, 20 << 10, 4 << 10), r.done());
+    // Back in a, leaving a gap at [20K, 24K).
+    w.submit(lane, a, 24 << 10, slice(data, 24 << 10, 4 << 10), r.done());
+    // Cut a at 26K, then continue from there: the truncate ends the run
+    // behind it, and the write after it is not folded into the one before.
+    w.truncate(lane, a, 26 << 10, r.done());
+    w.submit(lane, a, 26 << 10, slice(data, 26 << 10, 2 << 10), r.done());
+    gate.release();
+
+    std::vector<int> errors = r.wait(w, lane);
+    CHECK(errors == std::vector<int>(9, 0));
+    CHECK(w.writes() == 5 && w.merged() == 3);
+    CHECK(w.devices() == 1);
+
+    std::string expect = data.substr(0, 28 << 10);
+    std::fill(expect.begin() + (20 << 10), expect.begin() + (24 << 10), '\0');
+    CHECK(read_file(dir.file("a")) == expect);
+    std::string in_b = read_file(dir.file("b"));
+    CHECK(in_b.size() == 24 << 10 && in_b.substr(20 << 10) == data.substr(20 << 10, 4 << 10));
+}
+
+void merge_job_limit() {
+    TempDir dir;
+    const std::string data = random_bytes(100 * 100, 50);
+    auto f = open_file(dir.file("f"));
+    DiskWriters w(one_lane());
+    auto lane = lane_of(w, *f);
+    Results r;
+
+    // A hundred small continuing jobs are more iovecs than one pwritev
+    // takes: 64 of them, then the rest.
+    Gate gate(w, lane);
+    for (size_t i = 0; i < 100; ++i)
+        w.submit(lane, f, i * 100, slice(data, i * 100, 100), r.done());
+    gate.release();
+    CHECK(r.wait(w, lane) == std::vector<int>(100, 0));
+    CHECK(w.writes() == 2 && w.merged() == 98);
+    CHECK(read_file(dir.file("f")) == data);
+}
+
+void short_merged_write() {
+    TempDir dir;
+    const std::string data = random_bytes(12 << 10, 51);
+    auto f = open_file(dir.file("f"));
+    DiskWriters w(one_lane());
+    auto lane = lane_of(w, *f);
+    Results r;
+
+    // The file size limit lets the merged write land only partly, part way
+    // into its second job; the retry for the rest then fails with EFBIG.
+    constexpr rlim_t kLimit = 6000;
+    std::signal(SIGXFSZ, SIG_IGN);
+    rlimit saved{};
+    CHECK(::getrlimit(RLIMIT_FSIZE, &saved) == 0);
+    rlimit limited = saved;
+    limited.rlim_cur = kLimit;
+    CHECK(::setrlimit(RLIMIT_FSIZE, &limited) == 0);
+
+    Gate gate(w, lane);
+    for (size_t off = 0; off < data.size(); off += 4 << 10)
+        w.submit(lane, f, off, slice(data, off, 4 << 10), r.done());
+    gate.release();
+    std::vector<int> errors = r.wait(w, lane);
+    CHECK(::setrlimit(RLIMIT_FSIZE, &saved) == 0);
+
+    // Every job of the write hears of it, not only the one cut.
+    CHECK(errors == std::vector<int>(3, EFBIG));
+    CHECK(w.writes() == 1 && w.merged() == 2);
+    CHECK(read_file(dir.file("f")) == data.substr(0, kLimit));
+
+    // The lane carries on: the rest lands after the part that did.
+    w.submit(lane, f, kLimit, slice(data, kLimit, data.size() - kLimit), r.done());
+    errors = r.wait(w, lane);
+    CHECK(errors.size() == 4 && errors.back() == 0);
+    CHECK(read_file(dir.file("f")) == data);
+}
+
+} // namespace
+
+int main() {
+    merge_cut_offs();
+    merge_job_limit();
+    short_merged_write();
+    return 0;
+}
@@ -0,0 +1,166 @@
+// FileCache: open fds reused while a file is unchanged and reopened once it
+// is replaced or rewritten, extents admitted on their second touch only,
+// a bounded ghost list, and least-recently-used eviction past the budget.
+
+#include <fcntl.h>
+
+#include <cerrno>
+#include <string>
+#include <system_error>
+
+#include "tcptransfer/file_cache.h"
+#include "test_util.h"
+
+using namespace TcpTransfer;
+using namespace TcpTransfer::test;
+
+namespace {
+
+constexpr size_t kExtent = FileCache::kExtentSize;
+
+Fd open_dir(const std::string& path) {
+    Fd fd(::open(path.c_str(), O_RDONLY | O_DIRECTORY | O_CLOEXEC));
+    CHECK(fd);
+    return fd;
+}
+
+/// One fetch of extent index of f: looks it up, and keeps it if admitted.
+/// True on a hit.
+bool fetch(FileCache& cache, const FileCache::File& f, uint64_t index) {
+    bool admit = false;
+    if (cache.extent(f, index, admit))
+        return true;
+    if (admit)
+        cache.insert_extent(f, index, std::string(kExtent, static_cast<char>('a' + index)));
+    return false;
+}
+
+void open_files() {
+    TempDir root;
+    write_file(root.file("a"), "alpha");
+    write_file(root.file("b"), "bravo");
+    write_file(root.file("c"), "charlie");
+    Fd dir = open_dir(root.path());
+    FileCache cache(2, 0);
+
+    auto a = cache.open(dir.get(), "a", "a");
+    CHECK(a->regular && a->size == 5);
+    CHECK(cache.open(dir.get(), "a", "a") == a);
+    CHECK(cache.file_hits() == 1 && cache.file_misses() == 1);
+
+    // Replaced by a new inode, then rewritten in place: reopened each time.
+    write_file(root.file("a.new"), "alpha2");
+    std::filesystem::rename(root.file("a.new"), root.file("a"));
+    auto a2 = cache.open(dir.get(), "a", "a");
+    CHECK(a2 != a && a2->size == 6);
+    write_file(root.file("a"), "alpha-3");
+    auto a3 = cache.open(dir.get(), "a", "a");
+    CHECK(a3 != a2 && a3->size == 7);
+    CHECK(cache.file_misses() == 3);
+
+    // Two fds are kept: opening c evicts b, the least recently used.
+    auto b = cache.open(dir.get(), "b", "b");
+    CHECK(cache.open(dir.get(), "a", "a") == a3);
+    cache.open(dir.get(), "c", "c");
+    CHECK(cache.open(dir.get(), "a", "a") == a3);
+    CHECK(cache.open(dir.get(), "b", "b") != b);
+
+    // Symlinks are not followed and errno reaches the caller.
+    std::filesystem::create_symlink("a", root.file("link"));
+    int err = 0;
+    try {
+        cache.open(dir.get(), "link", "link");
+    } catch (const std::system_error&) {
+        err = errno;
+    }
+    CHECK(err == ELOOP);
+}
+
+void second_touch_admission() {
+    TempDir root;
+    write_file(root.file("f"), "content");
+    write_file(root.file("g"), "other");
+    Fd dir = open_dir(root.path());
+    FileCache cache(8, 3 * kExtent);
+    auto f = cache.open(dir.get(), "f", "f");
+
+    // The first miss only remembers the key; the second admits.
+    bool admit = true;
+    CHECK(!cache.extent(*f, 0, admit) && !admit);
+    CHECK(!cache.extent(*f, 0, admit) && admit);
+    auto kept = cache.insert_extent(*f, 0, std::string(kExtent, 'a'));
+    CHECK(cache.extent(*f, 0, admit) == kept && !admit);
+    CHECK(cache.extent_bytes() == kExtent);
+    CHECK(cache.extent_hits() == 1 && cache.extent_misses() == 2);
+
+    // Same index of another file is another extent.
+    auto g = cache.open(dir.get(), "g", "g");
+    CHECK(!cache.extent(*g, 0, admit) && !admit);
+
+    // A scan touching each extent once keeps none of them.
+    for (uint64_t i = 1; i <= 100; ++i)
+        CHECK(!fetch(cache, *f, i));
+    CHECK(cache.extent_bytes() == kExtent);
+    CHECK(fetch(cache, *f, 0));
+
+    // The ghost list holds two budgets' worth of keys: the scan has pushed
+    // out the early ones, so they start over, while the late ones admit.
+    CHECK(!cache.extent(*f, 1, admit) && !admit);
+    CHECK(!cache.extent(*f, 100, admit) && admit);
+
+    // An extent larger than the budget is handed back but never kept.
+    auto huge = cache.insert_extent(*f, 200, std::string(4 * kExtent, 'h'));
+    CHECK(huge->size() == 4 * kExtent);
+    CHECK(!cache.extent(*f, 200, admit));
+    CHECK(cache.extent_bytes() == kExtent);
+
+    // A rewritten file has a new identity: its old extents are not served.
+    write_file(root.file("f"), "content, changed");
+    auto f2 = cache.open(dir.get(), "f", "f");
+    CHECK(f2 != f);
+    CHECK(!cache.extent(*f2, 0, admit) && !admit);
+
+    // Without a budget nothing is remembered or admitted.
+    FileCache off(8, 0);
+    CHECK(!off.extent(*f2, 0, admit) && !admit);
+    CHECK(!off.extent(*f2, 0, admit) && !admit);
+    off.insert_extent(*f2, 0, "x");
+    CHECK(!off.extent(*f2, 0, admit) && off.extent_bytes() == 0);
+}
+
+void eviction() {
+    TempDir root;
+    write_file(root.file("f"), "content");
+    Fd dir = open_dir(root.path());
+    FileCache cache(8, 3 * kExtent);
+    auto f = cache.open(dir.get(), "f", "f");
+
+    for (uint64_t i = 0; i < 3; ++i) {
+        CHECK(!fetch(cache, *f, i));
+        CHECK(!fetch(cache, *f, i));
+    }
+    CHECK(cache.extent_bytes() == 3 * kExtent);
+    // Touching 0 makes 1 the least recently used, so 3 displaces it.
+    CHECK(fetch(cache, *f, 0));
+    CHECK(!fetch(cache, *f, 3));
+    CHECK(!fetch(cache, *f, 3));
+    CHECK(cache.extent_bytes() == 3 * kExtent);
+    CHECK(fetch(cache, *f, 0) && fetch(cache, *f, 2) && fetch(cache, *f, 3));
+    // An evicted extent leaves no ghost behind: 1 starts over.
+    bool admit = true;
+    CHECK(!cache.extent(*f, 1, admit) && !admit);
+
+    // Inserting a kept extent again returns the one already held.
+    auto held = cache.extent(*f, 2, admit);
+    CHECK(cache.insert_extent(*f, 2, "other") == held);
+    CHECK(cache.extent_bytes() == 3 * kExtent);
+}
+
+} // namespace
+
+int main() {
+    open_files();
+    second_touch_admission();
+    eviction();
+    return 0;
+}
@@ -0,0 +1,258 @@
+// Hot restart pieces: the resume journal's encoding, merging and file,
+// Server::handoff() against a stand-in successor on a socketpair, and
+// stop() journaling open uploads of a server in run().
+
+#include <fcntl.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include <future>
+#include <string>
+#include <thread>
+#include <vector>
+
+#include "tcptransfer/error.h"
+#include "tcptransfer/handoff.h"
+#include "tcptransfer/protocol.h"
+#include "tcptransfer/resume_journal.h"
+#include "tcptransfer/server.h"
+#include "tcptransfer/session.h"
+#include "test_util.h"
+
+using namespace TcpTransfer;
+using namespace TcpTransfer::test;
+
+namespace {
+
+JournalEntry entry_of(size_t i) {
+    return {i * 1000 + 7, static_cast<int64_t>(i) * 3, i * 500,
+            static_cast<uint32_t>(i * 2654435761u)};
+}
+
+bool same(const JournalEntry& a, const JournalEntry& b) {
+    return a.size == b.size && a.mtime_ns == b.mtime_ns && a.offset == b.offset && a.crc == b.crc;
+}
+
+void journal_encode_merge() {
+    ResumeJournal j;
+    for (size_t i = 0; i < 1000; ++i)
+        j.record("dir/" + std::to_string(i), entry_of(i));
+    std::vector<std::string> parts = j.encode(4096);
+    CHECK(parts.size() > 1);
+    ResumeJournal copy;
+    for (const std::string& p : parts) {
+        CHECK(p.size() < 4096 + 64);
+        copy.merge(p);
+    }
+    CHECK(copy.size() == 1000);
+    for (size_t i = 0; i < 1000; ++i) {
+        auto e = copy.take("dir/" + std::to_string(i));
+        CHECK(e && same(*e, entry_of(i)));
+    }
+    CHECK(copy.size() == 0);
+    CHECK(!copy.take("dir/0"));
+
+    // A later entry for a path replaces the earlier one.
+    copy.record("x", entry_of(1));
+    ResumeJournal newer;
+    newer.record("x", entry_of(2));
+    copy.merge(newer.encode(4096).at(0));
+    CHECK(copy.size() == 1 && same(*copy.take("x"), entry_of(2)));
+
+    // Malformed input merges nothing.
+    std::string bad = parts.at(0);
+    bad.resize(bad.size() - 3);
+    CHECK_THROWS(ProtocolError, copy.merge(bad));
+    CHECK(copy.size() == 0);
+    CHECK(ResumeJournal{}.encode(4096).empty());
+}
+
+void journal_save_load() {
+    TempDir root;
+    Fd rfd(::open(root.path().c_str(), O_PATH | O_DIRECTORY | O_CLOEXEC));
+    const std::string file = root.path() + "/" + ResumeJournal::kFileName;
+    ResumeJournal{}.save(rfd.get());
+    CHECK(!std::filesystem::exists(file));
+
+    // Enough entries for several 1 MiB parts in the file.
+    constexpr size_t kEntries = 60000;
+    ResumeJournal j;
+    for (size_t i = 0; i < kEntries; ++i)
+        j.record("some/longer/destination/path/" + std::to_string(i), entry_of(i));
+    j.save(rfd.get());
+    CHECK(std::filesystem::exists(file));
+    ResumeJournal loaded;
+    loaded.load(rfd.get());
+    CHECK(!std::filesystem::exists(file)); // used once
+    CHECK(loaded.size() == kEntries);
+    for (size_t i = 0; i < kEntries; i += 997)
+        CHECK(same(*loaded.take("some/longer/destination/path/" + std::to_string(i)),
+                   entry_of(i)));
+
+    // A damaged tail loses its part; the parts before it still load.
+    j.save(rfd.get());
+    std::filesystem::resize_file(file, std::filesystem::file_size(file) - 100);
+    ResumeJournal partial;
+    partial.load(rfd.get());
+    CHECK(partial.size() > 0 && partial.size() < kEntries);
+    for (size_t i = 0; i < kEntries; ++i)
+        if (auto e = partial.take("some/longer/destination/path/" + std::to_string(i)))
+            CHECK(same(*e, entry_of(i)));
+    CHECK(!std::filesystem::exists(file));
+}
+
+/// Plays the successor's side up to Done; false if the old server went away.
+bool take_handoff(int sock, Fd& listener) {
+    HandoffMsg type{};
+    std::string payload;
+    if (!recv_handoff(sock, std::chrono::seconds(5), type, payload, listener) ||
+        type != HandoffMsg::Listener || !listener)
+        return false;
+    for (;;) {
+        Fd none;
+        if (!recv_handoff(sock, std::chrono::seconds(5), type, payload, none))
+            return false;
+        if (type == HandoffMsg::Done)
+            return true;
+    }
+}
+
+struct Pair {
+    Fd old_end, new_end;
+    Pair() {
+        int sv[2];
+        CHECK(::socketpair(AF_UNIX, SOCK_SEQPACKET | SOCK_CLOEXEC, 0, sv) == 0);
+        old_end = Fd(sv[0]);
+        new_end = Fd(sv[1]);
+    }
+};
+
+void handoff_refuses_new_puts_until_acked() {
+    TempDir root, src;
+    ServerConfig cfg;
+    cfg.root = root.path();
+    cfg.bind_addr = "127.0.0.1";
+    Server server(cfg);
+    server.start();
+    write_file(src.file("f"), "contents");
+    auto session = Session::connect({"127.0.0.1", server.port()}, {});
+    session->put_file(src.file("f"), "in");
+
+    Pair p;
+    auto done = std::async(std::launch::async, [&] {
+        server.handoff(p.old_end.get(), std::chrono::milliseconds(1000));
+    });
+    Fd listener;
+    CHECK(take_handoff(p.new_end.get(), listener));
+    // Until the successor acks, the old server refuses new transfers.
+    try {
+        session->put_file(src.file("f"), "refused");
+        CHECK(false);
+    } catch (const RemoteError& e) {
+        CHECK(e.status() == Status::Busy);
+    }
+    send_handoff(p.new_end.get(), HandoffMsg::Ack, "");
+    done.get();
+    CHECK(!std::filesystem::exists(root.file("refused/f")));
+    // The listener now belongs to the successor alone.
+    Fd c = connect_tcp({"127.0.0.1", server.port()}, std::chrono::milliseconds(1000));
+    CHECK(wait_readable(listener.get(), std::chrono::milliseconds(1000)));
+    server.stop();
+}
+
+void failed_handoff_keeps_serving() {
+    TempDir root, src;
+    ServerConfig cfg;
+    cfg.root = root.path();
+    cfg.bind_addr = "127.0.0.1";
+    Server server(cfg);
+    server.start();
+    write_file(src.file("f"), "contents");
+
+    Pair p;
+    auto done = std::async(std::launch::async, [&] {
+        server.handoff(p.old_end.get(), std::chrono::milliseconds(1000));
+    });
+    Fd listener;
+    CHECK(take_handoff(p.new_end.get(), listener));
+    // The successor dies before acking.
+    p.new_end.reset();
+    listener.reset();
+    CHECK_THROWS(Error, done.get());
+
+    auto session = Session::connect({"127.0.0.1", server.port()}, {});
+    session->put_file(src.file("f"), "after");
+    CHECK(read_file(root.file("after/f")) == "contents");
+    server.stop();
+}
+
+int64_t mtime_of(const std::string& path) {
+    struct stat st{};
+    CHECK(::stat(path.c_str(), &st) == 0);
+    return int64_t{st.st_mtim.tv_sec} * 1000000000 + st.st_mtim.tv_nsec;
+}
+
+void stop_journals_uploads_under_run() {
+    TempDir root, src;
+    const std::string data = random_bytes(1 << 20, 46);
+    write_file(src.file("f"), data);
+    ServerConfig cfg;
+    cfg.root = root.path();
+    cfg.bind_addr = "127.0.0.1";
+    cfg.port = 0;
+    {
+        Server server(cfg);
+        std::thread serving([&] { server.run(); });
+        while (server.port() == 0)
+            std::this_thread::sleep_for(std::chrono::milliseconds(1));
+
+        // A put that stops after its first 64 KiB.
+        Fd sock = connect_tcp({"127.0.0.1", server.port()}, std::chrono::milliseconds(1000));
+        auto send = [&](FrameType type, const std::string& payload) {
+            std::string f = make_frame(type, 1, payload);
+            write_full(sock.get(), f.data(), f.size());
+        };
+        send(FrameType::Hello, HelloMsg{}.encode());
+        PutBeginMsg begin;
+        begin.remote_dir = "in";
+        begin.name = "f";
+        begin.size = data.size();
+        begin.mtime_ns = mtime_of(src.file("f"));
+        begin.flags = kPutChecksum;
+        send(FrameType::PutBegin, begin.encode());
+        std::string chunk;
+        WireWriter(chunk).u64(0);
+        chunk.append(data, 0, 64 << 10);
+        send(FrameType::Data, chunk);
+        while (server.stats().bytes_received < (64 << 10))
+            std::this_thread::sleep_for(std::chrono::milliseconds(1));
+
+        // From another thread than run()'s, with the upload still open.
+        server.stop();
+        serving.join();
+    }
+    CHECK(std::filesystem::exists(root.path() + "/" + ResumeJournal::kFileName));
+
+    Server next(cfg);
+    next.start();
+    auto session = Session::connect({"127.0.0.1", next.port()}, {});
+    PutOptions opts;
+    opts.resume = true;
+    PutResult r = session->put_file(src.file("f"), "in", opts);
+    CHECK(r.resumed_from == 64 << 10);
+    CHECK(read_file(root.file("in/f")) == data);
+    next.stop();
+    CHECK(next.stats().journal_resumes == 1);
+}
+
+} // namespace
+
+int main() {
+    journal_encode_merge();
+    journal_save_load();
+    handoff_refuses_new_puts_until_acked();
+    failed_handoff_keeps_serving();
+    stop_journals_uploads_under_run();
+    return 0;
+}
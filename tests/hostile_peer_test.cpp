@@ -0,0 +1,133 @@
+// Hand-built frames a well-behaved client never sends: the server answers
+// them with an error status and nothing lands outside the file.
+
+#include <string>
+
+#include "tcptransfer/error.h"
+#include "tcptransfer/protocol.h"
+#include "tcptransfer/server.h"
+#include "tcptransfer/socket.h"
+#include "test_util.h"
+
+using namespace TcpTransfer;
+using namespace TcpTransfer::test;
+
+namespace {
+
+/// A connection that speaks frames directly.
+class RawPeer {
+public:
+    explicit RawPeer(uint16_t port)
+        : fd_(connect_tcp({"127.0.0.1", port}, std::chrono::milliseconds(1000))) {
+        send(FrameType::Hello, 0, HelloMsg{}.encode());
+        CHECK(recv().type == FrameType::HelloAck);
+    }
+
+    void send(FrameType type, uint32_t stream, const std::string& payload) {
+        std::string f = make_frame(type, stream, payload);
+        write_full(fd_.get(), f.data(), f.size());
+    }
+    /// The next frame; payload_ holds its payload.
+    FrameHeader recv() {
+        CHECK(wait_readable(fd_.get(), std::chrono::milliseconds(5000)));
+        char hdr[kFrameHeaderSize];
+        CHECK(read_full(fd_.get(), hdr, sizeof(hdr)));
+        FrameHeader h = decode_header(hdr);
+        payload_.resize(h.length);
+        CHECK(read_full(fd_.get(), payload_.data(), h.length));
+        return h;
+    }
+    const std::string& payload() const { return payload_; }
+
+    /// Starts a plain put of size bytes on stream.
+    void put_begin(uint32_t stream, const std::string& name, uint64_t size, uint32_t flags = 0) {
+        PutBeginMsg m;
+        m.remote_dir = "in";
+        m.name = name;
+        m.size = size;
+        m.flags = flags;
+        send(FrameType::PutBegin, stream, m.encode());
+    }
+    void data(uint32_t stream, uint64_t offset, const std::string& bytes) {
+        std::string p;
+        WireWriter(p).u64(offset);
+        p += bytes;
+        send(FrameType::Data, stream, p);
+    }
+    /// Waits for stream's PutAck and returns its status.
+    Status put_ack(uint32_t stream) {
+        for (;;) {
+            FrameHeader h = recv();
+            if (h.type == FrameType::PutAck && h.stream == stream)
+                return StatusMsg::decode(payload_).status;
+        }
+    }
+
+private:
+    Fd fd_;
+    std::string payload_;
+};
+
+void data_offset_wraps() {
+    TempDir root;
+    ServerConfig cfg;
+    cfg.root = root.path();
+    cfg.bind_addr = "127.0.0.1";
+    Server server(cfg);
+    server.start();
+
+    RawPeer peer(server.port());
+    // offset + n wraps to 4, inside a 16-byte file.
+    peer.put_begin(1, "wrap", 16);
+    peer.data(1, ~uint64_t{0} - 3, std::string(8, 'x'));
+    CHECK(peer.put_ack(1) == Status::SizeMismatch);
+    // Just past the end, and one byte over it.
+    peer.put_begin(3, "past", 16);
+    peer.data(3, 17, "");
+    CHECK(peer.put_ack(3) == Status::SizeMismatch);
+    peer.put_begin(5, "over", 16);
+    peer.data(5, 8, std::string(9, 'x'));
+    CHECK(peer.put_ack(5) == Status::SizeMismatch);
+    // The connection still takes a good put.
+    peer.put_begin(7, "good", 16);
+    peer.data(7, 0, std::string(16, 'g'));
+    peer.send(FrameType::PutEnd, 7, PutEndMsg{}.encode());
+    CHECK(peer.put_ack(7) == Status::Ok);
+    CHECK(read_file(root.file("in/good")) == std::string(16, 'g'));
+    CHECK(!std::filesystem::exists(root.file("in/wrap")));
+    server.stop();
+}
+
+void copy_too_long() {
+    TempDir root;
+    ServerConfig cfg;
+    cfg.root = root.path();
+    cfg.bind_addr = "127.0.0.1";
+    Server server(cfg);
+    server.start();
+    const uint64_t size = 2 * kMaxCopyFrame;
+    write_file(root.file("in/basis"), std::string(size, 'b'));
+
+    RawPeer peer(server.port());
+    // Inside both files, but more than one Copy frame may reuse.
+    peer.put_begin(1, "basis", size, kPutDelta);
+    CopyMsg m;
+    m.length = kMaxCopyFrame + 1;
+    peer.send(FrameType::Copy, 1, m.encode());
+    CHECK(peer.put_ack(1) == Status::BadRequest);
+    // Wrapping ranges are refused too.
+    peer.put_begin(3, "basis", size, kPutDelta);
+    m.offset = ~uint64_t{0} - 10;
+    m.length = 100;
+    peer.send(FrameType::Copy, 3, m.encode());
+    CHECK(peer.put_ack(3) == Status::BadRequest);
+    server.stop();
+}
+
+} // namespace
+
+int main() {
+    data_offset_wraps();
+    copy_too_long();
+    return 0;
+}
@@ -0,0 +1,132 @@
+// Path classification against the straightforward per-component check it
+// replaced, on fixed cases, patterns straddling the 64-byte blocks and
+// random paths.
+
+#include <cstdio>
+#include <cstdlib>
+#include <random>
+#include <string>
+#include <string_view>
+
+#include "tcptransfer/path_util.h"
+#include "test_util.h"
+
+using namespace TcpTransfer;
+
+namespace {
+
+// The per-component implementation from before the bitmask classifier.
+namespace reference {
+
+bool safe_component(std::string_view c) {
+    if (c.empty() || c == "." || c == "..")
+        return false;
+    for (unsigned char ch : c) {
+        if (ch < 0x20 || ch == 0x7f || ch == '\\')
+            return false;
+    }
+    return true;
+}
+
+bool is_safe_relative_path(std::string_view p) {
+    if (p.empty())
+        return true;
+    if (p.size() > 4096 || p.front() == '/')
+        return false;
+    size_t start = 0;
+    for (;;) {
+        size_t slash = p.find('/', start);
+        std::string_view c =
+            p.substr(start, slash == std::string_view::npos ? p.npos : slash - start);
+        if (c.empty() && slash == std::string_view::npos && start > 0)
+            return true;
+        if (!safe_component(c))
+            return false;
+        if (slash == std::string_view::npos)
+            return true;
+        start = slash + 1;
+    }
+}
+
+bool is_safe_file_name(std::string_view name) {
+    return name.size() <= 255 && name.find('/') == std::string_view::npos &&
+           safe_component(name);
+}
+
+} // namespace reference
+
+void agrees(std::string_view p) {
+    if (is_safe_relative_path(p) != reference::is_safe_relative_path(p) ||
+        is_safe_file_name(p) != reference::is_safe_file_name(p)) {
+        std::fprintf(stderr, "disagree on %zu-byte path:", p.size());
+        for (unsigned char ch : p)
+            std::fprintf(stderr, " %02x", ch);
+        std::fprintf(stderr, "\n");
+        std::exit(1);
+    }
+}
+
+void fixed_cases() {
+    CHECK(is_safe_relative_path(""));
+    CHECK(is_safe_relative_path("a/b/c"));
+    CHECK(is_safe_relative_path("a/b/"));
+    CHECK(is_safe_relative_path("..."));
+    CHECK(is_safe_relative_path(".hidden/x..y"));
+    CHECK(is_safe_relative_path("caf\xc3\xa9"));
+    CHECK(!is_safe_relative_path("/a"));
+    CHECK(!is_safe_relative_path("a//b"));
+    CHECK(!is_safe_relative_path("a/b//"));
+    CHECK(!is_safe_relative_path("."));
+    CHECK(!is_safe_relative_path(".."));
+    CHECK(!is_safe_relative_path("a/../b"));
+    CHECK(!is_safe_relative_path("a/./b"));
+    CHECK(!is_safe_relative_path("a/.."));
+    CHECK(!is_safe_relative_path("a\\b"));
+    CHECK(!is_safe_relative_path(std::string_view("a\0b", 3)));
+    CHECK(!is_safe_relative_path("a\x7f"));
+    CHECK(is_safe_relative_path(std::string(4096, 'a')));
+    CHECK(!is_safe_relative_path(std::string(4097, 'a')));
+    CHECK(is_safe_file_name("name.txt"));
+    CHECK(!is_safe_file_name("a/b"));
+    CHECK(!is_safe_file_name(""));
+    CHECK(!is_safe_file_name(std::string(256, 'a')));
+}
+
+void block_boundaries() {
+    // Every bad pattern at every offset around the first two block edges,
+    // so that its bytes fall on both sides of one.
+    const std::string_view patterns[] = {"/../", "/./", "//", "/..", "/.", "\\", "/.../",
+                                         "/..a/", "/a./"};
+    for (std::string_view pat : patterns)
+        for (size_t at = 40; at < 140; ++at) {
+            std::string p(at, 'a');
+            p += pat;
+            agrees(p);
+            agrees(p + "b");
+            agrees(p + std::string(70, 'c'));
+        }
+}
+
+void random_paths() {
+    // Mostly the bytes the rules are about, with lengths across blocks.
+    const char alphabet[] = {'a', 'b', '/', '/', '.', '.', '.', '\\', '\0', '\x1f', ' ',
+                             '\x7f', '\x80', '\xff', '~'};
+    std::mt19937_64 rng(48);
+    std::string p;
+    for (int i = 0; i < 300000; ++i) {
+        size_t len = rng() % (i % 100 == 0 ? 300 : 140);
+        p.clear();
+        for (size_t j = 0; j < len; ++j)
+            p += alphabet[rng() % (i % 3 == 0 ? sizeof(alphabet) : 7)];
+        agrees(p);
+    }
+}
+
+} // namespace
+
+int main() {
+    fixed_cases();
+    block_boundaries();
+    random_paths();
+    return 0;
+}
@@ -0,0 +1,157 @@
+// TokenBucket's GCRA arithmetic (burst, debt, no banked credit, re-rating,
+// concurrent charges), rate parsing, and max-min fair shares with capped
+// claimants.
+
+#include <algorithm>
+#include <chrono>
+#include <random>
+#include <thread>
+#include <vector>
+
+#include "tcptransfer/error.h"
+#include "tcptransfer/rate_limit.h"
+#include "test_util.h"
+
+using namespace TcpTransfer;
+using namespace std::chrono_literals;
+
+namespace {
+
+using Clock = TokenBucket::Clock;
+
+void burst_then_debt() {
+    const Clock::time_point t0{10s};
+    TokenBucket b({1000, 100}); // 1 ms per byte, 100 ms of tolerance
+    CHECK(b.charge(100, t0) == Clock::duration::zero());
+    // Past the burst, the debt is what arrived early.
+    CHECK(b.charge(50, t0) == 50ms);
+    CHECK(b.charge(50, t0 + 20ms) == 80ms);
+    // Once the debt has drained, the burst is available again.
+    CHECK(b.charge(100, t0 + 300ms) == Clock::duration::zero());
+    CHECK(b.charged() == 300);
+
+    // An idle bucket banks no more than its burst.
+    const Clock::time_point later = t0 + 60s;
+    CHECK(b.charge(300, later) == 200ms);
+    CHECK(b.charge(0, later + 200ms) == Clock::duration::zero());
+}
+
+void limits() {
+    const Clock::time_point t0{10s};
+    TokenBucket unlimited;
+    CHECK(!unlimited.limit().limited());
+    CHECK(unlimited.charge(uint64_t{1} << 40, t0) == Clock::duration::zero());
+
+    // Burst defaults to 100 ms worth.
+    TokenBucket b({10000, 0});
+    CHECK(b.limit().burst == 1000);
+    CHECK(b.charge(1000, t0) == Clock::duration::zero());
+    CHECK(b.charge(10, t0) == 1ms);
+    // A new rate applies to later charges; debt owed is kept: 101 ms
+    // queued, plus 1 ms for this byte, less the new 100 ms tolerance.
+    b.set_limit({1000, 0});
+    CHECK(b.limit().bytes_per_sec == 1000 && b.limit().burst == 100);
+    CHECK(b.charge(1, t0) == 2ms);
+    // Lifting the limit ends the pauses.
+    b.set_limit({});
+    CHECK(b.charge(1 << 20, t0) == Clock::duration::zero());
+
+    // Huge charges saturate instead of wrapping into credit.
+    TokenBucket slow({1, 1});
+    CHECK(slow.charge(~uint64_t{0}, t0) > 24h * 365);
+}
+
+void concurrent_charges_add_up() {
+    const Clock::time_point t0{10s};
+    TokenBucket b({1000000, 1000}); // 1 us per byte, 1 ms of tolerance
+    constexpr int kThreads = 8, kCharges = 5000;
+    std::vector<std::thread> threads;
+    for (int i = 0; i < kThreads; ++i)
+        threads.emplace_back([&] {
+            for (int k = 0; k < kCharges; ++k)
+                b.charge(10, t0);
+        });
+    for (auto& t : threads)
+        t.join();
+    CHECK(b.charged() == uint64_t{kThreads} * kCharges * 10);
+    // Every charge moved the arrival time: none was lost to a race.
+    CHECK(b.charge(0, t0) == std::chrono::microseconds(kThreads * kCharges * 10) - 1ms);
+}
+
+void parsing() {
+    RateLimit r = parse_rate_limit("10m/1m");
+    CHECK(r.bytes_per_sec == 10 << 20 && r.burst == 1 << 20);
+    r = parse_rate_limit("5k");
+    CHECK(r.bytes_per_sec == 5 << 10 && r.burst == 0);
+    CHECK(parse_rate_limit("2gB").bytes_per_sec == uint64_t{2} << 30);
+    CHECK(parse_rate_limit("700").bytes_per_sec == 700);
+    CHECK_THROWS(Error, parse_rate_limit("fast"));
+    CHECK_THROWS(Error, parse_rate_limit("10q"));
+    CHECK_THROWS(Error, parse_rate_limit("10mx"));
+    CHECK_THROWS(Error, parse_rate_limit("10m/"));
+}
+
+void fair_shares() {
+    // Uncapped: by weight; weight 0 counts as 1.
+    auto s = weighted_fair_shares(1000, {1, 1, 2}, {0, 0, 0});
+    CHECK((s == std::vector<uint64_t>{250, 250, 500}));
+    s = weighted_fair_shares(300, {0, 2}, {0, 0});
+    CHECK((s == std::vector<uint64_t>{100, 200}));
+
+    // What a capped claimant cannot use goes to the others by weight.
+    s = weighted_fair_shares(1000, {1, 1, 2}, {0, 100, 0});
+    CHECK((s == std::vector<uint64_t>{300, 100, 600}));
+    // A cap found only after the first one is fixed: 2's share grows past
+    // its cap once 1 is capped, so it is capped in the next round.
+    s = weighted_fair_shares(1000, {1, 1, 2}, {0, 100, 550});
+    CHECK((s == std::vector<uint64_t>{350, 100, 550}));
+    // Caps above the fair share change nothing.
+    s = weighted_fair_shares(1000, {1, 1, 2}, {0, 0, 10000});
+    CHECK((s == std::vector<uint64_t>{250, 250, 500}));
+    // Everyone capped below capacity: the rest goes unused.
+    s = weighted_fair_shares(1000, {1, 1}, {100, 200});
+    CHECK((s == std::vector<uint64_t>{100, 200}));
+    // Nothing to share still leaves every claimant a trickle.
+    s = weighted_fair_shares(0, {1, 3}, {0, 0});
+    CHECK((s == std::vector<uint64_t>{1, 1}));
+    CHECK(weighted_fair_shares(1000, {}, {}).empty());
+
+    // Random claimants: caps hold, the capacity is not exceeded (beyond
+    // the one-byte floor), and uncapped claimants get at least what a
+    // capped one of lower weight got.
+    std::mt19937_64 rng(35);
+    for (int round = 0; round < 2000; ++round) {
+        size_t n = 1 + rng() % 12;
+        uint64_t capacity = rng() % 10000000;
+        std::vector<uint32_t> w(n);
+        std::vector<uint64_t> caps(n);
+        for (size_t i = 0; i < n; ++i) {
+            w[i] = static_cast<uint32_t>(rng() % 8);
+            caps[i] = rng() % 3 == 0 ? rng() % (capacity + 1) : 0;
+        }
+        s = weighted_fair_shares(capacity, w, caps);
+        CHECK(s.size() == n);
+        uint64_t sum = 0;
+        for (size_t i = 0; i < n; ++i) {
+            CHECK(caps[i] == 0 || s[i] <= caps[i]);
+            sum += s[i];
+        }
+        CHECK(sum <= capacity + n);
+        auto weight = [&](size_t i) { return std::max<uint32_t>(w[i], 1); };
+        for (size_t i = 0; i < n; ++i)
+            for (size_t j = 0; j < n; ++j)
+                if (caps[i] == 0 && caps[j] != 0 && weight(i) >= weight(j))
+                    CHECK(s[i] + 1 >= s[j]);
+    }
+}
+
+} // namespace
+
+int main() {
+    burst_then_debt();
+    limits();
+    concurrent_charges_add_up();
+    parsing();
+    fair_shares();
+    return 0;
+}
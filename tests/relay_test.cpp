@@ -0,0 +1,107 @@
+// Relayed puts down a chain of in-process servers: every hop and mirror
+// gets the file, and a dead hop fails the put back at the client.
+
+#include <memory>
+#include <string>
+#include <vector>
+
+#include "tcptransfer/error.h"
+#include "tcptransfer/server.h"
+#include "tcptransfer/session.h"
+#include "test_util.h"
+
+using namespace TcpTransfer;
+using namespace TcpTransfer::test;
+
+namespace {
+
+struct Hop {
+    TempDir root;
+    std::unique_ptr<Server> server;
+
+    Hop() {
+        ServerConfig cfg;
+        cfg.root = root.path();
+        cfg.bind_addr = "127.0.0.1";
+        cfg.allow_relay = true;
+        server = std::make_unique<Server>(cfg);
+        server->start();
+    }
+    std::string address() const { return "127.0.0.1:" + std::to_string(server->port()); }
+};
+
+void chain_and_mirrors() {
+    Hop hops[3];
+    TempDir src;
+    const std::string data = random_bytes((5 << 20) + 99, 3);
+    write_file(src.file("chain.bin"), data);
+
+    auto session = Session::connect({"127.0.0.1", hops[0].server->port()}, {});
+    PutOptions opts;
+    opts.chunk_size = 256 << 10;
+    opts.relay = {hops[1].address(), hops[2].address()};
+    opts.mirror_dirs = {"backup", "more/copies"};
+    PutResult r = session->put_file(src.file("chain.bin"), "in", opts);
+    CHECK(r.file_size == data.size());
+    for (Hop& h : hops) {
+        CHECK(read_file(h.root.file("in/chain.bin")) == data);
+        CHECK(read_file(h.root.file("backup/chain.bin")) == data);
+        CHECK(read_file(h.root.file("more/copies/chain.bin")) == data);
+    }
+
+    // The session is still good for a put that stays on the first hop.
+    session->put_file(src.file("chain.bin"), "local");
+    CHECK(read_file(hops[0].root.file("local/chain.bin")) == data);
+    CHECK(!std::filesystem::exists(hops[1].root.file("local/chain.bin")));
+    for (Hop& h : hops)
+        h.server->stop();
+}
+
+void dead_hop_fails_the_put() {
+    Hop hops[2];
+    std::string dead = hops[1].address();
+    hops[1].server.reset(); // closes the listener: connects are refused
+    TempDir src;
+    const std::string data = random_bytes(3 << 20, 4);
+    write_file(src.file("lost.bin"), data);
+
+    auto session = Session::connect({"127.0.0.1", hops[0].server->port()}, {});
+    PutOptions opts;
+    opts.relay = {dead};
+    std::string error;
+    try {
+        session->put_file(src.file("lost.bin"), "in", opts);
+    } catch (const RemoteError& e) {
+        error = e.what();
+    }
+    CHECK(error.find("relay") != std::string::npos);
+    hops[0].server->stop();
+}
+
+void relaying_needs_allow_relay() {
+    Hop next;
+    TempDir root, src;
+    ServerConfig cfg;
+    cfg.root = root.path();
+    cfg.bind_addr = "127.0.0.1";
+    Server first(cfg);
+    first.start();
+    write_file(src.file("small"), "hello");
+
+    auto session = Session::connect({"127.0.0.1", first.port()}, {});
+    PutOptions opts;
+    opts.relay = {next.address()};
+    CHECK_THROWS(RemoteError, session->put_file(src.file("small"), "in", opts));
+    CHECK(!std::filesystem::exists(next.root.file("in/small")));
+    first.stop();
+    next.server->stop();
+}
+
+} // namespace
+
+int main() {
+    chain_and_mirrors();
+    dead_hop_fails_the_put();
+    relaying_needs_allow_relay();
+    return 0;
+}
@@ -0,0 +1,137 @@
+// ReorderBuffer on its own, striped puts to an in-process server whose
+// first stripe starts late, so the others' chunks are held or spill, and
+// stripe counts a session refuses to send.
+
+#include <chrono>
+#include <future>
+#include <string>
+#include <thread>
+#include <vector>
+
+#include "tcptransfer/error.h"
+#include "tcptransfer/reorder_buffer.h"
+#include "tcptransfer/server.h"
+#include "tcptransfer/session.h"
+#include "test_util.h"
+
+using namespace TcpTransfer;
+using namespace TcpTransfer::test;
+
+namespace {
+
+std::vector<char> bytes_of(char c, size_t n) {
+    return std::vector<char>(n, c);
+}
+
+void buffer_order_and_overlap() {
+    ReorderBuffer rb;
+    CHECK(rb.empty() && rb.bytes() == 0);
+    CHECK(rb.insert(300, bytes_of('d', 100)));
+    CHECK(rb.insert(100, bytes_of('b', 100)));
+    CHECK(rb.insert(500, bytes_of('f', 50)));
+    CHECK(rb.bytes() == 250);
+
+    // Overlapping a held chunk on either side holds nothing.
+    CHECK(!rb.insert(150, bytes_of('x', 10)));
+    CHECK(!rb.insert(50, bytes_of('x', 60)));
+    CHECK(!rb.insert(250, bytes_of('x', 51)));
+    CHECK(!rb.insert(100, bytes_of('x', 1)));
+    CHECK(rb.bytes() == 250);
+
+    // Nothing continues a prefix ending at 0.
+    CHECK(rb.take_from(0).empty());
+    // 200 is missing, so the run from 100 stops there.
+    auto run = rb.take_from(100);
+    CHECK(run.size() == 1 && run[0].first == 100 && run[0].second == bytes_of('b', 100));
+    CHECK(rb.bytes() == 150);
+    CHECK(rb.insert(200, bytes_of('c', 100)));
+    CHECK(rb.insert(400, bytes_of('e', 100)));
+    run = rb.take_from(200);
+    CHECK(run.size() == 4);
+    uint64_t next = 200;
+    for (const auto& [offset, data] : run) {
+        CHECK(offset == next);
+        next += data.size();
+    }
+    CHECK(next == 550 && rb.empty() && rb.bytes() == 0);
+
+    CHECK(rb.insert(900, bytes_of('z', 10)));
+    CHECK(rb.insert(700, bytes_of('y', 10)));
+    auto all = rb.take_all();
+    CHECK(all.size() == 2 && all[0].first == 700 && all[1].first == 900);
+    CHECK(rb.empty() && rb.bytes() == 0);
+}
+
+/// Puts local_path as four stripes, stripe 0 once the server has reordered
+/// (or, with spills, spilled) the others' chunks.
+void put_late_first_stripe(const Server& server, const std::string& local_path, bool spills) {
+    PutOptions opts;
+    opts.chunk_size = 256 << 10;
+    const uint64_t key = 0x5eed0000 + server.port();
+    auto waited_for = [&] {
+        ServerStats st = server.stats();
+        return spills ? st.reorder_spills > 0 : st.chunks_reordered > 0;
+    };
+    std::vector<std::future<PutResult>> stripes;
+    for (unsigned i = 4; i-- > 0;) {
+        stripes.push_back(std::async(std::launch::async, [&, i] {
+            if (i == 0) {
+                auto until = std::chrono::steady_clock::now() + std::chrono::seconds(10);
+                while (!waited_for() && std::chrono::steady_clock::now() < until)
+                    std::this_thread::sleep_for(std::chrono::milliseconds(10));
+            }
+            auto session = Session::connect({"127.0.0.1", server.port()}, {});
+            return session->put_stripe(local_path, "in", opts, {key, i, 4});
+        }));
+    }
+    for (auto& s : stripes)
+        s.get();
+}
+
+void striped_put(size_t size, bool spills) {
+    TempDir root, src;
+    ServerConfig cfg;
+    cfg.root = root.path();
+    cfg.bind_addr = "127.0.0.1";
+    Server server(cfg);
+    server.start();
+    const std::string data = random_bytes(size, size);
+    write_file(src.file("striped.bin"), data);
+
+    put_late_first_stripe(server, src.file("striped.bin"), spills);
+    CHECK(read_file(root.file("in/striped.bin")) == data);
+    server.stop();
+    ServerStats st = server.stats();
+    CHECK(st.files_received == 1);
+    CHECK(st.chunks_reordered > 0);
+    CHECK((st.reorder_spills > 0) == spills);
+}
+
+void stripe_count_checked() {
+    TempDir root, src;
+    ServerConfig cfg;
+    cfg.root = root.path();
+    cfg.bind_addr = "127.0.0.1";
+    Server server(cfg);
+    server.start();
+    write_file(src.file("f"), "data");
+    auto session = Session::connect({"127.0.0.1", server.port()}, {});
+    // Refused before anything is sent, so the session stays usable.
+    CHECK_THROWS(Error, session->put_stripe(src.file("f"), "in", {}, {1, 0, kMaxStripes + 1}));
+    CHECK_THROWS(Error, session->put_stripe(src.file("f"), "in", {}, {1, 4, 4}));
+    CHECK(!session->broken());
+    session->put_file(src.file("f"), "in");
+    CHECK(read_file(root.file("in/f")) == "data");
+    server.stop();
+}
+
+} // namespace
+
+int main() {
+    buffer_order_and_overlap();
+    // Three quarters of the file fit in the 64 MiB the server may hold.
+    striped_put((24 << 20) + 777, false);
+    striped_put(96 << 20, true);
+    stripe_count_checked();
+    return 0;
+}
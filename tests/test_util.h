@@ -0,0 +1,94 @@
+// Helpers for the test executables: CHECK, which reports the failed
+// expression and exits nonzero, and scratch directories and files.
+#pragma once
+
+#include <unistd.h>
+
+#include <cstdint>
+#include <cstdio>
+#include <cstdlib>
+#include <filesystem>
+#include <fstream>
+#include <iterator>
+#include <random>
+#include <string>
+
+#define CHECK(cond)                                                                \
+    do {                                                                           \
+        if (!(cond)) {                                                             \
+            std::fprintf(stderr, "%s:%d: CHECK(%s) failed\n", __FILE__, __LINE__, \
+                         #cond);                                                   \
+            std::exit(1);                                                          \
+        }                                                                          \
+    } while (0)
+
+/// CHECK that stmt throws an exception of type E.
+#define CHECK_THROWS(E, stmt)                                                        \
+    do {                                                                             \
+        bool thrown_ = false;                                                        \
+        try {                                                                        \
+            stmt;                                                                    \
+        } catch (const E&) {                                                         \
+            thrown_ = true;                                                          \
+        }                                                                            \
+        if (!thrown_) {                                                              \
+            std::fprintf(stderr, "%s:%d: %s did not throw %s\n", __FILE__, __LINE__, \
+                         #stmt, #E);                                                 \
+            std::exit(1);                                                            \
+        }                                                                            \
+    } while (0)
+
+namespace TcpTransfer::test {
+
+/// A fresh directory under the system temp dir, removed with its contents.
+class TempDir {
+public:
+    TempDir() {
+        std::string tmpl = (std::filesystem::temp_directory_path() / "tcptransfer-XXXXXX");
+        if (!::mkdtemp(tmpl.data())) {
+            std::perror("mkdtemp");
+            std::exit(1);
+        }
+        path_ = tmpl;
+    }
+    ~TempDir() {
+        std::error_code ec;
+        std::filesystem::remove_all(path_, ec);
+    }
+    TempDir(const TempDir&) = delete;
+    TempDir& operator=(const TempDir&) = delete;
+
+    const std::string& path() const { return path_; }
+    /// path()/rel, creating its parent directories.
+    std::string file(const std::string& rel) const {
+        std::filesystem::path p = std::filesystem::path(path_) / rel;
+        std::filesystem::create_directories(p.parent_path());
+        return p;
+    }
+
+private:
+    std::string path_;
+};
+
+/// n bytes that do not compress, the same for the same seed.
+inline std::string random_bytes(size_t n, uint64_t seed) {
+    std::mt19937_64 rng(seed);
+    std::string s(n, '\0');
+    for (char& c : s)
+        c = static_cast<char>(rng());
+    return s;
+}
+
+inline void write_file(const std::string& path, const std::string& data) {
+    std::ofstream f(path, std::ios::binary | std::ios::trunc);
+    f.write(data.data(), static_cast<std::streamsize>(data.size()));
+    CHECK(f.good());
+}
+
+/// The whole file, or "" if it cannot be read.
+inline std::string read_file(const std::string& path) {
+    std::ifstream f(path, std::ios::binary);
+    return {std::istreambuf_iterator<char>(f), std::istreambuf_iterator<char>()};
+}
+
+} // namespace TcpTransfer::test
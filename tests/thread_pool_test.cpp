@@ -0,0 +1,165 @@
+// WorkStealingPool and TaskGroup: every task runs once, idle workers steal
+// from a busy one, failures reach wait(), and groups waited on from inside
+// pool tasks do not deadlock even on a single worker.
+
+#include <atomic>
+#include <chrono>
+#include <stdexcept>
+#include <string>
+#include <thread>
+#include <vector>
+
+#include "tcptransfer/thread_pool.h"
+#include "test_util.h"
+
+using namespace TcpTransfer;
+
+namespace {
+
+/// Spins until done() or a generous deadline; false on the deadline.
+template <typename F>
+bool eventually(F done) {
+    auto until = std::chrono::steady_clock::now() + std::chrono::seconds(10);
+    while (!done()) {
+        if (std::chrono::steady_clock::now() > until)
+            return false;
+        std::this_thread::yield();
+    }
+    return true;
+}
+
+void every_task_runs_once() {
+    WorkStealingPool pool(4, false);
+    CHECK(pool.size() == 4);
+    CHECK(pool.current_worker() == -1);
+    constexpr int kTasks = 10000;
+    std::vector<std::atomic<int>> ran(kTasks);
+    std::atomic<int> outside{0};
+    for (int i = 0; i < kTasks; ++i)
+        pool.submit(
+            [&, i] {
+                ran[i].fetch_add(1);
+                if (pool.current_worker() < 0)
+                    outside.fetch_add(1);
+            },
+            i % 3 == 0 ? i : -1);
+    CHECK(eventually([&] {
+        for (auto& r : ran)
+            if (r.load() == 0)
+                return false;
+        return true;
+    }));
+    for (auto& r : ran)
+        CHECK(r.load() == 1);
+    CHECK(outside.load() == 0);
+    CHECK(!pool.run_one());
+}
+
+void idle_workers_steal() {
+    WorkStealingPool pool(4, false);
+    // A worker queues tasks on its own deque and then does not run them:
+    // only the other workers can.
+    constexpr int kTasks = 200;
+    std::atomic<int> done{0};
+    std::atomic<int> owner{-1};
+    std::atomic<bool> stolen{false};
+    pool.submit([&] {
+        owner = pool.current_worker();
+        for (int i = 0; i < kTasks; ++i)
+            pool.submit([&] {
+                if (pool.current_worker() != owner.load())
+                    stolen = true;
+                done.fetch_add(1);
+            });
+        CHECK(eventually([&] { return done.load() == kTasks; }));
+    });
+    CHECK(eventually([&] { return done.load() == kTasks; }));
+    CHECK(stolen.load());
+}
+
+void group_failures() {
+    WorkStealingPool pool(3, false);
+    TaskGroup g(&pool);
+    std::atomic<int> ran{0};
+    for (int i = 0; i < 100; ++i)
+        g.run([&, i] {
+            ran.fetch_add(1);
+            if (i % 10 == 3)
+                throw std::runtime_error("task " + std::to_string(i));
+        });
+    // The first failure is rethrown, after every task has finished.
+    CHECK_THROWS(std::runtime_error, g.wait());
+    CHECK(ran.load() == 100);
+    // Reported once; the group is reusable.
+    g.wait();
+    g.run([&] { ran.fetch_add(1); });
+    g.wait();
+    CHECK(ran.load() == 101);
+
+    // Without a pool, tasks run inline and failures still wait for wait().
+    TaskGroup inline_group(nullptr);
+    int inline_ran = 0;
+    inline_group.run([&] { throw std::logic_error("inline"); });
+    inline_group.run([&] { ++inline_ran; });
+    CHECK(inline_ran == 1);
+    CHECK_THROWS(std::logic_error, inline_group.wait());
+}
+
+void nested_waits() {
+    // Every outer task waits on a group of its own. With one worker, that
+    // only finishes because wait() runs queued tasks itself.
+    for (size_t threads : {size_t{1}, size_t{2}, size_t{4}}) {
+        WorkStealingPool pool(threads, false);
+        std::atomic<int> leaves{0};
+        TaskGroup outer(&pool);
+        for (int i = 0; i < 16; ++i)
+            outer.run([&] {
+                TaskGroup inner(&pool);
+                for (int k = 0; k < 32; ++k)
+                    inner.run([&] {
+                        TaskGroup leaf(&pool);
+                        leaf.run([&] { leaves.fetch_add(1); });
+                        leaf.wait();
+                    });
+                inner.wait();
+            });
+        outer.wait();
+        CHECK(leaves.load() == 16 * 32);
+    }
+
+    // A failure deep inside surfaces at the outer wait.
+    WorkStealingPool pool(2, false);
+    TaskGroup outer(&pool);
+    outer.run([&] {
+        TaskGroup inner(&pool);
+        inner.run([] { throw std::runtime_error("deep"); });
+        inner.wait();
+    });
+    CHECK_THROWS(std::runtime_error, outer.wait());
+}
+
+void destructor_waits() {
+    WorkStealingPool pool(2, false);
+    std::atomic<int> ran{0};
+    {
+        TaskGroup g(&pool);
+        for (int i = 0; i < 50; ++i)
+            g.run([&] {
+                std::this_thread::sleep_for(std::chrono::microseconds(100));
+                ran.fetch_add(1);
+            });
+        g.run([] { throw std::runtime_error("ignored"); });
+    }
+    CHECK(ran.load() == 50);
+}
+
+} // namespace
+
+int main() {
+    every_task_runs_once();
+    idle_workers_steal();
+    group_failures();
+    nested_waits();
+    destructor_waits();
+    return 0;
+}
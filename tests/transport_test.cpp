@@ -0,0 +1,152 @@
+// Puts over pooled sessions to an in-process server: files land intact,
+// sessions are reused, and bad tokens and paths are refused.
+
+#include <sys/stat.h>
+
+#include <string>
+
+#include "tcptransfer/connection_pool.h"
+#include "tcptransfer/error.h"
+#include "tcptransfer/server.h"
+#include "tcptransfer/session.h"
+#include "test_util.h"
+
+using namespace TcpTransfer;
+using namespace TcpTransfer::test;
+
+namespace {
+
+void puts_land_intact() {
+    TempDir root, src;
+    ServerConfig cfg;
+    cfg.root = root.path();
+    cfg.bind_addr = "127.0.0.1";
+    cfg.token = "secret";
+    Server server(cfg);
+    server.start();
+    Endpoint ep{"127.0.0.1", server.port()};
+
+    PoolOptions popts;
+    popts.session.token = "secret";
+    popts.background_reaper = false;
+    ConnectionPool pool(popts);
+    const std::string big = random_bytes((3 << 20) + 12345, 1);
+    write_file(src.file("big.bin"), big);
+    write_file(src.file("empty"), "");
+    {
+        auto lease = pool.acquire(ep);
+        PutResult r = lease->put_file(src.file("big.bin"), "in/sub");
+        CHECK(r.file_size == big.size());
+        CHECK(r.bytes_sent == big.size());
+    }
+    {
+        auto lease = pool.acquire(ep);
+        lease->put_file(src.file("empty"), "in");
+    }
+    CHECK(pool.stats().connects == 1);
+    CHECK(pool.stats().reuses == 1);
+    CHECK(read_file(root.file("in/sub/big.bin")) == big);
+    CHECK(std::filesystem::exists(root.file("in/empty")));
+    CHECK(std::filesystem::file_size(root.file("in/empty")) == 0);
+
+    // Escaping the root is refused, and the session stays usable.
+    {
+        auto lease = pool.acquire(ep);
+        CHECK_THROWS(RemoteError, lease->put_file(src.file("empty"), "../out"));
+        CHECK(!lease->broken());
+        lease->put_file(src.file("empty"), "in/again");
+    }
+    CHECK(std::filesystem::exists(root.file("in/again/empty")));
+
+    // Permission bits arrive; setuid and setgid do not.
+    write_file(src.file("tool"), "#!/bin/sh\n");
+    CHECK(::chmod(src.file("tool").c_str(), 06755) == 0);
+    {
+        auto lease = pool.acquire(ep);
+        lease->put_file(src.file("tool"), "bin");
+    }
+    struct stat tool {};
+    CHECK(::stat(root.file("bin/tool").c_str(), &tool) == 0 && (tool.st_mode & 07777) == 0755);
+
+    SessionOptions wrong;
+    wrong.token = "wrong";
+    CHECK_THROWS(Error, Session::connect(ep, wrong));
+
+    server.stop();
+    ServerStats st = server.stats();
+    CHECK(st.files_received == 4);
+    CHECK(st.bytes_received == big.size() + 10); // and the script
+}
+
+void delta_put_reuses_old_copy() {
+    TempDir root, src;
+    ServerConfig cfg;
+    cfg.root = root.path();
+    cfg.bind_addr = "127.0.0.1";
+    Server server(cfg);
+    server.start();
+    std::string data = random_bytes((20 << 20) + 333, 5);
+    write_file(src.file("image"), data);
+    auto session = Session::connect({"127.0.0.1", server.port()}, {});
+    session->put_file(src.file("image"), "in");
+
+    // A few changed bytes; the rest is copied from the old file.
+    for (size_t at : {size_t{0}, size_t{9} << 20, data.size() - 1})
+        data[at] = static_cast<char>(data[at] ^ 0x5a);
+    write_file(src.file("image"), data);
+    PutOptions opts;
+    opts.delta = true;
+    PutResult r = session->put_file(src.file("image"), "in", opts);
+    CHECK(r.delta_reused > data.size() / 2);
+    CHECK(read_file(root.file("in/image")) == data);
+    server.stop();
+    CHECK(server.stats().delta_bytes_reused == r.delta_reused);
+}
+
+void resumed_put_continues_part_file() {
+    TempDir root, src;
+    ServerConfig cfg;
+    cfg.root = root.path();
+    cfg.bind_addr = "127.0.0.1";
+    Server server(cfg);
+    server.start();
+    const std::string data = random_bytes((6 << 20) + 17, 6);
+    write_file(src.file("big"), data);
+    const std::string part = root.file("in/.big.tcptransfer-part");
+    auto session = Session::connect({"127.0.0.1", server.port()}, {});
+    PutOptions opts;
+    opts.resume = true;
+
+    // What an interrupted put left is kept; the CRC covers the whole file.
+    write_file(part, data.substr(0, 2 << 20));
+    PutResult r = session->put_file(src.file("big"), "in", opts);
+    CHECK(r.resumed_from == 2 << 20);
+    CHECK(read_file(root.file("in/big")) == data);
+
+    // A part that is not the start of the file fails the CRC taken from
+    // disk at PutEnd, and is removed.
+    write_file(part, std::string(1 << 20, 'x'));
+    try {
+        session->put_file(src.file("big"), "in", opts);
+        CHECK(false);
+    } catch (const RemoteError& e) {
+        CHECK(e.status() == Status::ChecksumMismatch);
+    }
+    CHECK(!std::filesystem::exists(part));
+
+    // A part longer than the file cannot be the start of it.
+    write_file(part, data + "extra");
+    r = session->put_file(src.file("big"), "in", opts);
+    CHECK(r.resumed_from == 0);
+    CHECK(read_file(root.file("in/big")) == data);
+    server.stop();
+}
+
+} // namespace
+
+int main() {
+    puts_land_intact();
+    delta_put_reuses_old_copy();
+    resumed_put_continues_part_file();
+    return 0;
+}
@@ -0,0 +1,97 @@
+// tcptransfer_get: download a file, or a byte range of one, from a server
+// directory.
+
+#include <fcntl.h>
+
+#include <algorithm>
+#include <chrono>
+#include <cstdio>
+#include <cstdlib>
+#include <string>
+#include <vector>
+
+#include "tcptransfer/client.h"
+#include "tcptransfer/error.h"
+
+using namespace TcpTransfer;
+
+namespace {
+
+void usage() {
+    std::fprintf(stderr,
+                 "usage: tcptransfer_get [--token SECRET] [--client-id ID] [--stripes N]\n"
+                 "                       [--no-checksum] HOST:PORT REMOTE_PATH LOCAL_PATH\n"
+                 "       tcptransfer_get --range OFFSET:LENGTH [OPTIONS] HOST:PORT REMOTE_PATH\n"
+                 "                       LOCAL_PATH\n");
+    std::exit(2);
+}
+
+} // namespace
+
+int main(int argc, char** argv) {
+    ClientOptions opts;
+    opts.pool.background_reaper = false;
+    GetOptions get;
+    std::vector<std::string> pos;
+    bool ranged = false;
+    uint64_t offset = 0, length = kWholeFile;
+    for (int i = 1; i < argc; ++i) {
+        std::string a = argv[i];
+        auto value = [&]() -> std::string {
+            if (i + 1 >= argc)
+                usage();
+            return argv[++i];
+        };
+        if (a == "--token")
+            opts.pool.session.token = value();
+        else if (a == "--client-id")
+            opts.pool.session.client_id = value();
+        else if (a == "--stripes")
+            get.stripes = static_cast<unsigned>(std::stoul(value()));
+        else if (a == "--no-checksum")
+            get.checksum = false;
+        else if (a == "--range") {
+            unsigned long long off = 0, len = 0;
+            if (std::sscanf(value().c_str(), "%llu:%llu", &off, &len) != 2)
+                usage();
+            ranged = true;
+            offset = off;
+            length = len;
+        } else if (!a.empty() && a[0] == '-')
+            usage();
+        else
+            pos.push_back(a);
+    }
+    if (pos.size() != 3)
+        usage();
+    if (const char* tok = std::getenv("TCPTRANSFER_TOKEN"); tok && opts.pool.session.token.empty())
+        opts.pool.session.token = tok;
+    // Stripes run one per worker.
+    opts.workers = std::max(1u, get.stripes);
+
+    try {
+        GetResult r;
+        if (ranged) {
+            // A range lands at its own offsets in LOCAL_PATH, which is
+            // otherwise left alone; several ranges can fill one file.
+            auto session = Session::connect(Endpoint::parse(pos[0]), opts.pool.session);
+            Fd file(::open(pos[2].c_str(), O_WRONLY | O_CREAT | O_CLOEXEC, 0644));
+            if (!file)
+                throw_errno("open " + pos[2]);
+            r = session->get_range(pos[1], file.get(), offset, length, get);
+        } else {
+            Client client(Endpoint::parse(pos[0]), opts);
+            r = client.get(pos[1], pos[2], get).get();
+        }
+        double secs = std::chrono::duration<double>(r.elapsed).count();
+        std::printf("%s: %llu bytes at %llu of %llu in %.3fs (%.1f MB/s)\n", pos[1].c_str(),
+                    static_cast<unsigned long long>(r.bytes),
+                    static_cast<unsigned long long>(r.offset),
+                    static_cast<unsigned long long>(r.file_size), secs,
+                    secs > 0 ? r.bytes / secs / 1e6 : 0.0);
+    } catch (const std::exception& e) {
+        std::fprintf(stderr, "tcptransfer_get: %s\n", e.what());
+        return 1;
+    }
+    return 0;
+}
@@ -0,0 +1,236 @@
+// tcptransfer_put: upload local files into a server directory, or mirror
+// local directories into it with --sync, or keep mirroring them with --watch.
+
+#include <pthread.h>
+
+#include <chrono>
+#include <csignal>
+#include <cstdio>
+#include <cstdlib>
+#include <iterator>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <vector>
+
+#include "tcptransfer/client.h"
+#include "tcptransfer/hash_cache.h"
+#include "tcptransfer/metrics.h"
+#include "tcptransfer/trace.h"
+#include "tcptransfer/watcher.h"
+
+using namespace TcpTransfer;
+
+namespace {
+
+void usage() {
+    std::fprintf(stderr,
+                 "usage: tcptransfer_put [--token SECRET] [--client-id ID] [--chunk BYTES]\n"
+                 "                       [--no-checksum] [--resume] [--sendfile] [--compress]\n"
+                 "                       [--jobs N] [--delta] [--metrics] [--trace FILE.json]\n"
+                 "                       [--priority bulk|normal|interactive] [--deadline MS]\n"
+                 "                       [--fec K+M] [--relay HOST:PORT]... [--mirror DIR]...\n"
+                 "                       [--stripes N]\n"
+                 "                       HOST:PORT REMOTE_DIR FILE...\n"
+                 "       tcptransfer_put --sync [--hash-cache FILE | --no-hash-cache] [OPTIONS]\n"
+                 "                       HOST:PORT REMOTE_DIR DIR...\n"
+                 "       tcptransfer_put --watch [--debounce MS] [OPTIONS] HOST:PORT REMOTE_DIR DIR...\n");
+    std::exit(2);
+}
+
+/// Prints one line per outcome; returns the number of failures.
+int print_outcomes(const std::vector<PutOutcome>& outcomes, std::string* socket_text) {
+    int failures = 0;
+    for (const PutOutcome& out : outcomes) {
+        if (!out.ok()) {
+            std::fprintf(stderr, "%s: %s\n", out.path.c_str(), out.error.c_str());
+            ++failures;
+            continue;
+        }
+        std::printf("%s: %llu bytes", out.path.c_str(),
+                    static_cast<unsigned long long>(out.result.file_size));
+        if (out.result.resumed_from)
+            std::printf(" (resumed at %llu)",
+                        static_cast<unsigned long long>(out.result.resumed_from));
+        if (out.result.delta_reused)
+            std::printf(" (%llu reused)", static_cast<unsigned long long>(out.result.delta_reused));
+        std::printf("\n");
+        if (socket_text)
+            *socket_text = format_socket_metrics(out.result.socket);
+    }
+    return failures;
+}
+
+std::string sync_summary(const std::string& dir, const SyncResult& r) {
+    return dir + ": " + std::to_string(r.sent.size()) + " of " + std::to_string(r.files) +
+           " files sent, " + std::to_string(r.hashed) + " hashed";
+}
+
+} // namespace
+
+int main(int argc, char** argv) {
+    ClientOptions opts;
+    opts.pool.background_reaper = false;
+    opts.workers = 1;
+    opts.hash_cache = HashCache::default_path();
+    PoolOptions& pool_opts = opts.pool;
+    PutOptions& put = opts.put;
+    std::vector<std::string> pos;
+    bool dump_metrics = false;
+    bool sync = false;
+    bool watch = false;
+    WatchOptions wopts;
+    std::string trace_path;
+    for (int i = 1; i < argc; ++i) {
+        std::string a = argv[i];
+        auto value = [&]() -> std::string {
+            if (i + 1 >= argc)
+                usage();
+            return argv[++i];
+        };
+        if (a == "--token")
+            pool_opts.session.token = value();
+        else if (a == "--client-id")
+            pool_opts.session.client_id = value();
+        else if (a == "--chunk")
+            put.chunk_size = std::stoul(value());
+        else if (a == "--no-checksum")
+            put.checksum = false;
+        else if (a == "--resume")
+            put.resume = true;
+        else if (a == "--sendfile")
+            put.use_sendfile = true;
+        else if (a == "--compress")
+            put.compression = Codec::Zlib;
+        else if (a == "--delta")
+            put.delta = true;
+        else if (a == "--relay")
+            put.relay.push_back(value());
+        else if (a == "--mirror")
+            put.mirror_dirs.push_back(value());
+        else if (a == "--stripes")
+            put.stripes = static_cast<unsigned>(std::stoul(value()));
+        else if (a == "--fec") {
+            unsigned k = 0, m = 0;
+            if (std::sscanf(value().c_str(), "%u+%u", &k, &m) != 2 || k == 0 || m == 0 ||
+                k + m > 255)
+                usage();
+            put.fec = {static_cast<uint8_t>(k), static_cast<uint8_t>(m)};
+        }
+        else if (a == "--priority") {
+            std::string p = value();
+            if (p == "bulk")
+                put.priority = Priority::Bulk;
+            else if (p == "interactive")
+                put.priority = Priority::Interactive;
+            else if (p == "normal")
+                put.priority = Priority::Normal;
+            else
+                usage();
+        } else if (a == "--deadline")
+            put.deadline = std::chrono::milliseconds(std::stoll(value()));
+        else if (a == "--sync")
+            sync = true;
+        else if (a == "--watch")
+            watch = true;
+        else if (a == "--debounce")
+            wopts.debounce = std::chrono::milliseconds(std::stoll(value()));
+        else if (a == "--hash-cache")
+            opts.hash_cache = value();
+        else if (a == "--no-hash-cache")
+            opts.hash_cache.clear();
+        else if (a == "--jobs")
+            opts.workers = std::stoul(value());
+        else if (a == "--metrics")
+            dump_metrics = true;
+        else if (a == "--trace")
+            trace_path = value();
+        else if (!a.empty() && a[0] == '-')
+            usage();
+        else
+            pos.push_back(a);
+    }
+    if (pos.size() < 3)
+        usage();
+    if (const char* tok = std::getenv("TCPTRANSFER_TOKEN"); tok && pool_opts.session.token.empty())
+        pool_opts.session.token = tok;
+
+    sigset_t sigs;
+    sigemptyset(&sigs);
+    sigaddset(&sigs, SIGINT);
+    sigaddset(&sigs, SIGTERM);
+    if (watch)
+        pthread_sigmask(SIG_BLOCK, &sigs, nullptr); // before any thread starts
+
+    int failures = 0;
+    if (!trace_path.empty())
+        trace_start();
+    try {
+        Client client(Endpoint::parse(pos[0]), opts);
+        std::vector<std::string> args(pos.begin() + 2, pos.end());
+        std::vector<PutOutcome> outcomes;
+        std::vector<std::string> summaries;
+        if (watch) {
+            std::mutex print_mu;
+            std::vector<std::unique_ptr<DirWatcher>> watchers;
+            // Watch first, then catch up: anything written during the
+            // initial sync is queued by the kernel and pushed afterwards.
+            for (const std::string& dir : args)
+                watchers.push_back(std::make_unique<DirWatcher>(
+                    dir, wopts,
+                    [&client, &print_mu, dir, remote = pos[1]](std::vector<std::string> paths,
+                                                               bool rescan) {
+                        std::vector<PutOutcome> sent;
+                        try {
+                            if (rescan)
+                                sent = client.sync(dir, remote).get().sent;
+                            else
+                                sent = client.push(dir, std::move(paths), remote).get();
+                        } catch (const std::exception& e) {
+                            std::lock_guard<std::mutex> lk(print_mu);
+                            std::fprintf(stderr, "%s: %s\n", dir.c_str(), e.what());
+                            return;
+                        }
+                        std::lock_guard<std::mutex> lk(print_mu);
+                        print_outcomes(sent, nullptr);
+                        std::fflush(stdout);
+                    }));
+            for (const std::string& dir : args) {
+                SyncResult r = client.sync(dir, pos[1]).get();
+                std::lock_guard<std::mutex> lk(print_mu);
+                print_outcomes(r.sent, nullptr);
+                std::printf("%s\n", sync_summary(dir, r).c_str());
+                std::fflush(stdout);
+            }
+            for (auto& w : watchers)
+                w->start();
+            int sig = 0;
+            sigwait(&sigs, &sig);
+            watchers.clear();
+        } else if (sync) {
+            for (const std::string& dir : args) {
+                SyncResult r = client.sync(dir, pos[1]).get();
+                summaries.push_back(sync_summary(dir, r));
+                outcomes.insert(outcomes.end(), std::make_move_iterator(r.sent.begin()),
+                                std::make_move_iterator(r.sent.end()));
+            }
+        } else {
+            outcomes = client.put_many(std::move(args), pos[1]).get();
+        }
+        std::string socket_text;
+        failures = print_outcomes(outcomes, dump_metrics ? &socket_text : nullptr);
+        for (const std::string& s : summaries)
+            std::printf("%s\n", s.c_str());
+        if (dump_metrics)
+            std::fprintf(stderr, "%s%s", format_prometheus(collect_metrics()).c_str(),
+                         socket_text.c_str());
+        if (!trace_path.empty()) {
+            trace_stop();
+            trace_write(trace_path);
+        }
+    } catch (const std::exception& e) {
+        std::fprintf(stderr, "tcptransfer_put: %s\n", e.what());
+        return 1;
+    }
+    return failures ? 1 : 0;
+}
@@ -0,0 +1,180 @@
+// tcptransfer_server: receive uploaded files into a root directory.
+//
+// SIGUSR2 restarts the server in place from its binary on disk: the new
+// process takes over the listening socket and the resume journal, so an
+// upgrade refuses no connections and interrupted uploads resume cheaply.
+
+#include <sys/wait.h>
+
+#include <chrono>
+#include <csignal>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <string>
+#include <vector>
+
+#include "tcptransfer/handoff.h"
+#include "tcptransfer/server.h"
+#include "tcptransfer/trace.h"
+
+using namespace TcpTransfer;
+
+namespace {
+
+void usage() {
+    std::fprintf(stderr,
+                 "usage: tcptransfer_server --root DIR [--bind ADDR] [--port N]\n"
+                 "                          [--token SECRET] [--fsync] [--metadata-threads N]\n"
+                 "                          [--dir-cache N] [--allow-relay] [--relay-token SECRET]\n"
+                 "                          [--file-cache N] [--read-cache BYTES]\n"
+                 "                          [--hdd-writers N] [--ssd-writers N]\n"
+                 "                          [--metrics HOST:PORT|unix:PATH] [--trace FILE.json]\n"
+                 "                          [--max-rate RATE] [--client-rate RATE[/BURST]]\n"
+                 "                          [--client ID=WEIGHT[:RATE[/BURST]]]...\n"
+                 "                          [--dir-rate DIR=RATE[/BURST]]...\n"
+                 "                          [--drain-timeout MS]\n"
+                 "RATE and BURST are bytes (per second), with optional k/m/g suffix.\n");
+    std::exit(2);
+}
+
+} // namespace
+
+int main(int argc, char** argv) {
+    ServerConfig cfg;
+    cfg.port = 7070;
+    std::string trace_path; // spans of the last ~64K events per thread, written on exit
+    // Running transfers get this long to finish before a SIGUSR2 restart
+    // closes them.
+    std::chrono::milliseconds drain{10000};
+    std::vector<std::string> args; // for the successor, less --handoff-fd
+    for (int i = 1; i < argc; ++i) {
+        std::string a = argv[i];
+        auto value = [&]() -> std::string {
+            if (i + 1 >= argc)
+                usage();
+            return argv[++i];
+        };
+        if (a == "--handoff-fd")
+            cfg.handoff_fd = std::stoi(value());
+        else if (a == "--root")
+            cfg.root = value();
+        else if (a == "--bind")
+            cfg.bind_addr = value();
+        else if (a == "--port")
+            cfg.port = static_cast<uint16_t>(std::stoi(value()));
+        else if (a == "--token")
+            cfg.token = value();
+        else if (a == "--fsync")
+            cfg.fsync = true;
+        else if (a == "--allow-relay")
+            cfg.allow_relay = true;
+        else if (a == "--relay-token")
+            cfg.relay_token = value();
+        else if (a == "--metadata-threads")
+            cfg.metadata_threads = std::stoul(value());
+        else if (a == "--dir-cache")
+            cfg.dir_cache_size = std::stoul(value());
+        else if (a == "--file-cache")
+            cfg.file_cache_size = std::stoul(value());
+        else if (a == "--read-cache")
+            cfg.read_cache_bytes = std::stoull(value());
+        else if (a == "--hdd-writers")
+            cfg.disk_writers.rotational_lanes = std::stoul(value());
+        else if (a == "--ssd-writers")
+            cfg.disk_writers.flash_lanes = std::stoul(value());
+        else if (a == "--metrics")
+            cfg.metrics_listen = value();
+        else if (a == "--trace")
+            trace_path = value();
+        else if (a == "--drain-timeout")
+            drain = std::chrono::milliseconds(std::stoll(value()));
+        else if (a == "--max-rate")
+            cfg.max_ingest_rate = parse_rate_limit(value()).bytes_per_sec;
+        else if (a == "--client-rate")
+            cfg.client_limit = parse_rate_limit(value());
+        else if (a == "--client" || a == "--dir-rate") {
+            std::string v = value();
+            auto eq = v.rfind('=');
+            if (eq == std::string::npos)
+                usage();
+            std::string key = v.substr(0, eq), spec = v.substr(eq + 1);
+            if (a == "--dir-rate") {
+                cfg.dir_limits[key] = parse_rate_limit(spec);
+                continue;
+            }
+            ClientPolicy& p = cfg.clients[key];
+            auto colon = spec.find(':');
+            p.weight = static_cast<uint32_t>(std::stoul(spec.substr(0, colon)));
+            if (colon != std::string::npos)
+                p.limit = parse_rate_limit(spec.substr(colon + 1));
+        }
+        else
+            usage();
+    }
+    if (cfg.root.empty())
+        usage();
+    for (int i = 0; i < argc; ++i) {
+        if (std::strcmp(argv[i], "--handoff-fd") == 0)
+            ++i;
+        else
+            args.push_back(argv[i]);
+    }
+    if (const char* tok = std::getenv("TCPTRANSFER_TOKEN"); tok && cfg.token.empty())
+        cfg.token = tok;
+
+    sigset_t sigs;
+    sigemptyset(&sigs);
+    sigaddset(&sigs, SIGINT);
+    sigaddset(&sigs, SIGTERM);
+    sigaddset(&sigs, SIGUSR2);
+    pthread_sigmask(SIG_BLOCK, &sigs, nullptr);
+    std::signal(SIGPIPE, SIG_IGN);
+
+    try {
+        if (!trace_path.empty())
+            trace_start();
+        // Resolved now: after an upgrade renames a new binary over this
+        // one, /proc/self/exe names the old file.
+        std::string exe = current_exe();
+        Server server(cfg);
+        server.start();
+        std::fprintf(stderr, "listening on %s:%u, root %s\n", cfg.bind_addr.c_str(),
+                     server.port(), cfg.root.c_str());
+        for (;;) {
+            int sig = 0;
+            sigwait(&sigs, &sig);
+            if (sig != SIGUSR2)
+                break;
+            pid_t pid = -1;
+            try {
+                Fd sock = spawn_successor(exe, args, pid);
+                server.handoff(sock.get(), drain);
+                std::fprintf(stderr, "handed off to pid %d\n", static_cast<int>(pid));
+                break;
+            } catch (const std::exception& e) {
+                // Serving goes on with the listener; the successor may hold
+                // it too, and must not accept from it any longer.
+                std::fprintf(stderr, "tcptransfer_server: restart failed: %s\n", e.what());
+                if (pid > 0) {
+                    ::kill(pid, SIGKILL);
+                    ::waitpid(pid, nullptr, 0);
+                }
+            }
+        }
+        server.stop();
+        if (!trace_path.empty()) {
+            trace_stop();
+            trace_write(trace_path);
+        }
+        ServerStats st = server.stats();
+        std::fprintf(stderr, "shutdown: %llu files, %llu bytes received; %llu served\n",
+                     static_cast<unsigned long long>(st.files_received),
+                     static_cast<unsigned long long>(st.bytes_received),
+                     static_cast<unsigned long long>(st.files_served));
+    } catch (const std::exception& e) {
+        std::fprintf(stderr, "tcptransfer_server: %s\n", e.what());
+        return 1;
+    }
+    return 0;
+}